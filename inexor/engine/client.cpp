@@ -228,7 +228,7 @@ void flushclient()
 // print illegal network message to console (wrong protocol?)
 void neterr(const char *s, bool disc)
 {
-    spdlog::get("global")->error("illegal network message \"{0}\"", s);
+    LOG_EVERY_MS("global", error, 100, "illegal network message \"{0}\"", s);
     if(disc) disconnect();
 }
 
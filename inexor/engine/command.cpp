@@ -4,6 +4,7 @@
 #include "inexor/engine/engine.hpp"
 #include "inexor/rpc/SharedTree.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
 
 using namespace inexor::util;
 
@@ -1000,6 +1001,51 @@ static inline void compilefloat(vector<uint> &code, const char *word = NULL)
     return compilefloat(code, word ? parsefloat(word) : 0.0f);
 }
 
+/// Operations of CODE_MATHI, CODE_MATHF and CODE_LOOP.
+enum
+{
+    INLINE_ADD = 0, INLINE_SUB, INLINE_MUL, INLINE_DIV, INLINE_MOD,
+    INLINE_EQ, INLINE_NE, INLINE_LT, INLINE_GT, INLINE_LE, INLINE_GE,
+    INLINE_AND, INLINE_OR, INLINE_XOR, INLINE_SHL, INLINE_SHR,
+
+    INLINE_LOOP = 0, INLINE_WHILE,
+
+    INLINE_ARG = 1<<16 // push the result as an argument, used for (op a b) groups
+};
+
+/// Builtins runcode() evaluates itself with their already typed arguments, instead of going
+/// through the function pointer and commandret. They must behave exactly like the commands.
+static const struct inlinecmd { const char *name, *args; uint op; } inlinecmds[] =
+{
+    { "+", "ii", CODE_MATHI|(INLINE_ADD<<8) }, { "-", "ii", CODE_MATHI|(INLINE_SUB<<8) }, { "*", "ii", CODE_MATHI|(INLINE_MUL<<8) },
+    { "div", "ii", CODE_MATHI|(INLINE_DIV<<8) }, { "mod", "ii", CODE_MATHI|(INLINE_MOD<<8) },
+    { "=", "ii", CODE_MATHI|(INLINE_EQ<<8) }, { "!=", "ii", CODE_MATHI|(INLINE_NE<<8) },
+    { "<", "ii", CODE_MATHI|(INLINE_LT<<8) }, { ">", "ii", CODE_MATHI|(INLINE_GT<<8) },
+    { "<=", "ii", CODE_MATHI|(INLINE_LE<<8) }, { ">=", "ii", CODE_MATHI|(INLINE_GE<<8) },
+    { "&", "ii", CODE_MATHI|(INLINE_AND<<8) }, { "|", "ii", CODE_MATHI|(INLINE_OR<<8) }, { "^", "ii", CODE_MATHI|(INLINE_XOR<<8) },
+    { "<<", "ii", CODE_MATHI|(INLINE_SHL<<8) }, { ">>", "ii", CODE_MATHI|(INLINE_SHR<<8) },
+
+    { "+f", "ff", CODE_MATHF|(INLINE_ADD<<8) }, { "-f", "ff", CODE_MATHF|(INLINE_SUB<<8) }, { "*f", "ff", CODE_MATHF|(INLINE_MUL<<8) },
+    { "divf", "ff", CODE_MATHF|(INLINE_DIV<<8) }, { "modf", "ff", CODE_MATHF|(INLINE_MOD<<8) },
+    { "=f", "ff", CODE_MATHF|(INLINE_EQ<<8) }, { "!=f", "ff", CODE_MATHF|(INLINE_NE<<8) },
+    { "<f", "ff", CODE_MATHF|(INLINE_LT<<8) }, { ">f", "ff", CODE_MATHF|(INLINE_GT<<8) },
+    { "<=f", "ff", CODE_MATHF|(INLINE_LE<<8) }, { ">=f", "ff", CODE_MATHF|(INLINE_GE<<8) },
+
+    { "loop", "rie", CODE_LOOP|(INLINE_LOOP<<8) }, { "while", "ee", CODE_LOOP|(INLINE_WHILE<<8) }
+};
+static bool inlinecmdsoff = false; // benchscript compares against the plain command calls
+static int inlinestatement = -1, inlineop = -1; // where the last statement compiled to an inline op starts and its op
+
+/// @return the inline opcode for a builtin or 0 if it has to be called.
+static uint getinlinecmd(ident *id)
+{
+    static hashtable<const char *, const inlinecmd *> cmds(64);
+    if(inlinecmdsoff) return 0;
+    if(!cmds.numelems) loopi(int(sizeof(inlinecmds)/sizeof(inlinecmds[0]))) cmds[inlinecmds[i].name] = &inlinecmds[i];
+    const inlinecmd **cmd = cmds.access(id->name);
+    return cmd && !strcmp((*cmd)->args, id->args) ? (*cmd)->op : 0;
+}
+
 static bool compilearg(vector<uint> &code, const char *&p, int wordtype);
 static void compilestatements(vector<uint> &code, const char *&p, int rettype, int brak = '\0');
 
@@ -1295,16 +1341,26 @@ static bool compileword(vector<uint> &code, const char *&p, int wordtype, char *
         case '\"': word = cutstring(p, wordlen); break;
         case '$': compilelookup(code, p, wordtype); return true;
         case '(':
+        {
             p++;
+            int start = code.length();
             code.add(CODE_ENTER);
+            inlineop = -1;
             compilestatements(code, p, VAL_ANY, ')');
-            code.add(CODE_EXIT|(wordtype < VAL_ANY ? wordtype<<CODE_RET : 0));
+            if(inlinestatement == start+1 && inlineop == code.length()-1 && (code[inlineop]&CODE_OP_MASK) != CODE_LOOP)
+            {
+                // just one inline math op: run it right here instead of in a nested runcode()
+                code[start] = CODE_OFFSET|((start+1)<<8);
+                code[inlineop] |= INLINE_ARG|(wordtype < VAL_ANY ? wordtype<<CODE_RET : 0);
+            }
+            else code.add(CODE_EXIT|(wordtype < VAL_ANY ? wordtype<<CODE_RET : 0));
             switch(wordtype)
             {
                 case VAL_CODE: code.add(CODE_COMPILE); break;
                 case VAL_IDENT: code.add(CODE_IDENTU); break;
             }
-            return true;        
+            return true;
+        }
         case '[':
             p++;
             compileblock(code, p, wordtype);
@@ -1338,6 +1394,7 @@ static void compilestatements(vector<uint> &code, const char *&p, int rettype, i
     for(;;)
     {
         skipcomments(p);
+        int statement = code.length();
         idname = NULL;
         bool more = compileword(code, p, VAL_ANY, idname, idlen);
         if(!more) goto endstatement;
@@ -1429,7 +1486,13 @@ static void compilestatements(vector<uint> &code, const char *&p, int rettype, i
                         break;
                     }
                 endfmt:
-                    code.add(comtype|(rettype < VAL_ANY ? rettype<<CODE_RET : 0)|(id->index<<8));
+                    if(uint op = comtype == CODE_COM ? getinlinecmd(id) : 0)
+                    {
+                        inlinestatement = statement;
+                        inlineop = code.length();
+                        code.add(op|(rettype < VAL_ANY ? rettype<<CODE_RET : 0));
+                    }
+                    else code.add(comtype|(rettype < VAL_ANY ? rettype<<CODE_RET : 0)|(id->index<<8));
                     break;
                 }
                 case ID_LOCAL:
@@ -1548,6 +1611,88 @@ void freecode(uint *code)
     }
 }
 
+/// Compiled code of strings which get executed over and over again (binds, menus, sleep bodies).
+/// The least recently used entries get evicted once there are more than codecachesize.
+struct codecacheentry
+{
+    char *name;                  // the source string, key of codecache
+    uint *code;                  // compiled with compilecode(), the cache holds one reference
+    codecacheentry *prev, *next; // towards the more/less recently used entries
+
+    codecacheentry() : name(NULL), code(NULL), prev(NULL), next(NULL) {}
+};
+static hashnameset<codecacheentry> codecache;
+static codecacheentry *codecachefirst = NULL, *codecachelast = NULL;
+static bool codecacheoff = false; // benchexecute compares against compiling every time
+
+VAR_NOSYNC(codecacheentries, 1, 0, 0);
+VAR_NOSYNC(codecachehits, 1, 0, 0);
+VAR_NOSYNC(codecachemisses, 1, 0, 0);
+
+static void unlinkcodecache(codecacheentry &e)
+{
+    if(e.prev) e.prev->next = e.next; else codecachefirst = e.next;
+    if(e.next) e.next->prev = e.prev; else codecachelast = e.prev;
+    e.prev = e.next = NULL;
+}
+
+static void linkcodecache(codecacheentry &e)
+{
+    e.prev = NULL;
+    e.next = codecachefirst;
+    if(codecachefirst) codecachefirst->prev = &e; else codecachelast = &e;
+    codecachefirst = &e;
+}
+
+static void evictcodecache(int size)
+{
+    while(codecacheentries > max(size, 0) && codecachelast)
+    {
+        codecacheentry *e = codecachelast;
+        unlinkcodecache(*e);
+        freecode(e->code); // stays alive until a running execute() of it is done
+        char *name = e->name;
+        codecache.remove(name);
+        delete[] name;
+        codecacheentries--;
+    }
+}
+
+VARF(codecachesize, 0, 512, 16384, evictcodecache(codecachesize));
+VAR(codecachemaxlen, 0, 16384, 1<<20); // longer strings (e.g. whole config files) are compiled every time
+
+/// @return the compiled code of p with a reference the caller has to freecode() or NULL if p should not be cached.
+static uint *getcachedcode(const char *p)
+{
+    if(codecacheoff || !codecachesize) return NULL;
+    codecacheentry *e = codecache.access(p);
+    if(e)
+    {
+        codecachehits++;
+        if(e != codecachefirst)
+        {
+            unlinkcodecache(*e);
+            linkcodecache(*e);
+        }
+    }
+    else
+    {
+        int len = strlen(p);
+        if(len > codecachemaxlen) return NULL;
+        codecachemisses++;
+        uint *code = compilecode(p);
+        evictcodecache(codecachesize - 1);
+        codecacheentry ne;
+        ne.name = newstring(p, len);
+        ne.code = code;
+        e = &codecache.add(ne);
+        linkcodecache(*e);
+        codecacheentries++;
+    }
+    keepcode(e->code);
+    return e->code;
+}
+
 void printvar(ident *id, int i)
 {
     if (i < 0) spdlog::get("global")->info("{} = {}", id->name, i);
@@ -1633,7 +1778,7 @@ static const uint *skipcode(const uint *code, tagval &result)
 
 static inline void callcommand(ident *id, tagval *args, int numargs, bool lookup = false)
 {
-    int i = -1, fakeargs = 0;
+    int i = -1, fakeargs = 0, cachedargs = 0;
     bool rep = false;
     for(const char *fmt = id->args; *fmt; fmt++) switch(*fmt)
     {
@@ -1650,6 +1795,12 @@ static inline void callcommand(ident *id, tagval *args, int numargs, bool lookup
                 args[i].setcode(buf);
                 fakeargs++;
             }
+            else if(uint *code = getcachedcode(args[i].getstr()))
+            {
+                freearg(args[i]);
+                args[i].setcode(code+1);
+                cachedargs |= 1<<i;
+            }
             else
             {
                 vector<uint> buf;
@@ -1693,6 +1844,52 @@ static inline void callcommand(ident *id, tagval *args, int numargs, bool lookup
 cleanup:
     loopk(i) freearg(args[k]);
     for(; i < numargs; i++) freearg(args[i]);
+    if(cachedargs) loopk(MAXARGS) if(cachedargs&(1<<k)) freecode((uint *)args[k].code);
+}
+
+static void doloop(ident &id, int n, const uint *body);
+static void dowhile(const uint *cond, const uint *body);
+
+static inline int inlinemathi(int op, int a, int b)
+{
+    switch(op)
+    {
+        case INLINE_ADD: return a + b;
+        case INLINE_SUB: return a - b;
+        case INLINE_MUL: return a * b;
+        case INLINE_DIV: return b ? a / b : 0;
+        case INLINE_MOD: return b ? a % b : 0;
+        case INLINE_EQ: return int(a == b);
+        case INLINE_NE: return int(a != b);
+        case INLINE_LT: return int(a < b);
+        case INLINE_GT: return int(a > b);
+        case INLINE_LE: return int(a <= b);
+        case INLINE_GE: return int(a >= b);
+        case INLINE_AND: return a & b;
+        case INLINE_OR: return a | b;
+        case INLINE_XOR: return a ^ b;
+        case INLINE_SHL: return b < 32 ? a << max(b, 0) : 0;
+        case INLINE_SHR: return a >> clamp(b, 0, 31);
+    }
+    return 0;
+}
+
+static inline void inlinemathf(tagval &result, int op, float a, float b)
+{
+    switch(op)
+    {
+        case INLINE_ADD: result.setfloat(a + b); break;
+        case INLINE_SUB: result.setfloat(a - b); break;
+        case INLINE_MUL: result.setfloat(a * b); break;
+        case INLINE_DIV: result.setfloat(b ? a / b : 0); break;
+        case INLINE_MOD: result.setfloat(b ? fmod(a, b) : 0); break;
+        case INLINE_EQ: result.setint(int(a == b)); break;
+        case INLINE_NE: result.setint(int(a != b)); break;
+        case INLINE_LT: result.setint(int(a < b)); break;
+        case INLINE_GT: result.setint(int(a > b)); break;
+        case INLINE_LE: result.setint(int(a <= b)); break;
+        case INLINE_GE: result.setint(int(a >= b)); break;
+    }
 }
 
 #define MAXRUNDEPTH 255
@@ -1973,6 +2170,45 @@ static const uint *runcode(const uint *code, tagval &result)
                 }
                 goto forceresult;
 
+            case CODE_MATHI|RET_NULL: case CODE_MATHI|RET_STR: case CODE_MATHI|RET_FLOAT: case CODE_MATHI|RET_INT:
+            {
+                numargs -= 2;
+                int val = inlinemathi((op>>8)&0xFF, args[numargs].i, args[numargs+1].i);
+                if(op&INLINE_ARG)
+                {
+                    args[numargs].setint(val);
+                    forcearg(args[numargs++], op&CODE_RET_MASK);
+                    continue;
+                }
+                forcenull(result);
+                result.setint(val);
+                forcearg(result, op&CODE_RET_MASK);
+                continue;
+            }
+            case CODE_MATHF|RET_NULL: case CODE_MATHF|RET_STR: case CODE_MATHF|RET_FLOAT: case CODE_MATHF|RET_INT:
+                numargs -= 2;
+                if(op&INLINE_ARG)
+                {
+                    inlinemathf(args[numargs], (op>>8)&0xFF, args[numargs].f, args[numargs+1].f);
+                    forcearg(args[numargs++], op&CODE_RET_MASK);
+                    continue;
+                }
+                forcenull(result);
+                inlinemathf(result, (op>>8)&0xFF, args[numargs].f, args[numargs+1].f);
+                forcearg(result, op&CODE_RET_MASK);
+                continue;
+            case CODE_LOOP|RET_NULL: case CODE_LOOP|RET_STR: case CODE_LOOP|RET_FLOAT: case CODE_LOOP|RET_INT:
+            {
+                forcenull(result);
+                int first = numargs - ((op>>8) == INLINE_LOOP ? 3 : 2);
+                switch(op>>8)
+                {
+                    case INLINE_LOOP: doloop(*args[first].id, args[first+1].i, args[first+2].code); break;
+                    case INLINE_WHILE: dowhile(args[first].code, args[first+1].code); break;
+                }
+                goto forceresult;
+            }
+
             case CODE_CONC|RET_NULL: case CODE_CONC|RET_STR: case CODE_CONC|RET_FLOAT: case CODE_CONC|RET_INT:
             case CODE_CONCW|RET_NULL: case CODE_CONCW|RET_STR: case CODE_CONCW|RET_FLOAT: case CODE_CONCW|RET_INT:
             {
@@ -2124,6 +2360,12 @@ void executeret(const uint *code, tagval &result)
 
 void executeret(const char *p, tagval &result)
 {
+    if(uint *cached = getcachedcode(p))
+    {
+        runcode(cached+1, result);
+        freecode(cached);
+        return;
+    }
     vector<uint> code;
     code.reserve(64);
     compilemain(code, p, VAL_ANY);
@@ -2160,6 +2402,16 @@ int execute(const uint *code)
 
 int execute(const char *p)
 {
+    if(uint *cached = getcachedcode(p))
+    {
+        // cached code returns any type, getint() converts it like a RET_INT exit would
+        tagval result;
+        runcode(cached+1, result);
+        freecode(cached);
+        int i = result.getint();
+        freearg(result);
+        return i;
+    }
     vector<uint> code;
     code.reserve(64);
     compilemain(code, p, VAL_INT);
@@ -2229,6 +2481,71 @@ bool executebool(const char *p)
     return b;
 }
 
+/// Time repeated execute() calls of a few typical menu and bind scripts with and without the code cache.
+void benchexecute(int *iterations)
+{
+    static const char * const scripts[] =
+    {
+        "if (< (+ 1 2) 4) [result yes] [result no]",
+        "result (format \"%1 of %2 players\" (+ 3 4) (* 4 4))",
+        "loop i 8 [benchexecsum = (+ $benchexecsum $i)]",
+        "result (concat (at \"red green blue\" 1) (strreplace \"guibutton [x]\" x y))"
+    };
+    const int numscripts = int(sizeof(scripts)/sizeof(scripts[0]));
+    int n = max(*iterations, 1), hits = codecachehits, misses = codecachemisses;
+    alias("benchexecsum", "0");
+    double ms[2] = { 0, 0 };
+    loopk(2)
+    {
+        codecacheoff = k == 0;
+        inexor::util::Stopwatch sw;
+        loopi(n) loopj(numscripts) execute(scripts[j]);
+        ms[k] = sw.elapsed_ms();
+    }
+    codecacheoff = false;
+    spdlog::get("global")->info("benchexecute: {} x {} scripts: compiling every time {:.2f} ms, cached {:.2f} ms, speedup {:.1f}x ({} hits, {} misses)",
+        n, numscripts, ms[0], ms[1], ms[0]/max(ms[1], 0.001), codecachehits - hits, codecachemisses - misses);
+}
+COMMAND(benchexecute, "i");
+
+/// Run a few typical script workloads compiled with plain command calls and with inline builtins.
+/// Both have to give the same results.
+void benchscript(int *iterations)
+{
+    static const struct { const char *name, *script; } workloads[] =
+    {
+        { "empty loop", "loop i 1000 []" },
+        { "int math", "benchs = 0; loop i 1000 [benchs = (+ (mod (* $benchs 3) 1000003) (- $i (div $i 7)))]; result $benchs" },
+        { "compare", "benchs = 0; loop i 1000 [if (&& (>= $i 10) (!= (& $i 3) 0)) [benchs = (+ $benchs 1)]]; result $benchs" },
+        { "float math", "benchs = 0; loop i 1000 [benchs = (+f (*f $benchs 0.5) (divf $i 3))]; result $benchs" },
+        { "while", "benchs = 0; while [< $benchs 1000] [benchs = (+ $benchs 1)]; result $benchs" },
+        { "string concat", "benchs = \"\"; loop i 200 [benchs = (concatword $benchs (+ $i 1) \" \")]; result (strlen $benchs)" }
+    };
+    int n = max(*iterations, 1);
+    loopi(int(sizeof(workloads)/sizeof(workloads[0])))
+    {
+        uint *code[2];
+        string results[2];
+        double ms[2];
+        loopk(2)
+        {
+            inlinecmdsoff = k == 0;
+            code[k] = compilecode(workloads[i].script);
+            inexor::util::Stopwatch sw;
+            loopj(n) execute(code[k]+1);
+            ms[k] = sw.elapsed_ms();
+            char *s = executestr(code[k]+1);
+            copystring(results[k], s ? s : "");
+            DELETEA(s);
+            freecode(code[k]);
+        }
+        inlinecmdsoff = false;
+        spdlog::get("global")->info("benchscript: {} x {}: calls {:.2f} ms, inline {:.2f} ms, speedup {:.2f}x{}",
+            n, workloads[i].name, ms[0], ms[1], ms[0]/max(ms[1], 0.001), strcmp(results[0], results[1]) ? " RESULTS DIFFER" : "");
+    }
+}
+COMMAND(benchscript, "i");
+
 static string execdir = "";
 const char *getcurexecdir() { return execdir; } //returns the path of the file the command is called from
 
@@ -2252,7 +2569,9 @@ bool execfile(const char *cfgfile, bool msg)
 	
     copystring(execdir, parentdir(s)); //make the current path available to the executed commands
 
-    execute(buf);
+    uint *code = compilecode(buf); // run once, so keep it out of the code cache
+    execute(code+1);
+    freecode(code);
     
     sourcefile = oldsourcefile;
     sourcestr = oldsourcestr;
@@ -2466,17 +2785,18 @@ static inline void setiter(ident &id, int i, identstack &stack)
         id.flags &= ~IDF_UNKNOWN;
     }
 }
-ICOMMAND(loop, "rie", (ident *id, int *n, uint *body),
+static void doloop(ident &id, int n, const uint *body)
 {
-    if(*n <= 0 || id->type!=ID_ALIAS) return;
+    if(n <= 0 || id.type!=ID_ALIAS) return;
     identstack stack;
-    loopi(*n)
+    loopi(n)
     {
-        setiter(*id, i, stack);
+        setiter(id, i, stack);
         execute(body);
     }
-    poparg(*id);
-});
+    poparg(id);
+}
+ICOMMAND(loop, "rie", (ident *id, int *n, uint *body), doloop(*id, *n, body));
 ICOMMAND(loopwhile, "riee", (ident *id, int *n, uint *cond, uint *body),
 {
     if(*n <= 0 || id->type!=ID_ALIAS) return;
@@ -2489,7 +2809,11 @@ ICOMMAND(loopwhile, "riee", (ident *id, int *n, uint *cond, uint *body),
     }
     poparg(*id);
 });
-ICOMMAND(while, "ee", (uint *cond, uint *body), while(executebool(cond)) execute(body));
+static void dowhile(const uint *cond, const uint *body)
+{
+    while(executebool(cond)) execute(body);
+}
+ICOMMAND(while, "ee", (uint *cond, uint *body), dowhile(cond, body));
 
 char *loopconc(ident *id, int n, uint *body, bool space)
 {
@@ -3192,52 +3516,202 @@ COMMAND(strsplice, "ssii");
 #ifndef STANDALONE
 ICOMMAND(getmillis, "i", (int *total), intret(*total ? totalmillis : lastmillis));
 
-struct sleepcmd
+/// Pending sleep commands, ordered by due time in a binary heap.
+/// The bodies get compiled when scheduled, cancelling a timer only marks its slot as free.
+/// Handles count up and are looked up in a table, so a stale handle only matches a newer timer
+/// once 2^31 sleeps later the count wraps around.
+#define MAXSLEEPS (1<<20)
+struct sleepqueue
 {
-    int delay, millis, flags;
-    char *command;
-};
-vector<sleepcmd> sleepcmds;
+    struct sleepcmd
+    {
+        int id, seq, delay, millis, flags; // id 0 marks a free slot
+        uint *code;
+    };
+    vector<sleepcmd> slots;
+    vector<int> freeslots, heap; // the heap holds slot indices
+    hashtable<int, int> ids; // handle -> slot of every pending timer
+    int lastseq, lastid, pending, checking;
 
-void addsleep(int *msec, char *cmd)
-{
-    sleepcmd &s = sleepcmds.add();
-    s.delay = max(*msec, 1);
-    s.millis = lastmillis;
-    s.command = newstring(cmd);
-    s.flags = identflags;
-}
+    sleepqueue() : lastseq(0), lastid(0), pending(0), checking(0) {}
+    ~sleepqueue() { clear(false); }
 
-COMMANDN(sleep, addsleep, "is");
+    int due(int slot) const { return slots[slot].millis + slots[slot].delay; }
 
-void checksleep(int millis)
-{
-    loopv(sleepcmds)
+    /// Earlier due time first, ties in the order the sleeps were scheduled.
+    bool before(int a, int b) const
+    {
+        int d = due(a) - due(b);
+        return d < 0 || (!d && slots[a].seq - slots[b].seq < 0);
+    }
+
+    void upheap(int i)
+    {
+        while(i > 0)
+        {
+            int pi = (i - 1) >> 1;
+            if(!before(heap[i], heap[pi])) break;
+            swap(heap[i], heap[pi]);
+            i = pi;
+        }
+    }
+
+    void downheap(int i)
+    {
+        for(;;)
+        {
+            int ci = (i << 1) + 1;
+            if(ci >= heap.length()) break;
+            if(ci + 1 < heap.length() && before(heap[ci+1], heap[ci])) ci++;
+            if(!before(heap[ci], heap[i])) break;
+            swap(heap[ci], heap[i]);
+            i = ci;
+        }
+    }
+
+    int pop()
+    {
+        int slot = heap.removeunordered(0);
+        if(heap.length()) downheap(0);
+        return slot;
+    }
+
+    void release(int slot)
+    {
+        sleepcmd &s = slots[slot];
+        ids.remove(s.id);
+        s.id = 0;
+        pending--;
+        freecode(s.code);
+        s.code = NULL;
+    }
+
+    /// @return the slot of a pending timer or -1.
+    int find(int id)
+    {
+        int *slot = id > 0 ? ids.access(id) : NULL;
+        return slot ? *slot : -1;
+    }
+
+    /// @return the handle of the new timer or 0 if there are too many pending already.
+    int add(int delay, int millis, int flags, uint *code)
     {
-        sleepcmd &s = sleepcmds[i];
-        if(millis - s.millis >= s.delay)
+        int slot = freeslots.length() ? freeslots.pop() : slots.length();
+        if(slot >= MAXSLEEPS) { freecode(code); return 0; }
+        if(slot >= slots.length()) slots.add();
+        sleepcmd &s = slots[slot];
+        s.seq = ++lastseq;
+        do lastid = lastid < INT_MAX ? lastid + 1 : 1; while(ids.access(lastid));
+        s.id = lastid;
+        ids[s.id] = slot;
+        s.delay = max(delay, 1);
+        s.millis = millis;
+        s.flags = flags;
+        s.code = code;
+        pending++;
+        heap.add(slot);
+        upheap(heap.length()-1);
+        return s.id;
+    }
+
+    bool cancel(int id)
+    {
+        int slot = find(id);
+        if(slot < 0) return false;
+        release(slot); // its heap entry gets dropped once it comes up
+        return true;
+    }
+
+    /// @return the time left until timer id is due or -1 if there is no such timer.
+    int remaining(int id, int millis)
+    {
+        int slot = find(id);
+        if(slot < 0) return -1;
+        return max(slots[slot].delay - (millis - slots[slot].millis), 0);
+    }
+
+    struct duesleep
+    {
+        int id, seq, slot;
+
+        static bool compare(const duesleep &a, const duesleep &b) { return a.seq - b.seq < 0; }
+    };
+
+    void check(int millis)
+    {
+        // collect everything due first: bodies may schedule, cancel or clear other sleeps
+        vector<duesleep> due;
+        while(heap.length())
         {
-            char *cmd = s.command; // execute might create more sleep commands
-            s.command = NULL;
+            int slot = heap[0];
+            sleepcmd &s = slots[slot];
+            if(s.id && millis - s.millis < s.delay) break;
+            pop();
+            if(!s.id) { freeslots.add(slot); continue; }
+            duesleep &d = due.add();
+            d.id = s.id;
+            d.seq = s.seq;
+            d.slot = slot;
+        }
+        if(due.empty()) return;
+        due.sort(duesleep::compare); // run in the order they were scheduled like the old linear scan did
+        checking++;
+        loopv(due)
+        {
+            int slot = due[i].slot;
+            freeslots.add(slot);
+            sleepcmd &s = slots[slot];
+            if(s.id != due[i].id) continue; // cancelled by an earlier body
+            uint *code = s.code;
+            int flags = s.flags;
+            s.code = NULL;
+            ids.remove(s.id);
+            s.id = 0;
+            pending--;
             int oldflags = identflags;
-            identflags = s.flags;
-            execute(cmd);
+            identflags = flags;
+            execute(code+1);
             identflags = oldflags;
-            delete[] cmd;
-            if(sleepcmds.inrange(i) && !sleepcmds[i].command) sleepcmds.remove(i--);
+            freecode(code);
         }
+        checking--;
+    }
+
+    /// Remove all sleeps or (if clearoverrides) only those scheduled by overridden (map) scripts.
+    void clear(bool clearoverrides)
+    {
+        loopv(slots) if(slots[i].id && !(clearoverrides && !(slots[i].flags&IDF_OVERRIDDEN))) release(i);
+        if(pending || checking) return; // a running check() still refers to its slots
+        slots.setsize(0);
+        freeslots.setsize(0);
+        heap.setsize(0);
     }
+};
+static sleepqueue sleeps;
+
+static uint *compilesleep(const char *cmd)
+{
+    uint *code = getcachedcode(cmd);
+    return code ? code : compilecode(cmd);
+}
+
+void addsleep(int *msec, char *cmd)
+{
+    intret(sleeps.add(*msec, lastmillis, identflags, compilesleep(cmd)));
+}
+COMMANDN(sleep, addsleep, "is");
+
+ICOMMAND(cancelsleep, "i", (int *id), intret(sleeps.cancel(*id) ? 1 : 0));
+ICOMMAND(sleepremaining, "i", (int *id), intret(sleeps.remaining(*id, lastmillis)));
+
+void checksleep(int millis)
+{
+    sleeps.check(millis);
 }
 
 void clearsleep(bool clearoverrides)
 {
-    int len = 0;
-    loopv(sleepcmds) if(sleepcmds[i].command)
-    {
-        if(clearoverrides && !(sleepcmds[i].flags&IDF_OVERRIDDEN)) sleepcmds[len++] = sleepcmds[i];
-        else delete[] sleepcmds[i].command;
-    }
-    sleepcmds.shrink(len);
+    sleeps.clear(clearoverrides);
 }
 
 void clearsleep_(int *clearoverrides)
@@ -3246,5 +3720,33 @@ void clearsleep_(int *clearoverrides)
 }
 
 COMMANDN(clearsleep, clearsleep_, "i");
+
+/// Schedule count empty timers (up to 10 seconds) in a private queue, cancel every 8th one
+/// and drain the rest in simulated 60 fps frames.
+void benchsleep(int *count)
+{
+    int n = *count > 0 ? min(*count, 1000000) : 10000;
+    sleepqueue q;
+    uint *body = compilecode("");
+    vector<int> handles;
+    inexor::util::Stopwatch sw;
+    loopi(n)
+    {
+        keepcode(body);
+        handles.add(q.add(1 + rnd(10000), 0, identflags, body));
+    }
+    double addms = sw.elapsed_ms();
+    sw.reset();
+    for(int i = 0; i < n; i += 8) q.cancel(handles[i]);
+    double cancelms = sw.elapsed_ms();
+    sw.reset();
+    int frames = 0;
+    for(int millis = 0; q.pending; millis += 16, frames++) q.check(millis);
+    double checkms = sw.elapsed_ms();
+    freecode(body);
+    spdlog::get("global")->info("benchsleep: {} timers, add {:.3f} ms, cancel {:.3f} ms, {} frames checked in {:.3f} ms ({:.4f} ms per frame)",
+        n, addms, cancelms, frames, checkms, frames ? checkms/frames : 0.0);
+}
+COMMAND(benchsleep, "i");
 #endif
 
@@ -349,7 +349,18 @@ struct iqm : skelmodel, skelloader<iqm>
         {
             name = newstring(filename);
 
-            return loadiqm(filename, true, false);
+            string cachename;
+            if(initmeshcache("iqmmesh", filename, 0, cachename))
+            {
+                vector<char *> texnames;
+                bool cached = loadmeshcache(cachename, texnames);
+                texnames.deletearrays();
+                if(cached) return true;
+            }
+
+            if(!loadiqm(filename, true, false)) return false;
+            if(cachename[0]) savemeshcache(cachename);
+            return true;
         }
 
         skelanimspec *loadanim(const char *animname)
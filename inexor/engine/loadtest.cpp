@@ -0,0 +1,605 @@
+// loadtest.cpp: headless load generator, connects lots of fake players to a dedicated server
+
+#include <memory>
+
+#include "inexor/fpsgame/game.hpp"
+#include "inexor/util/Logging.hpp"
+#include "inexor/util/Metrics.hpp"
+#include <enet/time.h>
+
+using inexor::util::Histogram;
+
+inexor::util::Logging logging;
+
+void fatal(const char *fmt, ...)
+{
+    defvformatstring(msg, fmt, fmt);
+    spdlog::get("global")->critical(msg);
+    exit(EXIT_FAILURE);
+}
+
+static string host = "localhost";
+static int port = INEXOR_SERVER_PORT;
+static int numbots = 16;
+static int duration = 60;         // seconds, 0 runs until killed
+static int reportinterval = 5;    // seconds between two reports
+static int joininterval = 50;     // ms between two connects, so the server is not hit by all of them at once
+static int chatinterval = 30;     // mean seconds between two chat lines of a bot, 0 disables chat
+static int metricsport = 0;       // the server's metricsport, used to query its tick times
+
+enum { FRAMEMILLIS = 33, PINGMILLIS = 250, SPAWNMILLIS = 1500, NUMCHANNELS = 3 }; // like the client, see server::numchannels()
+
+static ENetAddress address;
+static ENetHost *clienthost = NULL;
+static enet_uint32 starttime = 0;
+int totalmillis = 0;
+
+static int msgsize(int type)
+{
+    static int sizetable[NUMMSG] = { -1 };
+    if(sizetable[0] < 0)
+    {
+        memset(sizetable, 0, sizeof(sizetable));
+        for(const int *p = msgsizes; *p >= 0; p += 2) sizetable[p[0]] = p[1];
+    }
+    return type >= 0 && type < NUMMSG ? sizetable[type] : -1;
+}
+
+/// One fake player, running in circles and shooting into the air.
+struct bot
+{
+    int num;
+    ENetPeer *peer = NULL;
+    int cn = -1;
+    bool connected = false, alive = false;
+    int lifesequence = 0, gunselect = GUN_PISTOL, ammo[NUMGUNS];
+
+    vec center, pos;
+    float radius, angle, speed;
+
+    vector<uchar> messages;
+    bool reliable = false;
+    int lastping = 0, nextshot = 0, nextchat = 0, nextspawn = 0;
+    int ping = 0, shots = 0, deaths = 0, unparsed = 0;
+    uint bytesin = 0, bytesout = 0;
+    int rttsum = 0, rttcount = 0, rttmax = 0, reportsum = 0, reportcount = 0;
+
+    bot(int num) : num(num)
+    {
+        memset(ammo, 0, sizeof(ammo));
+        // somewhere in the middle of a default sized map, walking at about player speed
+        center = vec(256 + rnd(512), 256 + rnd(512), 512);
+        radius = 32 + rnd(192);
+        angle = rndscale(2*PI);
+        speed = 60 + rnd(40);
+        pos = center;
+    }
+
+    void connect()
+    {
+        peer = enet_host_connect(clienthost, &address, NUMCHANNELS, 0);
+        if(peer) peer->data = this;
+    }
+
+    void send(int chan, packetbuf &p)
+    {
+        bytesout += p.length();
+        enet_peer_send(peer, chan, p.finalize());
+    }
+
+    void sendintro()
+    {
+        packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+        putint(p, N_CONNECT);
+        defformatstring(name, "load%d", num);
+        sendstring(name, p);
+        putint(p, 0);   // playermodel
+        putint(p, 100); // fov
+        sendstring("", p);
+        sendstring("", p);
+        sendstring("", p);
+        send(1, p);
+    }
+
+    void spawned(int ls, int gun, const int *spawnammo)
+    {
+        lifesequence = ls;
+        gunselect = gun;
+        memset(ammo, 0, sizeof(ammo));
+        for(int i = GUN_SG; i <= GUN_PISTOL; i++) ammo[i] = spawnammo[i-GUN_SG];
+        alive = true;
+        putint(messages, N_SPAWN);
+        putint(messages, lifesequence);
+        putint(messages, gunselect);
+        reliable = true;
+        nextshot = totalmillis + 1000 + rnd(1000);
+    }
+
+    void pong(int elapsed);
+
+    void died()
+    {
+        alive = false;
+        deaths++;
+        nextspawn = totalmillis + SPAWNMILLIS;
+    }
+
+    /// Same encoding as game::sendposition(), see N_POS in server::parsepacket().
+    void sendposition()
+    {
+        packetbuf q(100);
+        putint(q, N_POS);
+        putuint(q, cn);
+        q.put(PHYS_FLOOR | ((lifesequence&1)<<3) | (1<<4));
+        vec vel = vec(-sinf(angle), cosf(angle), 0).mul(speed);
+        ivec o = ivec(vec(pos).mul(DMF));
+        uint mag = min(int(vel.magnitude()*DVELF), 0xFFFF), flags = 0;
+        loopk(3) if(o[k] < 0 || o[k] > 0xFFFF) flags |= 1<<k;
+        if(mag > 0xFF) flags |= 1<<3;
+        putuint(q, flags);
+        loopk(3)
+        {
+            q.put(o[k]&0xFF);
+            q.put((o[k]>>8)&0xFF);
+            if(o[k] < 0 || o[k] > 0xFFFF) q.put((o[k]>>16)&0xFF);
+        }
+        float yaw, pitch;
+        vectoyawpitch(vel, yaw, pitch);
+        uint dir = (yaw < 0 ? 360 + int(yaw)%360 : int(yaw)%360) + 90*360;
+        q.put(dir&0xFF);
+        q.put((dir>>8)&0xFF);
+        q.put(90);
+        q.put(mag&0xFF);
+        if(mag > 0xFF) q.put((mag>>8)&0xFF);
+        q.put(dir&0xFF);
+        q.put((dir>>8)&0xFF);
+        send(0, q);
+    }
+
+    void shoot()
+    {
+        if(ammo[gunselect] <= 0)
+        {
+            int gun = -1;
+            for(int i = GUN_SG; i <= GUN_PISTOL; i++) if(ammo[i] > 0) { gun = i; break; }
+            if(gun < 0) { nextshot = totalmillis + 5000; return; }
+            gunselect = gun;
+            putint(messages, N_GUNSELECT);
+            putint(messages, gunselect);
+        }
+        vec dir = vec(rndscale(2) - 1, rndscale(2) - 1, rndscale(1)).normalize();
+        vec from = vec(pos).add(vec(0, 0, 14)), to = vec(dir).mul(guns[gunselect].range).add(from);
+        putint(messages, N_SHOOT);
+        putint(messages, totalmillis);
+        putint(messages, gunselect);
+        loopk(3) putint(messages, int(from[k]*DMF));
+        loopk(3) putint(messages, int(to[k]*DMF));
+        putint(messages, 0); // hits
+        reliable = true;
+        ammo[gunselect]--;
+        shots++;
+        // not holding the trigger all the time
+        nextshot = totalmillis + guns[gunselect].attackdelay + rnd(1000);
+    }
+
+    void chat()
+    {
+        putint(messages, N_TEXT);
+        defformatstring(text, "load test line %d from bot %d", rnd(1000), num);
+        sendstring(text, messages);
+        reliable = true;
+    }
+
+    /// Called every frame, does what game::c2sinfo() would do.
+    void update()
+    {
+        if(!connected || cn < 0) return;
+        if(alive)
+        {
+            angle += speed*FRAMEMILLIS/1000.0f/radius;
+            if(angle > 2*PI) angle -= 2*PI;
+            pos = vec(cosf(angle), sinf(angle), 0).mul(radius).add(center);
+            sendposition();
+            if(totalmillis >= nextshot) shoot();
+        }
+        else if(nextspawn && totalmillis >= nextspawn)
+        {
+            putint(messages, N_TRYSPAWN);
+            reliable = true;
+            nextspawn = totalmillis + 2*SPAWNMILLIS;
+        }
+        if(chatinterval && totalmillis >= nextchat)
+        {
+            if(nextchat) chat();
+            nextchat = totalmillis + chatinterval*500 + rnd(chatinterval*1000);
+        }
+        if(totalmillis - lastping > PINGMILLIS)
+        {
+            putint(messages, N_PING);
+            putint(messages, totalmillis);
+            lastping = totalmillis;
+        }
+        packetbuf p(MAXTRANS);
+        if(reliable) p.reliable();
+        p.put(messages.getbuf(), messages.length());
+        messages.setsize(0);
+        reliable = false;
+        send(1, p);
+    }
+
+    /// Parses what we need of the server's messages (see game::parsemessages()),
+    /// anything else is skipped by its size in msgsizes.
+    void parsemessages(packetbuf &p)
+    {
+        char text[MAXTRANS];
+        while(p.remaining() > 0 && !p.overread())
+        {
+            int type = getint(p);
+            switch(type)
+            {
+                case N_SERVINFO:
+                {
+                    cn = getint(p);
+                    int protocol = getint(p);
+                    getint(p); // sessionid
+                    getint(p); // haspass
+                    getstring(text, p);
+                    getstring(text, p);
+                    if(protocol != PROTOCOL_VERSION) fatal("server uses protocol %d, we use %d", protocol, PROTOCOL_VERSION);
+                    sendintro();
+                    break;
+                }
+
+                case N_MAPCHANGE:
+                    getstring(text, p);
+                    getint(p);
+                    getint(p);
+                    alive = false;
+                    break;
+
+                case N_ITEMLIST:
+                    while(getint(p) >= 0 && !p.overread()) getint(p);
+                    break;
+
+                case N_CURRENTMASTER:
+                    getint(p);
+                    while(getint(p) >= 0 && !p.overread()) getint(p);
+                    break;
+
+                case N_PAUSEGAME:
+                case N_GAMESPEED:
+                    getint(p);
+                    getint(p);
+                    break;
+
+                case N_TEAMINFO:
+                    for(;;)
+                    {
+                        getstring(text, p);
+                        if(p.overread() || !text[0]) break;
+                        getint(p);
+                    }
+                    break;
+
+                case N_SETTEAM:
+                    getint(p);
+                    getstring(text, p);
+                    getint(p);
+                    break;
+
+                case N_SPAWNSTATE:
+                {
+                    int scn = getint(p), state[12];
+                    loopi(msgsize(N_SPAWNSTATE)-2) state[i] = getint(p);
+                    // lifesequence, health, maxhealth, armour, armourtype, gunselect, ammo
+                    if(scn == cn) spawned(state[0], state[5], &state[6]);
+                    break;
+                }
+
+                case N_FORCEDEATH:
+                    if(getint(p) == cn) died();
+                    break;
+
+                case N_DIED:
+                {
+                    int victim = getint(p);
+                    getint(p);
+                    getint(p);
+                    getint(p);
+                    if(victim == cn) died();
+                    break;
+                }
+
+                case N_RESUME:
+                    while(getint(p) >= 0 && !p.overread()) loopi(8 + msgsize(N_SPAWNSTATE)-2) getint(p);
+                    break;
+
+                case N_INITCLIENT:
+                    getint(p);
+                    getstring(text, p);
+                    getstring(text, p);
+                    getstring(text, p);
+                    getint(p);
+                    getint(p);
+                    break;
+
+                case N_INITAI:
+                    loopi(5) getint(p);
+                    loopi(3) getstring(text, p);
+                    break;
+
+                case N_SERVMSG:
+                    getstring(text, p);
+                    break;
+
+                case N_CLIENT:
+                {
+                    getint(p);
+                    int len = getuint(p);
+                    p.subbuf(len);
+                    break;
+                }
+
+                case N_PONG:
+                {
+                    int sent = getint(p), elapsed = totalmillis - sent;
+                    if(elapsed < 0) break;
+                    pong(elapsed);
+                    break;
+                }
+
+                default:
+                {
+                    int size = msgsize(type);
+                    if(size <= 0) { unparsed++; return; } // variable sized and not handled, drop the rest of the packet
+                    loopi(size-1) getint(p);
+                    break;
+                }
+            }
+        }
+    }
+};
+
+static vector<bot *> bots;
+
+// round trips of N_PING over all bots, so it includes the time the server takes to react
+static Histogram totalrtt;
+static std::unique_ptr<Histogram> reportrtt(new Histogram);
+
+void bot::pong(int elapsed)
+{
+    rttsum += elapsed;
+    rttcount++;
+    rttmax = max(rttmax, elapsed);
+    reportsum += elapsed;
+    reportcount++;
+    totalrtt.record(elapsed);
+    reportrtt->record(elapsed);
+    putint(messages, N_CLIENTPING);
+    putint(messages, ping = (ping*5 + elapsed)/6);
+}
+
+/// The server side of the picture, as exported on its metricsport.
+struct serverstats
+{
+    double tickp50 = 0, tickp99 = 0, tickmax = 0, ticksum = 0, tickcount = 0, clients = 0;
+
+    static double find(const std::string &metrics, const char *name)
+    {
+        size_t len = strlen(name);
+        for(size_t pos = metrics.find(name); pos != std::string::npos; pos = metrics.find(name, pos + len))
+        {
+            if((!pos || metrics[pos-1] == '\n') && metrics.compare(pos+len, 1, " ") == 0) return atof(metrics.c_str() + pos+len+1);
+        }
+        return 0;
+    }
+
+    /// Fetches the metrics over http, blocking for at most a second.
+    bool fetch()
+    {
+        ENetAddress metricsaddress = address;
+        metricsaddress.port = metricsport;
+        ENetSocket sock = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
+        if(sock == ENET_SOCKET_NULL) return false;
+        std::string metrics;
+        bool ok = false;
+        if(!enet_socket_connect(sock, &metricsaddress))
+        {
+            const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+            ENetBuffer buf;
+            buf.data = (void *)request;
+            buf.dataLength = sizeof(request)-1;
+            if(enet_socket_send(sock, NULL, &buf, 1) == int(buf.dataLength))
+            {
+                char data[4096];
+                buf.data = data;
+                buf.dataLength = sizeof(data);
+                enet_uint32 started = enet_time_get();
+                while(enet_time_get() - started < 1000)
+                {
+                    enet_uint32 events = ENET_SOCKET_WAIT_RECEIVE;
+                    if(enet_socket_wait(sock, &events, 100) < 0) break;
+                    if(!(events & ENET_SOCKET_WAIT_RECEIVE)) continue;
+                    int len = enet_socket_receive(sock, NULL, &buf, 1);
+                    if(len <= 0) { ok = len == 0; break; } // the server closes the connection when done
+                    metrics.append(data, len);
+                }
+            }
+        }
+        enet_socket_destroy(sock);
+        if(!ok) return false;
+        tickp50 = find(metrics, "inexor_server_tick_seconds{quantile=\"0.5\"}");
+        tickp99 = find(metrics, "inexor_server_tick_seconds{quantile=\"0.99\"}");
+        tickmax = find(metrics, "inexor_server_tick_seconds{quantile=\"1\"}");
+        ticksum = find(metrics, "inexor_server_tick_seconds_sum");
+        tickcount = find(metrics, "inexor_server_tick_seconds_count");
+        clients = find(metrics, "inexor_server_clients");
+        return true;
+    }
+};
+
+static serverstats laststats;
+
+static void report()
+{
+    static int lastreport = 0;
+    float secs = max(totalmillis - lastreport, 1)/1000.0f;
+    lastreport = totalmillis;
+
+    int connected = 0, alive = 0, unparsed = 0;
+    const bot *worst = NULL;
+    loopv(bots)
+    {
+        bot &b = *bots[i];
+        if(b.connected) connected++;
+        if(b.alive) alive++;
+        unparsed += b.unparsed;
+        if(b.reportcount && (!worst || b.reportsum*worst->reportcount > worst->reportsum*b.reportcount)) worst = &b;
+    }
+    spdlog::get("global")->info("{0:>5}s: {1}/{2} connected, {3} alive, up {4:.1f} KiB/s, down {5:.1f} KiB/s{6}",
+        totalmillis/1000, connected, bots.length(), alive,
+        clienthost->totalSentData/1024.0f/secs, clienthost->totalReceivedData/1024.0f/secs,
+        unparsed ? ", some server messages could not be parsed" : "");
+    clienthost->totalSentData = clienthost->totalReceivedData = 0;
+
+    if(worst) spdlog::get("global")->info("        rtt p50 {0} ms, p99 {1} ms, max {2} ms, worst client load{3} avg {4} ms",
+        reportrtt->quantile(0.5), reportrtt->quantile(0.99), reportrtt->max(),
+        worst->num, worst->reportsum/worst->reportcount);
+    reportrtt.reset(new Histogram);
+    loopv(bots) bots[i]->reportsum = bots[i]->reportcount = 0;
+
+    serverstats stats;
+    if(metricsport && stats.fetch())
+    {
+        double ticks = stats.tickcount - laststats.tickcount;
+        spdlog::get("global")->info("        server {0} clients, {1:.1f} ticks/s, avg {2:.3f} ms, since start: p50 {3:.3f} ms, p99 {4:.3f} ms, max {5:.3f} ms",
+            int(stats.clients), ticks/secs, ticks > 0 ? (stats.ticksum - laststats.ticksum)/ticks*1000 : 0.0,
+            stats.tickp50*1000, stats.tickp99*1000, stats.tickmax*1000);
+        laststats = stats;
+    }
+    else if(metricsport) spdlog::get("global")->warn("        could not fetch the server's metrics from port {0}", metricsport);
+}
+
+static void summary()
+{
+    spdlog::get("global")->info("client   cn  shots  deaths  sent KiB  received KiB  rtt avg  rtt max");
+    loopv(bots)
+    {
+        bot &b = *bots[i];
+        spdlog::get("global")->info("load{0:<4} {1:>3} {2:>6} {3:>7} {4:>9.1f} {5:>13.1f} {6:>8} {7:>8}",
+            b.num, b.cn, b.shots, b.deaths, b.bytesout/1024.0f, b.bytesin/1024.0f,
+            b.rttcount ? b.rttsum/b.rttcount : 0, b.rttmax);
+    }
+    spdlog::get("global")->info("rtt over all clients: p50 {0} ms, p90 {1} ms, p99 {2} ms, max {3} ms",
+        totalrtt.quantile(0.5), totalrtt.quantile(0.9), totalrtt.quantile(0.99), totalrtt.max());
+}
+
+static void handleevent(ENetEvent &event)
+{
+    bot *b = event.peer ? (bot *)event.peer->data : NULL;
+    if(!b) return;
+    switch(event.type)
+    {
+        case ENET_EVENT_TYPE_CONNECT:
+            b->connected = true;
+            break;
+
+        case ENET_EVENT_TYPE_RECEIVE:
+        {
+            b->bytesin += event.packet->dataLength;
+            // channel 0 are the positions of the others, we only care about their size
+            if(event.channelID == 1)
+            {
+                packetbuf p(event.packet);
+                b->parsemessages(p);
+            }
+            enet_packet_destroy(event.packet);
+            break;
+        }
+
+        case ENET_EVENT_TYPE_DISCONNECT:
+            if(b->connected) spdlog::get("global")->warn("load{0} got disconnected (reason {1})", b->num, event.data);
+            else spdlog::get("global")->warn("load{0} could not connect", b->num);
+            b->connected = b->alive = false;
+            b->peer = NULL;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static bool option(char *opt)
+{
+    switch(opt[1])
+    {
+        case 'h': copystring(host, opt+2); return true;
+        case 'p': port = atoi(opt+2); return true;
+        case 'n': numbots = clamp(atoi(opt+2), 1, MAXCLIENTS); return true;
+        case 'd': duration = max(atoi(opt+2), 0); return true;
+        case 'r': reportinterval = max(atoi(opt+2), 1); return true;
+        case 'j': joininterval = max(atoi(opt+2), 0); return true;
+        case 't': chatinterval = max(atoi(opt+2), 0); return true;
+        case 'm': metricsport = clamp(atoi(opt+2), 0, MAX_POSSIBLE_PORT); return true;
+        default: return false;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    logging.initDefaultLoggers();
+    for(int i = 1; i < argc; i++) if(argv[i][0] != '-' || !option(argv[i]))
+    {
+        printf("usage: %s [-h<host>] [-p<port>] [-n<clients>] [-d<seconds>] [-r<report seconds>] [-j<join ms>] [-t<chat seconds>] [-m<server metricsport>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(enet_initialize()<0) fatal("Unable to initialise network module");
+    atexit(enet_deinitialize);
+    if(enet_address_set_host(&address, host) < 0) fatal("failed to resolve server address: %s", host);
+    address.port = port;
+    clienthost = enet_host_create(NULL, numbots, NUMCHANNELS, 0, 0);
+    if(!clienthost) fatal("could not create the client host");
+
+    spdlog::get("global")->info("connecting {0} clients to {1}:{2}", numbots, host, port);
+    starttime = enet_time_get();
+    int nextjoin = 0, nextframe = 0, nextreport = reportinterval*1000;
+    if(metricsport) laststats.fetch();
+    while(!duration || totalmillis < duration*1000)
+    {
+        if(bots.length() < numbots && totalmillis >= nextjoin)
+        {
+            bot *b = new bot(bots.length());
+            bots.add(b);
+            b->connect();
+            nextjoin = totalmillis + joininterval;
+        }
+
+        ENetEvent event;
+        if(enet_host_service(clienthost, &event, clamp(nextframe - totalmillis, 0, int(FRAMEMILLIS))) > 0)
+        {
+            do handleevent(event); while(enet_host_check_events(clienthost, &event) > 0);
+        }
+        totalmillis = int(enet_time_get() - starttime);
+
+        if(totalmillis >= nextframe)
+        {
+            loopv(bots) bots[i]->update();
+            enet_host_flush(clienthost);
+            // don't try to catch up when we fell behind, that would only send bursts
+            nextframe = max(nextframe + int(FRAMEMILLIS), totalmillis);
+        }
+        if(totalmillis >= nextreport)
+        {
+            report();
+            nextreport += reportinterval*1000;
+        }
+    }
+
+    report();
+    summary();
+    loopv(bots) if(bots[i]->peer) enet_peer_disconnect(bots[i]->peer, DISC_NONE);
+    enet_host_flush(clienthost);
+    enet_host_destroy(clienthost);
+    bots.deletecontents();
+    return EXIT_SUCCESS;
+}
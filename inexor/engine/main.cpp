@@ -9,6 +9,7 @@
 #include "inexor/util/Subsystem.hpp"
 #include "inexor/crashreporter/CrashReporter.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Profiler.hpp"
 #include "inexor/rpc/SharedTree.hpp"
 #include "inexor/rpc/SharedList.hpp"
 
@@ -108,6 +109,7 @@ void quit()
     localdisconnect();
     writecfg();
     cleanup();
+    metapp.stop("metrics");
     metapp.stop("cef");
     metapp.stop("rpc");
     exit(EXIT_SUCCESS);
@@ -757,6 +759,20 @@ static bool findarg(int argc, char **argv, const char *str)
 ICOMMANDERR(subsystem_start, "s", (char *s), std::string ccs{s}; metapp.start(ccs));
 ICOMMANDERR(subsystem_stop, "s", (char *s), std::string ccs{s}; metapp.stop(ccs));
 
+namespace inexor { namespace rpc {
+    extern void set_flush_interval(int ms);
+    extern void set_io_thread(bool on);
+    extern void benchsharedvarsync(int updates, int frames);
+    extern void rpcstats();
+} }
+
+/// Send changed shared variables to the rpc clients at most every that many milliseconds (0 = every frame).
+VARFP(rpcflushinterval, 0, 0, 1000, inexor::rpc::set_flush_interval(rpcflushinterval));
+/// Serve the rpc clients from their own thread instead of once a frame (1), so their latency doesn't depend on the frame rate.
+VARFP(rpciothread, 0, 0, 1, inexor::rpc::set_io_thread(rpciothread != 0));
+ICOMMAND(benchsharedvarsync, "ii", (int *updates, int *frames), inexor::rpc::benchsharedvarsync(*updates > 0 ? *updates : 10000, *frames > 0 ? *frames : 10));
+ICOMMAND(rpcstats, "", (), inexor::rpc::rpcstats());
+
 inexor::util::Logging logging;
 
 ICOMMANDERR(loglevel, "ss", (char *logger_name, char *log_level),
@@ -771,6 +787,9 @@ ICOMMANDERR(logformat, "ss", (char *logger_name, char *pattern),
     logging.setLogFormat(logger_name_s, pattern_s)
 );
 
+/// Measure how long ticks take when logging lines debug messages per tick, written synchronously and through the logging thread.
+ICOMMAND(benchlog, "ii", (int *lines, int *ticks), logging.benchmark(*lines > 0 ? *lines : 1000, *ticks > 0 ? *ticks : 100));
+
 SharedVar<char *> package_dir((char*)"media/core");
 
 int main(int argc, char **argv)
@@ -790,12 +809,15 @@ int main(int argc, char **argv)
     SUBSYSTEM_REQUIRE(rpc);
     // (embedded chromium): ingame html5+js browser for the ui. must come after rpc.. todo new system.
     SUBSYSTEM_REQUIRE(cef);
+    // monitoring: serves the counters and histograms of inexor::util::Metrics
+    SUBSYSTEM_REQUIRE(metrics);
 
     // Initialize the submodules
     metapp.start("rpc");
     metapp.initialize("rpc", argc, argv);
     metapp.start("cef");
     metapp.initialize("cef", argc, argv);
+    metapp.start("metrics");
 
     //initing = INIT_RESET;
     //for(int i = 1; i<argc; i++)
@@ -1001,34 +1023,57 @@ int main(int argc, char **argv)
         totalmillis = millis;
         updatetime();
 
-        metapp.tick();
+        PROFILE_SCOPE("frame");
 
-        input_router.checkinput();
-        menuprocess();
-        tryedit();
+        {
+            PROFILE_SCOPE("subsystems");
+            metapp.tick();
+        }
 
-        if(lastmillis) game::updateworld();
+        {
+            PROFILE_SCOPE("input");
+            input_router.checkinput();
+            menuprocess();
+            tryedit();
+        }
+
+        if(lastmillis)
+        {
+            PROFILE_SCOPE("updateworld");
+            game::updateworld();
+        }
 
         checksleep(lastmillis);
 
         serverslice(false, 0);
 
+        logging.flushConsole();
+
         if(frames) updatefpshistory(elapsedtime);
         frames++;
 
-        // miscellaneous general game effects
-        recomputecamera();
-        updateparticles();
-        updatesounds();
+        {
+            // miscellaneous general game effects
+            PROFILE_SCOPE("effects");
+            recomputecamera();
+            updateparticles();
+            updatesounds();
+        }
 
         if(screen_manager.minimized) continue;
 
         inbetweenframes = false;
 
-        if(mainmenu) gl_drawmainmenu();
-        else gl_drawframe();
+        {
+            PROFILE_SCOPE("render");
+            if(mainmenu) gl_drawmainmenu();
+            else gl_drawframe();
+        }
 
-        screen_manager.swapbuffers();
+        {
+            PROFILE_SCOPE("swapbuffers");
+            screen_manager.swapbuffers();
+        }
 
         renderedframe = inbetweenframes = true;
     }
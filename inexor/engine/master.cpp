@@ -50,17 +50,17 @@ void clearusers()
 }
 COMMAND(clearusers, "");
 
-vector<ipmask> bans, servbans, gbans;
+iptrie bans, servbans, gbans;
 
 void clearbans()
 {
-    bans.shrink(0);
-    servbans.shrink(0);
-    gbans.shrink(0);
+    bans.clear();
+    servbans.clear();
+    gbans.clear();
 }
 COMMAND(clearbans, "");
 
-void addban(vector<ipmask> &bans, const char *name)
+void addban(iptrie &bans, const char *name)
 {
     ipmask ban;
     ban.parse(name);
@@ -70,10 +70,9 @@ ICOMMAND(ban, "s", (char *name), addban(bans, name));
 ICOMMAND(servban, "s", (char *name), addban(servbans, name));
 ICOMMAND(gban, "s", (char *name), addban(gbans, name));
 
-bool checkban(vector<ipmask> &bans, enet_uint32 host)
+bool checkban(iptrie &bans, enet_uint32 host)
 {
-    loopv(bans) if(bans[i].check(host)) return true;
-    return false;
+    return bans.check(host);
 }
 
 struct authreq
@@ -250,9 +249,9 @@ void gengbanlist()
     l->buf.put(header, strlen(header));
     string cmd = "addgban ";
     int cmdlen = strlen(cmd);
-    loopv(gbans)
+    loopv(gbans.masks)
     {
-        ipmask &b = gbans[i];
+        ipmask &b = gbans.masks[i];
         l->buf.put(cmd, cmdlen + b.print(&cmd[cmdlen])); 
         l->buf.add('\n');
     }
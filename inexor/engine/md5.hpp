@@ -38,16 +38,20 @@ struct md5 : skelmodel, skelloader<md5>
         md5weight *weightinfo;
         int numweights;
         md5vert *vertinfo;
+        char *texname;
 
-        md5mesh() : weightinfo(NULL), numweights(0), vertinfo(NULL)
+        md5mesh() : weightinfo(NULL), numweights(0), vertinfo(NULL), texname(NULL)
         {
         }
 
         ~md5mesh()
         {
             cleanup();
+            DELETEA(texname);
         }
 
+        const char *cachetexname() const { return texname; }
+
         void cleanup()
         {
             DELETEA(weightinfo);
@@ -107,12 +111,12 @@ struct md5 : skelmodel, skelloader<md5>
                     char *start = strchr(buf, '"'), *end = start ? strchr(start+1, '"') : NULL;
                     if(start && end) 
                     {
-                        char *texname = newstring(start+1, end-(start+1));
+                        DELETEA(texname);
+                        texname = newstring(start+1, end-(start+1));
                         part *p = loading->parts.last();
                         p->initskins(notexture, notexture, group->meshes.length());
                         skin &s = p->skins.last();
                         s.tex = textureload(makerelpath(dir, texname), 0, true, false);
-                        delete[] texname;
                     }
                 }
                 else if(sscanf(buf, " numverts %d", &numverts)==1)
@@ -159,6 +163,24 @@ struct md5 : skelmodel, skelloader<md5>
 
         bool loadmesh(const char *filename, float smooth)
         {
+            string cachename;
+            if(initmeshcache("md5mesh", filename, smooth, cachename))
+            {
+                vector<char *> texnames;
+                if(loadmeshcache(cachename, texnames))
+                {
+                    loopv(texnames) if(texnames[i])
+                    {
+                        part *p = loading->parts.last();
+                        p->initskins(notexture, notexture, i+1);
+                        skin &s = p->skins.last();
+                        s.tex = textureload(makerelpath(dir, texnames[i]), 0, true, false);
+                    }
+                    texnames.deletearrays();
+                    return true;
+                }
+            }
+
             stream *f = openfile(filename, "r");
             if(!f) return false;
 
@@ -258,6 +280,7 @@ struct md5 : skelmodel, skelloader<md5>
             sortblendcombos();
 
             delete f;
+            if(cachename[0]) savemeshcache(cachename);
             return true;
         }
 
@@ -266,6 +289,13 @@ struct md5 : skelmodel, skelloader<md5>
             skelanimspec *sa = skel->findskelanim(filename);
             if(sa) return sa;
 
+            string cachename;
+            if(initanimcache("md5anim", filename, adjustments.getbuf(), adjustments.length()*sizeof(skeladjustment), cachename))
+            {
+                sa = loadanimcache(cachename, filename);
+                if(sa) return sa;
+            }
+
             stream *f = openfile(filename, "r");
             if(!f) return NULL;
 
@@ -376,6 +406,7 @@ struct md5 : skelmodel, skelloader<md5>
             if(animdata) delete[] animdata;
             delete f;
 
+            if(sa && cachename[0]) saveanimcache(cachename, sa);
             return sa;
         }
 
@@ -0,0 +1,190 @@
+// metrics.cpp: exports inexor::util::Metrics for monitoring (Prometheus or anything reading its text format)
+
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "inexor/engine/engine.hpp"
+#include "inexor/fpsgame/network_types.hpp"
+#include "inexor/util/Logging.hpp"
+#include "inexor/util/Metrics.hpp"
+#include "inexor/util/Subsystem.hpp"
+
+using inexor::util::Metrics;
+
+VAR(metricsport, 0, 0, MAX_POSSIBLE_PORT);          // serve the metrics over http on 127.0.0.1, 0 disables
+SVAR(metricsfile, "");                              // also dump them to this file periodically (e.g. for a textfile collector)
+VAR(metricsinterval, 1000, 15000, 60*60*1000);      // ms between two dumps to metricsfile
+
+/// Writes all metrics to a file in the home dir. The file gets replaced at once, so readers never see half of it.
+bool writemetrics(const char *name)
+{
+    string file, tmp;
+    copystring(file, findfile(path(name, true), "w"));
+    formatstring(tmp, "%s.tmp", file);
+    FILE *f = fopen(tmp, "w");
+    if(!f) return false;
+    std::string out = Metrics::render();
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    if(fclose(f)) ok = false;
+#ifdef WIN32
+    if(ok) remove(file);
+#endif
+    return ok && !rename(tmp, file);
+}
+
+ICOMMAND(metricsdump, "s", (char *name),
+{
+    const char *file = *name ? name : (*metricsfile ? metricsfile : "metrics.prom");
+    if(writemetrics(file)) spdlog::get("global")->info("wrote metrics to {0}", file);
+    else spdlog::get("global")->error("could not write metrics to {0}", file);
+});
+
+/// Resident memory and cpu time of the whole process, to compare one process running all server instances against one process each.
+static void collectprocessmetrics(std::string &out)
+{
+#ifndef WIN32
+    rusage usage;
+    if(!getrusage(RUSAGE_SELF, &usage))
+    {
+        double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)*1e-6;
+        Metrics::write_header(out, "process_cpu_seconds_total", "User and system cpu time spent", "counter");
+        Metrics::write_sample(out, "process_cpu_seconds_total", "", cpu);
+    }
+#endif
+#ifdef __linux__
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(!f) return;
+    bool ok = fscanf(f, "%ld %ld", &pages, &resident) == 2;
+    fclose(f);
+    if(!ok) return;
+    Metrics::write_header(out, "process_resident_memory_bytes", "Resident memory size", "gauge");
+    Metrics::write_sample(out, "process_resident_memory_bytes", "", double(resident) * sysconf(_SC_PAGESIZE));
+#endif
+}
+static int processmetrics INEXOR_ATTR_UNUSED = (Metrics::add_collector(collectprocessmetrics), 0);
+
+/// Serves the metrics on metricsport and dumps them to metricsfile.
+///
+/// Everything happens in tick() with non blocking sockets; as long as
+/// nobody connects this is one accept() per tick.
+class MetricsSubsystem : public inexor::util::Subsystem
+{
+    ENetSocket listener = ENET_SOCKET_NULL;
+    int port = 0;
+    int lastdump = 0;
+
+    struct connection
+    {
+        ENetSocket sock;
+        int opened;
+        std::string request, response;
+        size_t sent = 0;
+    };
+    std::vector<connection> connections;
+
+    void closelistener()
+    {
+        if(listener != ENET_SOCKET_NULL) enet_socket_destroy(listener);
+        listener = ENET_SOCKET_NULL;
+        for(connection &c : connections) enet_socket_destroy(c.sock);
+        connections.clear();
+    }
+
+    void openlistener()
+    {
+        closelistener();
+        port = metricsport;
+        if(!port) return;
+        ENetAddress address;
+        enet_address_set_host(&address, "127.0.0.1");
+        address.port = port;
+        listener = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
+        if(listener != ENET_SOCKET_NULL)
+        {
+            enet_socket_set_option(listener, ENET_SOCKOPT_REUSEADDR, 1);
+            enet_socket_set_option(listener, ENET_SOCKOPT_NONBLOCK, 1);
+            if(!enet_socket_bind(listener, &address) && !enet_socket_listen(listener, 4))
+            {
+                spdlog::get("global")->info("serving metrics on 127.0.0.1:{0}", port);
+                return;
+            }
+            enet_socket_destroy(listener);
+            listener = ENET_SOCKET_NULL;
+        }
+        spdlog::get("global")->error("could not listen for metrics on port {0}", port);
+    }
+
+    /// @return false once the connection is done.
+    bool serve(connection &c)
+    {
+        if(c.response.empty())
+        {
+            char buf[1024];
+            ENetBuffer in;
+            in.data = buf;
+            in.dataLength = sizeof(buf);
+            int len = enet_socket_receive(c.sock, NULL, &in, 1);
+            if(len < 0) return false;
+            c.request.append(buf, len);
+            // answer complete http requests; anything else (e.g. netcat) gets the metrics after a short while
+            bool complete = c.request.find("\r\n\r\n") != std::string::npos || c.request.find("\n\n") != std::string::npos;
+            if(!complete && c.request.size() < 8192 && totalmillis - c.opened < 500) return true;
+            std::string body = Metrics::render();
+            if(!c.request.compare(0, 4, "GET ") || !c.request.compare(0, 5, "HEAD "))
+            {
+                defformatstring(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", int(body.size()));
+                c.response = header;
+            }
+            if(c.request.compare(0, 5, "HEAD ")) c.response += body;
+        }
+        ENetBuffer out;
+        out.data = (void *)(c.response.data() + c.sent);
+        out.dataLength = c.response.size() - c.sent;
+        int sent = enet_socket_send(c.sock, NULL, &out, 1);
+        if(sent < 0) return false;
+        c.sent += sent;
+        return c.sent < c.response.size() && totalmillis - c.opened < 5000;
+    }
+
+public:
+    ~MetricsSubsystem()
+    {
+        closelistener();
+    }
+
+    void tick() override
+    {
+        if(port != metricsport) openlistener();
+        if(listener != ENET_SOCKET_NULL && connections.size() < 16)
+        {
+            ENetSocket sock = enet_socket_accept(listener, NULL);
+            if(sock != ENET_SOCKET_NULL)
+            {
+                enet_socket_set_option(sock, ENET_SOCKOPT_NONBLOCK, 1);
+                connections.emplace_back();
+                connections.back().sock = sock;
+                connections.back().opened = totalmillis;
+            }
+        }
+        for(size_t i = 0; i < connections.size();)
+        {
+            if(serve(connections[i])) { i++; continue; }
+            enet_socket_destroy(connections[i].sock);
+            connections.erase(connections.begin() + i);
+        }
+
+        if(*metricsfile && totalmillis - lastdump >= metricsinterval)
+        {
+            lastdump = totalmillis;
+            if(!writemetrics(metricsfile)) spdlog::get("global")->error("could not write metrics to {0}", metricsfile);
+        }
+    }
+};
+
+SUBSYSTEM_REGISTER(metrics, MetricsSubsystem);
@@ -0,0 +1,98 @@
+//NO INCLUDE GUARD
+/// Binary cache of fully processed model meshes and skeletal animations.
+///
+/// Text formats (md5, smd, obj) get parsed line by line on every load, followed by
+/// buildnorms()/calctangents(). Once a meshgroup or an animation has been processed we store the
+/// final data in homedir/cache/model/, keyed by a hash of the source file plus every loader setting
+/// which influences the result. Later loads only hash the source and read the cache in one go.
+
+#define MODELCACHE_MAGIC "IMDLCACH"
+#define MODELCACHE_VERSION 1
+
+/// Accumulates everything a processed model depends on into a 64 bit key.
+struct modelcachekey
+{
+    uint crc, adler;
+
+    modelcachekey() : crc(crc32(0, NULL, 0)), adler(adler32(0, NULL, 0)) {}
+
+    void add(const void *data, size_t len)
+    {
+        crc = crc32(crc, (const Bytef *)data, len);
+        adler = adler32(adler, (const Bytef *)data, len);
+    }
+    template<class T> void add(const T &val) { add(&val, sizeof(T)); }
+    void addstring(const char *s) { add(s, strlen(s)+1); }
+
+    /// Hash the complete contents of a (possibly zipped) source file.
+    /// @return false if the file can't be read.
+    bool addfile(const char *filename);
+
+    /// Where the cache file for this key lives (relative to the homedir).
+    void getpath(const char *kind, string &cachename) const;
+};
+
+/// Collects the serialized data in memory and writes it with a single write once complete.
+struct modelcachewriter
+{
+    vector<uchar> buf;
+
+    void put(const void *data, size_t len) { buf.put((const uchar *)data, int(len)); }
+    template<class T> void put(const T &val) { put(&val, sizeof(T)); }
+    template<class T> void putarray(const T *vals, int n) { if(n > 0) put(vals, n*sizeof(T)); }
+    void putstring(const char *s)
+    {
+        int len = s ? strlen(s) : 0;
+        put(len);
+        put(s, len);
+    }
+
+    bool save(const char *cachename);
+};
+
+/// Reads a complete cache file into memory and hands out its contents.
+/// All getters fail gracefully on truncated or corrupted data.
+struct modelcachereader
+{
+    char *data;
+    ucharbuf buf;
+
+    modelcachereader() : data(NULL) {}
+    ~modelcachereader() { DELETEA(data); }
+
+    bool load(const char *cachename);
+
+    bool get(void *dst, size_t len) { return buf.get((uchar *)dst, int(len)) == int(len); }
+    template<class T> bool get(T &val) { return get(&val, sizeof(T)); }
+
+    /// @return a new[] allocated array of n elements or NULL if there is not enough data left.
+    template<class T> T *getarray(int n)
+    {
+        if(n <= 0 || size_t(buf.remaining()) < n*sizeof(T)) return NULL;
+        T *vals = new T[n];
+        get(vals, n*sizeof(T));
+        return vals;
+    }
+
+    /// @return a newstring() or NULL if the string was empty.
+    char *getstring()
+    {
+        int len = 0;
+        if(!get(len) || len <= 0 || len > buf.remaining()) return NULL;
+        char *s = newstring(len);
+        get(s, len);
+        s[len] = '\0';
+        return s;
+    }
+
+    bool ok() const { return !(buf.flags&ucharbuf::OVERREAD); }
+};
+
+/// Counters shown by /modelcachestats.
+struct modelcacheinfo
+{
+    int hits, misses, writes;
+
+    modelcacheinfo() : hits(0), misses(0), writes(0) {}
+};
+extern modelcacheinfo modelcachecounters;
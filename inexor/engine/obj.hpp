@@ -28,6 +28,13 @@ struct obj : vertmodel, vertloader<obj>
             int len = strlen(filename);
             if(len < 4 || strcasecmp(&filename[len-4], ".obj")) return false;
 
+            string cachename;
+            if(initmeshcache("objmesh", filename, smooth, cachename) && loadmeshcache(cachename))
+            {
+                name = newstring(filename);
+                return true;
+            }
+
             stream *file = openfile(filename, "rb");
             if(!file) return false;
 
@@ -156,6 +163,7 @@ struct obj : vertmodel, vertloader<obj>
 
             delete file;
 
+            if(cachename[0] && meshes.length()) savemeshcache(cachename);
             return true;
         }
     };
@@ -1755,6 +1755,13 @@ void precachetextures()
         vtxarray *va = valist[i];
         loopj(va->texs + va->blends) if(texs.find(va->eslist[j].texture) < 0) texs.add(va->eslist[j].texture);
     }
+    vector<Slot *> load;
+    loopv(texs)
+    {
+        VSlot &vs = lookupvslot(texs[i], false);
+        if(!vs.slot->loaded && load.find(vs.slot) < 0) load.add(vs.slot);
+    }
+    loadslots(load);
     loopv(texs)
     {
         loadprogress = float(i+1)/texs.length();
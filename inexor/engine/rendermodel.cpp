@@ -1,6 +1,7 @@
 #include "inexor/engine/engine.hpp"
 #include "inexor/texture/cubemap.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
 
 SVARP(modeldir, "model");
 
@@ -25,6 +26,66 @@ VARP(gpuskel, 0, 1, 1);
 VAR(maxskelanimdata, 1, 192, 0);
 VAR(testtags, 0, 0, 1);
 
+/// Store processed md5/smd/iqm/obj meshes and animations in homedir/cache/model/.
+VARP(modelcache, 0, 1, 1);
+
+#include "inexor/engine/modelcache.hpp"
+
+modelcacheinfo modelcachecounters;
+
+bool modelcachekey::addfile(const char *filename)
+{
+    stream *f = openfile(filename, "rb");
+    if(!f) return false;
+    uchar buf[16384];
+    size_t len = 0;
+    for(size_t n; (n = f->read(buf, sizeof(buf))) > 0; len += n) add(buf, n);
+    delete f;
+    add(len);
+    return len > 0;
+}
+
+void modelcachekey::getpath(const char *kind, string &cachename) const
+{
+    formatstring(cachename, "cache/model/%s_%08x%08x.imc", kind, crc, adler);
+}
+
+bool modelcachewriter::save(const char *cachename)
+{
+    stream *f = openrawfile(path(cachename, true), "wb");
+    if(!f) return false;
+    f->write(MODELCACHE_MAGIC, 8);
+    f->putlil<int>(MODELCACHE_VERSION);
+    f->putlil<uint>(buf.length());
+    f->putlil<uint>(crc32(0, buf.getbuf(), buf.length()));
+    bool ok = f->write(buf.getbuf(), buf.length()) == size_t(buf.length());
+    delete f;
+    return ok;
+}
+
+bool modelcachereader::load(const char *cachename)
+{
+    const int headersize = 8 + 3*sizeof(uint);
+    size_t len = 0;
+    DELETEA(data);
+    data = loadfile(path(cachename, true), &len);
+    if(!data) return false;
+    if(len < size_t(headersize) || memcmp(data, MODELCACHE_MAGIC, 8)) return false;
+    uint header[3];
+    memcpy(header, &data[8], sizeof(header));
+    lilswap(header, 3);
+    if(header[0] != MODELCACHE_VERSION || header[1] != len - headersize) return false;
+    if(header[2] != crc32(0, (const Bytef *)&data[headersize], header[1])) return false;
+    buf.reset((uchar *)&data[headersize], header[1]);
+    return true;
+}
+
+void modelcachestats()
+{
+    spdlog::get("global")->info("model cache: {} hits, {} misses, {} written", modelcachecounters.hits, modelcachecounters.misses, modelcachecounters.writes);
+}
+COMMAND(modelcachestats, "");
+
 #include "inexor/engine/ragdoll.hpp"
 #include "inexor/engine/animmodel.hpp"
 #include "inexor/engine/vertmodel.hpp"
@@ -59,6 +120,64 @@ MODELTYPE(MDL_OBJ, obj);
 MODELTYPE(MDL_SMD, smd);
 MODELTYPE(MDL_IQM, iqm);
 
+static bool benchloadmeshes(md5::md5meshgroup &g, const char *filename) { g.shareskeleton(NULL); return g.load(filename, 2); }
+static bool benchloadmeshes(smd::smdmeshgroup &g, const char *filename) { g.shareskeleton(NULL); return g.load(filename); }
+static bool benchloadmeshes(iqm::iqmmeshgroup &g, const char *filename) { g.shareskeleton(NULL); return g.loadmesh(filename); }
+static bool benchloadmeshes(obj::objmeshgroup &g, const char *filename) { return g.load(filename, 2); }
+
+/// Load the meshes of filename a number of times and return the average time in ms (or -1 on failure).
+template<class MDL, class GROUP> static double benchmeshgroup(const char *filename, int iterations, bool usecache)
+{
+    int oldmodelcache = modelcache;
+    modelcache = usecache ? 1 : 0;
+    MDL mdl(filename);
+    MDL::loading = &mdl;
+    copystring(MDL::dir, parentdir(filename));
+    mdl.addpart();
+    if(usecache)
+    {
+        GROUP *g = new GROUP; // make sure the cache is filled before measuring
+        benchloadmeshes(*g, filename);
+        delete g;
+    }
+    double total = 0;
+    bool ok = true;
+    loopi(iterations)
+    {
+        GROUP *g = new GROUP;
+        inexor::util::Stopwatch sw;
+        ok = benchloadmeshes(*g, filename) && ok;
+        total += sw.elapsed_ms();
+        delete g;
+    }
+    MDL::loading = NULL;
+    modelcache = oldmodelcache;
+    return ok ? total/iterations : -1;
+}
+
+/// Compare parsing a model mesh file with loading it from the model cache.
+void benchmodelcache(char *filename, int *iterations)
+{
+    int n = clamp(*iterations, 1, 1000);
+    const char *ext = strrchr(filename, '.');
+    double cold = -1, warm = -1;
+    #define BENCHMESH(mdl) do { \
+        cold = benchmeshgroup<mdl, mdl::mdl##meshgroup>(filename, n, false); \
+        warm = benchmeshgroup<mdl, mdl::mdl##meshgroup>(filename, n, true); \
+    } while(0)
+    if(!ext) { spdlog::get("global")->error("benchmodelcache: unknown model format: {}", filename); return; }
+    else if(!strcasecmp(ext, ".md5mesh")) BENCHMESH(md5);
+    else if(!strcasecmp(ext, ".smd")) BENCHMESH(smd);
+    else if(!strcasecmp(ext, ".iqm")) BENCHMESH(iqm);
+    else if(!strcasecmp(ext, ".obj")) BENCHMESH(obj);
+    else { spdlog::get("global")->error("benchmodelcache: unknown model format: {}", filename); return; }
+    #undef BENCHMESH
+    if(cold < 0 || warm < 0) { spdlog::get("global")->error("benchmodelcache: could not load {}", filename); return; }
+    spdlog::get("global")->info("benchmodelcache: {} ({} iterations): parsed {:.3f} ms, cached {:.3f} ms, speedup {:.1f}x",
+                                filename, n, cold, warm, warm > 0 ? cold/warm : 0.0);
+}
+COMMAND(benchmodelcache, "si");
+
 #define checkmdl if(!loadingmodel) { spdlog::get("global")->error("not loading a model"); return; }
 
 void mdlcullface(int *cullface)
@@ -4,6 +4,12 @@
 #include "inexor/engine/rendertarget.hpp"
 #include "inexor/ui/screen/ScreenManager.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
+#include "inexor/util/ThreadPool.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace inexor::rendering::screen;
 
@@ -608,11 +614,135 @@ inline void seedpos<PT_TRAIL>(particleemitter &pe, const vec &o, const vec &d, i
     pe.extendbb(e, size); 
 }
 
+VARP(parallelparticles, 0, 1, 1);
+VAR(particlechunk, 64, 1024, 65536);
+
+/// The per frame hot data of a varenderer's particles, stored as structure of arrays.
+/// Everything else (color, size, flags and the payload union) stays in the particle records.
+struct particlearrays
+{
+    float *ox, *oy, *oz, *dx, *dy, *dz;
+    float *gravd; // 2*5000*gravity, which calc() divides by, 1 if unused
+    int *millis, *fade, *gravity;
+
+    particlearrays() : ox(NULL), oy(NULL), oz(NULL), dx(NULL), dy(NULL), dz(NULL), gravd(NULL), millis(NULL), fade(NULL), gravity(NULL) {}
+    ~particlearrays() { clear(); }
+
+    void clear()
+    {
+        DELETEA(ox); DELETEA(oy); DELETEA(oz);
+        DELETEA(dx); DELETEA(dy); DELETEA(dz);
+        DELETEA(gravd);
+        DELETEA(millis); DELETEA(fade); DELETEA(gravity);
+    }
+
+    void alloc(int n)
+    {
+        clear();
+        ox = new float[n]; oy = new float[n]; oz = new float[n];
+        dx = new float[n]; dy = new float[n]; dz = new float[n];
+        gravd = new float[n];
+        millis = new int[n]; fade = new int[n]; gravity = new int[n];
+    }
+
+    void set(int i, const vec &o, const vec &d, int f, int g, int m)
+    {
+        ox[i] = o.x; oy[i] = o.y; oz[i] = o.z;
+        dx[i] = d.x; dy[i] = d.y; dz[i] = d.z;
+        gravd[i] = g ? 2.0f * 5000.0f * g : 1;
+        millis[i] = m;
+        fade[i] = f;
+        gravity[i] = g;
+    }
+
+    void move(int dst, int src)
+    {
+        ox[dst] = ox[src]; oy[dst] = oy[src]; oz[dst] = oz[src];
+        dx[dst] = dx[src]; dy[dst] = dy[src]; dz[dst] = dz[src];
+        gravd[dst] = gravd[src];
+        millis[dst] = millis[src]; fade[dst] = fade[src]; gravity[dst] = gravity[src];
+    }
+
+    vec pos(int i) const { return vec(ox[i], oy[i], oz[i]); }
+    vec dir(int i) const { return vec(dx[i], dy[i], dz[i]); }
+};
+
+#define PARTBATCH 256
+
+/// Integrated position, blend and time of up to PARTBATCH particles.
+struct particlebatch
+{
+    float ox[PARTBATCH], oy[PARTBATCH], oz[PARTBATCH];
+    int blend[PARTBATCH], ts[PARTBATCH];
+};
+
+/// The blend of a fading particle [ts] millis into its life, kept in integers like partrenderer::calc().
+static inline int fadeblend(int ts, int fade)
+{
+    return fade > 5 ? max(255 - (ts<<8)/fade, 0) : 255;
+}
+
+static inline void integrateparticle(const particlearrays &pa, int j, int curmillis, particlebatch &b, int i)
+{
+    float ts = float(curmillis - pa.millis[j]), t = 0;
+    if(pa.fade[j] > 5)
+    {
+        if(pa.gravity[j]) t = ts = min(ts, float(pa.fade[j]));
+    }
+    else ts = 1;
+    float move = t/5000.0f;
+    b.ox[i] = pa.ox[j] + pa.dx[j]*move;
+    b.oy[i] = pa.oy[j] + pa.dy[j]*move;
+    b.oz[i] = pa.oz[j] + pa.dz[j]*move - t*t/pa.gravd[j];
+    b.blend[i] = fadeblend(curmillis - pa.millis[j], pa.fade[j]);
+    b.ts[i] = int(ts);
+}
+
+/// partrenderer::calc() for particles [start, start+n) which neither track nor collide.
+static void integrateparticles(const particlearrays &pa, int start, int n, int curmillis, particlebatch &b)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i now = _mm_set1_epi32(curmillis), five = _mm_set1_epi32(5), zero = _mm_setzero_si128();
+    const __m128 one = _mm_set1_ps(1), movediv = _mm_set1_ps(5000.0f);
+    for(; i+4 <= n; i += 4)
+    {
+        int j = start+i;
+        __m128i fadei = _mm_loadu_si128((const __m128i *)&pa.fade[j]);
+        __m128 fading = _mm_castsi128_ps(_mm_cmpgt_epi32(fadei, five)),
+               falling = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&pa.gravity[j]), zero)), fading),
+               ts = _mm_cvtepi32_ps(_mm_sub_epi32(now, _mm_loadu_si128((const __m128i *)&pa.millis[j]))),
+               fade = _mm_cvtepi32_ps(fadei);
+
+        // falling particles stop at the end of their life, non fading ones always use ts = 1
+        ts = _mm_or_ps(_mm_and_ps(falling, _mm_min_ps(ts, fade)), _mm_andnot_ps(falling, ts));
+        ts = _mm_or_ps(_mm_and_ps(fading, ts), _mm_andnot_ps(fading, one));
+
+        // divisions rather than multiplying by reciprocals, so positions come out bit identical to calc()
+        __m128 t = _mm_and_ps(falling, ts), move = _mm_div_ps(t, movediv);
+        _mm_storeu_ps(&b.ox[i], _mm_add_ps(_mm_loadu_ps(&pa.ox[j]), _mm_mul_ps(_mm_loadu_ps(&pa.dx[j]), move)));
+        _mm_storeu_ps(&b.oy[i], _mm_add_ps(_mm_loadu_ps(&pa.oy[j]), _mm_mul_ps(_mm_loadu_ps(&pa.dy[j]), move)));
+        _mm_storeu_ps(&b.oz[i], _mm_sub_ps(_mm_add_ps(_mm_loadu_ps(&pa.oz[j]), _mm_mul_ps(_mm_loadu_ps(&pa.dz[j]), move)),
+                                           _mm_div_ps(_mm_mul_ps(t, t), _mm_loadu_ps(&pa.gravd[j]))));
+        _mm_storeu_si128((__m128i *)&b.ts[i], _mm_cvttps_epi32(ts));
+        // there is no integer division in SSE2 and a float one is off by one for some fades
+        loopk(4) b.blend[i+k] = fadeblend(curmillis - pa.millis[j+k], pa.fade[j+k]);
+    }
+#endif
+    for(; i < n; i++) integrateparticle(pa, start+i, curmillis, b, i);
+}
+
+/// Renders quads from a flat array of particles.
+///
+/// Positions and timing live in a particlearrays, so the integration runs vectorized over them.
+/// Unless the type tracks or collides (which needs game state and the world), vertex generation
+/// is split into chunks and runs on the shared thread pool.
 template<int T>
 struct varenderer : partrenderer
 {
     partvert *verts;
-    particle *parts;
+    particle *parts; // colors, sizes, flags and payload; positions and timing are only up to date after sync()
+    particlearrays pa;
     int maxparts, numparts, lastupdate, rndmask;
     GLuint vbo;
 
@@ -637,6 +767,7 @@ struct varenderer : partrenderer
         DELETEA(verts);
         parts = new particle[n];
         verts = new partvert[n*4];
+        pa.alloc(n);
         maxparts = n;
         numparts = 0;
         lastupdate = -1;
@@ -653,8 +784,7 @@ struct varenderer : partrenderer
         if(!(type&PT_TRACK)) return;
         loopi(numparts)
         {
-            particle *p = parts+i;
-            if(!owner || (p->owner == owner)) p->fade = -1;
+            if(!owner || (parts[i].owner == owner)) pa.fade[i] = -1;
         }
         lastupdate = -1;
     }
@@ -671,12 +801,9 @@ struct varenderer : partrenderer
 
     particle *addpart(const vec &o, const vec &d, int fade, int color, float size, int gravity) 
     {
-        particle *p = parts + (numparts < maxparts ? numparts++ : rnd(maxparts)); //next free slot, or kill a random kitten
-        p->o = o;
-        p->d = d;
-        p->gravity = gravity;
-        p->fade = fade;
-        p->millis = lastmillis + emitoffset;
+        int i = numparts < maxparts ? numparts++ : rnd(maxparts); //next free slot, or kill a random kitten
+        pa.set(i, o, d, fade, gravity, lastmillis + emitoffset);
+        particle *p = parts + i;
         p->color = bvec(color>>16, (color>>8)&0xFF, color&0xFF);
         p->size = size;
         p->owner = NULL;
@@ -684,6 +811,18 @@ struct varenderer : partrenderer
         lastupdate = -1;
         return p;
     }
+
+    /// Copy the hot data of particle i back into its record, so the generic calc() can be used on it.
+    particle &sync(int i)
+    {
+        particle &p = parts[i];
+        p.o = pa.pos(i);
+        p.d = pa.dir(i);
+        p.gravity = pa.gravity[i];
+        p.fade = pa.fade[i];
+        p.millis = pa.millis[i];
+        return p;
+    }
  
     void seedemitter(particleemitter &pe, const vec &o, const vec &d, int fade, float size, int gravity)
     {
@@ -704,17 +843,14 @@ struct varenderer : partrenderer
         if(tpeak > 0 && tpeak < fade) pe.extendbb(o.z + 1.5f*d.z*tpeak/5000.0f, size);
     }
  
-    void genverts(particle *p, partvert *vs, bool regen)
+    void genverts(int i, vec o, const vec &d, int blend, int ts, partvert *vs)
     {
-        vec o, d;
-        int blend, ts;
-
-        calc(p, blend, ts, o, d);
-        if(blend <= 1 || p->fade <= 5) p->fade = -1; //mark to remove on next pass (i.e. after render)
+        particle *p = &parts[i];
+        if(blend <= 1 || pa.fade[i] <= 5) pa.fade[i] = -1; //mark to remove on next pass (i.e. after render)
 
         modifyblend<T>(o, blend);
 
-        if(regen)
+        if(p->flags&0x80)
         {
             p->flags &= ~0x80;
 
@@ -755,29 +891,57 @@ struct varenderer : partrenderer
         else if(type&PT_MOD) SETMODCOLOR;
         else loopi(4) vs[i].color.a = blend;
 
-        if(type&PT_ROT) genrotpos<T>(o, d, p->size, ts, p->gravity, vs, (p->flags>>2)&0x1F);
-        else genpos<T>(o, d, p->size, ts, p->gravity, vs);
+        if(type&PT_ROT) genrotpos<T>(o, d, p->size, ts, pa.gravity[i], vs, (p->flags>>2)&0x1F);
+        else genpos<T>(o, d, p->size, ts, pa.gravity[i], vs);
+    }
+
+    /// Generate the vertices of particles [start, end), vectorized in batches.
+    void genverts(int start, int end)
+    {
+        particlebatch b;
+        for(int i = start; i < end; i += PARTBATCH)
+        {
+            int n = min(end - i, PARTBATCH);
+            integrateparticles(pa, i, n, lastmillis, b);
+            loopk(n) genverts(i+k, vec(b.ox[k], b.oy[k], b.oz[k]), pa.dir(i+k), b.blend[k], b.ts[k], &verts[(i+k)*4]);
+        }
+    }
+
+    /// Fill the holes left by removed particles with the last ones.
+    void compact()
+    {
+        loopi(numparts) if(pa.fade[i] < 0)
+        {
+            do 
+            {
+                --numparts; 
+                if(numparts <= i) return;
+            }
+            while(pa.fade[numparts] < 0);
+            pa.move(i, numparts);
+            parts[i] = parts[numparts];
+            parts[i].flags |= 0x80;
+        }
     }
 
     void genverts()
     {
-        loopi(numparts)
+        compact();
+        if(collide || type&PT_TRACK)
         {
-            particle *p = &parts[i];
-            partvert *vs = &verts[i*4];
-            if(p->fade < 0)
+            loopi(numparts)
             {
-                do 
-                {
-                    --numparts; 
-                    if(numparts <= i) return;
-                }
-                while(parts[numparts].fade < 0);
-                *p = parts[numparts];
-                genverts(p, vs, true);
+                vec o, d;
+                int blend, ts;
+                calc(&sync(i), blend, ts, o, d);
+                genverts(i, o, d, blend, ts, &verts[i*4]);
             }
-            else genverts(p, vs, (p->flags&0x80)!=0);
         }
+        else if(parallelparticles && numparts >= 2*particlechunk)
+        {
+            inexor::util::shared_pool().parallel_for(numparts, particlechunk, [this](size_t start, size_t end) { genverts(int(start), int(end)); });
+        }
+        else genverts(0, numparts);
     }
    
     void update()
@@ -870,7 +1034,7 @@ struct softquadrenderer : quadrenderer
         int numsoft = 0;
         loopi(numparts)
         {
-            particle &p = parts[i];
+            particle &p = sync(i);
             float radius = p.size*SQRT2;
             vec o, d;
             int blend, ts;
@@ -973,6 +1137,44 @@ void removetrackedparticles(physent *owner)
     loopi(sizeof(parts)/sizeof(parts[0])) parts[i]->resettracked(owner);
 }
 
+/// Stress test of the particle simulation and vertex generation (without GL upload).
+/// Keeps count particles alive for the given number of 16ms frames, once serial and once in parallel.
+void benchparticles(int *count, int *frames)
+{
+    int n = clamp(*count > 0 ? *count : 40000, 1, 1000000), numframes = *frames > 0 ? *frames : 100;
+    quadrenderer bench("particle/base.png", PT_PART|PT_FLIP);
+    bench.init(n);
+
+    int oldmillis = lastmillis, oldparallel = parallelparticles;
+    double ms[2];
+    loopk(2)
+    {
+        parallelparticles = k;
+        lastmillis = oldmillis;
+        bench.reset();
+        ms[k] = 0;
+        loopi(numframes)
+        {
+            while(bench.numparts < n)
+            {
+                vec o(rndscale(1024), rndscale(1024), rndscale(512)), d(rnd(201)-100, rnd(201)-100, rnd(201)-100);
+                bench.addpart(o, d, 500 + rnd(2000), 0xFFFFFF, 0.5f + rndscale(2), rnd(2) ? 0 : 10 + rnd(40));
+            }
+            lastmillis += 16;
+            inexor::util::Stopwatch sw;
+            bench.genverts();
+            ms[k] += sw.elapsed_ms();
+        }
+    }
+    lastmillis = oldmillis;
+    parallelparticles = oldparallel;
+
+    double serial = ms[0]/numframes, parallel = ms[1]/numframes;
+    spdlog::get("global")->info("benchparticles: {} particles, {} frames: serial {:.3f} ms/frame ({:.1f}M particles/s), parallel {:.3f} ms/frame ({:.1f}M particles/s, {} workers)",
+        n, numframes, serial, n/(serial*1000.0), parallel, n/(parallel*1000.0), inexor::util::shared_pool().size());
+}
+COMMAND(benchparticles, "ii");
+
 VARP(particleglare, 0, 2, 100);
 
 VARN(debugparticles, dbgparts, 0, 0, 1);
@@ -1515,7 +1717,7 @@ void updateparticles()
             pe.lastemit = lastmillis;
         }
         if(dbgpcull && (canemit || replayed) && addedparticles)
-            spdlog::get("global")->debug("{0} emitters, {1} particles", emitted, addedparticles);
+            LOG_EVERY_MS("global", debug, 1000, "{0} emitters, {1} particles", emitted, addedparticles);
     }
     if(editmode) // show sparkly thingies for map entities in edit mode
     {
@@ -1,9 +1,23 @@
 // server.cpp: little more than enhanced multicaster
 // runs dedicated or as client coroutine
 
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "inexor/engine/engine.hpp"
 #include "inexor/crashreporter/CrashReporter.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Profiler.hpp"
+#include "inexor/util/Metrics.hpp"
+#include "inexor/util/Stopwatch.hpp"
+#include "inexor/util/Subsystem.hpp"
+#include "inexor/util/ThreadPool.hpp"
 #include "inexor/fpsgame/network_types.hpp"
 
 #define LOGSTRLEN 512
@@ -60,13 +74,122 @@ struct client                   // server side version of "dynent" type
     void *info;
 };
 
-vector<client *> clients;
+INSTANCE_LOCAL vector<client *> clients;
+
+INSTANCE_LOCAL ENetHost *serverhost = NULL;
+INSTANCE_LOCAL int laststatus = 0; 
+INSTANCE_LOCAL ENetSocket pongsock = ENET_SOCKET_NULL, lansock = ENET_SOCKET_NULL;
+
+INSTANCE_LOCAL int localclients = 0, nonlocalclients = 0;
 
-ENetHost *serverhost = NULL;
-int laststatus = 0; 
-ENetSocket pongsock = ENET_SOCKET_NULL, lansock = ENET_SOCKET_NULL;
+using inexor::util::Metrics;
 
-int localclients = 0, nonlocalclients = 0;
+static inexor::util::Histogram &tickmetric = Metrics::histogram("inexor_server_tick_seconds",
+    "Duration of a server tick (simulation and worldstate) without the time spent waiting for the network", 1e-6);
+static inexor::util::Histogram &sendintervalmetric = Metrics::histogram("inexor_server_send_interval_seconds",
+    "Time between two worldstate sends of the dedicated server", 1e-6);
+static inexor::util::Counter &wakeupmetric = Metrics::counter("inexor_server_wakeups_total",
+    "Times the dedicated server woke up for a tick or network traffic");
+static inexor::util::Histogram &servicemetric = Metrics::histogram("inexor_server_enet_service_seconds",
+    "Time spent in enet_host_service, including waiting for packets", 1e-6);
+
+/// Packets and bytes per channel, either received or sent.
+struct channelmetrics
+{
+    enum { NUMCHANS = 3 };
+    inexor::util::Counter *packets[NUMCHANS], *bytes[NUMCHANS];
+
+    channelmetrics(const char *dir)
+    {
+        defformatstring(packetsname, "inexor_server_packets_%s_total", dir);
+        defformatstring(bytesname, "inexor_server_bytes_%s_total", dir);
+        defformatstring(packetshelp, "Packets %s per channel", dir);
+        defformatstring(byteshelp, "Bytes %s per channel", dir);
+        loopi(NUMCHANS)
+        {
+            defformatstring(label, "channel=\"%d\"", i);
+            packets[i] = &Metrics::counter(packetsname, packetshelp, label);
+            bytes[i] = &Metrics::counter(bytesname, byteshelp, label);
+        }
+    }
+
+    void add(int chan, size_t len)
+    {
+        if(chan < 0 || chan >= NUMCHANS) return;
+        packets[chan]->add();
+        bytes[chan]->add(len);
+    }
+};
+static channelmetrics receivedmetrics("received"), sentmetrics("sent");
+
+static INSTANCE_LOCAL int serverinstance = 0;    // which of the dedicated server's instances runs on this thread
+
+int getserverinstance() { return serverinstance; }
+
+/// Connection quality of a remote client, as the metrics report it.
+struct clientstats
+{
+    int cn;
+    std::string hostname;
+    double rtt, rttvariance, loss;
+};
+
+/// What an instance last reported of its clients: the metrics get read on the thread of instance 0.
+struct instancestats
+{
+    int clients = 0;
+    std::vector<clientstats> remote;
+};
+static std::mutex instancestatsmutex;
+static std::vector<instancestats> allinstancestats;    // guarded by instancestatsmutex, by instance
+
+/// Hands the clients of this instance over to collectclientmetrics().
+static void publishclientstats()
+{
+    std::vector<clientstats> remote;
+    loopv(clients) if(clients[i]->type==ST_TCPIP)
+    {
+        const ENetPeer *peer = clients[i]->peer;
+        clientstats c = { i, clients[i]->hostname, peer->roundTripTime / 1000.0, peer->roundTripTimeVariance / 1000.0,
+                          peer->packetLoss / double(ENET_PEER_PACKET_LOSS_SCALE) };
+        remote.push_back(c);
+    }
+    std::lock_guard<std::mutex> lock(instancestatsmutex);
+    if(int(allinstancestats.size()) <= serverinstance) allinstancestats.resize(serverinstance + 1);
+    allinstancestats[serverinstance].clients = nonlocalclients;
+    allinstancestats[serverinstance].remote.swap(remote);
+}
+
+/// Connection quality of every client, only gathered when the metrics get read.
+/// The instance label only shows up with several instances, a single server exports what it always did.
+static void collectclientmetrics(std::string &out)
+{
+    publishclientstats();
+    std::lock_guard<std::mutex> lock(instancestatsmutex);
+    bool several = allinstancestats.size() > 1;
+    Metrics::write_header(out, "inexor_server_clients", "Connected remote clients", "gauge");
+    for(size_t i = 0; i < allinstancestats.size(); i++)
+    {
+        defformatstring(label, "instance=\"%d\"", int(i));
+        Metrics::write_sample(out, "inexor_server_clients", several ? label : "", allinstancestats[i].clients);
+    }
+    static const struct { const char *name, *help; double clientstats::*value; } families[] =
+    {
+        { "inexor_client_rtt_seconds", "Round trip time measured by ENet", &clientstats::rtt },
+        { "inexor_client_rtt_variance_seconds", "Round trip time variance measured by ENet", &clientstats::rttvariance },
+        { "inexor_client_packet_loss_ratio", "Mean packet loss measured by ENet", &clientstats::loss }
+    };
+    for(const auto &f : families)
+    {
+        Metrics::write_header(out, f.name, f.help, "gauge");
+        for(size_t i = 0; i < allinstancestats.size(); i++) for(const clientstats &c : allinstancestats[i].remote)
+        {
+            defformatstring(label, "%s%scn=\"%d\",host=\"%s\"", several ? tempformatstring("instance=\"%d\"", int(i)) : "", several ? "," : "", c.cn, c.hostname.c_str());
+            Metrics::write_sample(out, f.name, label, c.*f.value);
+        }
+    }
+}
+static int clientmetrics INEXOR_ATTR_UNUSED = (Metrics::add_collector(collectclientmetrics), 0);
 
 bool hasnonlocalclients() { return nonlocalclients!=0; }
 bool haslocalclients() { return localclients!=0; }
@@ -113,8 +236,11 @@ void delclient(client *c)
     }
 }
 
+static void stopinfoserver();
+
 void cleanupserver()
 {
+    stopinfoserver();
     if(serverhost) enet_host_destroy(serverhost);
     serverhost = NULL;
 
@@ -126,7 +252,7 @@ void cleanupserver()
 VARF(maxclients, 0, DEFAULTCLIENTS, MAXCLIENTS, { if(!maxclients) maxclients = DEFAULTCLIENTS; });
 VARF(maxdupclients, 0, 0, MAXCLIENTS, { if(serverhost) serverhost->duplicatePeers = maxdupclients ? maxdupclients : MAXCLIENTS; });
 
-void process(ENetPacket *packet, int sender, int chan);
+void process(ENetPacket *packet, int sender, int chan, int slot = -1);
 //void disconnect_client(int n, int reason);
 
 int getservermtu() { return serverhost ? serverhost->mtu : -1; }
@@ -147,6 +273,7 @@ void sendpacket(int n, int chan, ENetPacket *packet, int exclude)
     {
         case ST_TCPIP:
         {
+            sentmetrics.add(chan, packet->dataLength);
             enet_peer_send(clients[n]->peer, chan, packet);
             break;
         }
@@ -207,6 +334,36 @@ ENetPacket *sendf(int cn, int chan, const char *format, ...)
     return packet->referenceCount > 0 ? packet : NULL;
 }
 
+VARF(packetpool, 0, 1, 1, usepacketpool = packetpool!=0);   // build packets in pooled blocks instead of allocating MAXTRANS bytes each
+
+/// Builds [n] messages the way sendf does, with and without the packet pool, and reports what it cost.
+/// Under load, compare the tick times the load generator reports with /packetpool 0 and 1.
+void benchpackets(int *n)
+{
+    int messages = *n > 0 ? *n : 100000;
+    static inexor::util::Counter &allocated = Metrics::counter("inexor_packet_blocks_allocated_total", "Packet blocks the pool had to allocate");
+    static inexor::util::Counter &unpooled = Metrics::counter("inexor_packets_unpooled_total", "Packets with their own memory (too large for a block, or the pool is off)");
+    bool wasused = usepacketpool;
+    loopk(2)
+    {
+        usepacketpool = k==1;
+        uint64_t allocs = allocated.value() + unpooled.value();
+        inexor::util::Stopwatch build;
+        loopi(messages)
+        {
+            packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+            putint(p, N_TEXT);
+            putint(p, i&0x7F);
+            sendstring("benchpackets", p);
+            p.finalize(); // and gone again, like a packet nobody had to send
+        }
+        spdlog::get("global")->info("benchpackets: {0} messages {1}: {2:.3f} us each, {3} data buffers allocated",
+            messages, usepacketpool ? "pooled" : "unpooled", build.elapsed_us()/messages, allocated.value() + unpooled.value() - allocs);
+    }
+    usepacketpool = wasused;
+}
+COMMAND(benchpackets, "i");
+
 ENetPacket *sendfile(int cn, int chan, stream *file, const char *format, ...)
 {
     if(cn < 0)
@@ -284,10 +441,10 @@ void kicknonlocalclients(int reason)
     loopv(clients) if(clients[i]->type==ST_TCPIP) disconnect_client(i, reason);
 }
 
-void process(ENetPacket *packet, int sender, int chan)   // sender may be -1
+void process(ENetPacket *packet, int sender, int chan, int slot)   // sender may be -1
 {
     packetbuf p(packet);
-    server::parsepacket(sender, chan, p);
+    server::parsepacket(sender, chan, p, slot);
     if(p.overread()) { disconnect_client(sender, DISC_EOP); return; }
 }
 
@@ -310,11 +467,11 @@ int connectwithtimeout(ENetSocket sock, const char *hostname, const ENetAddress
 }
 #endif
 
-ENetSocket mastersock = ENET_SOCKET_NULL;
-ENetAddress masteraddress = { ENET_HOST_ANY, ENET_PORT_ANY }, serveraddress = { ENET_HOST_ANY, ENET_PORT_ANY };
-int lastupdatemaster = 0, lastconnectmaster = 0, masterconnecting = 0, masterconnected = 0;
-vector<char> masterout, masterin;
-int masteroutpos = 0, masterinpos = 0;
+INSTANCE_LOCAL ENetSocket mastersock = ENET_SOCKET_NULL;
+INSTANCE_LOCAL ENetAddress masteraddress = { ENET_HOST_ANY, ENET_PORT_ANY }, serveraddress = { ENET_HOST_ANY, ENET_PORT_ANY };
+INSTANCE_LOCAL int lastupdatemaster = 0, lastconnectmaster = 0, masterconnecting = 0, masterconnected = 0;
+INSTANCE_LOCAL vector<char> masterout, masterin;
+INSTANCE_LOCAL int masteroutpos = 0, masterinpos = 0;
 VARN(updatemaster, allowupdatemaster, 0, 1, 1);
 
 void disconnectmaster()
@@ -463,98 +620,376 @@ void flushmasterinput()
     else disconnectmaster();
 }
 
-static ENetAddress pongaddr;
+#define MAXPINGDATA 32
+
+VAR(serverinforate, 0, 10, 1000);           // server info replies per second to one address, 0 for no limit
+VAR(serverinfoburst, 1, 20, 1000);          // replies one address may get at once
+VAR(serverinfomaxrate, 0, 5000, 1000000);   // replies per second to everyone together, 0 for no limit
+
+static inexor::util::Counter &inforequestmetric = Metrics::counter("inexor_server_info_requests_total",
+    "Server info (ping) requests received");
+static inexor::util::Counter &inforeplymetric = Metrics::counter("inexor_server_info_replies_total",
+    "Server info reply packets sent");
+static inexor::util::Counter &infolimitedmetric = Metrics::counter("inexor_server_info_limited_total",
+    "Server info requests dropped by the rate limits");
 
+/// What gets sent back for one kind of server info request, after echoing the request.
+struct inforeply
+{
+    std::string data;           // the packets, one after another
+    std::vector<int> lengths;
+
+    bool operator==(const inforeply &o) const { return data == o.data && lengths == o.lengths; }
+};
+
+static INSTANCE_LOCAL inforeply *capturedreply = NULL;
+
+/// Called by the game from within server::serverinforeply(), once per packet.
 void sendserverinforeply(ucharbuf &p)
 {
-    ENetBuffer buf;
-    buf.data = p.buf;
-    buf.dataLength = p.length();
-    enet_socket_send(pongsock, &pongaddr, &buf, 1);
+    if(!capturedreply) return;
+    capturedreply->data.append((const char *)p.buf, p.length());
+    capturedreply->lengths.push_back(p.length());
 }
 
-#define MAXPINGDATA 32
-
-void checkserversockets()        // reply all server info requests
+/// Answers server info requests (pings of the server browser, LAN broadcasts, extinfo) on a thread of its own.
+///
+/// So floods of pings, spoofed or not, cost the main thread nothing. The thread can't ask the game,
+/// it sends replies refreshserverinfo() built on the main thread instead: those are cached per request
+/// kind (see server::serverinfokey()) and only swapped when their content changed.
+/// Every source address gets serverinforate replies per second, everyone together serverinfomaxrate.
+struct infoserver
 {
-    static ENetSocketSet readset, writeset;
-    ENET_SOCKETSET_EMPTY(readset);
-    ENET_SOCKETSET_EMPTY(writeset);
-    ENetSocket maxsock = pongsock;
-    ENET_SOCKETSET_ADD(readset, pongsock);
-    if(mastersock != ENET_SOCKET_NULL)
+    struct entry
     {
-        maxsock = max(maxsock, mastersock);
-        ENET_SOCKETSET_ADD(readset, mastersock);
-        if(!masterconnected) ENET_SOCKETSET_ADD(writeset, mastersock);
+        std::shared_ptr<const inforeply> reply; // NULL until the main thread built it
+        enet_uint32 lastasked;
+    };
+    std::mutex mtx;
+    std::map<std::string, entry> replies;       // guarded by mtx
+    std::atomic<bool> missing{false}, stopping{false};
+    std::atomic<int> rate{0}, burst{1}, maxrate{0};
+
+    // everything below is only used by the thread
+    ENetSocket sock, lansock;
+    std::thread thread;
+
+    struct pending
+    {
+        ENetAddress address;
+        std::string request, key;
+        enet_uint32 received;
+    };
+    std::vector<pending> waiting;
+
+    struct bucket
+    {
+        enet_uint32 host, last;
+        float tokens;
+    };
+    enum { NUMBUCKETS = 4096, MAXWAITING = 256, MAXREPLIES = 64 };
+    bucket buckets[NUMBUCKETS];
+    bucket total;
+
+    infoserver(ENetSocket sock, ENetSocket lansock) : sock(sock), lansock(lansock)
+    {
+        memset(buckets, 0, sizeof(buckets));
+        memset(&total, 0, sizeof(total));
+        thread = std::thread([this] { run(); });
     }
-    if(lansock != ENET_SOCKET_NULL)
+
+    ~infoserver()
     {
-        maxsock = max(maxsock, lansock);
-        ENET_SOCKETSET_ADD(readset, lansock);
+        stopping = true;
+        thread.join();
     }
-    if(enet_socketset_select(maxsock, &readset, &writeset, 0) <= 0) return;
 
-    ENetBuffer buf;
-    uchar pong[MAXTRANS];
-    loopi(2)
+    /// Token bucket: tokens refill at rate per second up to limit, each packet costs one.
+    static bool take(bucket &b, enet_uint32 now, int rate, int limit, int packets)
     {
-        ENetSocket sock = i ? lansock : pongsock;
-        if(sock == ENET_SOCKET_NULL || !ENET_SOCKETSET_CHECK(readset, sock)) continue;
+        if(!rate) return true;
+        b.tokens = min(float(limit), b.tokens + (now - b.last)*rate/1000.0f);
+        b.last = now;
+        if(b.tokens < 1) return false;
+        b.tokens -= packets;
+        return true;
+    }
 
-        buf.data = pong;
-        buf.dataLength = sizeof(pong);
-        int len = enet_socket_receive(sock, &pongaddr, &buf, 1);
-        if(len < 0 || len > MAXPINGDATA) continue;
-        ucharbuf req(pong, len), p(pong, sizeof(pong));
-        p.len += len;
-        server::serverinforeply(req, p);
+    bool allow(enet_uint32 host, enet_uint32 now, int packets)
+    {
+        // addresses share a bucket once in a while, but the memory used can't be flooded
+        bucket &b = buckets[(host * 2654435761U) >> 20];
+        if(b.host != host)
+        {
+            b.host = host;
+            b.last = now;
+            b.tokens = burst;
+        }
+        return take(b, now, rate, burst, packets) && take(total, now, maxrate, maxrate, packets);
     }
 
-    if(mastersock != ENET_SOCKET_NULL)
+    /// @param known set to false if there are too many kinds of requests already, drop it then.
+    std::shared_ptr<const inforeply> lookup(const std::string &key, enet_uint32 now, bool &known)
     {
-        if(!masterconnected)
+        std::unique_lock<std::mutex> lock(mtx);
+        auto it = replies.find(key);
+        known = it != replies.end() || replies.size() < MAXREPLIES;
+        if(!known) return NULL;
+        entry &e = it != replies.end() ? it->second : replies[key];
+        e.lastasked = now;
+        if(!e.reply) missing = true;
+        return e.reply;
+    }
+
+    void reply(const ENetAddress &address, const std::string &request, const inforeply &r, enet_uint32 now)
+    {
+        if(!allow(address.host, now, max(int(r.lengths.size()), 1))) { infolimitedmetric.add(); return; }
+        const char *data = r.data.data();
+        for(int len : r.lengths)
         {
-            if(ENET_SOCKETSET_CHECK(readset, mastersock) || ENET_SOCKETSET_CHECK(writeset, mastersock)) 
-            { 
-                int error = 0;
-                if(enet_socket_get_option(mastersock, ENET_SOCKOPT_ERROR, &error) < 0 || error)
-                {
-                    spdlog::get("global")->warn("could not connect to master server");
-                    disconnectmaster();
-                }
-                else
-                {
-                    masterconnecting = 0; 
-                    masterconnected = totalmillis ? totalmillis : 1; 
-                    server::masterconnected(); 
-                }
+            ENetBuffer buf[2];
+            buf[0].data = (void *)request.data();
+            buf[0].dataLength = request.size();
+            buf[1].data = (void *)data;
+            buf[1].dataLength = len;
+            enet_socket_send(sock, &address, buf, 2);
+            data += len;
+            inforeplymetric.add();
+        }
+    }
+
+    void receive(ENetSocket from, enet_uint32 now)
+    {
+        uchar request[MAXTRANS];
+        ENetBuffer buf;
+        buf.data = request;
+        buf.dataLength = sizeof(request);
+        loopi(1024) // then look at the other socket again
+        {
+            ENetAddress address;
+            int len = enet_socket_receive(from, &address, &buf, 1);
+            if(len <= 0) break;
+            inforequestmetric.add();
+            if(len > MAXPINGDATA) continue;
+            std::string key((const char *)request, server::serverinfokey(ucharbuf(request, len)));
+            bool known;
+            std::shared_ptr<const inforeply> r = lookup(key, now, known);
+            if(r) reply(address, std::string((const char *)request, len), *r, now);
+            else if(known && waiting.size() < MAXWAITING)
+            {
+                pending p;
+                p.address = address;
+                p.request.assign((const char *)request, len);
+                p.key = key;
+                p.received = now;
+                waiting.push_back(p);
+            }
+            else infolimitedmetric.add();
+        }
+    }
+
+    void run()
+    {
+        while(!stopping)
+        {
+            ENetSocketSet readset;
+            ENET_SOCKETSET_EMPTY(readset);
+            ENET_SOCKETSET_ADD(readset, sock);
+            if(lansock != ENET_SOCKET_NULL) ENET_SOCKETSET_ADD(readset, lansock);
+            int ready = enet_socketset_select(max(sock, lansock), &readset, NULL, waiting.empty() ? 100 : 5);
+            enet_uint32 now = enet_time_get();
+            if(ready > 0)
+            {
+                if(ENET_SOCKETSET_CHECK(readset, sock)) receive(sock, now);
+                if(lansock != ENET_SOCKET_NULL && ENET_SOCKETSET_CHECK(readset, lansock)) receive(lansock, now);
+            }
+            // requests the main thread has not built a reply for yet
+            for(size_t i = 0; i < waiting.size();)
+            {
+                pending &p = waiting[i];
+                bool known;
+                std::shared_ptr<const inforeply> r = lookup(p.key, now, known);
+                if(!r && now - p.received < 1000) { i++; continue; }
+                if(r) reply(p.address, p.request, *r, now);
+                waiting[i] = waiting.back();
+                waiting.pop_back();
             }
         }
-        if(mastersock != ENET_SOCKET_NULL && ENET_SOCKETSET_CHECK(readset, mastersock)) flushmasterinput();
     }
+};
+
+static INSTANCE_LOCAL infoserver *infoserv = NULL;
+
+static void startinfoserver()
+{
+    if(!infoserv && pongsock != ENET_SOCKET_NULL) infoserv = new infoserver(pongsock, lansock);
+}
+
+static void stopinfoserver()
+{
+    DELETEP(infoserv);
+}
+
+/// Rebuilds the server info replies that got asked for in the last seconds, on the main thread.
+/// Runs every 100 ms at most, unless a request waits for a reply nobody asked for before.
+static void refreshserverinfo(bool force = false)
+{
+    if(!infoserv) return;
+    infoserv->rate = serverinforate;
+    infoserv->burst = serverinfoburst;
+    infoserv->maxrate = serverinfomaxrate;
+    static INSTANCE_LOCAL enet_uint32 lastrefresh = 0;
+    enet_uint32 now = enet_time_get();
+    if(!force && !infoserv->missing && now - lastrefresh < 100) return;
+    lastrefresh = now;
+    infoserv->missing = false;
+
+    std::vector<std::string> keys;
+    {
+        std::unique_lock<std::mutex> lock(infoserv->mtx);
+        for(auto it = infoserv->replies.begin(); it != infoserv->replies.end();)
+        {
+            if(now - it->second.lastasked > 10000) it = infoserv->replies.erase(it);
+            else keys.push_back((it++)->first);
+        }
+    }
+    for(const std::string &key : keys)
+    {
+        std::shared_ptr<inforeply> r = std::make_shared<inforeply>();
+        uchar req[MAXPINGDATA], reply[MAXTRANS];
+        memcpy(req, key.data(), key.size());
+        ucharbuf reqbuf(req, int(key.size())), p(reply, sizeof(reply));
+        capturedreply = r.get();
+        server::serverinforeply(reqbuf, p);
+        capturedreply = NULL;
+        std::unique_lock<std::mutex> lock(infoserv->mtx);
+        auto it = infoserv->replies.find(key);
+        if(it != infoserv->replies.end() && (!it->second.reply || !(*it->second.reply == *r))) it->second.reply = r;
+    }
+}
+
+/// Floods our own info port with pings from one address, and compares that to what building
+/// the same number of replies cost the main thread when it still answered every ping itself.
+void benchserverinfo(int *n)
+{
+    if(!infoserv) { spdlog::get("global")->error("benchserverinfo needs a running server"); return; }
+    int requests = *n > 0 ? *n : 10000;
+
+    inexor::util::Stopwatch build;
+    loopi(requests)
+    {
+        inforeply r;
+        uchar reply[MAXTRANS];
+        ucharbuf reqbuf(NULL, 0), p(reply, sizeof(reply));
+        capturedreply = &r;
+        server::serverinforeply(reqbuf, p);
+        capturedreply = NULL;
+    }
+    double buildus = build.elapsed_us();
+
+    ENetAddress address;
+    if(enet_socket_get_address(pongsock, &address) < 0) return;
+    if(address.host == ENET_HOST_ANY) enet_address_set_host(&address, "127.0.0.1");
+    ENetSocket sock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+    if(sock == ENET_SOCKET_NULL) return;
+    enet_socket_set_option(sock, ENET_SOCKOPT_NONBLOCK, 1);
+
+    bool known;
+    infoserv->lookup("", enet_time_get(), known); // like a first ping would
+    inexor::util::Stopwatch refresh;
+    refreshserverinfo(true);
+    double refreshus = refresh.elapsed_us();
+
+    uint64_t handled = inforequestmetric.value(), limited = infolimitedmetric.value();
+    int received = 0;
+    uchar buf[MAXTRANS];
+    ENetBuffer in;
+    in.data = buf;
+    in.dataLength = sizeof(buf);
+    inexor::util::Stopwatch flood;
+    loopi(requests)
+    {
+        uchar ping[8];
+        ucharbuf p(ping, sizeof(ping));
+        putint(p, i+1);
+        ENetBuffer out;
+        out.data = ping;
+        out.dataLength = p.length();
+        enet_socket_send(sock, &address, &out, 1);
+        while(enet_socket_receive(sock, NULL, &in, 1) > 0) received++;
+    }
+    for(;;)
+    {
+        enet_uint32 events = ENET_SOCKET_WAIT_RECEIVE;
+        if(enet_socket_wait(sock, &events, 200) < 0 || !(events & ENET_SOCKET_WAIT_RECEIVE)) break;
+        while(enet_socket_receive(sock, NULL, &in, 1) > 0) received++;
+    }
+    enet_socket_destroy(sock);
+
+    spdlog::get("global")->info("benchserverinfo: building a reply per ping costs the main thread {0:.2f} us, refreshing all cached replies {1:.2f} us",
+        buildus/requests, refreshus);
+    spdlog::get("global")->info("benchserverinfo: {0} pings sent, the info thread got {1}, dropped {2} by the rate limits, {3} replies arrived within {4:.1f} ms",
+        requests, inforequestmetric.value() - handled, infolimitedmetric.value() - limited, received, flood.elapsed_ms());
+}
+COMMAND(benchserverinfo, "i");
+
+void checkserversockets()        // handle the master server connection, the info sockets belong to infoserver
+{
+    static INSTANCE_LOCAL ENetSocketSet readset, writeset;
+    if(mastersock == ENET_SOCKET_NULL) return;
+    ENET_SOCKETSET_EMPTY(readset);
+    ENET_SOCKETSET_EMPTY(writeset);
+    ENET_SOCKETSET_ADD(readset, mastersock);
+    if(!masterconnected) ENET_SOCKETSET_ADD(writeset, mastersock);
+    if(enet_socketset_select(mastersock, &readset, &writeset, 0) <= 0) return;
+
+    if(!masterconnected)
+    {
+        if(ENET_SOCKETSET_CHECK(readset, mastersock) || ENET_SOCKETSET_CHECK(writeset, mastersock)) 
+        { 
+            int error = 0;
+            if(enet_socket_get_option(mastersock, ENET_SOCKOPT_ERROR, &error) < 0 || error)
+            {
+                spdlog::get("global")->warn("could not connect to master server");
+                disconnectmaster();
+            }
+            else
+            {
+                masterconnecting = 0; 
+                masterconnected = totalmillis ? totalmillis : 1; 
+                server::masterconnected(); 
+            }
+        }
+    }
+    if(mastersock != ENET_SOCKET_NULL && ENET_SOCKETSET_CHECK(readset, mastersock)) flushmasterinput();
 }
 
 VAR(serveruprate, 0, 0, INT_MAX);
 SVAR(serverip, "");
 VARF(serverport, 0, INEXOR_SERVER_PORT, MAX_POSSIBLE_PORT, { if(!serverport) serverport = server::serverport(); });
 
+/// The game port of this instance, each one takes two (the game and the server info port) from serverport on.
+static int instanceport()
+{
+    return (serverport <= 0 ? server::serverport() : *serverport) + 2*serverinstance;
+}
+
 #ifdef STANDALONE
-int curtime = 0, lastmillis = 0, elapsedtime = 0, totalmillis = 0;
+INSTANCE_LOCAL int curtime = 0, lastmillis = 0, elapsedtime = 0, totalmillis = 0;
 #endif
 
 void updatemasterserver()
 {
     if(!masterconnected && lastconnectmaster && totalmillis-lastconnectmaster <= 5*60*1000) return;
-    if(mastername[0] && allowupdatemaster) requestmasterf("regserv %d\n", *serverport);
+    if(mastername[0] && allowupdatemaster) requestmasterf("regserv %d\n", instanceport());
     lastupdatemaster = totalmillis ? totalmillis : 1;
 }
 
-uint totalsecs = 0;
+INSTANCE_LOCAL uint totalsecs = 0;
 
 void updatetime()
 {
-    static int lastsec = 0;
+    static INSTANCE_LOCAL int lastsec = 0;
     if(totalmillis - lastsec >= 1000) 
     {
         int cursecs = (totalmillis - lastsec) / 1000;
@@ -563,34 +998,78 @@ void updatetime()
     }
 }
 
-void serverslice(bool dedicated, uint timeout)   // main server update, called from main loop in sp, or from below in dedicated server
+/// Move the clocks forward to now.
+/// @param tick whether a serverupdate() follows, which gets everything since the last one as curtime.
+///             Otherwise (packets between two ticks of the dedicated server) the game clock is advanced right away.
+static void updateservertime(bool tick = true)
 {
-    if(!serverhost) 
+    int millis = (int)enet_time_get();
+    elapsedtime = millis - totalmillis;
+    static INSTANCE_LOCAL int timeerr = 0, pending = 0;
+    int scaledtime = server::scaletime(elapsedtime) + timeerr, step = scaledtime/100;
+    timeerr = scaledtime%100;
+    if(server::ispaused()) step = 0;
+    lastmillis += step;
+    totalmillis = millis;
+    updatetime();
+    if(tick)
     {
-        server::serverupdate();
-        server::sendpackets();
-        return;
+        curtime = pending + step;
+        pending = 0;
     }
-       
-    // below is network only
+    else
+    {
+        pending += step;
+        server::advancetime(step);
+    }
+}
+
+VAR(packetdecodegrain, 0, 8, 1024);     // received packets per worker job when decoding them ahead of parsing, 0 parses them as before
+
+/// Packets received in one servicenetwork(), parsed together as soon as anything else happens.
+struct receivedpacket
+{
+    ENetPeer *peer;
+    int chan;
+    ENetPacket *packet;
+};
+static INSTANCE_LOCAL std::vector<receivedpacket> received;
 
-    if(dedicated) 
+/// Decodes the received packets on the shared thread pool, then parses them on this thread in the order they arrived.
+static void parsereceived()
+{
+    if(received.empty()) return;
+    int n = int(received.size());
+    if(packetdecodegrain)
     {
-        int millis = (int)enet_time_get();
-        elapsedtime = millis - totalmillis;
-        static int timeerr = 0;
-        int scaledtime = server::scaletime(elapsedtime) + timeerr;
-        curtime = scaledtime/100;
-        timeerr = scaledtime%100;
-        if(server::ispaused()) curtime = 0;
-        lastmillis += curtime;
-        totalmillis = millis;
-        updatetime();
+        PROFILE_SCOPE("decode");
+        // the workers (or other instances helping out) see thread local state of their own, so they get everything passed
+        server::packetbatch *batch = server::beginpacketbatch(n);
+        const std::vector<receivedpacket> &packets = received;
+        inexor::util::shared_pool().parallel_for(n, packetdecodegrain, [batch, &packets](size_t begin, size_t end)
+        {
+            for(size_t i = begin; i < end; i++) server::decodepacket(batch, int(i), packets[i].chan, packets[i].packet);
+        });
     }
-    server::serverupdate();
+    PROFILE_SCOPE("parse");
+    loopi(n)
+    {
+        receivedpacket &r = received[i];
+        client *c = (client *)r.peer->data; // NULL once an earlier packet got the client disconnected
+        if(c) process(r.packet, c->num, r.chan, packetdecodegrain ? i : -1);
+        if(r.packet->referenceCount==0) enet_packet_destroy(r.packet);
+    }
+    received.clear();
+}
 
+/// Everything network related except sending the worldstate.
+/// @param timeout ms to wait for incoming packets.
+/// @param drain handle everything that arrived, instead of returning after the first batch of packets.
+static void servicenetwork(uint timeout, bool drain = false)
+{
     flushmasteroutput();
     checkserversockets();
+    refreshserverinfo();
 
     if(!lastupdatemaster || totalmillis-lastupdatemaster>60*60*1000)       // send alive signal to masterserver every hour of uptime
         updatemasterserver();
@@ -604,15 +1083,20 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
         serverhost->totalSentData = serverhost->totalReceivedData = 0;
     }
 
+    PROFILE_SCOPE("network");
     ENetEvent event;
     bool serviced = false;
     while(!serviced)
     {
         if(enet_host_check_events(serverhost, &event) <= 0)
         {
-            if(enet_host_service(serverhost, &event, timeout) <= 0) break;
-            serviced = true;
+            inexor::util::Stopwatch service;
+            int result = enet_host_service(serverhost, &event, timeout);
+            servicemetric.record(uint64_t(service.elapsed_us()));
+            if(result <= 0) break;
+            serviced = !drain;
         }
+        if(event.type != ENET_EVENT_TYPE_RECEIVE) parsereceived();
         switch(event.type)
         {
             case ENET_EVENT_TYPE_CONNECT:
@@ -629,9 +1113,9 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
             }
             case ENET_EVENT_TYPE_RECEIVE:
             {
-                client *c = (client *)event.peer->data;
-                if(c) process(event.packet, c->num, event.channelID);
-                if(event.packet->referenceCount==0) enet_packet_destroy(event.packet);
+                receivedmetrics.add(event.channelID, event.packet->dataLength);
+                receivedpacket r = { event.peer, event.channelID, event.packet };
+                received.push_back(r);
                 break;
             }
             case ENET_EVENT_TYPE_DISCONNECT: 
@@ -647,6 +1131,23 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
                 break;
         }
     }
+    parsereceived();
+}
+
+void serverslice(bool dedicated, uint timeout)   // main server update, called from the main loop of the client; the dedicated server runs servertick() instead
+{
+    PROFILE_SCOPE("serverslice");
+    if(!serverhost) 
+    {
+        server::serverupdate();
+        server::sendpackets();
+        return;
+    }
+
+    // below is network only
+    if(dedicated) updateservertime();
+    server::serverupdate();
+    servicenetwork(timeout);
     if(server::sendpackets()) enet_host_flush(serverhost);
 }
 
@@ -655,6 +1156,34 @@ void flushserver(bool force)
     if(server::sendpackets(force) && serverhost) enet_host_flush(serverhost);
 }
 
+/// Record PROFILE_SCOPE zones, events is the number of zones kept per thread.
+ICOMMAND(profilestart, "i", (int *events), inexor::util::Profiler::start(*events > 0 ? *events : 1<<16));
+ICOMMAND(profilestop, "", (), inexor::util::Profiler::stop());
+
+void profilereport()
+{
+    std::string s = inexor::util::Profiler::summary();
+    if(s.empty()) { spdlog::get("global")->info("profiler: nothing recorded, use /profilestart"); return; }
+    const char *line = s.c_str();
+    while(*line)
+    {
+        const char *end = strchr(line, '\n');
+        spdlog::get("global")->info("{0}", std::string(line, end - line));
+        line = end + 1;
+    }
+}
+COMMAND(profilereport, "");
+
+/// Save everything recorded for chrome://tracing (or any other Chrome trace event viewer).
+void profileexport(const char *name)
+{
+    defformatstring(fname, "%s", *name ? name : "profile.json");
+    const char *file = findfile(path(fname), "w");
+    if(inexor::util::Profiler::export_trace(file)) spdlog::get("global")->info("profiler: wrote {0}", file);
+    else spdlog::get("global")->error("profiler: could not write {0}", file);
+}
+COMMAND(profileexport, "s");
+
 #ifndef STANDALONE
 void localdisconnect(bool cleanup)
 {
@@ -930,18 +1459,109 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrev, LPSTR szCmdLine, int sw)
 
 #endif
 
-static bool dedicatedserver = false;
+static std::atomic<bool> dedicatedserver{false};   // written by every instance
 
 bool isdedicatedserver() { return dedicatedserver; }
 
+extern inexor::util::Metasystem metapp;
+
+VAR(servertickrate, 10, 30, 250);   // simulation steps and worldstate updates per second of the dedicated server
+VAR(serveridlerate, 1, 10, 250);    // the same while no clients are connected
+
+int getservertickrate() { return servertickrate; }
+
+/// Deadlines of the dedicated server's ticks, at a fixed rate.
+struct serverticker
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point next = clock::now();
+
+    /// Schedule the following tick. If we fell behind by more than a tick, the missed ones are dropped.
+    void advance(int rate)
+    {
+        clock::duration period = std::chrono::microseconds(1000000 / max(rate, 1));
+        next += period;
+        clock::time_point now = clock::now();
+        if(now - next > period) next = now;
+    }
+
+    int64_t remainingus() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(next - clock::now()).count();
+    }
+
+    /// Sleep until exactly the deadline (with the os' timer precision, usually well below a ms).
+    void sleep() const
+    {
+#ifdef __linux__
+        // steady_clock is CLOCK_MONOTONIC
+        std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch());
+        timespec ts;
+        ts.tv_sec = ns.count() / 1000000000;
+        ts.tv_nsec = ns.count() % 1000000000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+        std::this_thread::sleep_until(next);
+#endif
+    }
+};
+
+/// Block until a packet arrives on any of the server's sockets or timeout ms passed.
+static void waitforserversockets(int timeout)
+{
+    ENetSocketSet readset, writeset;
+    ENET_SOCKETSET_EMPTY(readset);
+    ENET_SOCKETSET_EMPTY(writeset);
+    ENetSocket maxsock = serverhost->socket;
+    ENET_SOCKETSET_ADD(readset, serverhost->socket);
+    if(mastersock != ENET_SOCKET_NULL)
+    {
+        maxsock = max(maxsock, mastersock);
+        ENET_SOCKETSET_ADD(readset, mastersock);
+        if(!masterconnected) ENET_SOCKETSET_ADD(writeset, mastersock);
+    }
+    enet_socketset_select(maxsock, &readset, &writeset, timeout);
+}
+
+/// Simulation step and worldstate update.
+static void servertick()
+{
+    PROFILE_SCOPE("servertick");
+    inexor::util::Stopwatch tick;
+    updateservertime();
+    server::serverupdate();
+    if(server::sendpackets(true)) enet_host_flush(serverhost);
+    tickmetric.record(uint64_t(tick.elapsed_us()));
+
+    // instance 0 reads the metrics itself
+    static INSTANCE_LOCAL int lastpublish = 0;
+    if(serverinstance && totalmillis - lastpublish >= 1000)
+    {
+        lastpublish = totalmillis;
+        publishclientstats();
+    }
+
+    static INSTANCE_LOCAL serverticker::clock::time_point lastsend;
+    serverticker::clock::time_point now = serverticker::clock::now();
+    if(nonlocalclients && lastsend.time_since_epoch().count())
+        sendintervalmetric.record(std::chrono::duration_cast<std::chrono::microseconds>(now - lastsend).count());
+    lastsend = nonlocalclients ? now : serverticker::clock::time_point();
+}
+
+/// Runs servertick() at servertickrate (serveridlerate while nobody is connected) and handles the network in between.
+/// Instead of polling, it sleeps until either a packet arrives or shortly before the next tick,
+/// the last bit is slept precisely, so the worldstate goes out at steady intervals.
 void rundedicatedserver()
 {
     dedicatedserver = true;
     spdlog::get("global")->info("dedicated server started, waiting for clients...");
 #ifdef WIN32
     SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
-	for(;;)
-	{
+#endif
+    serverticker ticker;
+    for(;;)
+    {
+#ifdef WIN32
 		MSG msg;
 		while(PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
 		{
@@ -949,14 +1569,80 @@ void rundedicatedserver()
 			TranslateMessage(&msg);
 			DispatchMessage(&msg);
 		}
-		serverslice(true, 5);
-	}
-#else
-    for(;;) serverslice(true, 5);
 #endif
+        servertick();
+        if(!serverinstance) metapp.tick();
+        ticker.advance(nonlocalclients ? servertickrate : min(serveridlerate, servertickrate));
+        for(;;)
+        {
+            wakeupmetric.add();
+            int64_t left = ticker.remainingus();
+            if(left < 2000) break;
+            waitforserversockets(int((left - 1000) / 1000));
+            updateservertime(false); // so whatever arrived gets stamped with the time it arrived, not the last tick's
+            servicenetwork(0, true);
+        }
+        ticker.sleep();
+    }
     dedicatedserver = false;
 }
 
+/// Measures the intervals between two worldstate sends, for the old way of polling every 5 ms
+/// and sending once 33 ms passed and for serverticker at servertickrate, without doing any actual work.
+void benchticks(int *n)
+{
+    int ticks = *n > 0 ? *n : 300;
+    loopk(2)
+    {
+        bool scheduled = k==1;
+        inexor::util::Histogram *intervals = new inexor::util::Histogram;
+        int wakeups = 0;
+        inexor::util::Stopwatch total;
+        serverticker::clock::time_point last = serverticker::clock::now();
+        if(scheduled)
+        {
+            serverticker ticker;
+            loopi(ticks)
+            {
+                ticker.advance(servertickrate);
+                for(;;)
+                {
+                    wakeups++;
+                    int64_t left = ticker.remainingus();
+                    if(left < 2000) break;
+                    std::this_thread::sleep_for(std::chrono::milliseconds((left - 1000) / 1000));
+                }
+                ticker.sleep();
+                serverticker::clock::time_point now = serverticker::clock::now();
+                intervals->record(std::chrono::duration_cast<std::chrono::microseconds>(now - last).count());
+                last = now;
+            }
+        }
+        else
+        {
+            enet_uint32 lastsend = enet_time_get();
+            for(int sent = 0; sent < ticks;)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                wakeups++;
+                enet_uint32 elapsed = enet_time_get() - lastsend;
+                if(elapsed < 33) continue;
+                lastsend += elapsed - (elapsed%33);
+                serverticker::clock::time_point now = serverticker::clock::now();
+                intervals->record(std::chrono::duration_cast<std::chrono::microseconds>(now - last).count());
+                last = now;
+                sent++;
+            }
+        }
+        spdlog::get("global")->info("benchticks {0} ({1} Hz): interval p50 {2:.2f} ms, p90 {3:.2f} ms, p99 {4:.2f} ms, max {5:.2f} ms, {6:.0f} wakeups/s",
+            scheduled ? "scheduled" : "polling", scheduled ? servertickrate : 30,
+            intervals->quantile(0.5)/1000.0, intervals->quantile(0.9)/1000.0, intervals->quantile(0.99)/1000.0, intervals->max()/1000.0,
+            wakeups/max(total.elapsed_ms()/1000, 1e-3));
+        delete intervals;
+    }
+}
+COMMAND(benchticks, "i");
+
 bool servererror(bool dedicated, const char *desc)
 {
 #ifndef STANDALONE
@@ -973,7 +1659,7 @@ bool servererror(bool dedicated, const char *desc)
   
 bool setuplistenserver(bool dedicated)
 {
-    ENetAddress address = { ENET_HOST_ANY, enet_uint16(serverport <= 0 ? server::serverport() : serverport) };
+    ENetAddress address = { ENET_HOST_ANY, enet_uint16(instanceport()) };
     if(*serverip)
     {
         if(enet_address_set_host(&address, serverip)<0) spdlog::get("global")->warn("WARNING: server ip not resolved");
@@ -982,7 +1668,7 @@ bool setuplistenserver(bool dedicated)
     serverhost = enet_host_create(&address, min(maxclients + server::reserveclients(), MAXCLIENTS), server::numchannels(), 0, serveruprate);
     if(!serverhost) return servererror(dedicated, "could not create server host");
     serverhost->duplicatePeers = maxdupclients ? maxdupclients : MAXCLIENTS;
-    address.port = server::serverinfoport(serverport > 0 ? serverport : -1);
+    address.port = server::serverinfoport(serverport > 0 ? instanceport() : -1);
     pongsock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
     if(pongsock != ENET_SOCKET_NULL && enet_socket_bind(pongsock, &address) < 0)
     {
@@ -1000,9 +1686,42 @@ bool setuplistenserver(bool dedicated)
     }
     if(lansock == ENET_SOCKET_NULL) spdlog::get("global")->warn("WARNING: could not create LAN server info socket");
     else enet_socket_set_option(lansock, ENET_SOCKOPT_NONBLOCK, 1);
+    startinfoserver();
     return true;
 }
 
+#ifdef SERVERINSTANCES
+extern inexor::util::Logging logging;
+
+VAR(serverinstances, 1, 1, 64);     // matches the dedicated server runs, on serverport, serverport+2, .., each in a thread of its own
+
+/// Instance [instance] of the dedicated server: a match of its own, on ports of its own.
+static void runserverinstance(int instance)
+{
+    serverinstance = instance;
+    spdlog::get("global")->info("server instance {0} listens on port {1}", instance, instanceport());
+    server::serverinit();
+    setuplistenserver(true);
+    updatemasterserver();
+    rundedicatedserver(); // never returns
+}
+
+/// Starts the instances 1 and up of the dedicated server, the calling thread goes on as instance 0.
+///
+/// The game and engine state of an instance is INSTANCE_LOCAL, the rest is shared: the config (which ran already,
+/// so variables, users, map rotations, ..), the cache of map entities, the thread pool decoding packets.
+/// Only instance 0 runs the subsystems (metrics, rpc) and answers the console, so commands acting on the
+/// match (mapmode, ..) reach instance 0 alone.
+static void startserverinstances()
+{
+    if(serverinstances <= 1) return;
+    // tell the instances apart by their thread, each one logs its port first
+    for(const std::string &name : inexor::util::default_logger_names) logging.setLogFormat(name, "%H:%M:%S [%n] [%l] [%t] %v");
+    spdlog::get("global")->info("server instance 0 listens on port {0}", instanceport());
+    for(int i = 1; i < serverinstances; i++) std::thread(runserverinstance, i).detach();
+}
+#endif
+
 void initserver(bool listen, bool dedicated)
 {
     if(dedicated)
@@ -1017,6 +1736,10 @@ void initserver(bool listen, bool dedicated)
     if(initscript) execfile(initscript);
     else execfile("server-init.cfg", false);
 
+#ifdef SERVERINSTANCES
+    if(listen && dedicated) startserverinstances();
+#endif
+
     if(listen) setuplistenserver(dedicated);
 
     if(listen)
@@ -1070,6 +1793,9 @@ bool serveroption(char *opt)
 #ifdef STANDALONE
         case 'k': spdlog::get("global")->debug("Adding package directory: {}", opt); addpackagedir(opt+2); return true;
         case 'x': spdlog::get("global")->debug("Setting server init script: {}", opt); initscript = opt+2; return true;
+#endif
+#ifdef SERVERINSTANCES
+        case 's': setvar("serverinstances", atoi(opt+2)); return true;
 #endif
         default: return false;
     }
@@ -1080,10 +1806,12 @@ vector<const char *> gameargs;
 #ifdef STANDALONE
 
 inexor::util::Logging logging;
+inexor::util::Metasystem metapp;
 
 int main(int argc, char **argv)
 {
     logging.initDefaultLoggers();
+    metapp.start("metrics");
     UNUSED inexor::crashreporter::CrashReporter SingletonStackwalker; // We only need to initialse it, not use it.
     if(enet_initialize()<0) fatal("Unable to initialise network module");
     atexit(enet_deinitialize);
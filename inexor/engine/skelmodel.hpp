@@ -208,6 +208,9 @@ struct skelmodel : animmodel
             mesh::calctangents(bumpverts, verts, verts, numverts, tris, numtris, areaweight);
         }
 
+        /// The texture the source file assigned to this mesh (md5 "shader"), stored in the model cache.
+        virtual const char *cachetexname() const { return NULL; }
+
         void calcbb(vec &bbmin, vec &bbmax, const matrix4x3 &m)
         {
             loopj(numverts)
@@ -1336,6 +1339,205 @@ struct skelmodel : animmodel
             delete[] remap;
         }
 
+        /// Get the model cache file for the meshes of filename.
+        /// The skeleton state is part of the key since loaders only fill in bones of fresh skeletons.
+        /// @return false if caching is disabled or the source file can't be read.
+        bool initmeshcache(const char *kind, const char *filename, float setting, string &cachename)
+        {
+            cachename[0] = '\0';
+            if(!modelcache) return false;
+            modelcachekey key;
+            if(!key.addfile(filename)) return false;
+            key.add(setting);
+            key.add(skel->numbones > 0);
+            key.add(skel->shared <= 1);
+            key.getpath(kind, cachename);
+            return true;
+        }
+
+        /// Get the model cache file for an animation of this skeleton.
+        /// Frames get baked against the bind pose and the first frame of earlier animations, so they are part of the key.
+        bool initanimcache(const char *kind, const char *filename, const void *adjustments, int adjustlen, string &cachename)
+        {
+            cachename[0] = '\0';
+            if(!modelcache || skel->numbones <= 0) return false;
+            modelcachekey key;
+            if(!key.addfile(filename)) return false;
+            key.add(adjustments, adjustlen);
+            key.add(skel->numbones);
+            loopi(skel->numbones)
+            {
+                key.add(skel->bones[i].parent);
+                key.add(skel->bones[i].base);
+            }
+            if(skel->numframes > 0) key.add(skel->framebones, skel->numbones*sizeof(dualquat));
+            key.getpath(kind, cachename);
+            return true;
+        }
+
+        /// Store the processed meshes (including tangents), blend combos and bones.
+        void savemeshcache(const char *cachename)
+        {
+            modelcachewriter f;
+            f.put(skel->numbones);
+            loopi(skel->numbones)
+            {
+                boneinfo &b = skel->bones[i];
+                f.putstring(b.name);
+                f.put(b.parent);
+                f.put(b.base);
+            }
+            f.put(blendcombos.length());
+            loopv(blendcombos)
+            {
+                blendcombo &c = blendcombos[i];
+                f.put(c.uses);
+                f.putarray(c.weights, 4);
+                f.putarray(c.bones, 4);
+            }
+            f.put(meshes.length());
+            loopv(meshes)
+            {
+                skelmesh &m = *(skelmesh *)meshes[i];
+                m.calctangents();
+                f.putstring(m.name);
+                f.putstring(m.cachetexname());
+                f.put(m.numverts);
+                f.put(m.numtris);
+                f.put(m.maxweights);
+                f.putarray(m.verts, m.numverts);
+                f.putarray(m.bumpverts, m.numverts);
+                f.putarray(m.tris, m.numtris);
+            }
+            if(f.save(cachename)) modelcachecounters.writes++;
+        }
+
+        /// Restore everything savemeshcache() stored.
+        /// Nothing gets modified unless the whole cache file could be read.
+        /// @param texnames receives the texture name of each mesh (or NULL)
+        bool loadmeshcache(const char *cachename, vector<char *> &texnames)
+        {
+            modelcachereader f;
+            if(!f.load(cachename)) { modelcachecounters.misses++; return false; }
+
+            int numbones = 0, numcombos = 0, nummeshes = 0;
+            f.get(numbones);
+            if(numbones < 0 || numbones > f.buf.remaining()) { modelcachecounters.misses++; return false; }
+            boneinfo *newbones = new boneinfo[max(numbones, 1)];
+            loopi(numbones)
+            {
+                boneinfo &b = newbones[i];
+                b.name = f.getstring();
+                f.get(b.parent);
+                f.get(b.base);
+            }
+            vector<blendcombo> combos;
+            f.get(numcombos);
+            loopi(numcombos)
+            {
+                if(!f.ok()) break;
+                blendcombo &c = combos.add();
+                f.get(c.uses);
+                f.get(c.weights, sizeof(c.weights));
+                f.get(c.bones, sizeof(c.bones));
+            }
+            vector<skelmesh *> newmeshes;
+            bool valid = f.get(nummeshes) && nummeshes > 0;
+            loopi(nummeshes)
+            {
+                if(!valid || !f.ok()) { valid = false; break; }
+                skelmesh *m = new skelmesh;
+                m->group = this;
+                newmeshes.add(m);
+                m->name = f.getstring();
+                texnames.add(f.getstring());
+                f.get(m->numverts);
+                f.get(m->numtris);
+                f.get(m->maxweights);
+                m->verts = f.getarray<vert>(m->numverts);
+                m->bumpverts = f.getarray<bumpvert>(m->numverts);
+                m->tris = f.getarray<tri>(m->numtris);
+                if(!m->verts || !m->bumpverts || !m->tris) { valid = false; break; }
+                loopj(m->numverts) if(!combos.inrange(m->verts[j].blend)) { valid = false; break; }
+                loopj(m->numtris) loopk(3) if(m->tris[j].vert[k] >= m->numverts) { valid = false; break; }
+            }
+            if(!valid || !f.ok() || (skel->numbones > 0 && numbones != skel->numbones))
+            {
+                delete[] newbones;
+                newmeshes.deletecontents();
+                texnames.deletearrays();
+                modelcachecounters.misses++;
+                return false;
+            }
+
+            if(skel->numbones <= 0 && numbones > 0)
+            {
+                skel->numbones = numbones;
+                skel->bones = new boneinfo[numbones];
+                loopi(numbones)
+                {
+                    skel->bones[i].name = newbones[i].name;
+                    newbones[i].name = NULL;
+                    skel->bones[i].parent = newbones[i].parent;
+                }
+            }
+            if(skel->shared <= 1) loopi(min(numbones, skel->numbones))
+            {
+                boneinfo &b = skel->bones[i];
+                b.base = newbones[i].base;
+                (b.invbase = b.base).invert();
+            }
+            if(skel->numbones > 0) skel->linkchildren();
+            delete[] newbones;
+
+            loopv(combos)
+            {
+                numblends[combos[i].size()-1]++;
+                blendcombo &c = blendcombos.add(combos[i]);
+                c.interpindex = blendcombos.length()-1;
+            }
+            loopv(newmeshes) meshes.add(newmeshes[i]);
+            modelcachecounters.hits++;
+            return true;
+        }
+
+        /// Store the frames of an animation loaded from the source file.
+        void saveanimcache(const char *cachename, skelanimspec *sa)
+        {
+            modelcachewriter f;
+            f.put(sa->range);
+            f.putarray(&skel->framebones[sa->frame*skel->numbones], sa->range*skel->numbones);
+            if(f.save(cachename)) modelcachecounters.writes++;
+        }
+
+        /// Append a cached animation to the skeleton, the same way the loaders do.
+        skelanimspec *loadanimcache(const char *cachename, const char *animname)
+        {
+            modelcachereader f;
+            int range = 0;
+            dualquat *frames = NULL;
+            if(!f.load(cachename) || !f.get(range) || range <= 0 || !(frames = f.getarray<dualquat>(range*skel->numbones)))
+            {
+                modelcachecounters.misses++;
+                return NULL;
+            }
+            dualquat *framebones = new dualquat[(skel->numframes+range)*skel->numbones];
+            if(skel->framebones)
+            {
+                memcpy(framebones, skel->framebones, skel->numframes*skel->numbones*sizeof(dualquat));
+                delete[] skel->framebones;
+            }
+            memcpy(&framebones[skel->numframes*skel->numbones], frames, range*skel->numbones*sizeof(dualquat));
+            delete[] frames;
+            skel->framebones = framebones;
+            skelanimspec *sa = &skel->addskelanim(animname);
+            sa->frame = skel->numframes;
+            sa->range = range;
+            skel->numframes += range;
+            modelcachecounters.hits++;
+            return sa;
+        }
+
         int remapblend(int blend)
         {
             const blendcombo &c = blendcombos[blend];
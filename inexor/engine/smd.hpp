@@ -247,6 +247,15 @@ struct smd : skelmodel, skelloader<smd>
 
         bool loadmesh(const char *filename)
         {
+            string cachename;
+            if(initmeshcache("smdmesh", filename, 0, cachename))
+            {
+                vector<char *> texnames;
+                bool cached = loadmeshcache(cachename, texnames);
+                texnames.deletearrays();
+                if(cached) return true;
+            }
+
             stream *f = openfile(filename, "r");
             if(!f) return false;
             
@@ -291,6 +300,7 @@ struct smd : skelmodel, skelloader<smd>
             sortblendcombos();
 
             delete f;
+            if(cachename[0]) savemeshcache(cachename);
             return true;
         }
 
@@ -351,6 +361,13 @@ struct smd : skelmodel, skelloader<smd>
             skelanimspec *sa = skel->findskelanim(filename);
             if(sa || skel->numbones <= 0) return sa;
 
+            string cachename;
+            if(initanimcache("smdanim", filename, adjustments.getbuf(), adjustments.length()*sizeof(skeladjustment), cachename))
+            {
+                sa = loadanimcache(cachename, filename);
+                if(sa) return sa;
+            }
+
             stream *f = openfile(filename, "r");
             if(!f) return NULL;
 
@@ -394,6 +411,7 @@ struct smd : skelmodel, skelloader<smd>
 
             delete f;
 
+            if(cachename[0] && numframes > 0) saveanimcache(cachename, sa);
             return sa;
         }
 
@@ -247,6 +247,80 @@ struct vertmodel : animmodel
 
         int totalframes() const { return numframes; }
 
+        /// Get the model cache file for the meshes of filename (see modelcache.hpp).
+        /// @return false if caching is disabled or the source file can't be read.
+        bool initmeshcache(const char *kind, const char *filename, float setting, string &cachename)
+        {
+            cachename[0] = '\0';
+            if(!modelcache) return false;
+            modelcachekey key;
+            if(!key.addfile(filename)) return false;
+            key.add(setting);
+            key.getpath(kind, cachename);
+            return true;
+        }
+
+        /// Store the processed meshes including their tangents.
+        void savemeshcache(const char *cachename)
+        {
+            modelcachewriter f;
+            f.put(numframes);
+            f.put(meshes.length());
+            loopv(meshes)
+            {
+                vertmesh &m = *(vertmesh *)meshes[i];
+                m.calctangents();
+                f.putstring(m.name);
+                f.put(m.numverts);
+                f.put(m.numtris);
+                f.putarray(m.verts, numframes*m.numverts);
+                f.putarray(m.tcverts, m.numverts);
+                f.putarray(m.bumpverts, numframes*m.numverts);
+                f.putarray(m.tris, m.numtris);
+            }
+            if(f.save(cachename)) modelcachecounters.writes++;
+        }
+
+        /// Restore everything savemeshcache() stored.
+        /// Nothing gets modified unless the whole cache file could be read.
+        bool loadmeshcache(const char *cachename)
+        {
+            modelcachereader f;
+            int frames = 0, nummeshes = 0;
+            if(!f.load(cachename) || !f.get(frames) || frames <= 0 || !f.get(nummeshes) || nummeshes <= 0)
+            {
+                modelcachecounters.misses++;
+                return false;
+            }
+            vector<vertmesh *> newmeshes;
+            bool valid = true;
+            loopi(nummeshes)
+            {
+                vertmesh *m = new vertmesh;
+                m->group = this;
+                newmeshes.add(m);
+                m->name = f.getstring();
+                f.get(m->numverts);
+                f.get(m->numtris);
+                m->verts = f.getarray<vert>(frames*m->numverts);
+                m->tcverts = f.getarray<tcvert>(m->numverts);
+                m->bumpverts = f.getarray<bumpvert>(frames*m->numverts);
+                m->tris = f.getarray<tri>(m->numtris);
+                if(!f.ok() || !m->verts || !m->tcverts || !m->bumpverts || !m->tris) { valid = false; break; }
+                loopj(m->numtris) loopk(3) if(m->tris[j].vert[k] >= m->numverts) { valid = false; break; }
+            }
+            if(!valid)
+            {
+                newmeshes.deletecontents();
+                modelcachecounters.misses++;
+                return false;
+            }
+            numframes = frames;
+            loopv(newmeshes) meshes.add(newmeshes[i]);
+            modelcachecounters.hits++;
+            return true;
+        }
+
         void concattagtransform(part *p, int i, const matrix4x3 &m, matrix4x3 &n)
         {
             n.mul(m, tags[numtags + i].transform);
@@ -1,8 +1,14 @@
 // worldio.cpp: loading & saving of maps and savegames
 
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "inexor/engine/engine.hpp"
 #include "inexor/filesystem/mediadirs.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
 
 using namespace inexor::sound;
 using namespace inexor::util;
@@ -56,6 +62,138 @@ static void fixent(entity &e, int version)
 }
 
 
+VAR(mapcache, 0, 1, 1);     // keep what loadents() read of a map in memory and homedir/cache/map/, so playing it again inflates nothing
+
+#define MAPCACHE_MAGIC "IMAPMETA"
+#define MAPCACHE_VERSION 2
+
+/// What loadents() got out of a map file, and the size and modification time of the file it got it from.
+struct mapmeta
+{
+    long long size, mtime;
+    uint crc;
+    int version, worldsize;
+    std::vector<entity> ents;
+};
+
+/// by the name of the file found on disk, shared by the instances of the dedicated server
+static std::map<std::string, mapmeta> mapmetas;
+static std::mutex mapmetamutex;    // guards mapmetas and the files in homedir/cache/map/
+enum { MAXMAPMETAS = 256 };
+
+/// Find the map file opengzfile() is going to read.
+/// @return false if it is not a plain file (it is in a zip), those don't get cached.
+static bool statmapfile(const char *ogzname, std::string &file, long long &size, long long &mtime)
+{
+#ifndef STANDALONE
+    if(findzipfile(ogzname)) return false; // openfile() prefers these over files on disk
+#endif
+    if(!statfile(ogzname, size, mtime)) return false;
+    file = findfile(ogzname, "rb");
+    return true;
+}
+
+static void getmapcachename(const std::string &file, string &cachename)
+{
+    formatstring(cachename, "cache/map/%08x.imm", uint(crc32(0, (const Bytef *)file.c_str(), file.size())));
+}
+
+static bool readmapmeta(const std::string &file, mapmeta &m)
+{
+    string cachename;
+    getmapcachename(file, cachename);
+    size_t len = 0;
+    char *data = loadfile(path(cachename, true), &len);
+    if(!data) return false;
+    ucharbuf p((uchar *)data, int(len));
+    char magic[8] = { 0 };
+    int version = 0, entsize = 0, namelen = 0, numents = 0;
+    uint payloadcrc = 0;
+    p.get((uchar *)magic, 8);
+    p.get((uchar *)&version, sizeof(int));
+    p.get((uchar *)&payloadcrc, sizeof(uint));
+    bool ok = !memcmp(magic, MAPCACHE_MAGIC, 8) && version == MAPCACHE_VERSION && payloadcrc == crc32(0, p.buf + p.len, p.remaining());
+    if(ok)
+    {
+        // written and read on the same machine, so no byte swapping
+        p.get((uchar *)&entsize, sizeof(int));
+        p.get((uchar *)&namelen, sizeof(int));
+        ok = entsize == int(sizeof(entity)) && namelen == int(file.size()) && namelen <= p.remaining() && !memcmp(p.buf + p.len, file.c_str(), namelen);
+    }
+    if(ok)
+    {
+        p.pad(namelen);
+        p.get((uchar *)&m.size, sizeof(m.size));
+        p.get((uchar *)&m.mtime, sizeof(m.mtime));
+        p.get((uchar *)&m.crc, sizeof(m.crc));
+        p.get((uchar *)&m.version, sizeof(m.version));
+        p.get((uchar *)&m.worldsize, sizeof(m.worldsize));
+        p.get((uchar *)&numents, sizeof(numents));
+        ok = numents >= 0 && numents <= MAXENTS && p.remaining() == numents*int(sizeof(entity));
+    }
+    if(ok)
+    {
+        m.ents.resize(numents);
+        p.get((uchar *)m.ents.data(), numents*sizeof(entity));
+    }
+    delete[] data;
+    return ok && !p.overread();
+}
+
+static void writemapmeta(const std::string &file, const mapmeta &m)
+{
+    vector<uchar> buf;
+    int entsize = sizeof(entity), namelen = file.size(), numents = m.ents.size();
+    buf.put((const uchar *)&entsize, sizeof(int));
+    buf.put((const uchar *)&namelen, sizeof(int));
+    buf.put((const uchar *)file.c_str(), namelen);
+    buf.put((const uchar *)&m.size, sizeof(m.size));
+    buf.put((const uchar *)&m.mtime, sizeof(m.mtime));
+    buf.put((const uchar *)&m.crc, sizeof(m.crc));
+    buf.put((const uchar *)&m.version, sizeof(m.version));
+    buf.put((const uchar *)&m.worldsize, sizeof(m.worldsize));
+    buf.put((const uchar *)&numents, sizeof(int));
+    buf.put((const uchar *)m.ents.data(), numents*sizeof(entity));
+
+    string cachename;
+    getmapcachename(file, cachename);
+    stream *f = openrawfile(path(cachename, true), "wb");
+    if(!f) return;
+    f->write(MAPCACHE_MAGIC, 8);
+    f->putlil<int>(MAPCACHE_VERSION);
+    f->putlil<uint>(crc32(0, buf.getbuf(), buf.length()));
+    f->write(buf.getbuf(), buf.length());
+    delete f;
+}
+
+/// @return what we know about a map file, as long as the file did not change since. Needs mapmetamutex.
+static const mapmeta *findmapmeta(const std::string &file, long long size, long long mtime)
+{
+    auto it = mapmetas.find(file);
+    if(it == mapmetas.end())
+    {
+        mapmeta m;
+        if(!readmapmeta(file, m)) return NULL;
+        if(mapmetas.size() >= MAXMAPMETAS) mapmetas.clear();
+        it = mapmetas.emplace(file, std::move(m)).first;
+    }
+    return it->second.size == size && it->second.mtime == mtime ? &it->second : NULL;
+}
+
+static void addmapmeta(const std::string &file, long long size, long long mtime, uint crc, const octaheader &hdr, const entity *ents, int numents)
+{
+    std::lock_guard<std::mutex> lock(mapmetamutex);
+    if(mapmetas.size() >= MAXMAPMETAS) mapmetas.clear();
+    mapmeta &m = mapmetas[file];
+    m.size = size;
+    m.mtime = mtime;
+    m.crc = crc;
+    m.version = hdr.version;
+    m.worldsize = hdr.worldsize;
+    m.ents.assign(ents, ents + numents);
+    writemapmeta(file, m);
+}
+
 /// load/parse entities from a file
 /// @param fname file name which conains compressed OGZ content (a map)
 /// @param ents a reference to a vector of entites in which parsed entities from this file will be copied
@@ -67,6 +205,23 @@ bool loadents(const char *fname, vector<entity> &ents, uint *crc)
     getmapfilename(fname, NULL, mapname);
     formatstring(ogzname, "%s/%s.ogz", *mapdir, mapname);
     path(ogzname);
+
+    std::string file;
+    long long size = 0, mtime = 0;
+    bool cache = mapcache && statmapfile(ogzname, file, size, mtime);
+    if(cache)
+    {
+        std::lock_guard<std::mutex> lock(mapmetamutex);
+        const mapmeta *m = findmapmeta(file, size, mtime);
+        if(m)
+        {
+            ents.put(m->ents.data(), int(m->ents.size()));
+            if(crc) *crc = m->crc;
+            return true;
+        }
+    }
+    int firstent = ents.length();
+
     stream *f = opengzfile(ogzname, "rb");
     if(!f) return false;
     octaheader hdr;
@@ -163,10 +318,12 @@ bool loadents(const char *fname, vector<entity> &ents, uint *crc)
     }
 
     /// calculate CRC32 hash sum from file stream
-    if(crc)
+    if(crc || cache)
     {
         f->seek(0, SEEK_END);
-        *crc = f->getcrc();
+        uint filecrc = f->getcrc();
+        if(crc) *crc = filecrc;
+        if(cache) addmapmeta(file, size, mtime, filecrc, hdr, ents.getbuf() + firstent, ents.length() - firstent);
     }
     
     delete f;
@@ -174,6 +331,42 @@ bool loadents(const char *fname, vector<entity> &ents, uint *crc)
     return true;
 }
 
+/// Times loading the entities of a map without the cache, from the cache on disk and from memory.
+void benchloadents(const char *name, int *n)
+{
+    int iterations = *n > 0 ? *n : 10;
+    int oldcache = mapcache;
+    vector<entity> ents;
+    uint crc = 0;
+    double ms[3];
+    loopk(3)
+    {
+        mapcache = k > 0;
+        if(k == 1) loadents(name, ents, &crc); // make sure it is cached
+        Stopwatch watch;
+        loopi(iterations)
+        {
+            if(k == 1)
+            {
+                std::lock_guard<std::mutex> lock(mapmetamutex);
+                mapmetas.clear();
+            }
+            ents.setsize(0);
+            if(!loadents(name, ents, &crc))
+            {
+                spdlog::get("global")->error("benchloadents: could not load map {0}", name);
+                mapcache = oldcache;
+                return;
+            }
+        }
+        ms[k] = watch.elapsed_ms() / iterations;
+    }
+    mapcache = oldcache;
+    spdlog::get("global")->info("benchloadents: {0} ({1} entities, crc {2:08x}): {3:.3f} ms inflating, {4:.3f} ms from the disk cache, {5:.3f} ms from memory",
+        name, ents.length(), crc, ms[0], ms[1], ms[2]);
+}
+COMMAND(benchloadents, "si");
+
 
 
 
@@ -1150,6 +1343,38 @@ void savemap(char *mname)
 }
 COMMAND(savemap, "s");
 
+/// Load a map while recording which files it looks for, then repeat these lookups with and without the file cache.
+void benchmapfiles(const char *mname, int *iterations)
+{
+    int n = max(*iterations, 1);
+    vector<char *> lookups;
+    clearfilecache();
+    filelookuplog = &lookups;
+    int loadsyscalls = filesyscalls;
+    inexor::util::Stopwatch sw;
+    bool loaded = load_world(mname);
+    double loadms = sw.elapsed_ms();
+    loadsyscalls = filesyscalls - loadsyscalls;
+    filelookuplog = NULL;
+    if(!loaded) { lookups.deletearrays(); return; }
+
+    double ms[2];
+    int syscalls[2], found = 0;
+    loopk(2)
+    {
+        syscalls[k] = filesyscalls;
+        sw.reset();
+        found = replayfilelookups(lookups, k != 0, n);
+        ms[k] = sw.elapsed_ms() / n;
+        syscalls[k] = (filesyscalls - syscalls[k]) / n;
+    }
+    spdlog::get("global")->info("benchmapfiles: loading {0} took {1:.1f} ms with {2} file system calls; its {3} lookups ({4} found): "
+        "uncached {5:.3f} ms and {6} file system calls, cached {7:.3f} ms and {8} file system calls",
+        mname, loadms, loadsyscalls, lookups.length(), found, ms[0], syscalls[0], ms[1], syscalls[1]);
+    lookups.deletearrays();
+}
+COMMAND(benchmapfiles, "si");
+
 /// CRC32 is a checksum (and error detection) algorithm to generate map checksums
 /// so servers can detect modified maps
 
@@ -0,0 +1,332 @@
+//NO INCLUDE GUARD
+// hitcheck.hpp (server side hit validation)
+// rewinds the targets of a shot to where the shooter saw them and checks that the shot could have hit them
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_HITCHECKSIMD
+#include <emmintrin.h>
+#endif
+
+/// The positions of a player over the last two seconds or so, with the gamemillis they arrived at.
+typedef inexor::util::TimedHistory<vec, 64> poshistory;
+
+/// Sizes of the capsule around a player, which is a box of 4.1 by 4.1 from 14 below to 1 above the eyes.
+enum { HITCAPSULEBELOW = 14, HITCAPSULEABOVE = 1, HITCAPSULEHEIGHT = HITCAPSULEBELOW + HITCAPSULEABOVE };
+static const float HITCAPSULERADIUS = 5.8f; // diagonal of the box
+
+VAR(hitcheckslack, 0, 4, 64);          // cubes added around a player for what the positions miss (movement between samples, prediction)
+VAR(hitcheckwindow, 0, 150, 2000);     // ms around the shooter's ping the target may have been anywhere in
+VAR(hitcheckorigin, 0, 32, 1024);      // cubes a shot may start away from the shooter (gun offset, movement), 0 disables the check
+
+/// The segment a shot went along, widening for guns firing several spread out rays.
+struct hitray
+{
+    vec from, dir;  ///< dir spans the whole segment
+    float spread;   ///< cubes the allowed distance grows to at the end of dir
+
+    hitray(int gun, const vec &from, const vec &to) : from(from), dir(vec(to).sub(from)), spread(0)
+    {
+        float len = dir.magnitude();
+        if(guns[gun].rays > 1)
+        {
+            // see offsetray(): rays start at [from] and spread around [to], until they hit the world or reach the range
+            spread = guns[gun].range * guns[gun].spread / 2048.0f;
+            if(len > 0) dir.mul(guns[gun].range / len);
+        }
+        else if(len > 0) dir.mul((len + hitcheckslack) / len);
+    }
+};
+
+/// Players at several points in time as vertical capsules, kept as arrays so four get checked at once.
+struct capsulebatch
+{
+    enum { MAXCAPSULES = 1024 };
+
+#ifdef _MSC_VER
+    __declspec(align(16)) float x[MAXCAPSULES], y[MAXCAPSULES], z[MAXCAPSULES], r[MAXCAPSULES];
+#else
+    float x[MAXCAPSULES] __attribute__((aligned(16))), y[MAXCAPSULES] __attribute__((aligned(16))),
+          z[MAXCAPSULES] __attribute__((aligned(16))), r[MAXCAPSULES] __attribute__((aligned(16)));
+#endif
+    int tag[MAXCAPSULES];
+    uchar hit[MAXCAPSULES];
+    int n;
+
+    capsulebatch() : n(0) {}
+
+    bool full() const { return n >= MAXCAPSULES; }
+
+    /// A player with its eyes at [o], z is where the axis starts.
+    void add(const vec &o, float radius, int t)
+    {
+        if(full()) return;
+        x[n] = o.x;
+        y[n] = o.y;
+        z[n] = o.z - HITCAPSULEBELOW;
+        r[n] = radius;
+        tag[n] = t;
+        n++;
+    }
+
+    /// Checks every capsule against [ray], setting hit[i].
+    ///
+    /// The closest points between the ray and a capsule's axis are the usual segment to segment ones (Ericson,
+    /// Real-Time Collision Detection 5.1.9), a lot simpler since the axis is always vertical and of the same length.
+    /// A widening ray may still reach a capsule it passes further away from elsewhere, so these also check the
+    /// points of the ray closest to a few more points along the axis.
+    void check(const hitray &ray, bool simd = true)
+    {
+        const float h = HITCAPSULEHEIGHT, e = h*h, a = ray.dir.squaredlen(), b = h*ray.dir.z, denom = a*e - b*b;
+        if(a <= 0) { memset(hit, 0, n); return; }
+        bool parallel = denom <= 1e-6f*a*e; // shooting straight up or down
+        // moving along a widening ray gains more width than distance, which for a single point
+        // comes down to comparing the distance shrunk by this
+        float shrink = max(1 - ray.spread*ray.spread/a, 0.01f);
+        static const float axispoints[] = { 0, 0.25f, 0.5f, 0.75f, 1 };
+        int numaxispoints = ray.spread > 0 ? int(sizeof(axispoints)/sizeof(axispoints[0])) : 0;
+        int i = 0;
+#ifdef HAVE_HITCHECKSIMD
+        if(simd)
+        {
+            const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1),
+                         fx = _mm_set1_ps(ray.from.x), fy = _mm_set1_ps(ray.from.y), fz = _mm_set1_ps(ray.from.z),
+                         dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z),
+                         vh = _mm_set1_ps(h), vb = _mm_set1_ps(b), inve = _mm_set1_ps(1/e), inva = _mm_set1_ps(1/a),
+                         invdenom = _mm_set1_ps(parallel ? 0 : 1/denom), ve = _mm_set1_ps(e), spread = _mm_set1_ps(ray.spread),
+                         vshrink = _mm_set1_ps(shrink);
+            #define CLAMP01(v) _mm_min_ps(_mm_max_ps(v, zero), one)
+            #define SELECT(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+            for(; i + 4 <= n; i += 4)
+            {
+                __m128 rx = _mm_sub_ps(fx, _mm_load_ps(&x[i])), ry = _mm_sub_ps(fy, _mm_load_ps(&y[i])), rz = _mm_sub_ps(fz, _mm_load_ps(&z[i])),
+                       r2 = _mm_load_ps(&r[i]);
+                __m128 f = _mm_mul_ps(vh, rz);
+                __m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, rx), _mm_mul_ps(dy, ry)), _mm_mul_ps(dz, rz));
+                __m128 s = CLAMP01(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(vb, f), _mm_mul_ps(c, ve)), invdenom));
+                __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(vb, s), f), inve);
+                __m128 below = _mm_cmplt_ps(t, zero), above = _mm_cmpgt_ps(t, one);
+                s = SELECT(below, CLAMP01(_mm_mul_ps(_mm_sub_ps(zero, c), inva)),
+                    SELECT(above, CLAMP01(_mm_mul_ps(_mm_sub_ps(vb, c), inva)), s));
+                t = CLAMP01(t);
+                __m128 inside = zero;
+                for(int k = -1; k < numaxispoints; k++)
+                {
+                    if(k >= 0)
+                    {
+                        t = _mm_set1_ps(axispoints[k]);
+                        s = CLAMP01(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(vb, t), c), inva));
+                    }
+                    __m128 px = _mm_add_ps(rx, _mm_mul_ps(dx, s)), py = _mm_add_ps(ry, _mm_mul_ps(dy, s)),
+                           pz = _mm_sub_ps(_mm_add_ps(rz, _mm_mul_ps(dz, s)), _mm_mul_ps(vh, t));
+                    __m128 dist2 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz)), vshrink);
+                    __m128 allowed = _mm_add_ps(r2, _mm_mul_ps(spread, s));
+                    inside = _mm_or_ps(inside, _mm_cmple_ps(dist2, _mm_mul_ps(allowed, allowed)));
+                }
+                int mask = _mm_movemask_ps(inside);
+                loopk(4) hit[i+k] = (mask>>k)&1;
+            }
+            #undef CLAMP01
+            #undef SELECT
+        }
+#endif
+        for(; i < n; i++)
+        {
+            float rx = ray.from.x - x[i], ry = ray.from.y - y[i], rz = ray.from.z - z[i];
+            float f = h*rz, c = ray.dir.x*rx + ray.dir.y*ry + ray.dir.z*rz;
+            float s = parallel ? 0 : clamp((b*f - c*e)/denom, 0.0f, 1.0f);
+            float t = (b*s + f)/e;
+            if(t < 0) { t = 0; s = clamp(-c/a, 0.0f, 1.0f); }
+            else if(t > 1) { t = 1; s = clamp((b - c)/a, 0.0f, 1.0f); }
+            hit[i] = 0;
+            for(int k = -1; k < numaxispoints && !hit[i]; k++)
+            {
+                if(k >= 0)
+                {
+                    t = axispoints[k];
+                    s = clamp((b*t - c)/a, 0.0f, 1.0f);
+                }
+                float px = rx + ray.dir.x*s, py = ry + ray.dir.y*s, pz = rz + ray.dir.z*s - h*t;
+                float allowed = r[i] + ray.spread*s;
+                hit[i] = (px*px + py*py + pz*pz)*shrink <= allowed*allowed;
+            }
+        }
+    }
+};
+
+enum { HIT_UNCHECKED = 0, HIT_POSSIBLE, HIT_IMPOSSIBLE };
+
+/// Checks a shot against the positions its targets had while the shooter saw them: from [ping] ms
+/// before [millis] (when the shot happened on the server's clock) on, give or take hitcheckwindow.
+///
+/// @param targets may contain NULL for hits that are not worth checking.
+/// @param verdicts gets one of the HIT_ values per target.
+/// @return false if the shot itself did not start anywhere near the shooter.
+static bool checkshot(const hitray &ray, const poshistory *shooter, const poshistory * const *targets, int numtargets,
+                      int millis, int ping, uchar *verdicts, capsulebatch &batch, bool simd = true)
+{
+    int from = millis - ping - hitcheckwindow, to = millis + hitcheckwindow;
+    if(hitcheckorigin && shooter && shooter->size())
+    {
+        bool near = false, any = false;
+        float maxdist2 = float(hitcheckorigin)*hitcheckorigin;
+        shooter->during(from, to, [&](const vec &o) { any = true; if(o.squaredist(ray.from) <= maxdist2) near = true; });
+        if(any && !near)
+        {
+            loopi(numtargets) verdicts[i] = targets[i] ? HIT_IMPOSSIBLE : HIT_UNCHECKED;
+            return false;
+        }
+    }
+
+    batch.n = 0;
+    float radius = HITCAPSULERADIUS + hitcheckslack;
+    loopi(numtargets) if(targets[i]) targets[i]->during(from, to, [&](const vec &o) { batch.add(o, radius, i); });
+    batch.check(ray, simd);
+
+    loopi(numtargets) verdicts[i] = HIT_UNCHECKED;
+    loopi(batch.n)
+    {
+        uchar &v = verdicts[batch.tag[i]];
+        if(batch.hit[i]) v = HIT_POSSIBLE;
+        else if(v == HIT_UNCHECKED) v = HIT_IMPOSSIBLE;
+    }
+    return true;
+}
+
+/// Checks [n] shotgun shots at 8 targets with 8 positions each, with and without SSE2.
+void benchhitcheck(int *n)
+{
+    int shots = *n > 0 ? *n : 100000;
+    static capsulebatch batch;
+    static const int TARGETS = 8, SAMPLES = 8;
+    vector<hitray> rays;
+    loopi(64)
+    {
+        vec from(rndscale(1024), rndscale(1024), rndscale(256)), to(rndscale(1024), rndscale(1024), rndscale(256));
+        rays.add(hitray(GUN_SG, from, to));
+    }
+    batch.n = 0;
+    loopi(TARGETS) loopj(SAMPLES) batch.add(vec(rndscale(1024), rndscale(1024), rndscale(256)), HITCAPSULERADIUS + hitcheckslack, i);
+
+    int hits[2] = { 0, 0 };
+    double us[2];
+    loopk(2)
+    {
+        inexor::util::Stopwatch watch;
+        loopi(shots)
+        {
+            batch.check(rays[i%rays.length()], k==1);
+            loopj(batch.n) hits[k] += batch.hit[j];
+        }
+        us[k] = watch.elapsed_us();
+    }
+    double rays_per_shot = guns[GUN_SG].rays;
+    spdlog::get("global")->info("benchhitcheck: {0} shots against {1} capsules each: scalar {2:.0f}, sse2 {3:.0f} validated rays/s{4}",
+        shots, batch.n, shots*rays_per_shot/(us[0]*1e-6), shots*rays_per_shot/(us[1]*1e-6), hits[0]!=hits[1] ? " (results differ!)" : "");
+#ifndef HAVE_HITCHECKSIMD
+    spdlog::get("global")->info("benchhitcheck: built without SSE2, both ran the scalar code");
+#endif
+}
+COMMAND(benchhitcheck, "i");
+
+/// Replays the hitscan shots of a demo against the positions recorded with it and reports the hits hitcheck would have found impossible.
+/// Demos only hold what the server sent, so a hit is damage done by a player at the same time as its last shot.
+void replayhits(const char *name)
+{
+    defformatstring(file, "%s%s", name, strstr(name, ".dmo") ? "" : ".dmo");
+    stream *f = opengzfile(file, "rb");
+    demoheader hdr;
+    if(!f || f->read(&hdr, sizeof(demoheader))!=sizeof(demoheader) || memcmp(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic)))
+    {
+        spdlog::get("global")->error("replayhits: could not read demo \"{0}\"", file);
+        delete f;
+        return;
+    }
+    lilswap(&hdr.version, 2);
+    if(hdr.version!=DEMO_VERSION || hdr.protocol!=PROTOCOL_VERSION)
+    {
+        spdlog::get("global")->error("replayhits: demo \"{0}\" is from another version of Inexor", file);
+        delete f;
+        return;
+    }
+
+    struct lastshot { int millis, gun; vec from, to; };
+    std::map<int, poshistory> histories;
+    std::map<int, int> pings, impossible;
+    std::map<int, lastshot> shots;
+    int counts[3] = { 0, 0, 0 };
+    static capsulebatch batch;
+    std::vector<uchar> data;
+    int stamp[3];
+    while(f->read(stamp, sizeof(stamp))==sizeof(stamp))
+    {
+        lilswap(stamp, 3);
+        int millis = stamp[0], chan = stamp[1], len = stamp[2];
+        if(len < 0 || len > (1<<24)) break;
+        data.resize(len);
+        if(f->read(data.data(), len)!=size_t(len)) break;
+        ucharbuf p(data.data(), len);
+        if(chan==0) while(p.remaining() && getint(p)==N_POS)
+        {
+            posrecord r;
+            decodeposition(p, r);
+            if(p.overread()) break;
+            histories[r.pcn].add(millis, r.pos);
+        }
+        else if(chan==1) while(p.remaining())
+        {
+            int type = getint(p);
+            if(type==N_CLIENT)
+            {
+                int cn = getint(p), len = getuint(p);
+                ucharbuf q = p.subbuf(len);
+                while(q.remaining())
+                {
+                    int t = getint(q), size = msgsizelookup(t);
+                    if(t==N_CLIENTPING) pings[cn] = getint(q);
+                    else if(size > 0) loopi(size-1) getint(q);
+                    else break;
+                }
+            }
+            else if(type==N_SHOTFX)
+            {
+                int cn = getint(p);
+                lastshot &s = shots[cn];
+                s.millis = millis;
+                s.gun = getint(p);
+                getint(p);
+                loopk(3) s.from[k] = getint(p)/DMF;
+                loopk(3) s.to[k] = getint(p)/DMF;
+            }
+            else if(type==N_DAMAGE)
+            {
+                int target = getint(p), actor = getint(p);
+                loopi(3) getint(p);
+                auto s = shots.find(actor);
+                if(target==actor || s==shots.end() || s->second.millis!=millis || s->second.gun<GUN_FIST || s->second.gun>GUN_PISTOL || guns[s->second.gun].projspeed) continue;
+                const poshistory *targets[1] = { &histories[target] };
+                uchar verdict;
+                checkshot(hitray(s->second.gun, s->second.from, s->second.to), &histories[actor], targets, 1, millis, pings[actor], &verdict, batch);
+                counts[verdict]++;
+                if(verdict==HIT_IMPOSSIBLE)
+                {
+                    impossible[actor]++;
+                    spdlog::get("global")->info("replayhits: {0}.{1:03d}s: {2} hit {3} with the {4}, but was nowhere near",
+                        millis/1000, millis%1000, actor, target, guns[s->second.gun].name);
+                }
+            }
+            else
+            {
+                int size = msgsizelookup(type);
+                if(size <= 0) break; // can't tell where the next message starts
+                loopi(size-1) getint(p);
+            }
+            if(p.overread()) break;
+        }
+    }
+    delete f;
+
+    spdlog::get("global")->info("replayhits: {0} hits, {1} possible, {2} impossible, {3} unchecked",
+        counts[0]+counts[1]+counts[2], counts[HIT_POSSIBLE], counts[HIT_IMPOSSIBLE], counts[HIT_UNCHECKED]);
+    for(auto &i : impossible) spdlog::get("global")->info("replayhits: client {0}: {1} impossible hits", i.first, i.second);
+}
+COMMAND(replayhits, "s");
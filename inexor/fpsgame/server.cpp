@@ -1,6 +1,13 @@
+#include <map>
+#include <vector>
+
 #include "inexor/fpsgame/game.hpp"
 #include "inexor/util/random.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Profiler.hpp"
+#include "inexor/util/Metrics.hpp"
+#include "inexor/util/Stopwatch.hpp"
+#include "inexor/util/TimedHistory.hpp"
 
 namespace game
 {
@@ -17,7 +24,7 @@ namespace game
     const char *gameident() { return "fps"; }
 }
 
-extern ENetAddress masteraddress;
+extern INSTANCE_LOCAL ENetAddress masteraddress;
 
 namespace server
 {
@@ -31,7 +38,7 @@ namespace server
     static const int DEATHMILLIS = 300;
 
     struct clientinfo;
-    int gamemode = 0;
+    INSTANCE_LOCAL int gamemode = 0;
 
     struct gameevent
     {
@@ -41,6 +48,9 @@ namespace server
         virtual void process(clientinfo *ci) {}
 
         virtual bool keepable() const { return false; }
+
+        /// Done with the event, gives it back to its pool (see eventpool).
+        virtual void release() = 0;
     };
 
     struct timedevent : gameevent
@@ -66,6 +76,7 @@ namespace server
         vector<hitinfo> hits;
 
         void process(clientinfo *ci);
+        void release();
     };
 
     struct explodeevent : timedevent
@@ -76,11 +87,13 @@ namespace server
         bool keepable() const { return true; }
 
         void process(clientinfo *ci);
+        void release();
     };
 
     struct suicideevent : gameevent
     {
         void process(clientinfo *ci);
+        void release();
     };
 
     struct pickupevent : gameevent
@@ -88,8 +101,51 @@ namespace server
         int ent;
 
         void process(clientinfo *ci);
+        void release();
+    };
+
+    static inexor::util::Counter &eventallocmetric = inexor::util::Metrics::counter("inexor_server_event_allocations_total",
+        "Game events that had to be allocated because their pool was empty");
+
+    /// Keeps released events of one type for reuse, so shots and pickups don't cost a malloc/free each.
+    /// Reused events keep the buffer of their hits vector as well.
+    template<class T> struct eventpool
+    {
+        enum { MAXUNUSED = 1024 };
+
+        vector<T *> unused;
+        int allocated;
+
+        eventpool() : allocated(0) {}
+        ~eventpool() { unused.deletecontents(); }
+
+        T *get()
+        {
+            if(unused.length()) return unused.pop();
+            allocated++;
+            eventallocmetric.add();
+            return new T;
+        }
+
+        void put(T *e)
+        {
+            if(unused.length() >= MAXUNUSED) delete e;
+            else unused.add(e);
+        }
     };
 
+    // One set of pools per server instance, like the rest of the game state in here (clients, gamemode, ..).
+    // They are not thread safe: events only get created and released by the thread of the instance.
+    static INSTANCE_LOCAL eventpool<shotevent> shotevents;
+    static INSTANCE_LOCAL eventpool<explodeevent> explodeevents;
+    static INSTANCE_LOCAL eventpool<suicideevent> suicideevents;
+    static INSTANCE_LOCAL eventpool<pickupevent> pickupevents;
+
+    void shotevent::release() { hits.setsize(0); shotevents.put(this); }
+    void explodeevent::release() { hits.setsize(0); explodeevents.put(this); }
+    void suicideevent::release() { suicideevents.put(this); }
+    void pickupevent::release() { pickupevents.put(this); }
+
     template <int N>
     struct projectilestate
     {
@@ -226,7 +282,38 @@ namespace server
         }
     };
 
-    extern int gamemillis, nextexceeded;
+    /// N_POS as read by decodepacket() or the hit checks replaying a demo, from the type at [offset] up to [end]
+    struct posrecord
+    {
+        int offset, end, pcn;
+        uint flags;
+        vec pos, vel;
+    };
+
+    static void decodeposition(ucharbuf &p, posrecord &r)
+    {
+        r.pcn = getuint(p);
+        p.get();
+        r.flags = getuint(p);
+        loopk(3)
+        {
+            int n = p.get(); n |= p.get()<<8; if(r.flags&(1<<k)) { n |= p.get()<<16; if(n&0x800000) n |= -1<<24; }
+            r.pos[k] = n/DMF;
+        }
+        loopk(3) p.get();
+        int mag = p.get(); if(r.flags&(1<<3)) mag |= p.get()<<8;
+        int dir = p.get(); dir |= p.get()<<8;
+        r.vel = vec((dir%360)*RAD, (clamp(dir/360, 0, 180)-90)*RAD).mul(mag/DVELF);
+        if(r.flags&(1<<4))
+        {
+            p.get(); if(r.flags&(1<<5)) p.get();
+            if(r.flags&(1<<6)) loopk(2) p.get();
+        }
+    }
+
+    #include "inexor/fpsgame/hitcheck.hpp"
+
+    extern INSTANCE_LOCAL int gamemillis, nextexceeded;
 
     struct clientinfo
     {
@@ -239,8 +326,11 @@ namespace server
         bool connected, local, timesync;
         int gameoffset, lastevent, pushed, exceeded;
         gamestate state;
-        vector<gameevent *> events;
+        enum { MAXEVENTS = 128 };
+        queue<gameevent *, MAXEVENTS> events;
         vector<uchar> position, messages;
+        poshistory history;
+        int lasthitchecklog, unloggedhits; // see checkhits()
         uchar *wsdata;
         int wslen;
         vector<clientinfo *> bots;
@@ -258,14 +348,19 @@ namespace server
         char *authkickreason;
 
         clientinfo() : getdemo(NULL), getmap(NULL), clipboard(NULL), authchallenge(NULL), authkickreason(NULL) { reset(); }
-        ~clientinfo() { events.deletecontents(); cleanclipboard(); cleanauth(); }
+        ~clientinfo() { clearevents(); cleanclipboard(); cleanauth(); }
 
         void addevent(gameevent *e)
         {
-            if(state.state==CS_SPECTATOR || events.length()>100) delete e;
+            if(state.state==CS_SPECTATOR || events.length()>100) e->release();
             else events.add(e);
         }
 
+        void clearevents()
+        {
+            while(events.length()) events.remove()->release();
+        }
+
         enum
         {
             PUSHMILLIS = 3000
@@ -311,7 +406,7 @@ namespace server
             mapvote[0] = 0;
             modevote = INT_MAX;
             state.reset();
-            events.deletecontents();
+            clearevents();
             overflow = 0;
             timesync = false;
             lastevent = 0;
@@ -321,12 +416,13 @@ namespace server
             mapcrc = 0;
             warned = false;
             gameclip = false;
+            history.reset();
         }
 
         void reassign()
         {
             state.reassign();
-            events.deletecontents();
+            clearevents();
             timesync = false;
             lastevent = 0;
         }
@@ -360,6 +456,8 @@ namespace server
             connectauth = 0;
             position.setsize(0);
             messages.setsize(0);
+            history.reset();
+            lasthitchecklog = unloggedhits = 0;
             ping = 0;
             aireinit = 0;
             needclipboard = 0;
@@ -406,18 +504,35 @@ namespace server
     #define MM_PUBSERV ((1<<MM_OPEN) | (1<<MM_VETO))
     #define MM_COOPSERV (MM_AUTOAPPROVE | MM_PUBSERV | (1<<MM_LOCKED))
 
-    bool notgotitems = true;        // true when map has changed and waiting for clients to send item
-    int gamemillis = 0, gamelimit = 0, nextexceeded = 0, gamespeed = 100;
-    bool gamepaused = false, teamspersisted = false, shouldstep = true;
+    INSTANCE_LOCAL bool notgotitems = true;        // true when map has changed and waiting for clients to send item
+    INSTANCE_LOCAL int gamemillis = 0, gamelimit = 0, nextexceeded = 0, gamespeed = 100;
+    static INSTANCE_LOCAL int advancedmillis = 0; // of the next curtime, already added to gamemillis by advancetime()
+    INSTANCE_LOCAL bool gamepaused = false, teamspersisted = false, shouldstep = true;
 
-    string smapname = "";
-    int interm = 0;
-    enet_uint32 lastsend = 0;
-    int mastermode = MM_OPEN, mastermask = MM_PRIVSERV;
-    stream *mapdata = NULL;
+    INSTANCE_LOCAL string smapname = "";
+    INSTANCE_LOCAL int interm = 0;
+    INSTANCE_LOCAL enet_uint32 lastsend = 0;
+    INSTANCE_LOCAL int mastermode = MM_OPEN;
+    int mastermask = MM_PRIVSERV; // set by publicserver, for every instance
+    INSTANCE_LOCAL stream *mapdata = NULL;
 
-    vector<uint> allowedips;
-    vector<ban> bannedips;
+    INSTANCE_LOCAL vector<uint> allowedips;
+    INSTANCE_LOCAL vector<ban> bannedips;
+    INSTANCE_LOCAL iptrie bannedipset; // the ips of bannedips, for allowconnect()
+
+    static inline ipmask banmask(uint ip)
+    {
+        ipmask m;
+        m.ip = ip;
+        m.mask = 0xFFffFFff;
+        return m;
+    }
+
+    void clearbannedips()
+    {
+        bannedips.shrink(0);
+        bannedipset.clear();
+    }
 
     void addban(uint ip, int expire)
     {
@@ -426,11 +541,13 @@ namespace server
         b.time = totalmillis;
         b.expire = totalmillis + expire;
         b.ip = ip;
-        loopv(bannedips) if(bannedips[i].expire - b.expire > 0) { bannedips.insert(i, b); return; }
-        bannedips.add(b);
+        int pos = bannedips.length();
+        loopv(bannedips) if(bannedips[i].expire - b.expire > 0) { pos = i; break; }
+        bannedips.insert(pos, b);
+        bannedipset.add(banmask(ip));
     }
 
-    vector<clientinfo *> connects, clients, bots;
+    INSTANCE_LOCAL vector<clientinfo *> connects, clients, bots;
 
     void kickclients(uint ip, clientinfo *actor = NULL, int priv = PRIV_NONE)
     {
@@ -470,7 +587,7 @@ namespace server
     };
     int maprotation::exclude = 0;
     vector<maprotation> maprotations;
-    int curmaprotation = 0;
+    INSTANCE_LOCAL int curmaprotation = 0;
 
     VAR(lockmaprotation, 0, 0, 2);
 
@@ -619,11 +736,11 @@ namespace server
         int len;
     };
 
-    vector<demofile> demos;
+    INSTANCE_LOCAL vector<demofile> demos;
 
-    bool demonextmatch = false;
-    stream *demotmp = NULL, *demorecord = NULL, *demoplayback = NULL;
-    int nextplayback = 0, demomillis = 0;
+    INSTANCE_LOCAL bool demonextmatch = false;
+    INSTANCE_LOCAL stream *demotmp = NULL, *demorecord = NULL, *demoplayback = NULL;
+    INSTANCE_LOCAL int nextplayback = 0, demomillis = 0;
 
     VAR(maxdemos, 0, 5, 25);
     VAR(maxdemosize, 0, 16, 31);
@@ -687,8 +804,8 @@ namespace server
         uint ip;
         int teamkills;
     };
-    vector<teamkillinfo> teamkills;
-    bool shouldcheckteamkills = false;
+    INSTANCE_LOCAL vector<teamkillinfo> teamkills;
+    INSTANCE_LOCAL bool shouldcheckteamkills = false;
 
     void addteamkill(clientinfo *actor, clientinfo *victim, int n)
     {
@@ -733,20 +850,23 @@ namespace server
         return bots.inrange(n) ? bots[n] : NULL;
     }
 
-    uint mcrc = 0;
-    vector<entity> ments;
-    vector<server_entity> sents;
-    vector<savedscore> scores;
+    INSTANCE_LOCAL uint mcrc = 0;
+    INSTANCE_LOCAL vector<entity> ments;
+    INSTANCE_LOCAL vector<server_entity> sents;
+    INSTANCE_LOCAL vector<savedscore> scores;
 
-    int msgsizelookup(int msg)
+    int msgsizelookup(int msg)  // also used by decodepacket() on worker threads, so the table is built once in a thread safe way
     {
-        static int sizetable[NUMMSG] = { -1 };
-        if(sizetable[0] < 0)
+        static const struct sizetable
         {
-            memset(sizetable, -1, sizeof(sizetable));
-            for(const int *p = msgsizes; *p >= 0; p += 2) sizetable[p[0]] = p[1];
-        }
-        return msg >= 0 && msg < NUMMSG ? sizetable[msg] : -1;
+            int sizes[NUMMSG];
+            sizetable()
+            {
+                memset(sizes, -1, sizeof(sizes));
+                for(const int *p = msgsizes; *p >= 0; p += 2) sizes[p[0]] = p[1];
+            }
+        } table;
+        return msg >= 0 && msg < NUMMSG ? table.sizes[msg] : -1;
     }
 
     const char *modename(int n, const char *unknown)
@@ -826,8 +946,8 @@ namespace server
     {
         if(!name) name = ci->name;
         if(name[0] && !duplicatename(ci, name) && ci->state.aitype == AI_NONE) return name;
-        static string cname[3];
-        static int cidx = 0;
+        static INSTANCE_LOCAL string cname[3];
+        static INSTANCE_LOCAL int cidx = 0;
         cidx = (cidx+1)%3;
         formatstring(cname[cidx], ci->state.aitype == AI_NONE ? "%s %s(%d)%s" : "%s %s[%d]%s", name, COL_MAGENTA, ci->clientnum, COL_WHITE);
         return cname[cidx];
@@ -873,13 +993,13 @@ namespace server
     #include "inexor/fpsgame/bomb.hpp"
     #include "inexor/fpsgame/hideandseek.hpp"
 
-    captureservmode capturemode;
-    ctfservmode ctfmode;
-    collectservmode collectmode;
-    bombservmode bombmode;
-    hideandseekservmode hideandseekmode;
+    INSTANCE_LOCAL captureservmode capturemode;
+    INSTANCE_LOCAL ctfservmode ctfmode;
+    INSTANCE_LOCAL collectservmode collectmode;
+    INSTANCE_LOCAL bombservmode bombmode;
+    INSTANCE_LOCAL hideandseekservmode hideandseekmode;
 
-    servmode *smode = NULL;
+    INSTANCE_LOCAL servmode *smode = NULL;
 
     bool canspawnitem(int type) {
     	if(m_bomb) return (type>=I_BOMBS && type<=I_BOMBDELAY);
@@ -939,7 +1059,7 @@ namespace server
         return true;
     }
 
-    static hashset<teaminfo> teaminfos;
+    static INSTANCE_LOCAL hashset<teaminfo> teaminfos;
 
     void clearteaminfo()
     {
@@ -1100,6 +1220,9 @@ namespace server
         adddemo();
     }
 
+    static inexor::util::Counter &demometric = inexor::util::Metrics::counter("inexor_server_demo_written_bytes_total",
+        "Bytes written to demo recordings (uncompressed)");
+
     void writedemo(int chan, void *data, int len)
     {
         if(!demorecord) return;
@@ -1107,6 +1230,7 @@ namespace server
         lilswap(stamp, 3);
         demorecord->write(stamp, sizeof(stamp));
         demorecord->write(data, len);
+        demometric.add(sizeof(stamp) + len);
         if(demorecord->rawtell() >= (maxdemosize<<20)) enddemorecord();
     }
 
@@ -1118,11 +1242,17 @@ namespace server
     int welcomepacket(packetbuf &p, clientinfo *ci);
     void sendwelcome(clientinfo *ci);
 
+    /// Name for a temporary file of this server instance, on Windows the instances would share it otherwise.
+    static const char *instancetempname(const char *name)
+    {
+        return getserverinstance() ? tempformatstring("%s%d", name, getserverinstance()) : name;
+    }
+
     void setupdemorecord()
     {
         if(!m_mp(gamemode) || m_edit) return;
 
-        demotmp = opentempfile("demorecord", "w+b");
+        demotmp = opentempfile(instancetempname("demorecord"), "w+b");
         if(!demotmp) return;
 
         stream *f = opengzfile(NULL, "wb", demotmp);
@@ -1194,7 +1324,7 @@ namespace server
         if(!demos.inrange(num-1)) return;
         demofile &d = demos[num-1];
         if((ci->getdemo = sendf(ci->clientnum, 2, "rim", N_SENDDEMO, d.len, d.data)))
-            ci->getdemo->freeCallback = freegetdemo;
+            setfreecallback(ci->getdemo, freegetdemo);
     }
 
     void enddemoplayback()
@@ -1526,7 +1656,7 @@ namespace server
                 {
                     oi->state.timeplayed += lastmillis - oi->state.lasttimeplayed;
                     oi->state.lasttimeplayed = lastmillis;
-                    static savedscore curscore;
+                    static INSTANCE_LOCAL savedscore curscore;
                     curscore.save(oi->state);
                     return &curscore;
                 }
@@ -1620,8 +1750,8 @@ namespace server
         void cleanup() { DELETEA(data); len = 0; }
         bool contains(const uchar *p) const { return p >= data && p < &data[len]; }
     };
-    vector<worldstate> worldstates;
-    bool reliablemessages = false;
+    INSTANCE_LOCAL vector<worldstate> worldstates;
+    INSTANCE_LOCAL bool reliablemessages = false;
 
     void cleanworldstate(ENetPacket *packet)
     {
@@ -1719,8 +1849,12 @@ namespace server
         else ci.wslen += len;
     }
 
+    static inexor::util::Histogram &worldstatemetric = inexor::util::Metrics::histogram("inexor_server_worldstate_bytes",
+        "Size of the positions and messages gathered by one buildworldstate()");
+
     bool buildworldstate()
     {
+        PROFILE_SCOPE("buildworldstate");
         int wsmax = 0;
         loopv(clients)
         {
@@ -1756,6 +1890,7 @@ namespace server
             loopvj(ci.bots) addmessages(ws, wsbuf, mtu, *ci.bots[j], ci);
         }
         sendmessages(ws, wsbuf);
+        worldstatemetric.record(wsbuf.length());
         reliablemessages = false;
         if(ws.uses) return true;
         ws.cleanup();
@@ -1766,10 +1901,10 @@ namespace server
     bool sendpackets(bool force)
     {
         if(clients.empty() || (!hasnonlocalclients() && !demorecord)) return false;
-        enet_uint32 curtime = enet_time_get()-lastsend;
-        if(curtime<33 && !force) return false;
+        enet_uint32 curtime = enet_time_get()-lastsend, interval = 1000/getservertickrate();
+        if(curtime<interval && !force) return false;
         bool flush = buildworldstate();
-        lastsend += curtime - (curtime%33);
+        lastsend += curtime - (curtime%interval);
         return flush;
     }
 
@@ -2030,7 +2165,7 @@ namespace server
         aiman::clearai();
 
         gamemode = mode;
-        gamemillis = 0;
+        gamemillis = advancedmillis = 0;
         gamelimit = (m_overtime ? 15 : 10)*60000;
         interm = 0;
         nextexceeded = 0;
@@ -2403,6 +2538,65 @@ namespace server
         }
     }
 
+    VAR(hitcheck, 0, 1, 2);                // check reported hits against where the targets were: 0 off, 1 count and log impossible ones, 2 also drop them
+    VAR(hitcheckbudget, 0, 2000, 1000000); // us per tick for the checks, hits beyond that go through unchecked, 0 for no limit
+    VAR(hitchecklog, 0, 10000, 3600000);   // ms between two impossible hits of a client getting logged, the ones in between are only counted
+
+    static inexor::util::Counter &hitscheckedmetric = inexor::util::Metrics::counter("inexor_server_hits_checked_total",
+        "Reported hits checked against the positions of their targets");
+    static inexor::util::Counter &hitsimpossiblemetric = inexor::util::Metrics::counter("inexor_server_hits_impossible_total",
+        "Reported hits that could not have happened");
+    static inexor::util::Counter &hitsuncheckedmetric = inexor::util::Metrics::counter("inexor_server_hits_unchecked_total",
+        "Reported hits left unchecked, for lack of positions or time");
+    static INSTANCE_LOCAL double hitcheckused = 0; // us spent this tick
+
+    /// Drops (or just reports, see hitcheck) the hits of a shot which were nowhere near the targets the shooter saw.
+    static void checkhits(clientinfo *ci, shotevent &shot)
+    {
+        if(!hitcheck || ci->local || shot.hits.empty()) return;
+        if(hitcheckbudget && hitcheckused >= hitcheckbudget) { hitsuncheckedmetric.add(shot.hits.length()); return; }
+        int n = min(shot.hits.length(), int(MAXCLIENTS));
+        hitsuncheckedmetric.add(shot.hits.length() - n);
+        inexor::util::Stopwatch watch;
+
+        static INSTANCE_LOCAL capsulebatch batch;
+        const poshistory *targets[MAXCLIENTS];
+        uchar verdicts[MAXCLIENTS];
+        loopi(n)
+        {
+            clientinfo *target = getinfo(shot.hits[i].target);
+            targets[i] = target && target->state.state==CS_ALIVE ? &target->history : NULL;
+        }
+        // how far to rewind: the ping the client reports, but no more than enet measured, since it is up to the client what it reports
+        clientinfo *owner = getinfo(ci->ownernum);
+        ENetPeer *peer = getclientpeer(ci->ownernum);
+        int ping = owner && peer ? clamp(owner->ping, 0, int(peer->roundTripTime + peer->roundTripTimeVariance)) : 0;
+        checkshot(hitray(shot.gun, shot.from, shot.to), &ci->history, targets, n, shot.millis, ping, verdicts, batch);
+
+        for(int i = n-1; i >= 0; i--) switch(verdicts[i])
+        {
+            case HIT_UNCHECKED: hitsuncheckedmetric.add(); break;
+            case HIT_POSSIBLE: hitscheckedmetric.add(); break;
+            case HIT_IMPOSSIBLE:
+            {
+                hitscheckedmetric.add();
+                hitsimpossiblemetric.add();
+                if(ci->lasthitchecklog && totalmillis - ci->lasthitchecklog < hitchecklog) ci->unloggedhits++;
+                else
+                {
+                    clientinfo *target = getinfo(shot.hits[i].target);
+                    spdlog::get("global")->info("hitcheck: {0} ({1}) hit {2} with the {3}, but was nowhere near{4} ({5} more impossible hits since the last report)",
+                        ci->name, ci->clientnum, target ? target->name : "?", guns[shot.gun].name, hitcheck >= 2 ? ", dropped" : "", ci->unloggedhits);
+                    ci->lasthitchecklog = max(totalmillis, 1);
+                    ci->unloggedhits = 0;
+                }
+                if(hitcheck >= 2) shot.hits.remove(i);
+                break;
+            }
+        }
+        hitcheckused += watch.elapsed_us();
+    }
+
     void shotevent::process(clientinfo *ci)
     {
         gamestate &gs = ci->state;
@@ -2428,6 +2622,7 @@ namespace server
             case GUN_BOMB: gs.bombs.add(id); break;
             default:
             {
+                checkhits(ci, *this);
                 int totalrays = 0, maxrays = guns[gun].rays;
                 loopv(hits)
                 {
@@ -2472,7 +2667,7 @@ namespace server
 
     void clearevent(clientinfo *ci)
     {
-        delete ci->events.remove(0);
+        ci->events.remove()->release();
     }
 
     void flushevents(clientinfo *ci, int millis)
@@ -2485,11 +2680,15 @@ namespace server
         }
     }
 
+    static inexor::util::Histogram &eventsmetric = inexor::util::Metrics::histogram("inexor_server_event_queue_length",
+        "Queued events (shots, explosions, ..) of a client when processing them");
+
     void processevents()
     {
         loopv(clients)
         {
             clientinfo *ci = clients[i];
+            eventsmetric.record(ci->events.length());
             if(curtime>0 && ci->state.quadmillis) ci->state.quadmillis = max(ci->state.quadmillis-curtime, 0);
             flushevents(ci, gamemillis);
         }
@@ -2497,30 +2696,81 @@ namespace server
 
     void cleartimedevents(clientinfo *ci)
     {
-        int keep = 0;
-        loopv(ci->events)
+        // rotate through the queue once, only the keepable events get added back
+        int n = ci->events.length();
+        loopi(n)
         {
-            if(ci->events[i]->keepable())
+            gameevent *e = ci->events.remove();
+            if(e->keepable()) ci->events.add(e);
+            else e->release();
+        }
+        ci->timesync = false;
+    }
+
+    /// Compares the event pools with allocating every event (and its hits) on the heap.
+    /// Simulates a busy match: per client and tick a shotgun shot, a chaingun shot, an explosion and a pickup.
+    void benchevents(int *numclients, int *ticks)
+    {
+        int nc = clamp(*numclients > 0 ? *numclients : 24, 1, MAXCLIENTS), nt = *ticks > 0 ? *ticks : 10000;
+        loopk(2)
+        {
+            bool pooled = k==1;
+            queue<gameevent *, clientinfo::MAXEVENTS> events;
+            int allocations = 0, numevents = 0;
+            int allocbefore = shotevents.allocated + explodeevents.allocated + pickupevents.allocated;
+            inexor::util::Stopwatch sw;
+            loopi(nt)
             {
-                if(keep < i)
+                loopj(nc)
                 {
-                    for(int j = keep; j < i; j++) delete ci->events[j];
-                    ci->events.remove(keep, i - keep);
-                    i = keep;
+                    loopl(2)
+                    {
+                        shotevent *shot = pooled ? shotevents.get() : new shotevent;
+                        int alen = shot->hits.capacity();
+                        loop(m, l ? 1 : 6) shot->hits.add().target = m;
+                        if(shot->hits.capacity() != alen) allocations++;
+                        events.add(shot);
+                    }
+                    explodeevent *exp = pooled ? explodeevents.get() : new explodeevent;
+                    int alen = exp->hits.capacity();
+                    loopl(3) exp->hits.add().target = l;
+                    if(exp->hits.capacity() != alen) allocations++;
+                    events.add(exp);
+                    events.add(pooled ? (gameevent *)pickupevents.get() : new pickupevent);
+                    if(!pooled) allocations += 4;
+                    while(events.length())
+                    {
+                        gameevent *e = events.remove();
+                        if(pooled) e->release();
+                        else delete e;
+                        numevents++;
+                    }
                 }
-                keep = i+1;
-                continue;
             }
+            double ms = sw.elapsed_ms();
+            if(pooled) allocations += shotevents.allocated + explodeevents.allocated + pickupevents.allocated - allocbefore;
+            spdlog::get("global")->info("benchevents {0}: {1} events in {2:.2f} ms, {3:.1f} M events/s, {4:.2f} allocations per tick",
+                pooled ? "pooled" : "heap", numevents, ms, numevents/max(ms, 1e-3)/1000, double(allocations)/nt);
         }
-        while(ci->events.length() > keep) delete ci->events.pop();
-        ci->timesync = false;
+    }
+    COMMAND(benchevents, "ii");
+
+    void advancetime(int millis)
+    {
+        if(!shouldstep || gamepaused) return;
+        gamemillis += millis;
+        advancedmillis += millis;
     }
 
     void serverupdate()
     {
+        PROFILE_SCOPE("serverupdate");
+        hitcheckused = 0;
+        int advanced = advancedmillis;
+        advancedmillis = 0;
         if(shouldstep && !gamepaused)
         {
-            gamemillis += curtime;
+            gamemillis += max(curtime - advanced, 0);
 
             if(m_demo) readdemo();
             else if(!m_timed || gamemillis < gamelimit)
@@ -2550,7 +2800,7 @@ namespace server
         }
         else if(smode) smode->updatelimbo();
 
-        while(bannedips.length() && bannedips[0].expire-totalmillis <= 0) bannedips.remove(0);
+        while(bannedips.length() && bannedips[0].expire-totalmillis <= 0) bannedipset.remove(banmask(bannedips.remove(0).ip));
         loopv(connects) if(totalmillis-connects[i]->connectmillis>15000) disconnect_client(connects[i]->clientnum, DISC_TIMEOUT);
 
         if(nextexceeded && gamemillis > nextexceeded && (!m_timed || gamemillis < gamelimit))
@@ -2692,7 +2942,7 @@ namespace server
 
     void noclients()
     {
-        bannedips.shrink(0);
+        clearbannedips();
         aiman::clearai();
     }
 
@@ -2749,17 +2999,16 @@ namespace server
 
     int reserveclients() { return 3; }
 
-    vector<ipmask> gbans;
+    INSTANCE_LOCAL iptrie gbans;
 
     void cleargbans()
     {
-        gbans.shrink(0);
+        gbans.clear();
     }
 
     bool checkgban(uint ip)
     {
-        loopv(gbans) if(gbans[i].check(ip)) return true;
-        return false;
+        return gbans.check(ip);
     }
 
     void addgban(const char *name)
@@ -2768,13 +3017,52 @@ namespace server
         ban.parse(name);
         gbans.add(ban);
 
+        // everybody connected passed the previous bans already
         loopvrev(clients)
         {
             clientinfo *ci = clients[i];
             if(ci->state.aitype != AI_NONE || ci->local || ci->privilege >= PRIV_ADMIN) continue;
-            if(checkgban(getclientip(ci->clientnum))) disconnect_client(ci->clientnum, DISC_IPBAN);
+            if(ban.check(getclientip(ci->clientnum))) disconnect_client(ci->clientnum, DISC_IPBAN);
+        }
+    }
+
+    /// Compares iptrie lookups with checking every mask, for n random masks of 8 to 32 bits.
+    void benchbans(int *n)
+    {
+        int nummasks = *n > 0 ? *n : 100000, numlookups = 1000000;
+        vector<ipmask> masks;
+        loopi(nummasks)
+        {
+            ipmask &m = masks.add();
+            int len = 8 + rnd(25);
+            m.mask = ENET_HOST_TO_NET_32(0xFFffFFff << (32 - len));
+            m.ip = ENET_HOST_TO_NET_32(uint(rnd(0x10000))<<16 | uint(rnd(0x10000))) & m.mask;
         }
+        vector<uint> hosts;
+        loopi(numlookups) hosts.add(ENET_HOST_TO_NET_32(uint(rnd(0x10000))<<16 | uint(rnd(0x10000))));
+
+        inexor::util::Stopwatch sw;
+        iptrie trie;
+        trie.build(masks);
+        double buildms = sw.elapsed_ms();
+        sw.reset();
+        int found = 0;
+        loopv(hosts) if(trie.check(hosts[i])) found++;
+        double triems = sw.elapsed_ms();
+
+        // the linear scan is way slower, extrapolate from fewer lookups
+        int linearlookups = max(1, numlookups / max(1, nummasks / 100)), linearfound = 0;
+        sw.reset();
+        loopi(linearlookups) loopvj(masks) if(masks[j].check(hosts[i])) { linearfound++; break; }
+        double linearms = sw.elapsed_ms() * numlookups / linearlookups;
+        loopi(linearlookups) if(trie.check(hosts[i])) linearfound--;
+        if(linearfound) spdlog::get("global")->error("benchbans: trie and linear scan disagree");
+
+        spdlog::get("global")->info("benchbans: {0} masks, {1} trie nodes, built in {2:.2f} ms", nummasks, int(trie.trie.node_count()), buildms);
+        spdlog::get("global")->info("benchbans: {0} lookups ({1} banned): trie {2:.2f} ms, linear scan ~{3:.0f} ms",
+            numlookups, found, triems, linearms);
     }
+    COMMAND(benchbans, "i");
        
     int allowconnect(clientinfo *ci, const char *pwd = "")
     {
@@ -2788,7 +3076,7 @@ namespace server
         if(adminpass[0] && checkpassword(ci, adminpass, pwd)) return DISC_NONE;
         if(numclients(-1, false, true)>=maxclients) return DISC_MAXCLIENTS;
         uint ip = getclientip(ci->clientnum);
-        loopv(bannedips) if(bannedips[i].ip==ip) return DISC_IPBAN;
+        if(bannedipset.check(ip)) return DISC_IPBAN;
         if(checkgban(ip)) return DISC_IPBAN;
         if(mastermode>=MM_PRIVATE && allowedips.find(ip)<0) return DISC_PRIVATE;
         return DISC_NONE;
@@ -2841,7 +3129,7 @@ namespace server
         sendf(ci->clientnum, 1, "risis", N_AUTHCHAL, desc, id, val);
     }
 
-    uint nextauthreq = 0;
+    INSTANCE_LOCAL uint nextauthreq = 0;
 
     bool tryauth(clientinfo *ci, const char *user, const char *desc)
     {
@@ -2944,7 +3232,7 @@ namespace server
         clientinfo *ci = getinfo(sender);
         if(ci->state.state==CS_SPECTATOR && !ci->privilege && !ci->local) return;
         if(mapdata) DELETEP(mapdata);
-        mapdata = opentempfile("mapdata", "w+b");
+        mapdata = opentempfile(instancetempname("mapdata"), "w+b");
         if(!mapdata) { sendf(sender, 1, "ris", N_SERVMSG, "failed to open temporary file for map"); return; }
         mapdata->write(data, len);
         sendservmsgf("[%s sent a map to server, \"/getmap\" to receive it]", colorname(ci));
@@ -2996,7 +3284,130 @@ namespace server
         if(servermotd[0]) sendf(ci->clientnum, 1, "ris", N_SERVMSG, *servermotd);
     }
 
-    void parsepacket(int sender, int chan, packetbuf &p)     // has to parse exactly each byte of the packet
+    /// N_SHOOT or N_EXPLODE as read by decodepacket(), its hits are [numhits] entries of decodedpacket::hits from [firsthit] on
+    struct shotrecord
+    {
+        int offset, end, millis, gun, id, firsthit, numhits;
+        vec from, to;
+    };
+
+    static void decodehits(ucharbuf &p, vector<hitinfo> &hits)
+    {
+        int n = getint(p);
+        loopk(n)
+        {
+            if(p.overread()) break;
+            hitinfo &hit = hits.add();
+            hit.target = getint(p);
+            hit.lifesequence = getint(p);
+            hit.dist = getint(p)/DMF;
+            hit.rays = getint(p);
+            loopk(3) hit.dir[k] = getint(p)/DNF;
+        }
+    }
+
+    /// What the workers decoded of a packet: positions and shots, since they are what clients send most.
+    struct decodedpacket
+    {
+        vector<posrecord> positions;
+        vector<shotrecord> shots;
+        vector<hitinfo> hits;
+    };
+    /// One decodedpacket per packet of a batch, see beginpacketbatch().
+    struct packetbatch
+    {
+        // std::vector, since the engine vector moves its elements with memcpy and these own buffers
+        std::vector<decodedpacket> packets;
+    };
+    static INSTANCE_LOCAL packetbatch decoded;
+
+    /// The record decoded for the message at offset, records are sorted by offset and next only moves forward.
+    template<class T> static const T *decodedat(const vector<T> *records, int &next, int offset)
+    {
+        if(!records) return NULL;
+        while(next < records->length() && (*records)[next].offset < offset) next++;
+        return next < records->length() && (*records)[next].offset == offset ? &(*records)[next++] : NULL;
+    }
+
+    packetbatch *beginpacketbatch(int n)
+    {
+        if(int(decoded.packets.size()) < n) decoded.packets.resize(n);
+        loopi(n)
+        {
+            decoded.packets[i].positions.setsize(0);
+            decoded.packets[i].shots.setsize(0);
+            decoded.packets[i].hits.setsize(0);
+        }
+        return &decoded;
+    }
+
+    void decodepacket(packetbatch *batch, int slot, int chan, ENetPacket *packet)
+    {
+        if(chan > 1 || packet->flags&ENET_PACKET_FLAG_UNSEQUENCED) return;
+        decodedpacket &d = batch->packets[slot];
+        ucharbuf p(packet->data, packet->dataLength);
+        // a record only depends on the bytes from its offset on, so even if this walk went astray,
+        // parsepacket() could only ever pick up a record for a message it would have decoded the same way
+        while(p.remaining())
+        {
+            int offset = p.length(), type = getint(p);
+            switch(type)
+            {
+                case N_POS:
+                {
+                    posrecord r;
+                    r.offset = offset;
+                    decodeposition(p, r);
+                    if(p.overread()) return;
+                    r.end = p.length();
+                    d.positions.add(r);
+                    continue;
+                }
+
+                case N_SHOOT:
+                case N_EXPLODE:
+                {
+                    shotrecord r;
+                    r.offset = offset;
+                    if(type == N_SHOOT)
+                    {
+                        r.millis = r.id = getint(p);
+                        r.gun = getint(p);
+                        loopk(3) r.from[k] = getint(p)/DMF;
+                        loopk(3) r.to[k] = getint(p)/DMF;
+                    }
+                    else
+                    {
+                        r.millis = getint(p);
+                        r.gun = getint(p);
+                        r.id = getint(p);
+                    }
+                    r.firsthit = d.hits.length();
+                    decodehits(p, d.hits);
+                    if(p.overread()) return;
+                    r.numhits = d.hits.length() - r.firsthit;
+                    r.end = p.length();
+                    d.shots.add(r);
+                    continue;
+                }
+
+                case N_TEXT:
+                case N_SAYTEAM:
+                {
+                    char text[MAXTRANS];
+                    getstring(text, p);
+                    if(p.overread()) return;
+                    continue;
+                }
+            }
+            int size = type == N_EDITT || type == N_REPLACE || type == N_EDITVSLOT ? -1 : msgsizelookup(type);
+            if(size <= 0) return; // no idea how long the rest is without looking at the game state
+            loopi(size-1) getint(p);
+            if(p.overread()) return;
+        }
+    }
+
+    void parsepacket(int sender, int chan, packetbuf &p, int slot)     // has to parse exactly each byte of the packet
     {
         if(sender<0 || p.packet->flags&ENET_PACKET_FLAG_UNSEQUENCED || chan > 2) return;
         char text[MAXTRANS];
@@ -3078,31 +3489,26 @@ namespace server
         #define QUEUE_INT(n) QUEUE_BUF(putint(cm->messages, n))
         #define QUEUE_UINT(n) QUEUE_BUF(putuint(cm->messages, n))
         #define QUEUE_STR(text) QUEUE_BUF(sendstring(text, cm->messages))
+        const decodedpacket *d = slot >= 0 ? &decoded.packets[slot] : NULL;
+        int nextpos = 0, nextshot = 0;
         int curmsg;
         while((curmsg = p.length()) < p.maxlen) switch(type = checktype(getint(p), ci))
         {
             case N_POS:
             {
-                int pcn = getuint(p); 
-                p.get(); 
-                uint flags = getuint(p);
-                clientinfo *cp = getinfo(pcn);
-                if(cp && pcn != sender && cp->ownernum != sender) cp = NULL;
-                vec pos;
-                loopk(3)
+                posrecord r;
+                const posrecord *dr = decodedat(d ? &d->positions : NULL, nextpos, curmsg);
+                if(dr)
                 {
-                    int n = p.get(); n |= p.get()<<8; if(flags&(1<<k)) { n |= p.get()<<16; if(n&0x800000) n |= -1<<24; }
-                    pos[k] = n/DMF;
-                }
-                loopk(3) p.get();
-                int mag = p.get(); if(flags&(1<<3)) mag |= p.get()<<8;
-                int dir = p.get(); dir |= p.get()<<8;
-                vec vel = vec((dir%360)*RAD, (clamp(dir/360, 0, 180)-90)*RAD).mul(mag/DVELF);
-                if(flags&(1<<4))
-                {
-                    p.get(); if(flags&(1<<5)) p.get();
-                    if(flags&(1<<6)) loopk(2) p.get();
+                    r = *dr;
+                    p.len = r.end;
                 }
+                else decodeposition(p, r);
+                int pcn = r.pcn;
+                uint flags = r.flags;
+                const vec &pos = r.pos, &vel = r.vel;
+                clientinfo *cp = getinfo(pcn);
+                if(cp && pcn != sender && cp->ownernum != sender) cp = NULL;
                 if(cp)
                 {
                     if((!ci->local || demorecord || hasnonlocalclients()) && (cp->state.state==CS_ALIVE || cp->state.state==CS_EDITING))
@@ -3114,6 +3520,7 @@ namespace server
                     }
                     if(smode && cp->state.state==CS_ALIVE) smode->moved(cp, cp->state.o, cp->gameclip, pos, (flags&0x80)!=0);
                     cp->state.o = pos;
+                    cp->history.add(gamemillis, pos);
                     cp->gameclip = (flags&0x80)!=0;
                 }
                 break;
@@ -3172,7 +3579,7 @@ namespace server
                 {
                     ci->state.editstate = ci->state.state;
                     ci->state.state = CS_EDITING;
-                    ci->events.setsize(0);
+                    ci->clearevents();
                     ci->state.rockets.reset();
                     ci->state.grenades.reset();
                     ci->state.bombs.reset();
@@ -3268,58 +3675,64 @@ namespace server
 
             case N_SUICIDE:
             {
-                if(cq) cq->addevent(new suicideevent);
+                if(cq) cq->addevent(suicideevents.get());
                 break;
             }
 
             case N_SHOOT:
             {
-                shotevent *shot = new shotevent;
-                shot->id = getint(p);
-                shot->millis = cq ? cq->geteventmillis(gamemillis, shot->id) : 0;
-                shot->gun = getint(p);
-                loopk(3) shot->from[k] = getint(p)/DMF;
-                loopk(3) shot->to[k] = getint(p)/DMF;
-                int hits = getint(p);
-                loopk(hits)
+                shotevent *shot = shotevents.get();
+                const shotrecord *dr = decodedat(d ? &d->shots : NULL, nextshot, curmsg);
+                if(dr)
+                {
+                    shot->id = dr->id;
+                    shot->gun = dr->gun;
+                    shot->from = dr->from;
+                    shot->to = dr->to;
+                    shot->hits.put(d->hits.getbuf() + dr->firsthit, dr->numhits);
+                    p.len = dr->end;
+                }
+                else
                 {
-                    if(p.overread()) break;
-                    hitinfo &hit = shot->hits.add();
-                    hit.target = getint(p);
-                    hit.lifesequence = getint(p);
-                    hit.dist = getint(p)/DMF;
-                    hit.rays = getint(p);
-                    loopk(3) hit.dir[k] = getint(p)/DNF;
+                    shot->id = getint(p);
+                    shot->gun = getint(p);
+                    loopk(3) shot->from[k] = getint(p)/DMF;
+                    loopk(3) shot->to[k] = getint(p)/DMF;
+                    decodehits(p, shot->hits);
                 }
+                shot->millis = cq ? cq->geteventmillis(gamemillis, shot->id) : 0;
                 if(cq) 
                 {
                     cq->addevent(shot);
                     cq->setpushed();
                 }
-                else delete shot;
+                else shot->release();
                 break;
             }
 
             case N_EXPLODE:
             {
-                explodeevent *exp = new explodeevent;
-                int cmillis = getint(p);
-                exp->millis = cq ? cq->geteventmillis(gamemillis, cmillis) : 0;
-                exp->gun = getint(p);
-                exp->id = getint(p);
-                int hits = getint(p);
-                loopk(hits)
+                explodeevent *exp = explodeevents.get();
+                const shotrecord *dr = decodedat(d ? &d->shots : NULL, nextshot, curmsg);
+                int cmillis;
+                if(dr)
+                {
+                    cmillis = dr->millis;
+                    exp->gun = dr->gun;
+                    exp->id = dr->id;
+                    exp->hits.put(d->hits.getbuf() + dr->firsthit, dr->numhits);
+                    p.len = dr->end;
+                }
+                else
                 {
-                    if(p.overread()) break;
-                    hitinfo &hit = exp->hits.add();
-                    hit.target = getint(p);
-                    hit.lifesequence = getint(p);
-                    hit.dist = getint(p)/DMF;
-                    hit.rays = getint(p);
-                    loopk(3) hit.dir[k] = getint(p)/DNF;
+                    cmillis = getint(p);
+                    exp->gun = getint(p);
+                    exp->id = getint(p);
+                    decodehits(p, exp->hits);
                 }
+                exp->millis = cq ? cq->geteventmillis(gamemillis, cmillis) : 0;
                 if(cq) cq->addevent(exp);
-                else delete exp;
+                else exp->release();
                 break;
             }
 
@@ -3327,7 +3740,7 @@ namespace server
             {
                 int n = getint(p);
                 if(!cq) break;
-                pickupevent *pickup = new pickupevent;
+                pickupevent *pickup = pickupevents.get();
                 pickup->ent = n;
                 cq->addevent(pickup);
                 break;
@@ -3516,7 +3929,7 @@ namespace server
             {
                 if(ci->privilege || ci->local)
                 {
-                    bannedips.shrink(0);
+                    clearbannedips();
                     sendservmsg("cleared all bans");
                 }
                 break;
@@ -3616,7 +4029,7 @@ namespace server
                 {
                     sendservmsgf("[%s is getting the map]", colorname(ci));
                     if((ci->getmap = sendfile(sender, 2, mapdata, "ri", N_SENDMAP)))
-                        ci->getmap->freeCallback = freegetmap;
+                        setfreecallback(ci->getmap, freegetmap);
                     ci->needclipboard = totalmillis ? totalmillis : 1;
                 }
                 break;
@@ -3855,6 +4268,16 @@ namespace server
 
     #include "inexor/fpsgame/extinfo.hpp"
 
+    /// The server info replies get cached by the engine: requests that begin with the same
+    /// this many bytes get the same reply (after echoing the request).
+    /// Called from another thread, so only look at req.
+    int serverinfokey(ucharbuf req)
+    {
+        if(!req.remaining() || getint(req)) return 0; // an ordinary ping, the rest is for the client only
+        if(getint(req) == EXT_PLAYERSTATS) getint(req);
+        return min(req.length(), req.maxlen);
+    }
+
     void serverinforeply(ucharbuf &req, ucharbuf &p)
     {
         if(req.remaining() && !getint(req))
@@ -70,6 +70,75 @@ void testrpcclient(std::string port)
 // We currently use a static function to signal the subsystem changes (since we cant yet SUBSYSTEM_GET it) .. so this is a temporary workaround.
 template <>
 std::vector<RpcServer<TreeEvent, TreeService::AsyncService>::clienthandler> RpcServer<TreeEvent, TreeService::AsyncService>::clients = {};
+template <>
+change_queue<TreeEvent> RpcServer<TreeEvent, TreeService::AsyncService>::changes = {};
+template <>
+util::SpscQueue<client_msg<TreeEvent>> RpcServer<TreeEvent, TreeService::AsyncService>::inbox{RPC_THREAD_QUEUE_SIZE};
+template <>
+util::SpscQueue<client_msg<TreeEvent>> RpcServer<TreeEvent, TreeService::AsyncService>::outbox{RPC_THREAD_QUEUE_SIZE};
+template <>
+std::atomic<bool> RpcServer<TreeEvent, TreeService::AsyncService>::io_running{false};
+template <>
+bool RpcServer<TreeEvent, TreeService::AsyncService>::io_threaded = false;
+template <>
+int64 RpcServer<TreeEvent, TreeService::AsyncService>::received = 0;
+template <>
+double RpcServer<TreeEvent, TreeService::AsyncService>::receive_latency_sum = 0;
+template <>
+double RpcServer<TreeEvent, TreeService::AsyncService>::receive_latency_max = 0;
+
+/// How often (in milliseconds) variable changes get sent to the clients, 0 for every tick.
+void set_flush_interval(int ms)
+{
+    RpcServer<TreeEvent, TreeService::AsyncService>::changes.flush_interval = ms;
+}
+
+/// Whether the grpc completion queue runs in its own thread instead of getting polled each tick.
+void set_io_thread(bool on)
+{
+    RpcServer<TreeEvent, TreeService::AsyncService>::io_threaded = on;
+}
+
+/// Log how long messages of the clients waited for the game thread, and reset the counters.
+void rpcstats()
+{
+    typedef RpcServer<TreeEvent, TreeService::AsyncService> server;
+    spdlog::get("global")->info("rpcstats: {} messages received, latency avg {:.2f} ms, max {:.2f} ms, {} changes waiting for the rpc thread",
+        server::received, server::received ? server::receive_latency_sum / server::received : 0.0, server::receive_latency_max, server::changes.msgs.size());
+    server::received = 0;
+    server::receive_latency_sum = server::receive_latency_max = 0;
+}
+
+/// Queue updates changes of one variable per frame in a change queue of its own, with and without coalescing,
+/// and log what a flush would send to each client. Neither the variable nor the clients get touched.
+void benchsharedvarsync(int updates, int frames)
+{
+    for(int pass = 0; pass < 2; pass++)
+    {
+        change_queue<TreeEvent> q;
+        q.coalesce = pass == 1;
+        auto start = std::chrono::steady_clock::now();
+        for(int frame = 0; frame < frames; frame++)
+        {
+            for(int i = 0; i < updates; i++)
+            {
+                TreeEvent ev;
+                ev.set__masterport(1 + i%64);
+                q.add_change(std::move(ev));
+            }
+            // what flush_changes() would hand to the clients
+            for(client_msg<TreeEvent> &out : q.msgs)
+            {
+                q.messages++;
+                q.bytes += out.msg.ByteSize();
+            }
+            q.erase_front(q.msgs.size());
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        spdlog::get("global")->info("benchsharedvarsync ({}): {} changes -> {} messages, {} bytes per client in {:.2f} ms",
+            q.coalesce ? "coalesced" : "every change", q.changes, q.messages, q.bytes, ms);
+    }
+}
 
 /// This function sets the functions which get executed when specific stuff has been done on our SharedDeclarations.
 void set_on_change_functions()
@@ -79,7 +148,7 @@ void set_on_change_functions()
         {
             {{namespace}}::TreeEvent val;
             val.set_{{name_unique}}(newvalue);
-            inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_msg(std::move(val));
+            inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_change(std::move(val));
         }
     );
 {{/shared_vars}}
@@ -92,7 +161,7 @@ void set_on_change_functions()
         {{namespace}}::list_{{definition_name_unique}}_removed *rem_msg(tevent.mutable_list_{{instance_name_unique}}_removed());
         rem_msg->set_intern_shared_list_id_number(id);
 
-        inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_msg(std::move(tevent));
+        inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_event(std::move(tevent));
     };
 
     {{name_parent_cpp_full}}.element_pushed_back_func = [](int id, {{definition_name_cpp}} &element) {
@@ -103,7 +172,7 @@ void set_on_change_functions()
 {{/members}}
 
 
-        inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_msg(std::move(tevent));
+        inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_event(std::move(tevent));
 {{#members}}        element.{{name_cpp_short}}.onChange.connect([id](const {{type_cpp_primitive}} oldvalue, const {{type_cpp_primitive}} newvalue)
         {
             {{namespace}}::TreeEvent tevent;
@@ -111,7 +180,7 @@ void set_on_change_functions()
             modified_msg->set_intern_shared_list_id_number(id);
             modified_msg->set_sharedclass_member_{{name_unique}}(newvalue);
 
-            inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_msg(std::move(tevent));
+            inexor::rpc::RpcServer<{{namespace}}::TreeEvent, {{namespace}}::TreeService::AsyncService>::send_event(std::move(tevent));
         });
 {{/members}}
     };
@@ -3,10 +3,13 @@
 /// Note: This is a header only template library ("header-only" as a consequence of "template").
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <exception>
 #include <queue>
+#include <vector>
+#include <unordered_map>
 #include <functional>
 #include <chrono>
 #include <thread>
@@ -15,6 +18,7 @@
 #include <grpc++/grpc++.h>
 
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/SpscQueue.hpp"
 
 // size is important for us, proto explicitly specifies int64
 typedef int64_t int64;
@@ -37,8 +41,11 @@ extern void send_all_vars();
 template<typename MSG_TYPE>
 bool handle_index(int index, const MSG_TYPE &tree_event);
 
-#define MAX_RPC_EVENT_CHECKS_PER_TICK 100
 #define MAX_RPC_CLIENTS 128 // possible highest value is 255, see encode_signal()
+#define MAX_RPC_OUTSTANDING_WRITES 1024 // per client, we stop taking new messages from the game thread beyond that
+#define RPC_THREAD_QUEUE_SIZE 4096      // messages in flight between the game and the rpc thread (each direction)
+#define RPC_THREAD_POLL_MS 1            // how long the rpc thread waits for grpc events before looking for new messages
+#define MAX_RPC_EVENT_CHECKS_PER_TICK 100 // without the rpc thread: grpc events handled per tick at most
 
 /// The events we request GRPC to do.
 enum EVENT_TYPE
@@ -60,6 +67,81 @@ const inline void *encode_signal(const int event_type, int clientid)
     return reinterpret_cast<void*>(new callback_event(event_type, clientid));
 }
 
+/// A message passed between the game thread and the rpc thread.
+template<typename MSG_TYPE>
+struct client_msg
+{
+    MSG_TYPE msg;
+    /// The client this came from (and must not be sent back to), -1 for changes of the core.
+    int client_id = -1;
+    /// When the rpc thread received it.
+    std::chrono::steady_clock::time_point received;
+};
+
+/// Outgoing changes of the core, collected until the next flush.
+///
+/// A variable which changes several times in between only gets sent once with its latest value.
+/// All other events (list changes, ..) keep their order and no change gets coalesced across them.
+template<typename MSG_TYPE>
+struct change_queue
+{
+    std::vector<client_msg<MSG_TYPE>> msgs;
+
+    /// Position in msgs of the pending change of each variable (message key) since the last other event.
+    std::unordered_map<int64, size_t> latest;
+
+    /// Send the changes every that many milliseconds, 0 means every tick.
+    int flush_interval = 0;
+    bool coalesce = true;
+    std::chrono::steady_clock::time_point last_flush;
+
+    /// Number of changes queued and number of messages and their bytes which went to (each) client.
+    int64 changes = 0, messages = 0, bytes = 0;
+
+    void add_change(MSG_TYPE &&msg)
+    {
+        changes++;
+        if(coalesce)
+        {
+            auto pending = latest.find(msg.key_case());
+            if(pending != latest.end())
+            {
+                msgs[pending->second].msg = std::move(msg);
+                return;
+            }
+            latest[msg.key_case()] = msgs.size();
+        }
+        msgs.emplace_back();
+        msgs.back().msg = std::move(msg);
+    }
+
+    void add_event(MSG_TYPE &&msg, int client_id = -1)
+    {
+        changes++;
+        latest.clear();
+        msgs.emplace_back();
+        msgs.back().msg = std::move(msg);
+        msgs.back().client_id = client_id;
+    }
+
+    /// Forget the first n messages, they have been sent.
+    void erase_front(size_t n)
+    {
+        msgs.erase(msgs.begin(), msgs.begin() + n);
+        for(auto pending = latest.begin(); pending != latest.end();)
+        {
+            if(pending->second < n) pending = latest.erase(pending);
+            else (pending++)->second -= n;
+        }
+    }
+
+    bool flush_due() const
+    {
+        if(msgs.empty()) return false;
+        return flush_interval <= 0 || std::chrono::steady_clock::now() - last_flush >= std::chrono::milliseconds(flush_interval);
+    }
+};
+
 template<typename MSG_TYPE, typename ASYNC_SERVICE_TYPE>
 class RpcServer
 {
@@ -102,6 +184,12 @@ public:
         /// The clients identifier number.
         int id;
 
+        /// The last read result did not fit into the inbox yet, we don't read any further until it does.
+        bool read_stalled = false;
+
+        /// Changes this client missed because it was backed up.
+        int64 dropped = 0;
+
         clienthandler(int id_, std::unique_ptr<stream_type> &&stream_) : id(id_), stream(std::move(stream_)) {}
 
         /// Start an asynchronous read.
@@ -113,8 +201,10 @@ public:
         void write(const MSG_TYPE &msg)        { outstanding_writes.push(msg); }
 
         /// Whether or not writes are outstanding.
-        bool has_writes()                { return !outstanding_writes.size(); }
+        bool has_writes()                { return !outstanding_writes.empty(); }
         bool currently_writing()         { return writer_busy; }
+        /// Whether we should stop queueing more writes for this client.
+        bool backed_up()                 { return outstanding_writes.size() >= MAX_RPC_OUTSTANDING_WRITES; }
 
         /// Send the next item from the queue, needs to be called only if the queue was empty in the last finished_send_one() and in case of a kick-off
         void request_send_one();
@@ -128,36 +218,85 @@ public:
     };
     static std::vector<clienthandler> clients;
 
+    /// Changes waiting for the next flush, see send_change().
+    static change_queue<MSG_TYPE> changes;
+
+    /// Once the rpc thread runs, it is the only one touching clients and the completion queue.
+    /// The game thread only talks to it through these.
+    static util::SpscQueue<client_msg<MSG_TYPE>> inbox, outbox;
+    /// Whether anyone takes messages out of the outbox, otherwise flushed changes just get dropped.
+    static std::atomic<bool> io_running;
+    /// Whether the completion queue should be run by its own thread, otherwise the game thread polls it in process_queue().
+    static bool io_threaded;
+
+    /// Messages received from the clients and how long they waited for the game thread (in milliseconds).
+    static int64 received;
+    static double receive_latency_sum, receive_latency_max;
+
 private:
     /// Client which isn't connected yet, a buffer caused by the async API.
     std::unique_ptr<stream_type> connect_slot;
+
+    std::thread io_thread;
+    std::atomic<bool> io_stop{false};
+    /// The initial sync is done and the clients get served by either the rpc thread or process_queue().
+    bool io_started = false;
 public:
     std::string server_address;
 
     RpcServer(const char *address);
     ~RpcServer();
 
-    /// This is essentially doing the sending/receiving.
-    /// Quits if there are no more values to send and we don't receive anything anymore or if MAX_RPC_EVENT_CHECKS_PER_TICK is reached.
-    /// In case of errors it throws a std::exception (TODO).
+    /// Game thread side, once per tick: apply what the clients sent and hand our changes to the rpc thread.
+    /// Without the rpc thread (see io_threaded) this polls the completion queue and writes to the clients itself.
     void process_queue();
 
-    /// This is used during the startup, we process_queue() until we receive a special event.
+    /// This is used during the startup, we process the completion queue until we receive a special event.
     /// After 10 seconds of not receiving this event it throws a runtime error.
     void block_until_initialized();
 
-    /// Send any variable changes in the core to all clients.
-    /// For broadcasting purpose param excluded_id is given: you don't want to send back a change you just received from a client.
-    static void send_msg(const MSG_TYPE &msg, int excluded_id = -1)
+    /// Serve the clients from now on: the completion queue runs in its own thread if io_threaded is set,
+    /// so rpc latency doesn't depend on the frame rate, otherwise it gets polled once per tick.
+    void start_io();
+
+    /// Queue the new value of a variable, overriding any value of it which has not been sent yet.
+    static void send_change(MSG_TYPE &&msg) { changes.add_change(std::move(msg)); }
+
+    /// Queue an event which must reach the clients in order with the changes around it.
+    /// @param client_id the client it came from, which won't get it back.
+    static void send_event(MSG_TYPE &&msg, int client_id = -1) { changes.add_event(std::move(msg), client_id); }
+
+    /// Hand all queued changes to the rpc thread.
+    /// If it's backed up the rest stays queued (and keeps getting coalesced) until the next flush.
+    static void flush_changes()
     {
-        for(clienthandler &ci: clients)
+        size_t sent = 0;
+        for(client_msg<MSG_TYPE> &out : changes.msgs)
         {
-            if(ci.id != excluded_id) ci.write(msg);
+            const int size = out.msg.ByteSize();
+            if(io_running && !outbox.push(std::move(out))) break;
+            changes.messages++;
+            changes.bytes += size;
+            sent++;
         }
+        changes.erase_front(sent);
+        changes.last_flush = std::chrono::steady_clock::now();
     }
 
-
 private:
+    /// The loop of the rpc thread.
+    void run_io();
+    void stop_io_thread();
+
+    /// Without the rpc thread: handle up to MAX_RPC_EVENT_CHECKS_PER_TICK events of the completion queue.
+    void poll_completion_queue();
+
+    /// Takes a message read from a client into the inbox, returns false if it's full.
+    static bool receive(const MSG_TYPE &msg, int client_id);
+    /// Retry the reads which didn't fit into the inbox.
+    void retry_stalled_reads();
+    /// Give the changes of the game thread to the clients, those which are backed up miss them.
+    void drain_outbox();
 
     void open_connect_slot();
     void handle_new_connection();
@@ -176,7 +315,8 @@ private:
 
     void kickoff_writes();
 
-    void handle_queue_event(callback_event *encoded_callback, bool broadcast, std::function<void(const MSG_TYPE &)> receive_handler);
+    /// @param receive_handler takes a message read from a client, returns false if it can't take it yet.
+    void handle_queue_event(callback_event *encoded_callback, std::function<bool(const MSG_TYPE &, int)> receive_handler);
 
     int pick_unused_id();
     bool change_variable(const MSG_TYPE &receivedval);
@@ -201,7 +341,7 @@ void RpcServer<MSG_TYPE, U>::clienthandler::request_read()
 template<typename MSG_TYPE, typename U> inline
 void RpcServer<MSG_TYPE, U>::clienthandler::request_send_one()
 {
-    if(writer_busy || has_writes()) return;
+    if(writer_busy || !has_writes()) return;
     writer_busy = true;
     const void* cq_id = encode_signal(EVENT_TYPE::E_WRITE, id);
     stream->Write(outstanding_writes.front(), (void *)cq_id);
@@ -245,6 +385,8 @@ RpcServer<MSG_TYPE, U>::RpcServer(const char *address) : server_address(address)
 template<typename MSG_TYPE, typename U> inline
 RpcServer<MSG_TYPE, U>::~RpcServer()
 {
+    io_stop = true;
+    if(io_thread.joinable()) io_thread.join();
 	// TODO we should also receive whether disconnect was successfully
     for(auto &client : clients) client.request_disconnect();
     grpc_server->Shutdown();
@@ -313,25 +455,49 @@ void RpcServer<MSG_TYPE, U>::kickoff_writes()
 template<typename MSG_TYPE, typename U> inline
 void RpcServer<MSG_TYPE, U>::process_queue()
 {
-    kickoff_writes();
+    if(io_started && io_threaded != io_thread.joinable())
+    {
+        if(io_threaded) start_io();
+        else stop_io_thread();
+    }
+    if(io_started && !io_thread.joinable()) poll_completion_queue();
+
+    client_msg<MSG_TYPE> in;
+    while(inbox.pop(in))
+    {
+        double latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - in.received).count();
+        received++;
+        receive_latency_sum += latency;
+        receive_latency_max = std::max(receive_latency_max, latency);
+
+        change_variable(in.msg);
+        send_event(std::move(in.msg), in.client_id); // broadcast changes from one client to the other clients.
+    }
+    if(changes.flush_due()) flush_changes();
+    if(io_started && !io_thread.joinable())
+    {
+        drain_outbox();
+        kickoff_writes();
+    }
+}
 
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::poll_completion_queue()
+{
     using grpc::CompletionQueue;
 
+    retry_stalled_reads();
+    kickoff_writes();
     for(int i = 0; i < MAX_RPC_EVENT_CHECKS_PER_TICK; i++)
     {
         callback_event *callback_value;
         bool no_internal_grpc_error = false;
-
-        // read the next event from the completion queue (in nonblocking fashion)
-        // TODO: adapt blocking time to the time budget and whether or not writes are outstanding
         CompletionQueue::NextStatus stat = cq->AsyncNext((void **)(&callback_value), &no_internal_grpc_error, gpr_inf_past(GPR_CLOCK_REALTIME));
-
-        //if(!) break;// throw std::runtime_error("GRPC had an internal error: Shutting down.");
-
-        if(no_internal_grpc_error && stat == CompletionQueue::NextStatus::GOT_EVENT)
-            handle_queue_event(callback_value, true, [=](const MSG_TYPE &msg) {
-                    this->change_variable(msg);
-                });
+        if(stat == CompletionQueue::NextStatus::GOT_EVENT)
+        {
+            if(no_internal_grpc_error) handle_queue_event(callback_value, receive);
+            else delete callback_value;
+        }
         else if(stat == CompletionQueue::NextStatus::TIMEOUT)
         {
             if(!any_writes_outstanding()) break;
@@ -344,6 +510,90 @@ void RpcServer<MSG_TYPE, U>::process_queue()
     }
 }
 
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::start_io()
+{
+    io_started = true;
+    io_running = true;
+    if(io_threaded && !io_thread.joinable()) io_thread = std::thread([this] { run_io(); io_running = false; });
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::stop_io_thread()
+{
+    io_stop = true;
+    io_thread.join();
+    io_stop = false;
+    io_running = true; // the game thread takes over
+}
+
+template<typename MSG_TYPE, typename U> inline
+bool RpcServer<MSG_TYPE, U>::receive(const MSG_TYPE &msg, int client_id)
+{
+    client_msg<MSG_TYPE> in;
+    in.msg = msg;
+    in.client_id = client_id;
+    in.received = std::chrono::steady_clock::now();
+    return inbox.push(std::move(in));
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::retry_stalled_reads()
+{
+    for(clienthandler &ci : clients) if(ci.read_stalled && receive(ci.get_read_result(), ci.id))
+    {
+        ci.read_stalled = false;
+        ci.request_read();
+    }
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::drain_outbox()
+{
+    // one slow client must not hold back the others, so it just misses what doesn't fit anymore
+    client_msg<MSG_TYPE> out;
+    while(outbox.pop(out))
+    {
+        for(clienthandler &ci : clients)
+        {
+            if(ci.id == out.client_id) continue;
+            if(!ci.backed_up()) ci.write(out.msg);
+            else if(!ci.dropped++)
+                spdlog::get("global")->warn("RPC Server: client {} is backed up, it misses changes from now on", ci.id);
+        }
+    }
+}
+
+template<typename MSG_TYPE, typename U> inline
+void RpcServer<MSG_TYPE, U>::run_io()
+{
+    using grpc::CompletionQueue;
+
+    while(!io_stop)
+    {
+        drain_outbox();
+        retry_stalled_reads();
+        kickoff_writes();
+
+        callback_event *callback_value;
+        bool no_internal_grpc_error = false;
+        auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(RPC_THREAD_POLL_MS);
+        CompletionQueue::NextStatus stat = cq->AsyncNext((void **)(&callback_value), &no_internal_grpc_error, deadline);
+        while(stat == CompletionQueue::NextStatus::GOT_EVENT)
+        {
+            if(no_internal_grpc_error) handle_queue_event(callback_value, receive);
+            else delete callback_value;
+            // handle everything which is ready before looking at the outbox again
+            stat = cq->AsyncNext((void **)(&callback_value), &no_internal_grpc_error, gpr_inf_past(GPR_CLOCK_REALTIME));
+        }
+        if(stat == CompletionQueue::NextStatus::SHUTDOWN)
+        {
+            spdlog::get("global")->error("[GRPC Server] Completion Queue Shutdown status received, stopping the rpc thread.");
+            return;
+        }
+    }
+}
+
 template<typename MSG_TYPE, typename ASYNC_SERVICE_TYPE>
 inline void RpcServer<MSG_TYPE, ASYNC_SERVICE_TYPE>::block_until_initialized()
 {
@@ -362,15 +612,15 @@ inline void RpcServer<MSG_TYPE, ASYNC_SERVICE_TYPE>::block_until_initialized()
         bool regularEvent = cq->Next((void **)(&callback_value), &no_internal_grpc_error);
         if(no_internal_grpc_error && regularEvent)
         {
-            handle_queue_event(callback_value, false, [&](const MSG_TYPE &msg) {
-                int64 index = msg.key_case();
+            handle_queue_event(callback_value, [&](const MSG_TYPE &msg, int client_id) {
                 // FINISHED_TREE_INTRO_SEND
                 if(msg.general_event() == 1)
                 {
                     initialized = true;
-                    return;
+                    return true;
                 }
                 this->change_variable(msg);
+                return true;
             });
         }
         else if(!regularEvent)
@@ -382,7 +632,7 @@ inline void RpcServer<MSG_TYPE, ASYNC_SERVICE_TYPE>::block_until_initialized()
 }
 
 template<typename MSG_TYPE, typename U> inline
-void RpcServer<MSG_TYPE, U>::handle_queue_event(callback_event *encoded_callback, bool broadcast, std::function<void(const MSG_TYPE &)> receive_handler)
+void RpcServer<MSG_TYPE, U>::handle_queue_event(callback_event *encoded_callback, std::function<bool(const MSG_TYPE &, int)> receive_handler)
 {
     switch(encoded_callback->type)
     {
@@ -391,10 +641,8 @@ void RpcServer<MSG_TYPE, U>::handle_queue_event(callback_event *encoded_callback
         clienthandler *ci = get_client(encoded_callback->client_id);
         if(!ci) break; // TODO we should better process its last messages, but we dont have the clients read_buffer anymore.
 
-        const MSG_TYPE msg = ci->get_read_result();
-        ci->request_read();
-        receive_handler(msg);
-        if(broadcast) send_msg(msg, ci->id); //broadcast changes from one client to other clients.
+        if(receive_handler(ci->get_read_result(), ci->id)) ci->request_read();
+        else ci->read_stalled = true; // backpressure: don't read any further until the game thread caught up
         break;
     }
     case E_WRITE:
@@ -41,6 +41,7 @@ public:
         spdlog::get("global")->info("RPC server listening on {0}", serv->server_address);
         set_on_change_functions();
         serv->block_until_initialized();
+        serv->start_io();
     }
 
     virtual void tick() override
@@ -103,8 +103,7 @@ namespace tiger
 
     void hash(const uchar *str, int length, hashval &val)
     {
-        static bool init = false;
-        if(!init) { gensboxes(); init = true; }
+        static const bool init INEXOR_ATTR_UNUSED = (gensboxes(), true); // once, even if several server instances hash at the same time
 
         uchar temp[64];
 
@@ -2,11 +2,18 @@
 
 #include "inexor/rpc/SharedTree.hpp"
 
-extern int curtime;                     // current frame time
-extern int lastmillis;                  // last time
-extern int elapsedtime;                 // elapsed frame time
-extern int totalmillis;                 // total elapsed time
-extern uint totalsecs;
+// the dedicated server can run several instances (matches) in a thread each, what belongs to one of them is thread local there
+#ifdef SERVERINSTANCES
+#define INSTANCE_LOCAL thread_local
+#else
+#define INSTANCE_LOCAL
+#endif
+
+extern INSTANCE_LOCAL int curtime;      // current frame time
+extern INSTANCE_LOCAL int lastmillis;   // last time
+extern INSTANCE_LOCAL int elapsedtime;  // elapsed frame time
+extern INSTANCE_LOCAL int totalmillis;  // total elapsed time
+extern INSTANCE_LOCAL uint totalsecs;
 extern int gamespeed, paused;
 
 enum
@@ -442,6 +449,8 @@ extern ENetPacket *sendfile(int cn, int chan, stream *file, const char *format =
 extern void sendpacket(int cn, int chan, ENetPacket *packet, int exclude = -1);
 extern void flushserver(bool force);
 extern int getservermtu();
+extern int getservertickrate();
+extern int getserverinstance();
 extern int getnumclients();
 extern uint getclientip(int n);
 extern void localconnect();
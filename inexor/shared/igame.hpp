@@ -111,11 +111,19 @@ namespace server
     extern void localconnect(int n);
     extern bool allowbroadcast(int n);
     extern void recordpacket(int chan, void *data, int len);
-    extern void parsepacket(int sender, int chan, packetbuf &p);
+    /// Received packets are parsed in batches: decodepacket() runs on worker threads for slot 0 to n-1 of the batch
+    /// and must not touch any game state, then parsepacket() applies them in order on the thread of the server.
+    struct packetbatch;
+    extern packetbatch *beginpacketbatch(int n);
+    extern void decodepacket(packetbatch *batch, int slot, int chan, ENetPacket *packet);
+    extern void parsepacket(int sender, int chan, packetbuf &p, int slot = -1);
     extern void sendservmsg(const char *s);
     extern bool sendpackets(bool force = false);
     extern void serverinforeply(ucharbuf &req, ucharbuf &p);
+    extern int serverinfokey(ucharbuf req);
     extern void serverupdate();
+    /// Moves the game clock millis forward between two serverupdate()s, which then only add the rest of curtime.
+    extern void advancetime(int millis);
     extern bool servercompatible(char *name, char *sdec, char *map, int ping, const vector<int> &attr, int np);
     extern int laninfoport();
     extern int serverinfoport(int servport = -1);
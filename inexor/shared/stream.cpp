@@ -1,3 +1,5 @@
+#include <mutex>
+
 #include "inexor/shared/cube.hpp"
 #include "inexor/util/Logging.hpp"
 
@@ -224,11 +226,12 @@ done:
 
 ///////////////////////// file system ///////////////////////
 
+#include <sys/stat.h>
+
 #ifdef WIN32
 #include <shlobj.h>
 #else
 #include <unistd.h>
-#include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
 #endif
@@ -244,7 +247,7 @@ vector<packagedir> packagedirs;
 /// Append a string together but add the prefix in the field.
 char *makerelpath(const char *dir, const char *file, const char *prefix, const char *cmd)
 {
-    static string tmp;
+    static thread_local string tmp;
     if(prefix) copystring(tmp, prefix);
     else tmp[0] = '\0';
     if(file[0]=='<')
@@ -315,11 +318,10 @@ char *path(char *s)
     return s;
 }
 
-/// Returns a static string with adapted slashes according to the platforms prefered pathseperator.
-/// @warning not threadsafe!
+/// Returns a static string (one per thread) with adapted slashes according to the platforms prefered pathseperator.
 char *path(const char *s, bool copy)
 {
-    static string tmp;
+    static thread_local string tmp;
     copystring(tmp, s);
     path(tmp);
     return tmp;
@@ -331,12 +333,144 @@ const char *parentdir(const char *filename)
 {
     const char *p = filename + strlen(filename);
     while(p > filename && *p != '/' && *p != '\\') p--;
-    static string parent;
+    static thread_local string parent;
     size_t len = p-filename+1;
     copystring(parent, filename, len);
     return parent;
 }
 
+int filesyscalls = 0;
+vector<char *> *filelookuplog = NULL;
+
+/// Directory listings we already read, so looking for files (and especially for ones which don't exist) doesn't hit the disk again.
+/// Files the game creates through findfile() get added, anything changed from the outside needs a rescanfiles.
+/// Thread safe, the instances of the dedicated server share it.
+struct dircache
+{
+    hashtable<const char *, bool> dirs; ///< listed directories ("" is the working dir) -> whether they exist
+    hashset<const char *> files;
+    vector<char *> names;
+    std::mutex mtx;
+
+    dircache() : dirs(1<<10), files(1<<14) {}
+    ~dircache() { clear(); }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        dirs.clear();
+        files.clear();
+        names.deletearrays();
+    }
+
+    /// Keys use '/' (and are lowercase on case insensitive file systems).
+    /// @return false for paths we don't handle, e.g. containing "." or ".." components.
+    static bool makekey(const char *path, string &key, size_t &dirlen)
+    {
+        size_t len = 0;
+        dirlen = 0;
+        for(const char *c = path; *c; c++)
+        {
+            if(len >= sizeof(key)-1) return false;
+            char k = *c == '\\' ? '/' : *c;
+#ifdef WIN32
+            k = cubelower(k);
+#endif
+            if(k == '/')
+            {
+                if(len == dirlen && len) return false; // "//"
+                const char *comp = &key[dirlen];
+                if((len == dirlen+1 && comp[0] == '.') || (len == dirlen+2 && comp[0] == '.' && comp[1] == '.')) return false;
+                dirlen = len+1;
+            }
+            key[len++] = k;
+        }
+        key[len] = '\0';
+        const char *name = &key[dirlen];
+        return name[0] && strcmp(name, ".") && strcmp(name, "..");
+    }
+
+    char *addname(const char *name, size_t len)
+    {
+        char *n = newstring(name, len);
+        names.add(n);
+        return n;
+    }
+
+    bool scan(char *dir, size_t dirlen)
+    {
+        vector<char *> entries;
+        filesyscalls++;
+        bool exists = listdir(dirlen ? dir : ".", false, NULL, entries);
+        dirs[addname(dir, dirlen)] = exists;
+        string entry, key;
+        loopv(entries)
+        {
+            formatstring(entry, "%s%s", dir, entries[i]);
+            size_t keydirlen;
+            if(makekey(entry, key, keydirlen)) files.add(addname(key, strlen(key)));
+        }
+        entries.deletearrays();
+        return exists;
+    }
+
+    /// @return 1 or 0 if we know whether the file exists, -1 if we can't tell.
+    int exists(const char *path)
+    {
+        string key;
+        size_t dirlen;
+        if(!makekey(path, key, dirlen)) return -1;
+        char c = key[dirlen];
+        key[dirlen] = '\0';
+        std::lock_guard<std::mutex> lock(mtx);
+        bool *dir = dirs.access(key);
+        bool direxists = dir ? *dir : scan(key, dirlen);
+        key[dirlen] = c;
+        return direxists && files.access(key) ? 1 : 0;
+    }
+
+    /// Remember a file we are about to create, if we know its directory.
+    void add(const char *path)
+    {
+        string key;
+        size_t dirlen;
+        if(!makekey(path, key, dirlen)) return;
+        char c = key[dirlen];
+        key[dirlen] = '\0';
+        std::lock_guard<std::mutex> lock(mtx);
+        bool *dir = dirs.access(key);
+        if(!dir) return;
+        *dir = true;
+        key[dirlen] = c;
+        if(!files.access(key)) files.add(addname(key, strlen(key)));
+    }
+};
+static dircache filecache;
+
+VARF(usefilecache, 0, 1, 1, clearfilecache());
+
+/// Forget everything we know about the file system.
+void clearfilecache()
+{
+    filecache.clear();
+}
+
+/// Look for all the given files (like findfile(name, "r")) iterations times, with or without the file cache, which starts out empty.
+/// @return how many of them were found per iteration.
+int replayfilelookups(const vector<char *> &names, bool cached, int iterations)
+{
+    int oldcache = usefilecache, found = 0;
+    usefilecache = cached ? 1 : 0;
+    clearfilecache();
+    loopk(iterations)
+    {
+        found = 0;
+        loopv(names) if(findfile(names[i], "e")) found++;
+    }
+    usefilecache = oldcache;
+    return found;
+}
+
 /// Checks whether given file exists (and is available in the specific mode)
 /// Where Path is the filename and mode can optionally be set (but only effects posix systems)
 /// ATTENTION: DO NOT USE THIS METHOD DIRECTLY! It doesn't give a fuck about your homedir 
@@ -347,6 +481,12 @@ bool fileexists(const char *path, const char *mode)
 {
     bool exists = true;
     if(mode[0]=='w' || mode[0]=='a') path = parentdir(path);
+    else if(mode[0]!='d' && usefilecache)
+    {
+        int cached = filecache.exists(path);
+        if(cached >= 0) return cached != 0;
+    }
+    filesyscalls++;
 #ifdef WIN32
     if(GetFileAttributes(path[0] ? path : ".\\") == INVALID_FILE_ATTRIBUTES) exists = false;
 #else
@@ -355,6 +495,24 @@ bool fileexists(const char *path, const char *mode)
     return exists;
 }
 
+/// Size and modification time of the plain file findfile() finds for filename, the time in ns where the file system keeps it.
+/// @return false if there is none, e.g. because the file only exists inside a zip.
+bool statfile(const char *filename, llong &size, llong &mtime)
+{
+    const char *found = findfile(filename, "rb");
+    struct stat st;
+    if(stat(found, &st) || !(st.st_mode&S_IFREG)) return false;
+    size = st.st_size;
+#if defined(__APPLE__)
+    mtime = st.st_mtimespec.tv_sec*1000000000LL + st.st_mtimespec.tv_nsec;
+#elif defined(WIN32)
+    mtime = st.st_mtime*1000000000LL;
+#else
+    mtime = st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
 /// Creates a directory of given name
 /// @Return Returns true on success
 bool createdir(const char *path)
@@ -362,9 +520,10 @@ bool createdir(const char *path)
     size_t len = strlen(path);
     if(path[len-1]==PATHDIV)
     {
-        static string strip;
+        static thread_local string strip;
         path = copystring(strip, path, len);
     }
+    filecache.add(path);
 #ifdef WIN32
     return CreateDirectory(path, NULL)!=0;
 #else
@@ -405,10 +564,12 @@ const char *addpackagedir(const char *dir)
 ///         Otherwise it returns the inital filename.
 const char *findfile(const char *filename, const char *mode)
 {
-    static string s;
+    static thread_local string s;
+    if(filelookuplog && mode[0]!='w' && mode[0]!='a') filelookuplog->add(newstring(filename));
     if(homedir[0])
     {
         formatstring(s, "%s%s", homedir, filename);
+        if(mode[0]=='w' || mode[0]=='a') filecache.add(s);
         if(fileexists(s, mode)) return s;
         if(mode[0]=='w' || mode[0]=='a')
         {
@@ -425,7 +586,11 @@ const char *findfile(const char *filename, const char *mode)
             return s;
         }
     }
-    if(mode[0]=='w' || mode[0]=='a') return filename;
+    if(mode[0]=='w' || mode[0]=='a')
+    {
+        filecache.add(filename);
+        return filename;
+    }
     loopv(packagedirs)
     {
         packagedir &pf = packagedirs[i];
@@ -680,6 +845,9 @@ struct filestream : stream
     }
 };
 
+// also on the dedicated server, so maps or configs dropped into a package dir while it runs can be found
+ICOMMAND(rescanfiles, "", (), clearfilecache());
+
 #ifndef STANDALONE
 VAR(dbggz, 0, 0, 1);
 #endif
@@ -1154,7 +1322,17 @@ stream *openrawfile(const char *filename, const char *mode)
     const char *found = findfile(filename, mode);
     if(!found) return NULL;
     filestream *file = new filestream;
-    if(!file->open(found, mode)) { delete file; return NULL; }
+    if(!file->open(found, mode))
+    {
+        delete file;
+        if(mode[0]=='w' || mode[0]=='a' || !usefilecache) return NULL;
+        // the file cache may just be outdated (files deleted in the meantime), try again with an uptodate one.
+        clearfilecache();
+        found = findfile(filename, mode);
+        if(!found) return NULL;
+        file = new filestream;
+        if(!file->open(found, mode)) { delete file; return NULL; }
+    }
     return file;
 }
 
@@ -1,12 +1,15 @@
 /// @file General tools, typedefines and generic definitions.
 
 #include "inexor/shared/cube.hpp"
+#include "inexor/util/Metrics.hpp"
+#include "inexor/util/PacketPool.hpp"
 #ifndef WIN32
 #include <unistd.h>
 #endif
 
-static string tmpstr[4];
-static int tmpidx = 0;
+// per thread, the server instances format their messages concurrently
+static thread_local string tmpstr[4];
+static thread_local int tmpidx = 0;
 
 char *tempformatstring(const char *fmt, ...)
 {
@@ -122,6 +125,48 @@ void getstring(char *text, ucharbuf &p, size_t len)
     while(*t++);
 }
 
+bool usepacketpool = true;
+
+static inexor::util::Counter &packetblocksallocated = inexor::util::Metrics::counter("inexor_packet_blocks_allocated_total", "Packet blocks the pool had to allocate");
+static inexor::util::Counter &packetblocksreused = inexor::util::Metrics::counter("inexor_packet_blocks_reused_total", "Packets built in a block from the pool");
+static inexor::util::Counter &packetsunpooled = inexor::util::Metrics::counter("inexor_packets_unpooled_total", "Packets with their own memory (too large for a block, or the pool is off)");
+
+/// The pool of the calling thread, which lives as long as the process since packets may be destroyed as late as that.
+static inexor::util::PacketPool &packetpool()
+{
+    static thread_local inexor::util::PacketPool *pool = NULL;
+    if(!pool) pool = new inexor::util::PacketPool(PACKETBLOCKSIZE, PACKETPOOLSIZE);
+    return *pool;
+}
+
+ENetPacket *newpacket(int size, int flags)
+{
+    if(!usepacketpool)
+    {
+        packetsunpooled.add();
+        return enet_packet_create(NULL, size, flags);
+    }
+    inexor::util::PacketPool &pool = packetpool();
+    uint64_t allocated = pool.allocated, reused = pool.reused;
+    ENetPacket *packet = pool.create(size, flags);
+    if(pool.allocated != allocated) packetblocksallocated.add();
+    else if(pool.reused != reused) packetblocksreused.add();
+    else packetsunpooled.add();
+    return packet;
+}
+
+ENetPacket *growpacket(ENetPacket *packet, int len, int size)
+{
+    ENetPacket *grown = inexor::util::PacketPool::grow(packet, len, size);
+    if(grown != packet) packetsunpooled.add();
+    return grown;
+}
+
+void setfreecallback(ENetPacket *packet, ENetPacketFreeCallback callback)
+{
+    inexor::util::PacketPool::set_free_callback(packet, callback);
+}
+
 void filtertext(char *dst, const char *src, bool whitespace, bool forcespace, size_t len)
 {
     for(int c = uchar(*src); c; c = uchar(*++src))
@@ -192,4 +237,3 @@ int ipmask::print(char *buf) const
     if(!bits && range%8) buf += sprintf(buf, "/%d", range);
     return int(buf-start);
 }
-
@@ -12,6 +12,7 @@
 #include "inexor/util/random.hpp"
 #include "inexor/rpc/SharedTree.hpp"
 #include "inexor/util.hpp"
+#include "inexor/util/IpTrie.hpp"
 
 typedef unsigned char uchar;
 typedef unsigned short ushort;
@@ -334,6 +335,24 @@ struct databuf
 typedef databuf<char> charbuf;
 typedef databuf<uchar> ucharbuf;
 
+/// storage for the packets built by packetbufs
+///
+/// Most messages are built into a packetbuf of MAXTRANS bytes and end up a few bytes long,
+/// so instead of allocating (and freeing) that much memory for every one of them,
+/// packets get a block from a per thread pool (with ENET_PACKET_FLAG_NO_ALLOCATE) and their
+/// freeCallback hands the block back once ENet is done with the packet, i.e. after the last
+/// peer sent it. Packets growing beyond a block move to memory of their own. See inexor::util::PacketPool.
+enum { PACKETBLOCKSIZE = 5000, PACKETPOOLSIZE = 256 };
+
+extern bool usepacketpool;
+
+/// create a packet of [size] bytes, from the pool if it fits a block
+extern ENetPacket *newpacket(int size, int flags);
+/// return a packet with [size] bytes holding the first [len] bytes of [packet] (which gets destroyed if it had to be replaced)
+extern ENetPacket *growpacket(ENetPacket *packet, int len, int size);
+/// pooled packets need their own freeCallback, so set any other callback with this
+extern void setfreecallback(ENetPacket *packet, ENetPacketFreeCallback callback);
+
 /// network packet buffer
 struct packetbuf : ucharbuf
 {
@@ -348,7 +367,7 @@ struct packetbuf : ucharbuf
 	/// reserve memory in this constructor
     packetbuf(int growth, int pflags = 0) : growth(growth)
     {
-        packet = enet_packet_create(NULL, growth, pflags);
+        packet = newpacket(growth, pflags);
         buf = (uchar *)packet->data;
         maxlen = packet->dataLength;
     }
@@ -368,7 +387,7 @@ struct packetbuf : ucharbuf
 	/// resize ENET packet, copy data and buffer length
     void resize(int n)
     {
-        enet_packet_resize(packet, n);
+        packet = growpacket(packet, len, n);
         buf = (uchar *)packet->data;
         maxlen = packet->dataLength;
     }
@@ -1212,6 +1231,7 @@ template<class K, class T> struct hashtable : hashbase<hashtable<K, T>, hashtabl
     template<class U> static inline void setkey(elemtype &elem, const U &key) { elem.key = key; }
 };
 
+#define enumeratek(ht,k,e,b)      loopi((ht).size) for(void *ec = (ht).chains[i]; ec;) { k &e = (ht).enumkey(ec); ec = (ht).enumnext(ec); b; }
 #define enumeratekt(ht,k,e,t,f,b) loopi((ht).size) for(void *ec = (ht).chains[i]; ec;) { k &e = (ht).enumkey(ec); t &f = (ht).enumdata(ec); ec = (ht).enumnext(ec); b; }
 #define enumerate(ht,t,e,b)       loopi((ht).size) for(void *ec = (ht).chains[i]; ec;) { t &e = (ht).enumdata(ec); ec = (ht).enumnext(ec); b; }
 
@@ -1477,10 +1497,15 @@ extern char *path(char *s);
 extern char *path(const char *s, bool copy);
 extern const char *parentdir(const char *directory);
 extern bool fileexists(const char *path, const char *mode);
+extern void clearfilecache();
+extern int filesyscalls;
+extern vector<char *> *filelookuplog;
+extern int replayfilelookups(const vector<char *> &names, bool cached, int iterations);
 extern bool createdir(const char *path);
 extern size_t fixpackagedir(char *dir);
 extern const char *addpackagedir(const char *dir);
 extern const char *findfile(const char *filename, const char *mode);
+extern bool statfile(const char *filename, llong &size, llong &mtime);
 extern bool findzipfile(const char *filename);
 extern stream *openrawfile(const char *filename, const char *mode);
 extern stream *openzipfile(const char *filename, const char *mode);
@@ -1523,3 +1548,34 @@ struct ipmask
     bool check(enet_uint32 host) const { return (host & mask) == ip; }
 };
 
+/// set of ipmasks with fast lookups, e.g. for ban lists with thousands of entries, see inexor::util::IpTrie
+struct iptrie
+{
+    vector<ipmask> masks;           // everything added, in order
+    inexor::util::IpTrie trie;
+
+    void clear() { masks.setsize(0); trie.clear(); }
+    void add(const ipmask &m)
+    {
+        masks.add(m);
+        trie.add(ENET_NET_TO_HOST_32(m.ip), ENET_NET_TO_HOST_32(m.mask));
+    }
+    /// takes back one add() of exactly this mask, takes a look at every mask
+    bool remove(const ipmask &m)
+    {
+        loopv(masks) if(masks[i].ip == m.ip && masks[i].mask == m.mask)
+        {
+            masks.remove(i);
+            return trie.remove(ENET_NET_TO_HOST_32(m.ip), ENET_NET_TO_HOST_32(m.mask));
+        }
+        return false;
+    }
+    /// rebuild from scratch (e.g. for a new ban list from the master server)
+    void build(const vector<ipmask> &list) { clear(); loopv(list) add(list[i]); }
+
+    bool check(enet_uint32 host) const { return trie.contains(ENET_NET_TO_HOST_32(host)); }
+
+    int length() const { return masks.length(); }
+    bool empty() const { return masks.empty(); }
+};
+
@@ -2,6 +2,16 @@
 #include "inexor/filesystem/mediadirs.hpp"
 
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
+
+#include <new>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 enum
 {
@@ -52,63 +62,113 @@ struct zipfile
     }
 };
 
-struct zipstream;
-
+/// A zip file with all its contents available in memory.
+/// It gets mapped if possible, so only the parts we actually read get loaded (and they are shared with the OS file cache).
 struct ziparchive
 {
     char *name;
-    FILE *data;
+    uchar *data;
+    size_t datasize;
+    bool mapped;
+#ifdef WIN32
+    HANDLE file, mapping;
+#endif
     hashnameset<zipfile> files;
     int openfiles;
-    zipstream *owner;
 
-    ziparchive() : name(NULL), data(NULL), files(512), openfiles(0), owner(NULL)
+    ziparchive() : name(NULL), data(NULL), datasize(0), mapped(false),
+#ifdef WIN32
+        file(INVALID_HANDLE_VALUE), mapping(NULL),
+#endif
+        files(512), openfiles(0)
     {
     }
     ~ziparchive()
     {
         DELETEA(name);
-        if(data) 
-		{
-			fclose(data); data = NULL; 
-		}
+        unmap();
+    }
+
+    bool map(const char *filename)
+    {
+#ifdef WIN32
+        file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if(file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER filesize;
+        if(GetFileSizeEx(file, &filesize) && filesize.QuadPart > 0 && (mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL)))
+        {
+            data = (uchar *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            datasize = size_t(filesize.QuadPart);
+        }
+        mapped = data != NULL;
+#else
+        int fd = open(filename, O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(!fstat(fd, &st) && st.st_size > 0)
+        {
+            void *view = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(view != MAP_FAILED)
+            {
+                data = (uchar *)view;
+                datasize = st.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd); // the mapping stays valid
+#endif
+        if(mapped) return true;
+
+        // no address space left or the like: just read it
+        FILE *f = fopen(filename, "rb");
+        if(!f) return false;
+        long len = fseek(f, 0, SEEK_END) < 0 ? -1 : ftell(f);
+        if(len > 0 && fseek(f, 0, SEEK_SET) >= 0)
+        {
+            data = new (std::nothrow) uchar[len];
+            datasize = len;
+            if(data && fread(data, 1, len, f) != size_t(len)) DELETEA(data);
+        }
+        fclose(f);
+        return data != NULL;
+    }
+
+    void unmap()
+    {
+        if(!mapped) DELETEA(data);
+#ifdef WIN32
+        if(data) UnmapViewOfFile(data);
+        if(mapping) CloseHandle(mapping);
+        if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if(data) munmap(data, datasize);
+#endif
+        data = NULL;
+        datasize = 0;
+        mapped = false;
     }
 };
 
-static bool findzipdirectory(FILE *f, zipdirectoryheader &hdr)
+static bool findzipdirectory(const uchar *data, size_t size, zipdirectoryheader &hdr)
 {
-    if(fseek(f, 0, SEEK_END) < 0) return false;
+    if(size < ZIP_DIRECTORY_SIZE) return false;
 
-    long offset = ftell(f);
-    if(offset < 0) return false;
-
-    uchar buf[1024], *src = NULL;
-    long end = max(offset - 0xFFFFL - ZIP_DIRECTORY_SIZE, 0L);
-    size_t len = 0;
+    // the directory header is followed by a comment of up to 64K
+    const uchar *src = &data[size - ZIP_DIRECTORY_SIZE], *end = &data[size - min(size, size_t(0xFFFF + ZIP_DIRECTORY_SIZE))];
     const uint signature = lilswap<uint>(ZIP_DIRECTORY_SIGNATURE);
-
-    while(offset > end)
-    {
-        size_t carry = min(len, size_t(ZIP_DIRECTORY_SIZE-1)), next = min(sizeof(buf) - carry, size_t(offset - end));
-        offset -= next;
-        memmove(&buf[next], buf, carry);
-        if(next + carry < ZIP_DIRECTORY_SIZE || fseek(f, offset, SEEK_SET) < 0 || fread(buf, 1, next, f) != next) return false;
-        len = next + carry;
-        uchar *search = &buf[next-1];
-        for(; search >= buf; search--) if(*(uint *)search == signature) break; 
-        if(search >= buf) { src = search; break; }
-    }        
-
-    if(!src || &buf[len] - src < ZIP_DIRECTORY_SIZE) return false;
-
-    hdr.signature = lilswap(*(uint *)src); src += 4;
-    hdr.disknumber = lilswap(*(ushort *)src); src += 2;
-    hdr.directorydisk = lilswap(*(ushort *)src); src += 2;
-    hdr.diskentries = lilswap(*(ushort *)src); src += 2;
-    hdr.entries = lilswap(*(ushort *)src); src += 2;
-    hdr.size = lilswap(*(uint *)src); src += 4;
-    hdr.offset = lilswap(*(uint *)src); src += 4;
-    hdr.commentlength = lilswap(*(ushort *)src); src += 2;
+    for(; src >= end; src--) if(*(const uint *)src == signature) break;
+    if(src < end) return false;
+
+    hdr.signature = lilswap(*(const uint *)src); src += 4;
+    hdr.disknumber = lilswap(*(const ushort *)src); src += 2;
+    hdr.directorydisk = lilswap(*(const ushort *)src); src += 2;
+    hdr.diskentries = lilswap(*(const ushort *)src); src += 2;
+    hdr.entries = lilswap(*(const ushort *)src); src += 2;
+    hdr.size = lilswap(*(const uint *)src); src += 4;
+    hdr.offset = lilswap(*(const uint *)src); src += 4;
+    hdr.commentlength = lilswap(*(const ushort *)src); src += 2;
 
     if(hdr.signature != ZIP_DIRECTORY_SIGNATURE || hdr.disknumber != hdr.directorydisk || hdr.diskentries != hdr.entries) return false;
 
@@ -119,32 +179,32 @@ static bool findzipdirectory(FILE *f, zipdirectoryheader &hdr)
 VAR(dbgzip, 0, 0, 1);
 #endif
 
-static bool readzipdirectory(const char *archname, FILE *f, int entries, int offset, uint size, vector<zipfile> &files)
+static bool readzipdirectory(const char *archname, const uchar *data, size_t datasize, int entries, uint offset, uint size, vector<zipfile> &files)
 {
-    uchar *buf = new uchar[size], *src = buf;
-    if(fseek(f, offset, SEEK_SET) < 0 || fread(buf, 1, size, f) != size) { delete[] buf; return false; }
+    if(size_t(offset) + size > datasize) return false;
+    const uchar *buf = &data[offset], *src = buf;
     loopi(entries)
     {
         if(src + ZIP_FILE_SIZE > &buf[size]) break;
 
         zipfileheader hdr;
-        hdr.signature = lilswap(*(uint *)src); src += 4;
-        hdr.version = lilswap(*(ushort *)src); src += 2;
-        hdr.needversion = lilswap(*(ushort *)src); src += 2;
-        hdr.flags = lilswap(*(ushort *)src); src += 2;
-        hdr.compression = lilswap(*(ushort *)src); src += 2;
-        hdr.modtime = lilswap(*(ushort *)src); src += 2;
-        hdr.moddate = lilswap(*(ushort *)src); src += 2;
-        hdr.crc32 = lilswap(*(uint *)src); src += 4;
-        hdr.compressedsize = lilswap(*(uint *)src); src += 4;
-        hdr.uncompressedsize = lilswap(*(uint *)src); src += 4;
-        hdr.namelength = lilswap(*(ushort *)src); src += 2;
-        hdr.extralength = lilswap(*(ushort *)src); src += 2;
-        hdr.commentlength = lilswap(*(ushort *)src); src += 2;
-        hdr.disknumber = lilswap(*(ushort *)src); src += 2;
-        hdr.internalattribs = lilswap(*(ushort *)src); src += 2;
-        hdr.externalattribs = lilswap(*(uint *)src); src += 4;
-        hdr.offset = lilswap(*(uint *)src); src += 4;
+        hdr.signature = lilswap(*(const uint *)src); src += 4;
+        hdr.version = lilswap(*(const ushort *)src); src += 2;
+        hdr.needversion = lilswap(*(const ushort *)src); src += 2;
+        hdr.flags = lilswap(*(const ushort *)src); src += 2;
+        hdr.compression = lilswap(*(const ushort *)src); src += 2;
+        hdr.modtime = lilswap(*(const ushort *)src); src += 2;
+        hdr.moddate = lilswap(*(const ushort *)src); src += 2;
+        hdr.crc32 = lilswap(*(const uint *)src); src += 4;
+        hdr.compressedsize = lilswap(*(const uint *)src); src += 4;
+        hdr.uncompressedsize = lilswap(*(const uint *)src); src += 4;
+        hdr.namelength = lilswap(*(const ushort *)src); src += 2;
+        hdr.extralength = lilswap(*(const ushort *)src); src += 2;
+        hdr.commentlength = lilswap(*(const ushort *)src); src += 2;
+        hdr.disknumber = lilswap(*(const ushort *)src); src += 2;
+        hdr.internalattribs = lilswap(*(const ushort *)src); src += 2;
+        hdr.externalattribs = lilswap(*(const uint *)src); src += 4;
+        hdr.offset = lilswap(*(const uint *)src); src += 4;
         if(hdr.signature != ZIP_FILE_SIGNATURE) break;
         if(!hdr.namelength || !hdr.uncompressedsize || (hdr.compression && (hdr.compression != Z_DEFLATED || !hdr.compressedsize)))
         {
@@ -171,28 +231,25 @@ static bool readzipdirectory(const char *archname, FILE *f, int entries, int off
 
         src += hdr.namelength + hdr.extralength + hdr.commentlength;
     }
-    delete[] buf;
 
     return files.length() > 0;
 }
 
-static bool readlocalfileheader(FILE *f, ziplocalfileheader &h, uint offset)
+static bool readlocalfileheader(const ziparchive &arch, ziplocalfileheader &h, uint offset)
 {
-    uchar buf[ZIP_LOCAL_FILE_SIZE];
-    if(fseek(f, offset, SEEK_SET) < 0 || fread(buf, 1, ZIP_LOCAL_FILE_SIZE, f) != ZIP_LOCAL_FILE_SIZE)
-        return false;
-    uchar *src = buf;
-    h.signature = lilswap(*(uint *)src); src += 4;
-    h.version = lilswap(*(ushort *)src); src += 2;
-    h.flags = lilswap(*(ushort *)src); src += 2;
-    h.compression = lilswap(*(ushort *)src); src += 2;
-    h.modtime = lilswap(*(ushort *)src); src += 2;
-    h.moddate = lilswap(*(ushort *)src); src += 2;
-    h.crc32 = lilswap(*(uint *)src); src += 4;
-    h.compressedsize = lilswap(*(uint *)src); src += 4;
-    h.uncompressedsize = lilswap(*(uint *)src); src += 4;
-    h.namelength = lilswap(*(ushort *)src); src += 2;
-    h.extralength = lilswap(*(ushort *)src); src += 2;
+    if(size_t(offset) + ZIP_LOCAL_FILE_SIZE > arch.datasize) return false;
+    const uchar *src = &arch.data[offset];
+    h.signature = lilswap(*(const uint *)src); src += 4;
+    h.version = lilswap(*(const ushort *)src); src += 2;
+    h.flags = lilswap(*(const ushort *)src); src += 2;
+    h.compression = lilswap(*(const ushort *)src); src += 2;
+    h.modtime = lilswap(*(const ushort *)src); src += 2;
+    h.moddate = lilswap(*(const ushort *)src); src += 2;
+    h.crc32 = lilswap(*(const uint *)src); src += 4;
+    h.compressedsize = lilswap(*(const uint *)src); src += 4;
+    h.uncompressedsize = lilswap(*(const uint *)src); src += 4;
+    h.namelength = lilswap(*(const ushort *)src); src += 2;
+    h.extralength = lilswap(*(const ushort *)src); src += 2;
     if(h.signature != ZIP_LOCAL_FILE_SIGNATURE) return false;
     // h.uncompressedsize or h.compressedsize may be zero - so don't validate
     return true;
@@ -200,6 +257,30 @@ static bool readlocalfileheader(FILE *f, ziplocalfileheader &h, uint offset)
 
 static vector<ziparchive *> archives;
 
+/// Where each mounted path is found, the archive added last wins.
+struct zipindexentry
+{
+    ziparchive *arch;
+    zipfile *file;
+};
+static hashtable<const char *, zipindexentry> *zipindex = NULL;
+
+static void buildzipindex()
+{
+    int numfiles = 0, size = 1<<10;
+    loopv(archives) numfiles += archives[i]->files.numelems;
+    while(size < numfiles) size <<= 1;
+
+    DELETEP(zipindex);
+    zipindex = new hashtable<const char *, zipindexentry>(size);
+    loopvj(archives) enumerate(archives[j]->files, zipfile, f,
+    {
+        zipindexentry &e = (*zipindex)[f.name];
+        e.arch = archives[j];
+        e.file = &f;
+    });
+}
+
 ziparchive *findzip(const char *name)
 {
     loopv(archives) if(!strcmp(name, archives[i]->name)) return archives[i];
@@ -281,26 +362,26 @@ bool addzip(const char *name, const char *mount = NULL, const char *strip = NULL
         return true;
     }
  
-    FILE *f = fopen(findfile(pname, "rb"), "rb");
-    if(!f) 
+    ziparchive *arch = new ziparchive;
+    if(!arch->map(findfile(pname, "rb")))
     {
         spdlog::get("global")->error("could not open file {0}", pname);
+        delete arch;
         return false;
     }
     zipdirectoryheader h;
     vector<zipfile> files;
-    if(!findzipdirectory(f, h) || !readzipdirectory(pname, f, h.entries, h.offset, h.size, files))
+    if(!findzipdirectory(arch->data, arch->datasize, h) || !readzipdirectory(pname, arch->data, arch->datasize, h.entries, h.offset, h.size, files))
     {
         spdlog::get("global")->error("could not read directory in zip {0}", pname);
-        fclose(f);
+        delete arch;
         return false;
     }
     
-    ziparchive *arch = new ziparchive;
     arch->name = newstring(pname);
-    arch->data = f;
     mountzip(*arch, files, mount, strip);
     archives.add(arch);
+    buildzipindex();
 
     spdlog::get("global")->info("added zip {0}", pname);
     return true;
@@ -327,24 +408,20 @@ bool removezip(const char *name)
     spdlog::get("global")->info("removed zip {0}", exists->name);
     archives.removeobj(exists); 
     delete exists;
+    buildzipindex();
     return true;
 }
 
+/// Reads straight out of the archive's memory: stored files get copied from there, deflated ones inflated from there.
 struct zipstream : stream
 {
-    enum
-    {
-        BUFSIZE  = 16384
-    };
-
     ziparchive *arch;
     zipfile *info;
     z_stream zfile;
-    uchar *buf;
     uint reading;
     bool ended;
 
-    zipstream() : arch(NULL), info(NULL), buf(NULL), reading(~0U), ended(false)
+    zipstream() : arch(NULL), info(NULL), reading(~0U), ended(false)
     {
         zfile.zalloc = NULL;
         zfile.zfree = NULL;
@@ -358,20 +435,11 @@ struct zipstream : stream
         close();
     }
 
-    void readbuf(uint size = BUFSIZE)
+    /// Hand all the compressed data to zlib at once.
+    void resetinput()
     {
-        if(!zfile.avail_in) zfile.next_in = (Bytef *)buf;
-        size = min(size, uint(&buf[BUFSIZE] - &zfile.next_in[zfile.avail_in]));
-        if(arch->owner != this)
-        {
-            arch->owner = NULL;
-            if(fseek(arch->data, reading, SEEK_SET) >= 0) arch->owner = this;
-            else return;
-        }
-        uint remaining = info->offset + info->compressedsize - reading,
-             n = arch->owner == this ? fread(zfile.next_in + zfile.avail_in, 1, min(size, remaining), arch->data) : 0U;
-        zfile.avail_in += n;
-        reading += n;
+        zfile.next_in = (Bytef *)&arch->data[info->offset];
+        zfile.avail_in = info->compressedsize;
     }
 
     bool open(ziparchive *a, zipfile *f)
@@ -379,10 +447,10 @@ struct zipstream : stream
         if(f->offset == ~0U)
         {
             ziplocalfileheader h;
-            a->owner = NULL;
-            if(!readlocalfileheader(a->data, h, f->header)) return false;
+            if(!readlocalfileheader(*a, h, f->header)) return false;
             f->offset = f->header + ZIP_LOCAL_FILE_SIZE + h.namelength + h.extralength;
         }
+        if(size_t(f->offset) + (f->compressedsize ? f->compressedsize : f->size) > a->datasize) return false;
 
         if(f->compressedsize && inflateInit2(&zfile, -MAX_WBITS) != Z_OK) return false;
 
@@ -391,7 +459,7 @@ struct zipstream : stream
         info = f;
         reading = f->offset;
         ended = false;
-        if(f->compressedsize) buf = new uchar[BUFSIZE];
+        if(f->compressedsize) resetinput();
         return true;
     }
 
@@ -414,8 +482,7 @@ struct zipstream : stream
     void close()
     {
         stopreading();
-        DELETEA(buf);
-        if(arch) { arch->owner = NULL; arch->openfiles--; arch = NULL; }
+        if(arch) { arch->openfiles--; arch = NULL; }
     }
 
     offset size() { return info->size; }
@@ -435,9 +502,6 @@ struct zipstream : stream
                 default: return false;
             } 
             pos = clamp(pos, offset(info->offset), offset(info->offset + info->size));
-            arch->owner = NULL;
-            if(fseek(arch->data, int(pos), SEEK_SET) < 0) return false;
-            arch->owner = this;
             reading = pos;
             ended = false;
             return true;
@@ -453,11 +517,9 @@ struct zipstream : stream
 
         if(pos >= (offset)info->size)
         {
-            reading = info->offset + info->compressedsize;
             zfile.next_in += zfile.avail_in;
             zfile.avail_in = 0;
             zfile.total_in = info->compressedsize; 
-            arch->owner = NULL;
             ended = false;
             return true;
         }
@@ -466,19 +528,9 @@ struct zipstream : stream
         if(pos >= (offset)zfile.total_out) pos -= zfile.total_out;
         else 
         {
-            if(zfile.next_in && zfile.total_in <= uint(zfile.next_in - buf))
-            {
-                zfile.avail_in += zfile.total_in;
-                zfile.next_in -= zfile.total_in;
-            }
-            else
-            {
-                arch->owner = NULL;
-                zfile.avail_in = 0;
-                zfile.next_in = NULL;
-                reading = info->offset;
-            }
+            // all input is still there, so just start over
             inflateReset(&zfile);
+            resetinput();
         }
 
         uchar skip[512];
@@ -498,14 +550,8 @@ struct zipstream : stream
         if(reading == ~0U || !buf || !len) return 0;
         if(!info->compressedsize)
         {
-            if(arch->owner != this)
-            {
-                arch->owner = NULL;
-                if(fseek(arch->data, reading, SEEK_SET) < 0) { stopreading(); return 0; }
-                arch->owner = this;
-            }
-              
-            size_t n = fread(buf, 1, min(len, size_t(info->size + info->offset - reading)), arch->data);
+            size_t n = min(len, size_t(info->size + info->offset - reading));
+            memcpy(buf, &arch->data[reading], n);
             reading += n;
             if(n < len) ended = true;
             return n;
@@ -515,7 +561,6 @@ struct zipstream : stream
         zfile.avail_out = len;
         while(zfile.avail_out > 0)
         {
-            if(!zfile.avail_in) readbuf(BUFSIZE);
             int err = inflate(&zfile, Z_NO_FLUSH);
             if(err != Z_OK) 
             {
@@ -537,26 +582,17 @@ struct zipstream : stream
 stream *openzipfile(const char *name, const char *mode)
 {
     for(; *mode; mode++) if(*mode=='w' || *mode=='a') return NULL;
-    loopvrev(archives)
-    {
-        ziparchive *arch = archives[i];
-        zipfile *f = arch->files.access(name);
-        if(!f) continue;
-        zipstream *s = new zipstream;
-        if(s->open(arch, f)) return s;
-        delete s;
-    }
+    zipindexentry *e = zipindex ? zipindex->access(name) : NULL;
+    if(!e) return NULL;
+    zipstream *s = new zipstream;
+    if(s->open(e->arch, e->file)) return s;
+    delete s;
     return NULL;
 }
 
 bool findzipfile(const char *name)
 {
-    loopvrev(archives)
-    {
-        ziparchive *arch = archives[i];
-        if(arch->files.access(name)) return true;
-    }
-    return false;
+    return zipindex && zipindex->access(name);
 }
 
 int listzipfiles(const char *dir, const char *ext, vector<char *> &files)
@@ -591,6 +627,35 @@ int listzipfiles(const char *dir, const char *ext, vector<char *> &files)
 }
 
 #ifndef STANDALONE
+/// Look up and read every file of the mounted zips iterations times and log the lookups/s and MB/s.
+void benchzip(int *iterations)
+{
+    if(!zipindex || !zipindex->numelems) { spdlog::get("global")->error("benchzip: no zips added"); return; }
+    int n = max(*iterations, 1), found = 0;
+    vector<const char *> names;
+    enumeratek(*zipindex, const char *, name, names.add(name));
+
+    inexor::util::Stopwatch sw;
+    loopk(n) loopv(names) if(findzipfile(names[i])) found++;
+    double lookupms = sw.elapsed_ms();
+
+    uchar buf[65536];
+    size_t bytes = 0;
+    sw.reset();
+    loopk(n) loopv(names)
+    {
+        stream *f = openzipfile(names[i], "rb");
+        if(!f) continue;
+        for(size_t len; (len = f->read(buf, sizeof(buf))) > 0;) bytes += len;
+        delete f;
+    }
+    double readms = sw.elapsed_ms();
+
+    spdlog::get("global")->info("benchzip: {0} files in {1} zips: {2:.0f} lookups/s ({3} found), read {4:.1f} MB in {5:.1f} ms ({6:.1f} MB/s)",
+        names.length(), archives.length(), found / max(lookupms, 1e-3) * 1000, found, bytes / (1024.0*1024.0), readms, bytes / (1024.0*1024.0) / max(readms, 1e-3) * 1000);
+}
+COMMAND(benchzip, "i");
+
 ICOMMAND(addzip, "sss", (const char *name, const char *mount, const char *strip), addzip(name, mount[0] ? mount : NULL, strip[0] ? strip : NULL));
 ICOMMAND(removezip, "s", (const char *name), removezip(name));
 #endif
@@ -0,0 +1,103 @@
+#include <cstdint>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/IpTrie.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace std;
+using namespace inexor::util;
+
+static uint32_t ip(uint32_t a, uint32_t b, uint32_t c, uint32_t d) { return a << 24 | b << 16 | c << 8 | d; }
+
+test(IpTrie, ExactMatch) {
+    IpTrie t;
+    expectNot(t.contains(ip(1, 2, 3, 4))) << "An empty trie should not contain anything";
+    t.add(ip(1, 2, 3, 4), 0xFFFFFFFF);
+    t.add(ip(1, 2, 3, 6), 0xFFFFFFFF);
+    expect(t.contains(ip(1, 2, 3, 4)));
+    expect(t.contains(ip(1, 2, 3, 6)));
+    expectNot(t.contains(ip(1, 2, 3, 5))) << "Ips next to the added ones should not match";
+    expectNot(t.contains(ip(1, 2, 3, 0)));
+    expectEq(t.size(), 2u);
+}
+
+test(IpTrie, PrefixMatch) {
+    IpTrie t;
+    t.add(ip(10, 0, 0, 0), 0xFF000000);   // 10.0.0.0/8
+    t.add(ip(10, 1, 0, 0), 0xFFFF0000);   // 10.1.0.0/16
+    t.add(ip(10, 1, 2, 128), 0xFFFFFF80); // 10.1.2.128/25
+    t.add(ip(99, 88, 77, 66), 0xFFFF0000); // host bits get ignored
+
+    const IpTrie::Mask *m = t.find(ip(10, 200, 0, 1));
+    assert(m);
+    expectEq(m->mask, 0xFF000000u);
+    m = t.find(ip(10, 1, 9, 9));
+    assert(m);
+    expectEq(m->mask, 0xFFFF0000u) << "The most specific mask should win";
+    m = t.find(ip(10, 1, 2, 200));
+    assert(m);
+    expectEq(m->mask, 0xFFFFFF80u);
+    m = t.find(ip(10, 1, 2, 100));
+    assert(m);
+    expectEq(m->mask, 0xFFFF0000u);
+    m = t.find(ip(99, 88, 1, 2));
+    assert(m);
+    expectEq(m->ip, ip(99, 88, 0, 0));
+
+    expectNot(t.contains(ip(11, 0, 0, 0)));
+    expectNot(t.contains(ip(9, 255, 255, 255)));
+}
+
+test(IpTrie, NonPrefixMask) {
+    IpTrie t;
+    t.add(ip(1, 0, 3, 4), 0xFF00FFFF); // 1.*.3.4
+    expect(t.contains(ip(1, 77, 3, 4)));
+    expectNot(t.contains(ip(1, 77, 3, 5)));
+    expect(t.remove(ip(1, 0, 3, 4), 0xFF00FFFF));
+    expectNot(t.contains(ip(1, 77, 3, 4)));
+}
+
+test(IpTrie, Remove) {
+    IpTrie t;
+    t.add(ip(10, 0, 0, 0), 0xFF000000);
+    t.add(ip(10, 1, 0, 0), 0xFFFF0000);
+    t.add(ip(10, 1, 0, 0), 0xFFFF0000);
+
+    expectNot(t.remove(ip(10, 2, 0, 0), 0xFFFF0000)) << "Removing a mask which wasn't added should fail";
+    expectNot(t.remove(ip(10, 0, 0, 0), 0xFFFF0000));
+    expectEq(t.size(), 3u);
+
+    expect(t.remove(ip(10, 1, 0, 0), 0xFFFF0000));
+    expectEq(t.find(ip(10, 1, 2, 3))->mask, 0xFFFF0000u) << "A mask added twice should need to be removed twice";
+    expect(t.remove(ip(10, 1, 0, 0), 0xFFFF0000));
+    expectEq(t.find(ip(10, 1, 2, 3))->mask, 0xFF000000u) << "The shorter mask should match once the longer one is gone";
+    expect(t.remove(ip(10, 0, 0, 0), 0xFF000000));
+    expectNot(t.contains(ip(10, 1, 2, 3)));
+    expect(t.empty());
+
+    t.add(ip(10, 1, 0, 0), 0xFFFF0000);
+    expect(t.contains(ip(10, 1, 2, 3))) << "Masks should be addable again after removing them";
+}
+
+test(IpTrie, MatchesLinearScan) {
+    vector<IpTrie::Mask> masks;
+    IpTrie t;
+    for (int i = 0; i < 2000; i++) {
+        int len = rand<int>(0, 32);
+        IpTrie::Mask m;
+        m.mask = len ? 0xFFFFFFFFu << (32 - len) : 0;
+        if (len < 8) m.mask |= 0xFF; // a few which are no prefix
+        m.ip = rand<uint32_t>() & m.mask;
+        masks.push_back(m);
+        t.add(m.ip, m.mask);
+    }
+    for (int i = 0; i < 20000; i++) {
+        uint32_t host = rand<uint32_t>();
+        if (i % 2) host = masks[rand<size_t>(0, masks.size() - 1)].ip | (rand<uint32_t>() & 0xFF);
+        bool linear = false;
+        for (const IpTrie::Mask &m : masks) linear |= (host & m.mask) == m.ip;
+        expectEq(t.contains(host), linear) << host;
+    }
+}
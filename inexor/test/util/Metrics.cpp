@@ -0,0 +1,60 @@
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/Metrics.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace std;
+using namespace inexor::util;
+
+test(Metrics, HistogramBuckets) {
+    for (uint64_t v : { 0ull, 1ull, 31ull, 32ull, 33ull, 1000ull, 123456789ull, ~0ull }) {
+        int b = Histogram::bucket_of(v);
+        assert(b >= 0 && b < Histogram::bucket_count) << v;
+        expect(Histogram::bucket_max(b) >= v) << v;
+        expect(Histogram::bucket_max(b) - v <= v / Histogram::sub_count) << "Relative error too large for " << v;
+        if (b > 0) {
+            expect(Histogram::bucket_max(b - 1) < v) << "Buckets should not overlap at " << v;
+        }
+    }
+}
+
+test(Metrics, HistogramQuantiles) {
+    Histogram h;
+    expectEq(h.quantile(0.5), 0u);
+    for (uint64_t i = 1; i <= 1000; i++) h.record(i);
+    expectEq(h.count(), 1000u);
+    expectEq(h.sum(), 500500u);
+    expectEq(h.max(), 1000u);
+    expect(h.quantile(0.5) >= 500 && h.quantile(0.5) <= 516) << h.quantile(0.5);
+    expect(h.quantile(0.99) >= 990 && h.quantile(0.99) <= 1000) << h.quantile(0.99);
+    expectEq(h.quantile(1), 1000u) << "Quantiles should never exceed the maximum";
+}
+
+test(Metrics, Render) {
+    Counter &a = Metrics::counter("test_packets_total", "Packets", "chan=\"0\"");
+    Counter &b = Metrics::counter("test_packets_total", "Packets", "chan=\"1\"");
+    expectEq(&a, &Metrics::counter("test_packets_total", "Packets", "chan=\"0\"")) << "Registering twice should return the same counter";
+    thread t([&a]() { for (int i = 0; i < 1000; i++) a.add(); });
+    for (int i = 0; i < 1000; i++) a.add();
+    t.join();
+    b.add(7);
+
+    Histogram &h = Metrics::histogram("test_tick_seconds", "Tick", 1e-6);
+    h.record(2000);
+    Metrics::add_collector([](string &out) {
+        Metrics::write_header(out, "test_clients", "Clients", "gauge");
+        Metrics::write_sample(out, "test_clients", "", 3);
+    });
+
+    string s = Metrics::render();
+    expect(s.find("# TYPE test_packets_total counter\n") != string::npos) << s;
+    expect(s.find("test_packets_total{chan=\"0\"} 2000\n") != string::npos) << s;
+    expect(s.find("test_packets_total{chan=\"1\"} 7\n") != string::npos) << s;
+    expect(s.find("# TYPE test_tick_seconds summary\n") != string::npos) << s;
+    expect(s.find("test_tick_seconds{quantile=\"1\"} 0.002") != string::npos) << s;
+    expect(s.find("test_tick_seconds_count 1\n") != string::npos) << s;
+    expect(s.find("test_clients 3\n") != string::npos) << s;
+}
@@ -0,0 +1,105 @@
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/PacketPool.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace std;
+using namespace inexor::util;
+
+static int callbacks = 0;
+static void countcallback(ENetPacket *) { callbacks++; }
+
+test(PacketPool, AcquireAndReuse) {
+    PacketPool pool(512, 4);
+    ENetPacket *p = pool.create(100, ENET_PACKET_FLAG_RELIABLE);
+    assert(p);
+    expect(PacketPool::pooled(p));
+    expectEq(p->dataLength, 100u);
+    expect(p->flags & ENET_PACKET_FLAG_RELIABLE);
+    expectEq(pool.allocated, 1u);
+    expectEq(pool.in_use(), 1u);
+
+    enet_uint8 *data = p->data;
+    enet_packet_destroy(p);
+    expectEq(pool.in_use(), 0u);
+    expectEq(pool.free_count(), 1u) << "Destroying the packet should hand its block back";
+
+    p = pool.create(512, 0);
+    expectEq(p->data, data) << "The next packet should reuse the free block";
+    expectEq(pool.reused, 1u);
+    expectEq(pool.allocated, 1u);
+    enet_packet_destroy(p);
+}
+
+test(PacketPool, FreeCallback) {
+    PacketPool pool(512, 4);
+    callbacks = 0;
+    ENetPacket *p = pool.create(10, 0);
+    PacketPool::set_free_callback(p, countcallback);
+    expect(PacketPool::pooled(p)) << "Setting a callback should keep the block's own";
+    enet_packet_destroy(p);
+    expectEq(callbacks, 1);
+    expectEq(pool.free_count(), 1u);
+
+    p = pool.create(10, 0);
+    enet_packet_destroy(p);
+    expectEq(callbacks, 1) << "A reused block should not keep the callback of its last packet";
+
+    p = pool.create(1000, 0);
+    expectNot(PacketPool::pooled(p)) << "Packets larger than a block should get memory of their own";
+    PacketPool::set_free_callback(p, countcallback);
+    enet_packet_destroy(p);
+    expectEq(callbacks, 2);
+    expectEq(pool.unpooled, 1u);
+}
+
+test(PacketPool, Grow) {
+    PacketPool pool(512, 4);
+    ENetPacket *p = pool.create(100, ENET_PACKET_FLAG_RELIABLE);
+    for (int i = 0; i < 100; i++) p->data[i] = enet_uint8(i);
+
+    ENetPacket *same = PacketPool::grow(p, 100, 512);
+    expectEq(same, p) << "Growing within the block should keep the packet";
+    expectEq(p->dataLength, 512u);
+
+    callbacks = 0;
+    PacketPool::set_free_callback(p, countcallback);
+    ENetPacket *grown = PacketPool::grow(p, 100, 2000);
+    assertNeq(grown, p);
+    expectNot(PacketPool::pooled(grown));
+    expectEq(grown->dataLength, 2000u);
+    expect(grown->flags & ENET_PACKET_FLAG_RELIABLE);
+    expectNot(grown->flags & ENET_PACKET_FLAG_NO_ALLOCATE);
+    for (int i = 0; i < 100; i++) expectEq(grown->data[i], enet_uint8(i));
+    expectEq(callbacks, 1) << "Replacing the packet should destroy the old one";
+    expectEq(pool.free_count(), 1u);
+    expectEq(pool.in_use(), 0u);
+
+    // unpooled packets get resized by ENet, reallocating their data
+    ENetPacket *bigger = PacketPool::grow(grown, 2000, 4000);
+    expectEq(bigger, grown);
+    expectEq(bigger->dataLength, 4000u);
+    for (int i = 0; i < 100; i++) expectEq(bigger->data[i], enet_uint8(i));
+    enet_packet_destroy(bigger);
+}
+
+test(PacketPool, EveryBlockReturns) {
+    PacketPool pool(256, 8);
+    vector<ENetPacket *> packets;
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 20; i++) {
+            ENetPacket *p = pool.create(rand<size_t>(1, 256), 0);
+            if (i % 3 == 0) p = PacketPool::grow(p, p->dataLength, 300);
+            packets.push_back(p);
+        }
+        expectEq(pool.in_use(), 13u) << "The 7 grown ones should have given their blocks back already";
+        for (ENetPacket *p : packets) enet_packet_destroy(p);
+        packets.clear();
+        expectEq(pool.in_use(), 0u) << "Every block should be back after destroying all packets";
+        expectEq(pool.free_count(), 8u) << "No more than max_free blocks should be kept";
+    }
+    expectEq(pool.allocated + pool.reused, 60u);
+}
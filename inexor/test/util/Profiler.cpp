@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/Profiler.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace std;
+using namespace inexor::util;
+
+static int count_lines(const string &s, const string &needle) {
+    int n = 0;
+    istringstream in(s);
+    string line;
+    while (getline(in, line))
+        if (line.compare(0, needle.size(), needle) == 0) n++;
+    return n;
+}
+
+test(Profiler, Summary) {
+    Profiler::start();
+    for (int i = 0; i < 10; i++) {
+        ProfileScope outer("outer");
+        ProfileScope inner("inner");
+    }
+    Profiler::stop();
+
+    { ProfileScope z("stopped"); }
+
+    string s = Profiler::summary();
+    expectEq(count_lines(s, "outer "), 1) << s;
+    expectEq(count_lines(s, "inner "), 1) << s;
+    expectNot(count_lines(s, "stopped")) << "Nothing should get recorded after stop()";
+    expect(s.find("10 calls") != string::npos) << s;
+    expectNot(Profiler::recording()) << "summary() shouldn't resume a stopped profiler";
+}
+
+test(Profiler, RingBufferAndThreads) {
+    Profiler::start(16);
+    thread t([]() {
+        for (int i = 0; i < 100; i++) ProfileScope z("worker");
+    });
+    for (int i = 0; i < 5; i++) ProfileScope z("main");
+    t.join();
+    Profiler::stop();
+
+    string s = Profiler::summary();
+    expect(s.find("16 calls") != string::npos) << "Only the last 16 zones of a thread should be kept\n" << s;
+    expect(s.find("5 calls") != string::npos) << s;
+}
+
+test(Profiler, ExportTrace) {
+    Profiler::start();
+    { ProfileScope z("exported \"zone\""); }
+    Profiler::stop();
+
+    const char *file = "profiler_test_trace.json";
+    assert(Profiler::export_trace(file));
+    ifstream in(file);
+    stringstream json;
+    json << in.rdbuf();
+    in.close();
+    remove(file);
+
+    expectEq(json.str().compare(0, 15, "{\"displayTimeUn"), 0) << json.str();
+    expect(json.str().find("\"name\":\"exported \\\"zone\\\"\",\"ph\":\"X\"") != string::npos)
+        << "Zone names should be escaped\n" << json.str();
+}
@@ -0,0 +1,52 @@
+#include <memory>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/SpscQueue.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace std;
+using namespace inexor::util;
+
+test(SpscQueue, FifoAndBounds) {
+    SpscQueue<int> q(5);
+    expectEq(q.capacity(), 8u) << "Capacity should be rounded up to a power of two";
+    int v = -1;
+    expectNot(q.pop(v)) << "A new queue should be empty";
+    for (int i = 0; i < 8; i++) assert(q.push(i));
+    expectNot(q.push(8)) << "push() should fail once the queue is full";
+    expectEq(q.size(), 8u);
+    for (int i = 0; i < 8; i++) {
+        assert(q.pop(v));
+        expectEq(v, i) << "Elements should come out in the order they went in";
+    }
+    expectNot(q.pop(v));
+    expect(q.empty());
+}
+
+test(SpscQueue, MoveOnly) {
+    SpscQueue<unique_ptr<int>> q(4);
+    assert(q.push(unique_ptr<int>(new int(42))));
+    unique_ptr<int> p;
+    assert(q.pop(p));
+    expectEq(*p, 42);
+}
+
+test(SpscQueue, TwoThreads) {
+    const int count = 200000;
+    SpscQueue<int> q(64);
+    thread producer([&q, count]() {
+        for (int i = 0; i < count; i++)
+            while (!q.push(i)) this_thread::yield();
+    });
+    int next = 0;
+    while (next < count) {
+        int v;
+        if (!q.pop(v)) { this_thread::yield(); continue; }
+        assertEq(v, next) << "Wrapping around the ring lost or reordered elements";
+        next++;
+    }
+    producer.join();
+    expect(q.empty());
+}
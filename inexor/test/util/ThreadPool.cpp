@@ -0,0 +1,48 @@
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/ThreadPool.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace std;
+using namespace inexor::util;
+
+test(ThreadPool, SubmitAndWait) {
+    ThreadPool pool(3);
+    atomic<int> sum(0);
+    for (int i = 1; i <= 100; i++) pool.submit([&sum, i]() { sum += i; });
+    pool.wait();
+    expectEq(sum, 5050) << "wait() should only return after all jobs ran";
+}
+
+test(ThreadPool, ParallelForCoversRange) {
+    ThreadPool pool(4);
+    for (size_t count : {0, 1, 7, 64, 1000, 4097}) {
+        vector<int> hits(count, 0);
+        pool.parallel_for(count, 16, [&hits](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) hits[i]++;
+        });
+        for (size_t i = 0; i < count; i++)
+            assertEq(hits[i], 1) << "Element " << i << " of " << count << " should be visited exactly once";
+    }
+}
+
+test(ThreadPool, ParallelForNested) {
+    ThreadPool pool(2);
+    atomic<int> n(0);
+    pool.parallel_for(8, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            pool.parallel_for(100, 10, [&n](size_t b, size_t e) { n += int(e - b); });
+    });
+    expectEq(n, 800) << "Nested parallel_for calls should neither deadlock nor lose work";
+}
+
+test(ThreadPool, ParallelForRethrows) {
+    ThreadPool pool(2);
+    expectThrow(pool.parallel_for(100, 1, [](size_t begin, size_t end) {
+        if (begin <= 50 && 50 < end) throw runtime_error("fail");
+    }), runtime_error);
+}
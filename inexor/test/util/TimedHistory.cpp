@@ -0,0 +1,76 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "inexor/util/TimedHistory.hpp"
+#include "inexor/test/helpers.hpp"
+
+using namespace std;
+using namespace inexor::util;
+
+typedef TimedHistory<int, 4> History;
+
+static vector<int> during(const History &h, int from, int to) {
+    vector<int> r;
+    h.during(from, to, [&](int v) { r.push_back(v); });
+    return r;
+}
+
+test(TimedHistory, Empty) {
+    History h;
+    expectEq(h.size(), 0u);
+    expect(during(h, 0, 1000).empty()) << "An empty history should not call f";
+}
+
+test(TimedHistory, During) {
+    History h;
+    h.add(100, 1);
+    h.add(200, 2);
+    h.add(300, 3);
+
+    expectEq(during(h, 150, 250), vector<int>({1, 2}))
+        << "The sample before from should be included, it was current until the next";
+    expectEq(during(h, 200, 300), vector<int>({2, 3})) << "Samples right at from and to should be included";
+    expectEq(during(h, 0, 50), vector<int>()) << "Nothing was known before the first sample";
+    expectEq(during(h, 0, 100), vector<int>({1}));
+    expectEq(during(h, 400, 500), vector<int>({3})) << "The last sample stays current after it arrived";
+    expectEq(during(h, 210, 220), vector<int>({2}));
+}
+
+test(TimedHistory, Overwrite) {
+    History h;
+    for (int i = 1; i <= 6; i++) h.add(i * 100, i);
+    expectEq(h.size(), 4u);
+    expectEq(h.get(0).value, 3) << "The oldest samples should have been overwritten";
+    expectEq(h.get(3).value, 6);
+    expectEq(h.get(3).millis, 600);
+    expectEq(during(h, 0, 1000), vector<int>({3, 4, 5, 6}));
+    expectEq(during(h, 0, 200), vector<int>()) << "Overwritten samples should not show up anymore";
+
+    h.reset();
+    expectEq(h.size(), 0u);
+    expect(during(h, 0, 1000).empty());
+}
+
+test(TimedHistory, MatchesLinearScan) {
+    TimedHistory<int, 16> h;
+    vector<pair<int, int>> all;
+    int millis = 0;
+    for (int i = 0; i < 200; i++) {
+        millis += rand<int>(0, 50);
+        h.add(millis, i);
+        all.push_back(make_pair(millis, i));
+
+        int from = millis - rand<int>(0, 600), to = from + rand<int>(0, 300);
+        size_t first = all.size() - h.size();
+        vector<int> expected;
+        for (size_t j = first; j < all.size(); j++) {
+            bool until = j + 1 < all.size() && all[j + 1].first > from;
+            if (all[j].first <= to && (all[j].first >= from || j + 1 == all.size() || until))
+                expected.push_back(all[j].second);
+        }
+        vector<int> got;
+        h.during(from, to, [&](int v) { got.push_back(v); });
+        expectEq(got, expected) << from << " " << to;
+    }
+}
@@ -79,30 +79,37 @@ SDL_Surface *fixsurfaceformat(SDL_Surface *s)
     return s;
 }
 
+std::mutex texturefilelock;
+
 bool canloadsurface(const char *name)
 {
+    std::lock_guard<std::mutex> guard(texturefilelock);
     stream *f = openfile(name, "rb");
     if(!f) return false;
     delete f;
     return true;
 }
 
+/// Load and decode an image file.
+/// Threadsafe: only reading the file is done under the texturefilelock, decoding works on a copy in memory.
 SDL_Surface *loadsurface(const char *name)
 {
+    size_t len = 0;
+    char *buf;
+    {
+        std::lock_guard<std::mutex> guard(texturefilelock);
+        buf = loadfile(name, &len, false);
+    }
+    if(!buf) return NULL;
     SDL_Surface *s = NULL;
-    stream *z = openzipfile(name, "rb");
-    if(z)
+    SDL_RWops *rw = SDL_RWFromConstMem(buf, int(len));
+    if(rw)
     {
-        SDL_RWops *rw = z->rwops();
-        if(rw)
-        {
-            char *ext = (char *)strrchr(name, '.');
-            if(ext) ++ext;
-            s = IMG_LoadTyped_RW(rw, 0, ext);
-            SDL_FreeRW(rw);
-        }
-        delete z;
+        const char *ext = strrchr(name, '.');
+        if(ext) ++ext;
+        s = IMG_LoadTyped_RW(rw, 0, ext);
+        SDL_FreeRW(rw);
     }
-    if(!s) s = IMG_Load(findfile(name, "rb"));
+    delete[] buf;
     return fixsurfaceformat(s);
 }
@@ -4,6 +4,12 @@
 
 #include "SDL_image.h"
 
+#include <mutex>
+
+/// Serializes file access (zip archives, findfile()) of textures loading on worker threads.
+/// Decoding happens outside of it.
+extern std::mutex texturefilelock;
+
 extern SDL_Surface *wrapsurface(void *data, int width, int height, int bpp);
 
 extern bool canloadsurface(const char *name);
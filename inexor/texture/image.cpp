@@ -4,6 +4,7 @@
 #include "inexor/texture/image.hpp"
 #include "inexor/texture/texsettings.hpp"
 #include "inexor/texture/macros.hpp"
+#include "inexor/texture/simdimage.hpp"
 
 
 
@@ -35,6 +36,7 @@ void scaletexture(uchar *src, uint sw, uint sh, uint bpp, uint pitch, uchar *dst
 {
     if(sw == dw * 2 && sh == dh * 2)
     {
+        if(simdhalvetexture(src, sw, sh, bpp, pitch, dst)) return;
         switch(bpp)
         {
         case 1: return halvetexture1(src, sw, sh, pitch, dst);
@@ -45,6 +47,7 @@ void scaletexture(uchar *src, uint sw, uint sh, uint bpp, uint pitch, uchar *dst
     }
     else if(sw < dw || sh < dh || sw&(sw - 1) || sh&(sh - 1) || dw&(dw - 1) || dh&(dh - 1))
     {
+        if(simdscaletexture(src, sw, sh, bpp, pitch, dst, dw, dh)) return;
         switch(bpp)
         {
         case 1: return scaletexture1(src, sw, sh, pitch, dst, dw, dh);
@@ -55,6 +58,7 @@ void scaletexture(uchar *src, uint sw, uint sh, uint bpp, uint pitch, uchar *dst
     }
     else
     {
+        if(simdshifttexture(src, sw, sh, bpp, pitch, dst, dw, dh)) return;
         switch(bpp)
         {
         case 1: return shifttexture1(src, sw, sh, pitch, dst, dw, dh);
@@ -266,6 +270,7 @@ void texoffset(ImageData &s, int xoffset, int yoffset)
 
 void texmad(ImageData &s, const vec &mul, const vec &add)
 {
+    if(simdtexmad(s, mul, add)) return;
     int maxk = min(int(s.bpp), 3);
     writetex(s,
         loopk(maxk) dst[k] = uchar(clamp(dst[k] * mul[k] + 255 * add[k], 0.0f, 255.0f));
@@ -337,6 +342,7 @@ void texgrey(ImageData &s)
 
 void texpremul(ImageData &s)
 {
+    if(simdtexpremul(s)) return;
     switch(s.bpp)
     {
     case 2:
@@ -406,6 +412,14 @@ void texnormal(ImageData &s, int emphasis)
     uchar *src = s.data, *dst = d.data;
     loop(y, s.h) loop(x, s.w)
     {
+        if(x == 1)
+        {
+            // everything but the wrapping first and last column
+            int done = simdtexnormalspan(&src[y*s.pitch + x*s.bpp], &src[((y + s.h - 1) % s.h)*s.pitch + x*s.bpp], &src[((y + 1) % s.h)*s.pitch + x*s.bpp],
+                                         s.bpp, s.w - 2, 255.0f / emphasis, dst);
+            x += done;
+            dst += 3*done;
+        }
         vec normal(0.0f, 0.0f, 255.0f / emphasis);
         normal.x += src[y*s.pitch + ((x + s.w - 1) % s.w)*s.bpp];
         normal.x -= src[y*s.pitch + ((x + 1) % s.w)*s.bpp];
@@ -448,6 +462,15 @@ static void blurtexture(int w, int h, uchar *dst, const uchar *src, int margin)
     {
         for(int x = margin; x < w - margin; x++)
         {
+            if(!normals && x == max(n, margin) && y >= n && y < h - n)
+            {
+                // no border handling needed in between
+                int done = simdblurspan(n, bpp, stride, src, dst, w - x - max(n, margin));
+                x += done;
+                dst += done*bpp;
+                src += done*bpp;
+                if(x >= w - margin) break;
+            }
             int dr = 0, dg = 0, db = 0;
             const uchar *p = src - startoffset;
             const int *m = mat + mstartoffset;
@@ -0,0 +1,725 @@
+/// @file SIMD image kernels, see simdimage.hpp.
+/// Everything is integer arithmetic in the same precision as the scalar code, or float math in the
+/// same order of operations, so results stay bit exact. AVX2 and SSSE3/SSE4.1 code is compiled with
+/// per function target attributes and only called after checking the cpu at runtime.
+
+#include "inexor/texture/simdimage.hpp"
+#include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_IMAGESIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SIMDTARGET(isa)
+#else
+#define SIMDTARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+VAR(imagesimd, 0, 4, 4); // highest instruction set to use: 0 scalar, 1 sse2, 2 ssse3, 3 sse4.1, 4 avx2
+
+static int imagesimdoverride = -1; // set by benchimagekernels to compare against the scalar code
+
+static int detectimagesimd()
+{
+#if !defined(HAVE_IMAGESIMD)
+    return IMAGESIMD_SCALAR;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxleaf = info[0];
+    __cpuid(info, 1);
+    if(!(info[2]&(1<<9))) return IMAGESIMD_SSE2;
+    if(!(info[2]&(1<<19))) return IMAGESIMD_SSSE3;
+    // avx2 also needs the os to save the ymm registers
+    if(maxleaf < 7 || !(info[2]&(1<<27)) || !(info[2]&(1<<28)) || (_xgetbv(0)&6) != 6) return IMAGESIMD_SSE41;
+    __cpuidex(info, 7, 0);
+    return info[1]&(1<<5) ? IMAGESIMD_AVX2 : IMAGESIMD_SSE41;
+#else
+    __builtin_cpu_init();
+    if(!__builtin_cpu_supports("ssse3")) return IMAGESIMD_SSE2;
+    if(!__builtin_cpu_supports("sse4.1")) return IMAGESIMD_SSSE3;
+    return __builtin_cpu_supports("avx2") ? IMAGESIMD_AVX2 : IMAGESIMD_SSE41;
+#endif
+}
+
+int imagesimdlevel()
+{
+    static const int cpulevel = detectimagesimd();
+    return min(cpulevel, imagesimdoverride >= 0 ? imagesimdoverride : int(imagesimd));
+}
+
+static const char *imagesimdname(int level)
+{
+    static const char * const names[] = { "scalar", "sse2", "ssse3", "sse4.1", "avx2" };
+    return names[clamp(level, 0, int(IMAGESIMD_AVX2))];
+}
+
+#ifdef HAVE_IMAGESIMD
+
+static inline void halvepixel(const uchar *src, uint stride, uint bpp, uchar *dst)
+{
+    loopk(bpp) dst[k] = (uint(src[k]) + uint(src[k+bpp]) + uint(src[stride+k]) + uint(src[stride+k+bpp]))>>2;
+}
+
+/// Add horizontally neighbouring pixels of the (already vertically summed) 16 bit channels of bytes 0-7 (lo) and 8-15 (hi).
+template<int BPP>
+static inline __m128i pairsum(__m128i lo, __m128i hi)
+{
+    if(BPP == 1)
+    {
+        const __m128i one = _mm_set1_epi16(1);
+        return _mm_packs_epi32(_mm_madd_epi16(lo, one), _mm_madd_epi16(hi, one));
+    }
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 2*BPP));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 2*BPP));
+    if(BPP == 2)
+    {
+        lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+        hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+    }
+    return _mm_unpacklo_epi64(lo, hi);
+}
+
+template<int BPP>
+static void halvetexture_sse2(uchar *src, uint sw, uint sh, uint stride, uchar *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const uint rowbytes = sw*BPP, simdbytes = rowbytes&~15U;
+    for(uchar *yend = &src[sh*stride]; src < yend; src += 2*stride)
+    {
+        uint i = 0;
+        for(; i < simdbytes; i += 16, dst += 8)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)&src[i]), b = _mm_loadu_si128((const __m128i *)&src[stride+i]),
+                    lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                    hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+                    sum = _mm_srli_epi16(pairsum<BPP>(lo, hi), 2);
+            _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(sum, sum));
+        }
+        for(; i < rowbytes; i += 2*BPP, dst += BPP) halvepixel(&src[i], stride, BPP, dst);
+    }
+}
+
+/// pairsum() working on both 128 bit lanes.
+template<int BPP>
+SIMDTARGET("avx2") static inline __m256i pairsum256(__m256i lo, __m256i hi)
+{
+    if(BPP == 1)
+    {
+        const __m256i one = _mm256_set1_epi16(1);
+        return _mm256_packs_epi32(_mm256_madd_epi16(lo, one), _mm256_madd_epi16(hi, one));
+    }
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 2*BPP));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 2*BPP));
+    if(BPP == 2)
+    {
+        lo = _mm256_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+        hi = _mm256_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+    }
+    return _mm256_unpacklo_epi64(lo, hi);
+}
+
+template<int BPP>
+SIMDTARGET("avx2") static void halvetexture_avx2(uchar *src, uint sw, uint sh, uint stride, uchar *dst)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const uint rowbytes = sw*BPP, simdbytes = rowbytes&~31U;
+    for(uchar *yend = &src[sh*stride]; src < yend; src += 2*stride)
+    {
+        uint i = 0;
+        for(; i < simdbytes; i += 32, dst += 16)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i *)&src[i]), b = _mm256_loadu_si256((const __m256i *)&src[stride+i]),
+                    lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero)),
+                    hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero)),
+                    sum = _mm256_srli_epi16(pairsum256<BPP>(lo, hi), 2);
+            // both lanes hold 8 result bytes in their low half
+            sum = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(sum));
+        }
+        for(; i < rowbytes; i += 2*BPP, dst += BPP) halvepixel(&src[i], stride, BPP, dst);
+    }
+}
+
+/// RGB needs a byte shuffle to line up the two pixels of every output, so it is done with SSSE3.
+/// 8 source pixels (24 bytes) are read as bytes 0-15 (a) and 8-23 (b) of each row.
+SIMDTARGET("ssse3") static void halvetexture3_ssse3(uchar *src, uint sw, uint sh, uint stride, uchar *dst)
+{
+    const __m128i firsta = _mm_setr_epi8(0, 1, 2, 6, 7, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+                  firstb = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 4, 5, 6, 10, 11, 12, -1, -1, -1, -1),
+                  seconda = _mm_setr_epi8(3, 4, 5, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+                  secondb = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 7, 8, 9, 13, 14, 15, -1, -1, -1, -1),
+                  zero = _mm_setzero_si128();
+    const uint rowbytes = sw*3;
+    for(uchar *yend = &src[sh*stride]; src < yend; src += 2*stride)
+    {
+        uint i = 0;
+        for(; i + 24 <= rowbytes; i += 24, dst += 12)
+        {
+            __m128i lo = zero, hi = zero;
+            loopk(2)
+            {
+                const uchar *row = &src[k*stride + i];
+                __m128i a = _mm_loadu_si128((const __m128i *)row), b = _mm_loadu_si128((const __m128i *)&row[8]),
+                        first = _mm_or_si128(_mm_shuffle_epi8(a, firsta), _mm_shuffle_epi8(b, firstb)),
+                        second = _mm_or_si128(_mm_shuffle_epi8(a, seconda), _mm_shuffle_epi8(b, secondb));
+                lo = _mm_add_epi16(lo, _mm_add_epi16(_mm_unpacklo_epi8(first, zero), _mm_unpacklo_epi8(second, zero)));
+                hi = _mm_add_epi16(hi, _mm_add_epi16(_mm_unpackhi_epi8(first, zero), _mm_unpackhi_epi8(second, zero)));
+            }
+            __m128i sum = _mm_packus_epi16(_mm_srli_epi16(lo, 2), _mm_srli_epi16(hi, 2));
+            _mm_storel_epi64((__m128i *)dst, sum);
+            int last = _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+            memcpy(&dst[8], &last, 4);
+        }
+        for(; i < rowbytes; i += 6, dst += 3) halvepixel(&src[i], stride, 3, dst);
+    }
+}
+
+/// Sums up the rows of every block in 16 bit first, which is where almost all the work is.
+static void shifttexture_sse2(uchar *src, uint sw, uint sh, uint bpp, uint stride, uchar *dst, uint dw, uint dh)
+{
+    uint wfrac = sw/dw, hfrac = sh/dh, wshift = 0, hshift = 0;
+    while(dw<<wshift < sw) wshift++;
+    while(dh<<hshift < sh) hshift++;
+    const uint tshift = wshift + hshift, rowbytes = sw*bpp, simdbytes = rowbytes&~15U;
+    const __m128i zero = _mm_setzero_si128(), shift = _mm_cvtsi32_si128(tshift);
+    ushort *sums = new ushort[rowbytes];
+    for(uchar *yend = &src[sh*stride]; src < yend; src += hfrac*stride)
+    {
+        memset(sums, 0, rowbytes*sizeof(ushort));
+        for(uchar *row = src, *rowend = &src[hfrac*stride]; row < rowend; row += stride)
+        {
+            uint i = 0;
+            for(; i < simdbytes; i += 16)
+            {
+                __m128i p = _mm_loadu_si128((const __m128i *)&row[i]);
+                __m128i *s = (__m128i *)&sums[i];
+                _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), _mm_unpacklo_epi8(p, zero)));
+                _mm_storeu_si128(&s[1], _mm_add_epi16(_mm_loadu_si128(&s[1]), _mm_unpackhi_epi8(p, zero)));
+            }
+            for(; i < rowbytes; i++) sums[i] += row[i];
+        }
+        for(ushort *xsrc = sums, *xend = &sums[rowbytes]; xsrc < xend; xsrc += wfrac*bpp, dst += bpp)
+        {
+            if(bpp == 4)
+            {
+                __m128i t = zero;
+                for(ushort *xcur = xsrc, *cend = &xsrc[wfrac*4]; xcur < cend; xcur += 4)
+                    t = _mm_add_epi32(t, _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)xcur), zero));
+                t = _mm_srl_epi32(t, shift);
+                t = _mm_packs_epi32(t, t);
+                int c = _mm_cvtsi128_si32(_mm_packus_epi16(t, t));
+                memcpy(dst, &c, 4);
+            }
+            else loopk(bpp)
+            {
+                uint t = 0;
+                for(ushort *xcur = &xsrc[k], *cend = &xsrc[wfrac*bpp]; xcur < cend; xcur += bpp) t += *xcur;
+                dst[k] = t>>tshift;
+            }
+        }
+    }
+    delete[] sums;
+}
+
+template<int BPP>
+SIMDTARGET("sse4.1") static inline __m128i loadpixel(const uchar *p)
+{
+    int c;
+    if(BPP >= 4) memcpy(&c, p, 4);
+    else c = p[0] | (p[1]<<8) | (p[2]<<16);
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(c));
+}
+
+template<int BPP>
+SIMDTARGET("sse4.1") static inline void storepixel(uchar *p, __m128i c)
+{
+    // truncate like the uchar assignment in the scalar code, not saturate
+    c = _mm_and_si128(c, _mm_set1_epi32(0xFF));
+    c = _mm_packs_epi32(c, c);
+    int v = _mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+    if(BPP >= 4) memcpy(p, &v, 4);
+    else { p[0] = uchar(v); p[1] = uchar(v>>8); p[2] = uchar(v>>16); }
+}
+
+/// Sum of the pixels strictly between xsrc and xend.
+template<int BPP>
+SIMDTARGET("sse4.1") static inline __m128i spansum(const uchar *xsrc, const uchar *xend)
+{
+    __m128i t = _mm_setzero_si128();
+    for(const uchar *xcur = &xsrc[BPP]; xcur < xend; xcur += BPP) t = _mm_add_epi32(t, loadpixel<BPP>(xcur));
+    return t;
+}
+
+/// scaletexture from scale.hpp with all channels of a pixel in one register.
+/// The arithmetic wraps around at 32 bit exactly like the uint math there.
+template<int BPP>
+SIMDTARGET("sse4.1") static void scaletexture_sse41(uchar *src, uint sw, uint sh, uint stride, uchar *dst, uint dw, uint dh)
+{
+    uint wfrac = (sw<<12)/dw, hfrac = (sh<<12)/dh, darea = dw*dh, sarea = sw*sh;
+    int over, under;
+    for(over = 0; (darea>>over) > sarea; over++);
+    for(under = 0; (darea<<under) < sarea; under++);
+    uint cscale = clamp(under, over - 12, 12),
+         ascale = clamp(12 + under - over, 0, 24),
+         dscale = ascale + 12 - cscale,
+         area = ((ullong)darea<<ascale)/sarea;
+    const __m128i cshift = _mm_cvtsi32_si128(cscale), dshift = _mm_cvtsi32_si128(dscale), varea = _mm_set1_epi32(area);
+    dw *= wfrac;
+    dh *= hfrac;
+    for(uint y = 0; y < dh; y += hfrac)
+    {
+        const uint yn = y + hfrac - 1, yi = y>>12, h = (yn>>12) - yi, ylow = ((yn|(-int(h)>>24))&0xFFFU) + 1 - (y&0xFFFU), yhigh = (yn&0xFFFU) + 1;
+        const __m128i vylow = _mm_set1_epi32(ylow), vyhigh = _mm_set1_epi32(yhigh);
+        const uchar *ysrc = &src[yi*stride];
+        for(uint x = 0; x < dw; x += wfrac, dst += BPP)
+        {
+            const uint xn = x + wfrac - 1, xi = x>>12, w = (xn>>12) - xi, xlow = ((w+0xFFFU)&0x1000U) - (x&0xFFFU), xhigh = (xn&0xFFFU) + 1;
+            const __m128i vxlow = _mm_set1_epi32(xlow), vxhigh = _mm_set1_epi32(xhigh);
+            const uchar *xsrc = &ysrc[xi*BPP], *xend = &xsrc[w*BPP];
+            #define EDGES _mm_add_epi32(_mm_mullo_epi32(loadpixel<BPP>(xsrc), vxlow), _mm_mullo_epi32(loadpixel<BPP>(xend), vxhigh))
+            __m128i t = _mm_add_epi32(spansum<BPP>(xsrc, xend), _mm_srli_epi32(EDGES, 12));
+            t = _mm_srl_epi32(_mm_mullo_epi32(vylow, t), cshift);
+            if(h)
+            {
+                xsrc += stride;
+                xend += stride;
+                for(uint hcur = h; --hcur; xsrc += stride, xend += stride)
+                {
+                    __m128i c = _mm_add_epi32(_mm_slli_epi32(spansum<BPP>(xsrc, xend), 12), EDGES);
+                    t = _mm_add_epi32(t, _mm_srl_epi32(c, cshift));
+                }
+                __m128i c = _mm_add_epi32(spansum<BPP>(xsrc, xend), _mm_srli_epi32(EDGES, 12));
+                t = _mm_add_epi32(t, _mm_srl_epi32(_mm_mullo_epi32(vyhigh, c), cshift));
+            }
+            #undef EDGES
+            storepixel<BPP>(dst, _mm_srl_epi32(_mm_mullo_epi32(t, varea), dshift));
+        }
+    }
+}
+
+// same weights as in blurtexture() in image.cpp
+static const int blurweights3x3[9] =
+{
+    0x10, 0x20, 0x10,
+    0x20, 0x40, 0x20,
+    0x10, 0x20, 0x10
+};
+static const int blurweights5x5[25] =
+{
+    0x05, 0x05, 0x09, 0x05, 0x05,
+    0x05, 0x0A, 0x14, 0x0A, 0x05,
+    0x09, 0x14, 0x28, 0x14, 0x09,
+    0x05, 0x0A, 0x14, 0x0A, 0x05,
+    0x05, 0x05, 0x09, 0x05, 0x05
+};
+
+/// Away from the borders the blur is a plain convolution of every byte with the bytes BPP apart.
+/// The weights sum up to 0x100, so 16 bit lanes never overflow.
+template<int N, int BPP>
+static int blurspan_sse2(int stride, const uchar *src, uchar *dst, int count)
+{
+    const int *mat = N > 1 ? blurweights5x5 : blurweights3x3, size = 2*N + 1;
+    const __m128i zero = _mm_setzero_si128(), alphamask = _mm_set1_epi32(0xFF000000);
+    __m128i weights[25];
+    loopi(size*size) weights[i] = _mm_set1_epi16(mat[i]);
+    int bytes = count*BPP, i = 0;
+    for(; i + 16 <= bytes; i += 16)
+    {
+        __m128i lo = zero, hi = zero;
+        const __m128i *w = weights;
+        for(int dy = -N; dy <= N; dy++)
+        {
+            const uchar *p = &src[dy*stride + i - N*BPP];
+            for(int dx = 0; dx < size; dx++, p += BPP, w++)
+            {
+                __m128i c = _mm_loadu_si128((const __m128i *)p);
+                lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), *w));
+                hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(c, zero), *w));
+            }
+        }
+        __m128i blurred = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+        if(BPP > 3) blurred = _mm_or_si128(_mm_andnot_si128(alphamask, blurred), _mm_and_si128(alphamask, _mm_loadu_si128((const __m128i *)&src[i])));
+        _mm_storeu_si128((__m128i *)&dst[i], blurred);
+    }
+    return i/BPP;
+}
+
+template<int N, int BPP>
+SIMDTARGET("avx2") static int blurspan_avx2(int stride, const uchar *src, uchar *dst, int count)
+{
+    const int *mat = N > 1 ? blurweights5x5 : blurweights3x3, size = 2*N + 1;
+    const __m256i alphamask = _mm256_set1_epi32(0xFF000000);
+    __m256i weights[25];
+    loopi(size*size) weights[i] = _mm256_set1_epi16(mat[i]);
+    int bytes = count*BPP, i = 0;
+    for(; i + 32 <= bytes; i += 32)
+    {
+        __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+        const __m256i *w = weights;
+        for(int dy = -N; dy <= N; dy++)
+        {
+            const uchar *p = &src[dy*stride + i - N*BPP];
+            for(int dx = 0; dx < size; dx++, p += BPP, w++)
+            {
+                lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p)), *w));
+                hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)&p[16])), *w));
+            }
+        }
+        __m256i blurred = _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+        blurred = _mm256_permute4x64_epi64(blurred, _MM_SHUFFLE(3, 1, 2, 0));
+        if(BPP > 3) blurred = _mm256_or_si256(_mm256_andnot_si256(alphamask, blurred), _mm256_and_si256(alphamask, _mm256_loadu_si256((const __m256i *)&src[i])));
+        _mm256_storeu_si256((__m256i *)&dst[i], blurred);
+    }
+    return i/BPP;
+}
+
+static int texnormalspan_sse2(const uchar *src, const uchar *up, const uchar *down, int bpp, int count, float z, uchar *dst)
+{
+    const __m128 vz = _mm_set1_ps(z), zz = _mm_mul_ps(vz, vz), half = _mm_set1_ps(127.5f);
+    int x = 0;
+    for(; x + 4 <= count; x += 4, src += 4*bpp, up += 4*bpp, down += 4*bpp, dst += 12)
+    {
+        #define GATHER(p) _mm_cvtepi32_ps(_mm_setr_epi32((p)[0], (p)[bpp], (p)[2*bpp], (p)[3*bpp]))
+        __m128 nx = _mm_sub_ps(GATHER(src - bpp), GATHER(src + bpp)),
+               ny = _mm_sub_ps(GATHER(up), GATHER(down)),
+               mag = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), zz));
+        #undef GATHER
+        int cx[4], cy[4], cz[4];
+        _mm_storeu_si128((__m128i *)cx, _mm_cvttps_epi32(_mm_add_ps(half, _mm_mul_ps(_mm_div_ps(nx, mag), half))));
+        _mm_storeu_si128((__m128i *)cy, _mm_cvttps_epi32(_mm_add_ps(half, _mm_mul_ps(_mm_div_ps(ny, mag), half))));
+        _mm_storeu_si128((__m128i *)cz, _mm_cvttps_epi32(_mm_add_ps(half, _mm_mul_ps(_mm_div_ps(vz, mag), half))));
+        loopi(4)
+        {
+            dst[3*i] = uchar(cx[i]);
+            dst[3*i+1] = uchar(cy[i]);
+            dst[3*i+2] = uchar(cz[i]);
+        }
+    }
+    return x;
+}
+
+static inline void texmadpixels(uchar *dst, int bpp, int maxk, const vec &mul, const vec &add, int count)
+{
+    loopi(count) loopk(maxk) dst[i*bpp + k] = uchar(clamp(dst[i*bpp + k] * mul[k] + 255 * add[k], 0.0f, 255.0f));
+}
+
+/// @param mulpat,addpat per byte factors for period bytes, a multiple of 16 and bpp.
+static void texmad_sse2(ImageData &s, const vec &mul, const vec &add, const float *mulpat, const float *addpat, int period)
+{
+    const int maxk = min(s.bpp, 3), bytes = s.w*s.bpp;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 lower = _mm_setzero_ps(), upper = _mm_set1_ps(255.0f);
+    uchar *row = s.data;
+    loop(y, s.h)
+    {
+        int i = 0;
+        for(; i + period <= bytes; i += period) for(int j = 0; j < period; j += 16)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)&row[i+j]),
+                    lo = _mm_unpacklo_epi8(p, zero), hi = _mm_unpackhi_epi8(p, zero),
+                    c[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+            loopk(4)
+            {
+                __m128 f = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(c[k]), _mm_loadu_ps(&mulpat[j + 4*k])), _mm_loadu_ps(&addpat[j + 4*k]));
+                c[k] = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(f, upper), lower));
+            }
+            _mm_storeu_si128((__m128i *)&row[i+j], _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], c[3])));
+        }
+        texmadpixels(&row[i], s.bpp, maxk, mul, add, (bytes - i)/s.bpp);
+        row += s.pitch;
+    }
+}
+
+SIMDTARGET("avx2") static void texmad_avx2(ImageData &s, const vec &mul, const vec &add, const float *mulpat, const float *addpat, int period)
+{
+    const int maxk = min(s.bpp, 3), bytes = s.w*s.bpp;
+    const __m256 lower = _mm256_setzero_ps(), upper = _mm256_set1_ps(255.0f);
+    uchar *row = s.data;
+    loop(y, s.h)
+    {
+        int i = 0;
+        for(; i + period <= bytes; i += period) for(int j = 0; j < period; j += 16)
+        {
+            __m256i c[2];
+            loopk(2)
+            {
+                __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&row[i + j + 8*k])));
+                f = _mm256_add_ps(_mm256_mul_ps(f, _mm256_loadu_ps(&mulpat[j + 8*k])), _mm256_loadu_ps(&addpat[j + 8*k]));
+                c[k] = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(f, upper), lower));
+            }
+            __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(c[0], c[1]), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128((__m128i *)&row[i+j], _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1)));
+        }
+        texmadpixels(&row[i], s.bpp, maxk, mul, add, (bytes - i)/s.bpp);
+        row += s.pitch;
+    }
+}
+
+/// (c*a)/255 for 16 bit products c*a of two bytes, exact for all of them.
+static inline __m128i div255(__m128i v)
+{
+    return _mm_mulhi_epu16(_mm_add_epi16(v, _mm_set1_epi16(1)), _mm_set1_epi16(257));
+}
+
+template<int BPP>
+static void texpremul_sse2(ImageData &s)
+{
+    const __m128i zero = _mm_setzero_si128(), alphamask = BPP > 2 ? _mm_set1_epi32(0xFF000000) : _mm_set1_epi16(0xFF00);
+    const int bytes = s.w*BPP;
+    uchar *row = s.data;
+    loop(y, s.h)
+    {
+        int i = 0;
+        for(; i + 16 <= bytes; i += 16)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)&row[i]), lo = _mm_unpacklo_epi8(p, zero), hi = _mm_unpackhi_epi8(p, zero), alo, ahi;
+            if(BPP > 2)
+            {
+                alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            }
+            else
+            {
+                alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+                ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+            }
+            __m128i c = _mm_packus_epi16(div255(_mm_mullo_epi16(lo, alo)), div255(_mm_mullo_epi16(hi, ahi)));
+            _mm_storeu_si128((__m128i *)&row[i], _mm_or_si128(_mm_andnot_si128(alphamask, c), _mm_and_si128(alphamask, p)));
+        }
+        for(uchar *dst = &row[i], *end = &row[bytes]; dst < end; dst += BPP)
+        {
+            uint alpha = dst[BPP-1];
+            loopk(BPP-1) dst[k] = uchar((uint(dst[k])*alpha) / 255);
+        }
+        row += s.pitch;
+    }
+}
+
+SIMDTARGET("avx2") static inline __m256i div255_avx2(__m256i v)
+{
+    return _mm256_mulhi_epu16(_mm256_add_epi16(v, _mm256_set1_epi16(1)), _mm256_set1_epi16(257));
+}
+
+template<int BPP>
+SIMDTARGET("avx2") static void texpremul_avx2(ImageData &s)
+{
+    const __m256i zero = _mm256_setzero_si256(), alphamask = BPP > 2 ? _mm256_set1_epi32(0xFF000000) : _mm256_set1_epi16(0xFF00);
+    const int bytes = s.w*BPP;
+    uchar *row = s.data;
+    loop(y, s.h)
+    {
+        int i = 0;
+        for(; i + 32 <= bytes; i += 32)
+        {
+            __m256i p = _mm256_loadu_si256((const __m256i *)&row[i]), lo = _mm256_unpacklo_epi8(p, zero), hi = _mm256_unpackhi_epi8(p, zero), alo, ahi;
+            if(BPP > 2)
+            {
+                alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            }
+            else
+            {
+                alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+                ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+            }
+            __m256i c = _mm256_packus_epi16(div255_avx2(_mm256_mullo_epi16(lo, alo)), div255_avx2(_mm256_mullo_epi16(hi, ahi)));
+            _mm256_storeu_si256((__m256i *)&row[i], _mm256_or_si256(_mm256_andnot_si256(alphamask, c), _mm256_and_si256(alphamask, p)));
+        }
+        for(uchar *dst = &row[i], *end = &row[bytes]; dst < end; dst += BPP)
+        {
+            uint alpha = dst[BPP-1];
+            loopk(BPP-1) dst[k] = uchar((uint(dst[k])*alpha) / 255);
+        }
+        row += s.pitch;
+    }
+}
+
+#endif // HAVE_IMAGESIMD
+
+bool simdhalvetexture(uchar *src, uint sw, uint sh, uint bpp, uint stride, uchar *dst)
+{
+#ifdef HAVE_IMAGESIMD
+    int level = imagesimdlevel();
+    if(level >= IMAGESIMD_AVX2) switch(bpp)
+    {
+        case 1: halvetexture_avx2<1>(src, sw, sh, stride, dst); return true;
+        case 2: halvetexture_avx2<2>(src, sw, sh, stride, dst); return true;
+        case 4: halvetexture_avx2<4>(src, sw, sh, stride, dst); return true;
+    }
+    if(level >= IMAGESIMD_SSE2) switch(bpp)
+    {
+        case 1: halvetexture_sse2<1>(src, sw, sh, stride, dst); return true;
+        case 2: halvetexture_sse2<2>(src, sw, sh, stride, dst); return true;
+        case 3: if(level < IMAGESIMD_SSSE3) break; halvetexture3_ssse3(src, sw, sh, stride, dst); return true;
+        case 4: halvetexture_sse2<4>(src, sw, sh, stride, dst); return true;
+    }
+#endif
+    return false;
+}
+
+bool simdshifttexture(uchar *src, uint sw, uint sh, uint bpp, uint stride, uchar *dst, uint dw, uint dh)
+{
+#ifdef HAVE_IMAGESIMD
+    // the 16 bit row sums hold up to 257 rows
+    if(imagesimdlevel() >= IMAGESIMD_SSE2 && sh/dh <= 256)
+    {
+        shifttexture_sse2(src, sw, sh, bpp, stride, dst, dw, dh);
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool simdscaletexture(uchar *src, uint sw, uint sh, uint bpp, uint stride, uchar *dst, uint dw, uint dh)
+{
+#ifdef HAVE_IMAGESIMD
+    if(imagesimdlevel() >= IMAGESIMD_SSE41) switch(bpp)
+    {
+        case 3: scaletexture_sse41<3>(src, sw, sh, stride, dst, dw, dh); return true;
+        case 4: scaletexture_sse41<4>(src, sw, sh, stride, dst, dw, dh); return true;
+    }
+#endif
+    return false;
+}
+
+int simdblurspan(int n, int bpp, int stride, const uchar *src, uchar *dst, int count)
+{
+#ifdef HAVE_IMAGESIMD
+    int level = imagesimdlevel();
+    if(level >= IMAGESIMD_AVX2) switch((n << 4) | bpp)
+    {
+        case 0x13: return blurspan_avx2<1, 3>(stride, src, dst, count);
+        case 0x23: return blurspan_avx2<2, 3>(stride, src, dst, count);
+        case 0x14: return blurspan_avx2<1, 4>(stride, src, dst, count);
+        case 0x24: return blurspan_avx2<2, 4>(stride, src, dst, count);
+    }
+    if(level >= IMAGESIMD_SSE2) switch((n << 4) | bpp)
+    {
+        case 0x13: return blurspan_sse2<1, 3>(stride, src, dst, count);
+        case 0x23: return blurspan_sse2<2, 3>(stride, src, dst, count);
+        case 0x14: return blurspan_sse2<1, 4>(stride, src, dst, count);
+        case 0x24: return blurspan_sse2<2, 4>(stride, src, dst, count);
+    }
+#endif
+    return 0;
+}
+
+int simdtexnormalspan(const uchar *src, const uchar *up, const uchar *down, int bpp, int count, float z, uchar *dst)
+{
+#ifdef HAVE_IMAGESIMD
+    if(imagesimdlevel() >= IMAGESIMD_SSE2) return texnormalspan_sse2(src, up, down, bpp, count, z, dst);
+#endif
+    return 0;
+}
+
+bool simdtexmad(ImageData &s, const vec &mul, const vec &add)
+{
+#ifdef HAVE_IMAGESIMD
+    int level = imagesimdlevel();
+    if(level < IMAGESIMD_SSE2 || s.bpp < 1 || s.bpp > 4) return false;
+    // one period holds a whole number of pixels and 16 byte blocks
+    int period = s.bpp == 3 ? 48 : 16, maxk = min(s.bpp, 3);
+    float mulpat[48], addpat[48];
+    loopi(period)
+    {
+        int k = i%s.bpp;
+        mulpat[i] = k < maxk ? mul[k] : 1.0f;
+        addpat[i] = k < maxk ? 255 * add[k] : 0.0f;
+    }
+    if(level >= IMAGESIMD_AVX2) texmad_avx2(s, mul, add, mulpat, addpat, period);
+    else texmad_sse2(s, mul, add, mulpat, addpat, period);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool simdtexpremul(ImageData &s)
+{
+#ifdef HAVE_IMAGESIMD
+    int level = imagesimdlevel();
+    if(level >= IMAGESIMD_AVX2) switch(s.bpp)
+    {
+        case 2: texpremul_avx2<2>(s); return true;
+        case 4: texpremul_avx2<4>(s); return true;
+    }
+    if(level >= IMAGESIMD_SSE2) switch(s.bpp)
+    {
+        case 2: texpremul_sse2<2>(s); return true;
+        case 4: texpremul_sse2<4>(s); return true;
+    }
+#endif
+    return false;
+}
+
+/// One kernel of the benchmark, working in place on s (like the texture modifiers do).
+struct imagekernel
+{
+    const char *name;
+    int bpp;
+    void (*run)(ImageData &s);
+};
+
+static void benchscale(ImageData &s, int w, int h)
+{
+    ImageData d(w, h, s.bpp);
+    scaletexture(s.data, s.w, s.h, s.bpp, s.pitch, d.data, w, h);
+    s.replace(d);
+}
+
+static const imagekernel imagekernels[] =
+{
+    { "halve", 3, [](ImageData &s) { benchscale(s, s.w/2, s.h/2); } },
+    { "halve", 4, [](ImageData &s) { benchscale(s, s.w/2, s.h/2); } },
+    { "shift", 4, [](ImageData &s) { benchscale(s, s.w/4, s.h/4); } },
+    { "scale", 3, [](ImageData &s) { benchscale(s, s.w*3/4, s.h*3/4); } },
+    { "scale", 4, [](ImageData &s) { benchscale(s, s.w*3/4, s.h*3/4); } },
+    { "blur3x3", 3, [](ImageData &s) { texblur(s, 1, 1); } },
+    { "blur5x5", 4, [](ImageData &s) { texblur(s, 2, 1); } },
+    { "normal", 1, [](ImageData &s) { texnormal(s, 3); } },
+    { "premul", 4, [](ImageData &s) { texpremul(s); } },
+    { "mad", 3, [](ImageData &s) { texmad(s, vec(0.8f, 1.3f, 0.5f), vec(0.1f, -0.2f, 0)); } },
+    { "mad", 4, [](ImageData &s) { texmad(s, vec(0.8f, 1.3f, 0.5f), vec(0.1f, -0.2f, 0)); } }
+};
+
+/// Time every kernel scalar and vectorized over random images of 256 up to maxsize pixels
+/// and check that both produce the same bytes.
+void benchimagekernels(int *iterations, int *maxsize)
+{
+    int n = max(*iterations, 1), limit = *maxsize > 0 ? clamp(*maxsize, 256, 4096) : 4096;
+    imagesimdoverride = -1;
+    int level = imagesimdlevel(), mismatches = 0;
+    spdlog::get("global")->info("benchimagekernels: using {}, {} iterations", imagesimdname(level), n);
+    for(int size = 256; size <= limit; size *= 2) for(const imagekernel &k : imagekernels)
+    {
+        ImageData ref(size, size, k.bpp);
+        uint seed = 0x9E3779B9U ^ size;
+        loopi(size*size*k.bpp) { seed = seed*1664525U + 1013904223U; ref.data[i] = uchar(seed>>24); }
+        double ms[2] = { 0, 0 };
+        vector<uchar> result[2];
+        loopj(2)
+        {
+            imagesimdoverride = j ? -1 : IMAGESIMD_SCALAR;
+            loopl(n)
+            {
+                ImageData s(size, size, k.bpp);
+                memcpy(s.data, ref.data, size*size*k.bpp);
+                inexor::util::Stopwatch sw;
+                k.run(s);
+                ms[j] += sw.elapsed_ms();
+                if(l == n-1) { int len = s.h*s.pitch; result[j].setsize(0); result[j].put(s.data, len); }
+            }
+        }
+        imagesimdoverride = -1;
+        bool exact = result[0].length() == result[1].length() && !memcmp(result[0].getbuf(), result[1].getbuf(), result[0].length());
+        if(!exact) mismatches++;
+        spdlog::get("global")->info("  {} bpp {} {}px: scalar {:.2f} ms, simd {:.2f} ms, {:.1f}x{}",
+            k.name, k.bpp, size, ms[0]/n, ms[1]/n, ms[0]/max(ms[1], 0.001), exact ? "" : " MISMATCH");
+    }
+    if(mismatches) spdlog::get("global")->error("benchimagekernels: {} kernels differ from the scalar reference", mismatches);
+}
+COMMAND(benchimagekernels, "ii");
@@ -0,0 +1,43 @@
+/// @file SIMD versions of the hot image kernels: mip generation, scaling and some texture modifiers.
+/// All of them produce bit identical results to the scalar reference in image.cpp and scale.hpp.
+/// They return false (or 0 processed pixels) if neither the cpu nor imagesimd allow a vectorized
+/// path for the given format, the caller then runs the scalar code.
+
+#pragma once
+
+#include "inexor/shared/cube.hpp"
+#include "inexor/texture/image.hpp"
+
+enum
+{
+    IMAGESIMD_SCALAR = 0,
+    IMAGESIMD_SSE2,
+    IMAGESIMD_SSSE3,
+    IMAGESIMD_SSE41,
+    IMAGESIMD_AVX2
+};
+
+/// The best instruction set supported by the running cpu, limited by imagesimd.
+extern int imagesimdlevel();
+
+/// Halve a 1, 2, 3 or 4 bpp image (sw and sh even) into the tightly packed dst.
+extern bool simdhalvetexture(uchar *src, uint sw, uint sh, uint bpp, uint stride, uchar *dst);
+
+/// Power of two box filter downscale, see shifttexture in scale.hpp.
+extern bool simdshifttexture(uchar *src, uint sw, uint sh, uint bpp, uint stride, uchar *dst, uint dw, uint dh);
+
+/// Arbitrary (fixed point area averaging) rescale of a 3 or 4 bpp image, see scaletexture in scale.hpp.
+extern bool simdscaletexture(uchar *src, uint sw, uint sh, uint bpp, uint stride, uchar *dst, uint dw, uint dh);
+
+/// Blur up to count pixels of a row starting at src, all of them at least n pixels away from every border.
+/// @param stride the bytes per row of src.
+/// @return the number of pixels written to dst.
+extern int simdblurspan(int n, int bpp, int stride, const uchar *src, uchar *dst, int count);
+
+/// Derive up to count normals from the height in the first channel starting at src.
+/// up and down point to the same column one row above and below, src[-bpp] and src[count*bpp] are valid.
+/// @return the number of pixels written to dst (3 bytes each).
+extern int simdtexnormalspan(const uchar *src, const uchar *up, const uchar *down, int bpp, int count, float z, uchar *dst);
+
+extern bool simdtexmad(ImageData &s, const vec &mul, const vec &add);
+extern bool simdtexpremul(ImageData &s);
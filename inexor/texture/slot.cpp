@@ -8,8 +8,14 @@
 #include "inexor/texture/image.hpp"
 #include "inexor/texture/cubemap.hpp"
 #include "inexor/texture/slot.hpp"
+#include "inexor/texture/texcache.hpp"
 #include "inexor/filesystem/mediadirs.hpp"
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
+#include "inexor/util/ThreadPool.hpp"
+
+#include <string>
+#include <unordered_map>
 
 using namespace rapidjson;
 using namespace inexor::filesystem;
@@ -682,22 +688,9 @@ Slot::Tex *Slot::findtexture(int type)
     return NULL;
 }
 
-/// Combine and load texture data to be ready for sending it to the gpu.
-/// Combination is used to merge the diffuse and the specularity map into one texture (spec as alpha)
-/// and to merge the normal info and the depth info into another (depth as alpha)
-/// @param msg show progress bar.
-void Slot::combinetextures(int index, Slot::Tex &t, bool msg, bool forceload)
+bool Slot::combineimages(int index, Slot::Tex &t, ImageData &ts, int &compress, bool msg)
 {
-    vector<char> key;
-    int texmask = 0; // receive control mask, todo check neccessarity
-
-    gencombinedname(key, texmask, *this, t, index, forceload);
-
-    t.t = gettexture(key.getbuf()); //todo check if working
-    if(t.t) return;
-    int compress = 0;
-    ImageData ts;
-    if(!texturedata(ts, NULL, &t, msg, &compress)) { t.t = notexture; return; }
+    if(!texturedata(ts, NULL, &t, msg, &compress)) return false;
     switch(t.type)
     {
         case TEX_DIFFUSE:
@@ -718,8 +711,149 @@ void Slot::combinetextures(int index, Slot::Tex &t, bool msg, bool forceload)
             }
             break;
     }
+    return true;
+}
+
+/// Combine and load texture data to be ready for sending it to the gpu.
+/// Combination is used to merge the diffuse and the specularity map into one texture (spec as alpha)
+/// and to merge the normal info and the depth info into another (depth as alpha)
+/// @param msg show progress bar.
+void Slot::combinetextures(int index, Slot::Tex &t, bool msg, bool forceload)
+{
+    vector<char> key;
+    int texmask = 0; // receive control mask, todo check neccessarity
+
+    gencombinedname(key, texmask, *this, t, index, forceload);
+
+    t.t = gettexture(key.getbuf()); //todo check if working
+    if(t.t) return;
+    texcachekey ck;
+    bool cacheable = gettexcachekey(ck, key.getbuf(), *this, t, index);
+    if(cacheable && !texcacheverify && (t.t = texcacheload(ck, key.getbuf()))) return;
+    int compress = 0;
+    ImageData ts;
+    if(!combineimages(index, t, ts, compress, msg)) { t.t = notexture; return; }
     t.t = newtexture( t.t, key.getbuf(), ts, 0, true, true, true, compress);
+    if(cacheable) texcachesave(ck, t.t);
+}
+
+VARP(paralleltextures, 0, 1, 1);
+VAR(texturebatch, 1, 64, 1024); // images kept in memory at once while loading slots in parallel
+
+/// One combined texture to be created by loadslots().
+struct slottexjob
+{
+    Slot *slot;
+    int index;
+    vector<char> key;
+    vector<Slot::Tex *> targets; // every slot texture using this key
+    ImageData image;
+    int compress;
+    bool ok, cacheable;
+    texcachekey cachekey;
+
+    slottexjob(Slot *slot, int index) : slot(slot), index(index), compress(0), ok(false), cacheable(false) {}
+};
+
+static void prepareslottexs(vector<slottexjob *> &jobs, int start, int end)
+{
+    auto prepare = [&jobs, start](size_t begin, size_t end)
+    {
+        for(size_t i = start + begin; i < start + end; i++)
+        {
+            slottexjob &job = *jobs[i];
+            job.ok = job.slot->combineimages(job.index, job.slot->sts[job.index], job.image, job.compress);
+        }
+    };
+    if(paralleltextures) inexor::util::shared_pool().parallel_for(end - start, 1, prepare);
+    else prepare(0, end - start);
+}
+
+/// Load many slots at once (e.g. all slots used by a map).
+/// The registry and cache lookups and texture combination bookkeeping is done up front, then all images are
+/// decoded, modified and merged on the shared thread pool (in batches of texturebatch images) and
+/// only the final GL upload happens one by one on the main thread.
+void loadslots(vector<Slot *> &list, bool msg)
+{
+    vector<slottexjob *> jobs;
+    std::unordered_map<std::string, slottexjob *> keys;
+    loopv(list)
+    {
+        Slot &s = *list[i];
+        if(s.loaded) continue;
+        linkslotshader(s);
+        loopvj(s.sts)
+        {
+            Slot::Tex &t = s.sts[j];
+            if(t.combined >= 0) continue;
+            if(t.type == TEX_ENVMAP) { t.t = cubemapload(t.name); continue; }
+
+            slottexjob *job = new slottexjob(&s, j);
+            int texmask = 0;
+            gencombinedname(job->key, texmask, s, t, j, false);
+            t.t = gettexture(job->key.getbuf());
+            if(t.t) { delete job; continue; }
+            auto dup = keys.find(job->key.getbuf());
+            if(dup != keys.end()) { dup->second->targets.add(&t); delete job; continue; }
+            job->cacheable = gettexcachekey(job->cachekey, job->key.getbuf(), s, t, j);
+            if(job->cacheable && !texcacheverify && (t.t = texcacheload(job->cachekey, job->key.getbuf()))) { delete job; continue; } // registered now
+            job->targets.add(&t);
+            keys[job->key.getbuf()] = job;
+            jobs.add(job);
+        }
+        s.loaded = true;
+    }
+
+    for(int start = 0; start < jobs.length(); start += texturebatch)
+    {
+        int end = min(start + int(texturebatch), jobs.length());
+        if(msg) renderprogress(float(start)/jobs.length(), "loading textures...");
+        prepareslottexs(jobs, start, end);
+        for(int i = start; i < end; i++)
+        {
+            slottexjob &job = *jobs[i];
+            Texture *tex = job.ok ? newtexture(NULL, job.key.getbuf(), job.image, 0, true, true, true, job.compress) : notexture;
+            if(job.ok && job.cacheable) texcachesave(job.cachekey, tex);
+            loopvj(job.targets) job.targets[j]->t = tex;
+            job.image.cleanup();
+        }
+    }
+    jobs.deletecontents();
+}
+
+/// Time the CPU side of loading all textures of the current slots (decoding, modifiers, merging),
+/// serial and on the shared thread pool. Nothing is uploaded.
+void benchtextureload(int *iterations)
+{
+    vector<slottexjob *> jobs;
+    loopv(slots)
+    {
+        Slot &s = *slots[i];
+        loopvj(s.sts) if(s.sts[j].combined < 0 && s.sts[j].type != TEX_ENVMAP) jobs.add(new slottexjob(&s, j));
+    }
+    if(jobs.empty()) { spdlog::get("global")->error("benchtextureload: no texture slots defined, load a map first"); return; }
+
+    int n = max(*iterations, 1), oldparallel = paralleltextures;
+    double ms[2];
+    loopk(2)
+    {
+        paralleltextures = k;
+        inexor::util::Stopwatch sw;
+        loopj(n) for(int start = 0; start < jobs.length(); start += texturebatch)
+        {
+            int end = min(start + int(texturebatch), jobs.length());
+            prepareslottexs(jobs, start, end);
+            for(int i = start; i < end; i++) jobs[i]->image.cleanup();
+        }
+        ms[k] = sw.elapsed_ms()/n;
+    }
+    paralleltextures = oldparallel;
+
+    spdlog::get("global")->info("benchtextureload: {} images from {} slots: serial {:.1f} ms, parallel {:.1f} ms ({} workers), speedup {:.1f}x",
+        jobs.length(), slots.length(), ms[0], ms[1], inexor::util::shared_pool().size(), ms[0]/max(ms[1], 0.001));
+    jobs.deletecontents();
 }
+COMMAND(benchtextureload, "i");
 
 struct jsontextype
 {
@@ -144,6 +144,9 @@ class Slot
 
     VSlot *findvariant(const VSlot &src, const VSlot &delta);
 
+    /// Decode, modify and merge the images of t (and the spec/depth texture combined into it) into ts.
+    /// Does not touch any GPU or registry state, so it may run on worker threads if msg is false.
+    bool combineimages(int index, Slot::Tex &t, ImageData &ts, int &compress, bool msg = false);
     void combinetextures(int index, Slot::Tex &t, bool msg = true, bool forceload = false);
 
     Slot &load(bool msg, bool forceload);
@@ -172,6 +175,7 @@ struct MSlot : Slot, VSlot
 };
 
 extern void loadlayermasks();
+extern void loadslots(vector<Slot *> &list, bool msg = true);
 
 extern void clearslots();
 extern void cleanupslots();
@@ -0,0 +1,364 @@
+/// @file Persistent cache of fully processed slot textures.
+
+#include "inexor/texture/texcache.hpp"
+#include "inexor/texture/texture.hpp"
+#include "inexor/texture/texsettings.hpp"
+#include "inexor/texture/format.hpp"
+#include "inexor/texture/SDL_loading.hpp"
+#include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <boost/filesystem.hpp>
+
+#define TEXCACHE_MAGIC "ITEXCACH"
+#define TEXCACHE_VERSION 2
+#define TEXCACHE_DIR "cache/texture/"
+
+VARP(texcache, 0, 1, 1);
+VARP(texcachesize, 16, 512, 16384); // MB, least recently used entries get evicted beyond that
+VAR(texcacheverify, 0, 0, 1);
+
+extern SharedVar<int> usedds, scaledds;
+
+static struct texcacheinfo
+{
+    int hits, misses, writes, verified, mismatches, evicted;
+    llong disksize; // -1 until the cache directory was scanned
+
+    texcacheinfo() : hits(0), misses(0), writes(0), verified(0), mismatches(0), evicted(0), disksize(-1) {}
+} texcachecounters;
+
+/// Header of a cache file, followed by levels times (int size, size bytes) and the payload crc.
+struct texcacheheader
+{
+    char magic[8];
+    int version;
+    int type, xs, ys, bpp;
+    int internal, format, compressed, levels;
+};
+
+static void addtokey(texcachekey &k, const void *data, size_t len)
+{
+    k.crc = crc32(k.crc, (const Bytef *)data, len);
+    k.adler = adler32(k.adler, (const Bytef *)data, len);
+}
+
+static void addtokey(texcachekey &k, int val) { addtokey(k, &val, sizeof(val)); }
+
+/// Add the image file a texture name (with optional <commands>) refers to: its path, size and modification time,
+/// so a miss does not read every source twice. Files inside a zip are hashed by their contents, which are in memory anyway.
+static bool addsourcetokey(texcachekey &k, const char *name)
+{
+    const char *file = strrchr(name, '>');
+    file = file ? file+1 : name;
+    int len = strlen(file);
+    if(strstr(name, "<dds") || (len >= 4 && !strcasecmp(file + len - 4, ".dds"))) return false;
+
+    string pname;
+    copystring(pname, file);
+    path(pname);
+    std::lock_guard<std::mutex> guard(texturefilelock);
+    llong size = 0, mtime = 0;
+    if(!findzipfile(pname)) // openfile() prefers these over files on disk
+    {
+        if(!statfile(pname, size, mtime)) return false;
+        const char *found = findfile(pname, "rb");
+        addtokey(k, found, strlen(found)+1);
+        addtokey(k, &size, sizeof(size));
+        addtokey(k, &mtime, sizeof(mtime));
+        return true;
+    }
+    stream *f = openzipfile(pname, "rb");
+    if(!f) return false;
+    uchar buf[16384];
+    size_t total = 0;
+    for(;;)
+    {
+        size_t n = f->read(buf, sizeof(buf));
+        if(!n) break;
+        addtokey(k, buf, n);
+        total += n;
+    }
+    delete f;
+    addtokey(k, &total, sizeof(total));
+    return true;
+}
+
+bool gettexcachekey(texcachekey &k, const char *key, Slot &s, Slot::Tex &t, int index)
+{
+    if(!texcache) return false;
+    k.crc = crc32(0, NULL, 0);
+    k.adler = adler32(0, NULL, 0);
+    addtokey(k, TEXCACHE_VERSION);
+    addtokey(k, key, strlen(key)+1);
+    addtokey(k, t.type);
+    if(!addsourcetokey(k, t.name)) return false;
+    if(t.type == TEX_DIFFUSE || t.type == TEX_NORMAL) loopv(s.sts)
+    {
+        Slot::Tex &a = s.sts[i];
+        if(a.combined != index) continue;
+        if(!addsourcetokey(k, a.name)) return false;
+        break;
+    }
+    const int settings[] = { usetexcompress, texcompress, texcompressquality, maxtexsize, hwtexsize, texreduce, reducefilter, usenp2, usedds, scaledds };
+    addtokey(k, settings, sizeof(settings));
+    return true;
+}
+
+static void gettexcachepath(const texcachekey &k, string &cachename)
+{
+    formatstring(cachename, TEXCACHE_DIR "%08x%08x.itc", k.crc, k.adler);
+}
+
+/// Load a complete cache file and check its header and checksum.
+/// @return the file contents (new[] allocated) or NULL.
+static uchar *readtexcache(const texcachekey &k, size_t &len)
+{
+    string cachename;
+    gettexcachepath(k, cachename);
+    uchar *data;
+    {
+        std::lock_guard<std::mutex> guard(texturefilelock);
+        data = (uchar *)loadfile(path(cachename), &len, false);
+    }
+    if(!data) return NULL;
+    texcacheheader *hdr = (texcacheheader *)data;
+    uint crc = 0;
+    if(len < sizeof(texcacheheader) + sizeof(uint) || memcmp(hdr->magic, TEXCACHE_MAGIC, 8)) { delete[] data; return NULL; }
+    lilswap(&hdr->version, (sizeof(texcacheheader) - sizeof(hdr->magic))/sizeof(int));
+    memcpy(&crc, &data[len - sizeof(uint)], sizeof(uint));
+    lilswap(&crc, 1);
+    if(hdr->version != TEXCACHE_VERSION || hdr->levels <= 0 || crc != crc32(crc32(0, NULL, 0), data + sizeof(texcacheheader), len - sizeof(texcacheheader) - sizeof(uint)))
+    {
+        delete[] data;
+        return NULL;
+    }
+    return data;
+}
+
+/// Update the modification time, which the eviction uses as last access time.
+static void touchtexcache(const texcachekey &k)
+{
+    string cachename;
+    gettexcachepath(k, cachename);
+    boost::system::error_code ec;
+    boost::filesystem::last_write_time(findfile(path(cachename), "rb"), time(NULL), ec);
+}
+
+Texture *texcacheload(const texcachekey &k, const char *key)
+{
+    size_t len = 0;
+    uchar *data = readtexcache(k, len);
+    if(!data) { texcachecounters.misses++; return NULL; }
+    const texcacheheader &hdr = *(const texcacheheader *)data;
+
+    Texture *t = registertexture(key);
+    t->clamp = 0;
+    t->mipmap = true;
+    t->type = hdr.type;
+    t->xs = hdr.xs;
+    t->ys = hdr.ys;
+    t->bpp = hdr.bpp;
+    glGenTextures(1, &t->id);
+    setuptexparameters(t->id, data, 0, reducefilter ? 2 : 0, hdr.format, GL_TEXTURE_2D);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    const uchar *src = data + sizeof(texcacheheader), *end = data + len - sizeof(uint);
+    int w = 0, h = 0;
+    loopi(hdr.levels)
+    {
+        int vals[3];
+        if(end - src < int(sizeof(vals))) break;
+        memcpy(vals, src, sizeof(vals));
+        lilswap(vals, 3);
+        src += sizeof(vals);
+        int lw = vals[0], lh = vals[1], size = vals[2];
+        if(size < 0 || size > end - src) break;
+        if(!i) { w = lw; h = lh; }
+        if(hdr.compressed) glCompressedTexImage2D_(GL_TEXTURE_2D, i, hdr.internal, lw, lh, 0, size, src);
+        else glTexImage2D(GL_TEXTURE_2D, i, hdr.internal, lw, lh, 0, hdr.format, GL_UNSIGNED_BYTE, src);
+        src += size;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    t->w = w;
+    t->h = h;
+    delete[] data;
+
+    touchtexcache(k);
+    texcachecounters.hits++;
+    return t;
+}
+
+/// Read back all levels of the texture bound to GL_TEXTURE_2D.
+static void readbacktexture(Texture *t, vector<uchar> &payload, texcacheheader &hdr)
+{
+    GLint compressed = 0, internal = 0;
+    glBindTexture(GL_TEXTURE_2D, t->id);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internal);
+
+    memcpy(hdr.magic, TEXCACHE_MAGIC, 8);
+    hdr.version = TEXCACHE_VERSION;
+    hdr.type = t->type;
+    hdr.xs = t->xs;
+    hdr.ys = t->ys;
+    hdr.bpp = t->bpp;
+    hdr.internal = internal;
+    hdr.format = texformat(t->bpp);
+    hdr.compressed = compressed ? 1 : 0;
+    hdr.levels = 0;
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    for(int level = 0;; level++)
+    {
+        GLint w = 0, h = 0, size = 0;
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &w);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &h);
+        if(w <= 0 || h <= 0) break;
+        if(compressed) glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+        else size = w*h*hdr.bpp;
+        int vals[3] = { w, h, size };
+        lilswap(vals, 3);
+        payload.put((const uchar *)vals, sizeof(vals));
+        uchar *dst = payload.reserve(size).buf;
+        if(compressed) glGetCompressedTexImage_(GL_TEXTURE_2D, level, dst);
+        else glGetTexImage(GL_TEXTURE_2D, level, hdr.format, GL_UNSIGNED_BYTE, dst);
+        payload.advance(size);
+        hdr.levels++;
+        if(max(w, h) <= 1 || !t->mipmap) break;
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+}
+
+/// Delete the least recently used entries until the cache fits into texcachesize again.
+static void evicttexcache()
+{
+    namespace fs = boost::filesystem;
+    string dirname;
+    copystring(dirname, findfile(path(TEXCACHE_DIR "x", true), "w"));
+    char *slash = strrchr(dirname, PATHDIV);
+    if(slash) slash[1] = '\0';
+
+    struct entry { fs::path file; std::time_t used; llong size; };
+    std::vector<entry> entries;
+    llong total = 0;
+    boost::system::error_code ec;
+    for(fs::directory_iterator it(dirname, ec), end; !ec && it != end; it.increment(ec))
+    {
+        if(it->path().extension() != ".itc") continue;
+        entry e = { it->path(), fs::last_write_time(it->path(), ec), llong(fs::file_size(it->path(), ec)) };
+        if(ec) continue;
+        entries.push_back(e);
+        total += e.size;
+    }
+
+    llong limit = llong(texcachesize) << 20;
+    if(total > limit)
+    {
+        // make some room, so we do not need to scan again with every new entry
+        std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) { return a.used < b.used; });
+        for(const entry &e : entries)
+        {
+            if(total <= limit - limit/8) break;
+            if(fs::remove(e.file, ec)) { total -= e.size; texcachecounters.evicted++; }
+        }
+    }
+    texcachecounters.disksize = total;
+}
+
+void texcachesave(const texcachekey &k, Texture *t)
+{
+    if(!t || t == notexture || !t->id || t->type&Texture::STUB) return;
+
+    texcacheheader hdr;
+    vector<uchar> payload;
+    readbacktexture(t, payload, hdr);
+    if(!hdr.levels) return;
+
+    if(texcacheverify)
+    {
+        size_t len = 0;
+        uchar *data = readtexcache(k, len);
+        if(data)
+        {
+            texcacheheader old = *(texcacheheader *)data;
+            bool same = old.type == hdr.type && old.xs == hdr.xs && old.ys == hdr.ys && old.internal == hdr.internal && old.levels == hdr.levels &&
+                        len == sizeof(texcacheheader) + payload.length() + sizeof(uint) && !memcmp(data + sizeof(texcacheheader), payload.getbuf(), payload.length());
+            delete[] data;
+            texcachecounters.verified++;
+            if(same) return;
+            texcachecounters.mismatches++;
+            spdlog::get("global")->warn("texture cache entry of {} differs from the source, rewriting it", t->name);
+        }
+    }
+
+    uint crc = crc32(crc32(0, NULL, 0), payload.getbuf(), payload.length());
+    lilswap(&hdr.version, (sizeof(texcacheheader) - sizeof(hdr.magic))/sizeof(int));
+    lilswap(&crc, 1);
+
+    string cachename;
+    gettexcachepath(k, cachename);
+    stream *f = openrawfile(path(cachename), "wb");
+    if(!f) return;
+    bool ok = f->write(&hdr, sizeof(hdr)) == sizeof(hdr) && f->write(payload.getbuf(), payload.length()) == size_t(payload.length()) && f->write(&crc, sizeof(crc)) == sizeof(crc);
+    delete f;
+    if(!ok) return;
+    texcachecounters.writes++;
+
+    llong size = sizeof(hdr) + payload.length() + sizeof(crc);
+    if(texcachecounters.disksize < 0 || texcachecounters.disksize + size > (llong(texcachesize) << 20)) evicttexcache();
+    else texcachecounters.disksize += size;
+}
+
+void texcachestats()
+{
+    if(texcachecounters.disksize < 0) evicttexcache();
+    spdlog::get("global")->info("texture cache: {} hits, {} misses, {} written, {} verified ({} mismatches), {} evicted, {:.1f} of {} MB used",
+        texcachecounters.hits, texcachecounters.misses, texcachecounters.writes, texcachecounters.verified, texcachecounters.mismatches,
+        texcachecounters.evicted, texcachecounters.disksize/double(1<<20), int(texcachesize));
+}
+COMMAND(texcachestats, "");
+
+/// Time loading all textures of the loaded slots from their sources and from the cache, including the upload.
+/// The textures are created in addition to the registered ones and deleted again.
+void benchtexcache(int *iterations)
+{
+    int n = max(*iterations, 1), images = 0;
+    double ms[2] = { 0, 0 };
+    loopk(2) loopj(n) loopv(slots)
+    {
+        Slot &s = *slots[i];
+        if(!s.loaded) continue;
+        loopvj(s.sts)
+        {
+            Slot::Tex &t = s.sts[j];
+            if(t.combined >= 0 || t.type == TEX_ENVMAP || !t.t || t.t == notexture) continue;
+            texcachekey ck;
+            if(!gettexcachekey(ck, t.t->name, s, t, j)) continue;
+            defformatstring(key, "benchtexcache:%d:%d", i, j);
+
+            inexor::util::Stopwatch sw;
+            Texture *tex = NULL;
+            if(k) tex = texcacheload(ck, key);
+            else
+            {
+                ImageData img;
+                int compress = 0;
+                if(s.combineimages(j, t, img, compress)) tex = newtexture(NULL, key, img, 0, true, true, true, compress);
+            }
+            ms[k] += sw.elapsed_ms();
+            if(!tex) continue;
+            if(!k)
+            {
+                images++;
+                texcachesave(ck, tex);
+            }
+            cleanuptexture(tex);
+        }
+    }
+    if(!images) { spdlog::get("global")->error("benchtexcache: no cacheable slot textures loaded, load a map first"); return; }
+    spdlog::get("global")->info("benchtexcache: {} textures: decoding and processing {:.1f} ms, from cache {:.1f} ms, speedup {:.1f}x",
+        images/n, ms[0]/n, ms[1]/n, ms[0]/max(ms[1], 0.001));
+}
+COMMAND(benchtexcache, "i");
@@ -0,0 +1,32 @@
+/// @file Persistent cache of fully processed slot textures.
+/// Stores the final (modified, merged, resized, mipmapped and possibly driver compressed) levels
+/// of a texture as they were uploaded, so later loads skip decoding and processing altogether.
+
+#pragma once
+
+#include "inexor/engine/engine.hpp"
+#include "inexor/texture/slot.hpp"
+
+/// Identifies one cache entry: a hash over the source files (path, size and modification time),
+/// the texture commands and every setting which influences the uploaded result.
+struct texcachekey
+{
+    uint crc, adler;
+
+    texcachekey() : crc(0), adler(0) {}
+};
+
+/// Compute the cache key of slot texture t with the combined name key.
+/// @return false if the texture can not be cached (e.g. it is a dds file or a source is missing).
+extern bool gettexcachekey(texcachekey &k, const char *key, Slot &s, Slot::Tex &t, int index);
+
+/// Create and register texture key from the cache.
+/// @return NULL on a cache miss.
+extern Texture *texcacheload(const texcachekey &k, const char *key);
+
+/// Read back the uploaded texture t and store it.
+/// In verify mode (texcacheverify 1) the existing entry is compared against it instead.
+extern void texcachesave(const texcachekey &k, Texture *t);
+
+extern SharedVar<int> texcache;
+extern SharedVar<int> texcacheverify;
@@ -333,9 +333,12 @@ static vec parsevec(const char *arg)
 VAR(usedds, 0, 1, 1);
 VAR(scaledds, 0, 2, 4);
 
+/// Load an image and apply all texture commands (<mad>, <rotate>, ..) given in its name.
+/// Threadsafe as long as msg is false.
 bool texturedata(ImageData &d, const char *tname, Slot::Tex *tex, bool msg, int *compress)
 {
     const char *cmds = NULL, *file = tname;
+    string pname;
 
     if(!tname)
     {
@@ -349,7 +352,6 @@ bool texturedata(ImageData &d, const char *tname, Slot::Tex *tex, bool msg, int
         }
         else file = tex->name;
 
-        static string pname; //todo threadsafe?
         formatstring(pname, "%s", file);
         file = path(pname);
     }
@@ -391,7 +393,12 @@ bool texturedata(ImageData &d, const char *tname, Slot::Tex *tex, bool msg, int
         string dfile;
         copystring(dfile, file);
         memcpy(dfile + flen - 4, ".dds", 4);
-        if(!loaddds(dfile, d, raw ? 1 : (dds ? 0 : -1)) && (!dds || raw))
+        bool loaded;
+        {
+            std::lock_guard<std::mutex> guard(texturefilelock);
+            loaded = loaddds(dfile, d, raw ? 1 : (dds ? 0 : -1));
+        }
+        if(!loaded && (!dds || raw))
         {
             if(msg) spdlog::get("global")->warn("could not load texture {}", dfile);
             return false;
@@ -0,0 +1,125 @@
+#include <algorithm>
+
+#include "inexor/util/IpTrie.hpp"
+
+namespace inexor {
+namespace util {
+
+namespace {
+
+uint32_t prefix_mask(int len) { return len > 0 ? 0xFFFFFFFFu << (32 - len) : 0; }
+int prefix_bit(uint32_t ip, int n) { return (ip >> (31 - n)) & 1; }
+
+/// Length of the prefix mask is a prefix of, -1 if it isn't of the form 1..10..0.
+int prefix_length(uint32_t mask) {
+    uint32_t inv = ~mask;
+    if (inv & (inv + 1)) return -1;
+    int len = 0;
+    while (len < 32 && prefix_bit(mask, len)) len++;
+    return len;
+}
+
+}
+
+void IpTrie::clear() {
+    nodes.clear();
+    others.clear();
+    count = 0;
+    add_node(0, 0, 0);
+}
+
+int IpTrie::add_node(uint32_t prefix, int len, int refs) {
+    Node n;
+    n.mask.ip = prefix;
+    n.mask.mask = prefix_mask(len);
+    n.len = len;
+    n.refs = refs;
+    n.child[0] = n.child[1] = -1;
+    nodes.push_back(n);
+    return int(nodes.size()) - 1;
+}
+
+void IpTrie::add(uint32_t ip, uint32_t mask) {
+    count++;
+    int len = prefix_length(mask);
+    if (len < 0) {
+        others.push_back(Mask{ip & mask, mask});
+        return;
+    }
+    uint32_t prefix = ip & mask;
+
+    // nodes gets reallocated by add_node(), hence indices instead of references
+    int n = 0;
+    for (;;) {
+        if (nodes[n].len == len) {
+            nodes[n].refs++;
+            return;
+        }
+        int dir = prefix_bit(prefix, nodes[n].len), c = nodes[n].child[dir];
+        if (c < 0) {
+            int leaf = add_node(prefix, len, 1);
+            nodes[n].child[dir] = leaf;
+            return;
+        }
+        // length of the prefix shared with the child, at least one more bit than n has
+        int common = nodes[n].len + 1, max_common = std::min(nodes[c].len, len);
+        uint32_t diff = nodes[c].mask.ip ^ prefix;
+        while (common < max_common && !prefix_bit(diff, common)) common++;
+        if (common == nodes[c].len) {
+            n = c;
+            continue;
+        }
+
+        // split the edge to c at the first differing bit
+        int split = add_node(prefix & prefix_mask(common), common, 0);
+        nodes[split].child[prefix_bit(nodes[c].mask.ip, common)] = c;
+        nodes[n].child[dir] = split;
+        n = split;
+    }
+}
+
+bool IpTrie::remove(uint32_t ip, uint32_t mask) {
+    int len = prefix_length(mask);
+    if (len < 0) {
+        for (size_t i = 0; i < others.size(); i++) {
+            if (others[i].mask == mask && others[i].ip == (ip & mask)) {
+                others.erase(others.begin() + i);
+                count--;
+                return true;
+            }
+        }
+        return false;
+    }
+    uint32_t prefix = ip & mask;
+    for (int n = 0; n >= 0;) {
+        Node &cur = nodes[n];
+        if (cur.len > len || (prefix & cur.mask.mask) != cur.mask.ip) return false;
+        if (cur.len == len) {
+            if (!cur.refs) return false;
+            cur.refs--;
+            count--;
+            return true;
+        }
+        n = cur.child[prefix_bit(prefix, cur.len)];
+    }
+    return false;
+}
+
+const IpTrie::Mask *IpTrie::find(uint32_t ip) const {
+    const Mask *best = nullptr;
+    for (int n = 0; n >= 0;) {
+        const Node &cur = nodes[n];
+        if ((ip & cur.mask.mask) != cur.mask.ip) break;
+        if (cur.refs) best = &cur.mask;
+        if (cur.len >= 32) break;
+        n = cur.child[prefix_bit(ip, cur.len)];
+    }
+    if (best) return best;
+    for (const Mask &m : others) {
+        if ((ip & m.mask) == m.ip) return &m;
+    }
+    return nullptr;
+}
+
+}
+}
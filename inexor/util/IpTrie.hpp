@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// A set of ip masks (ban lists with tens of thousands of entries, ..)
+/// where checking an ip doesn't get slower with more masks.
+///
+/// Masks are kept in a path compressed binary trie (radix tree) over
+/// their prefix bits, so a lookup takes at most 32 steps. Masks which
+/// are no prefix (like 1.*.3.4) are checked one after another.
+/// Everything is in host byte order.
+///
+///   IpTrie bans;
+///   bans.add(0x0A000000, 0xFF000000); // 10.0.0.0/8
+///   bans.contains(0x0A010203);        // true
+class IpTrie {
+public:
+    struct Mask {
+        uint32_t ip, mask;
+    };
+
+    IpTrie() { clear(); }
+
+    void clear();
+
+    /// Adding the same mask twice takes two remove() to get rid of it.
+    void add(uint32_t ip, uint32_t mask);
+
+    /// Takes back one add() of exactly this mask.
+    /// @return false if it wasn't added.
+    bool remove(uint32_t ip, uint32_t mask);
+
+    /// @return The most specific mask containing ip, nullptr if none does.
+    const Mask *find(uint32_t ip) const;
+
+    bool contains(uint32_t ip) const { return find(ip) != nullptr; }
+
+    /// Number of masks added and not removed again.
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
+
+    /// Number of trie nodes, removed masks leave theirs behind until clear().
+    size_t node_count() const { return nodes.size(); }
+
+private:
+    struct Node {
+        Mask mask;     ///< all bits of ip below len are 0
+        int len;       ///< prefix length in bits
+        int refs;      ///< how often this mask was added, 0 if the node only splits the way to its children
+        int child[2];  ///< indices into nodes, -1 for none
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Mask> others; ///< the masks which are no prefix
+    size_t count;
+
+    int add_node(uint32_t prefix, int len, int refs);
+};
+
+}
+}
@@ -1,26 +1,140 @@
 #include "inexor/util/Logging.hpp"
+#include "inexor/util/Stopwatch.hpp"
 
 #include <spdlog/sinks/msvc_sink.h>
+#include <spdlog/sinks/null_sink.h>
 
 #include <vector>
 #include <string>
 #include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
 
 using std::make_shared;
 
 namespace inexor {
 namespace util {
 
-Logging::Logging()
+/// The logger itself doesn't format anything, the pattern gets applied by the AsyncLogBackend.
+class deferred_formatter : public spdlog::formatter
+{
+public:
+    void format(spdlog::details::log_msg &msg) override {}
+};
+
+AsyncLogBackend::AsyncLogBackend(size_t queue_size) : ring(new slot[queue_size]), mask(queue_size - 1)
+{
+    for(size_t i = 0; i < queue_size; i++) ring[i].sequence.store(i, std::memory_order_relaxed);
+    worker = std::thread([this] { run(); });
+}
+
+AsyncLogBackend::~AsyncLogBackend()
+{
+    stopping = true;
+    worker.join();
+}
+
+void AsyncLogBackend::push(AsyncSink *target, const spdlog::details::log_msg &msg)
+{
+    // claim the next free slot (see spdlog's mpmc_bounded_queue), but fill it in place
+    slot *s;
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for(;;)
+    {
+        s = &ring[pos & mask];
+        intptr_t dif = intptr_t(s->sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+        if(!dif)
+        {
+            if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if(dif < 0)
+        {
+            dropped++; // the backend didn't get to this slot since the last round
+            return;
+        }
+        else pos = enqueue_pos.load(std::memory_order_relaxed);
+    }
+    s->target = target;
+    s->level = msg.level;
+    s->time = msg.time;
+    s->thread_id = msg.thread_id;
+    s->length = std::min(msg.raw.size(), MAX_MESSAGE_LENGTH);
+    memcpy(s->text, msg.raw.data(), s->length);
+    s->sequence.store(pos + 1, std::memory_order_release);
+    queued++;
+}
+
+void AsyncLogBackend::flush()
+{
+    if(std::this_thread::get_id() == worker.get_id()) return;
+    const uint64_t until = queued;
+    if(written >= until) return;
+    std::unique_lock<std::mutex> lock(flush_mutex);
+    flush_waiters++;
+    flushed.wait(lock, [&] { return written >= until; });
+    flush_waiters--;
+}
+
+void AsyncLogBackend::run()
+{
+    uint64_t reported_drops = 0;
+    for(;;)
+    {
+        slot &s = ring[dequeue_pos & mask];
+        if(s.sequence.load(std::memory_order_acquire) == dequeue_pos + 1)
+        {
+            spdlog::details::log_msg msg;
+            msg.logger_name = &s.target->name();
+            msg.level = s.level;
+            msg.time = s.time;
+            msg.thread_id = s.thread_id;
+            msg.raw << fmt::StringRef(s.text, s.length);
+            s.target->write(msg);
+            s.sequence.store(dequeue_pos + mask + 1, std::memory_order_release); // free for the next round
+            dequeue_pos++;
+            written++;
+            if(flush_waiters)
+            {
+                // taking the lock makes sure a flush() which just checked written is waiting already
+                std::lock_guard<std::mutex> lock(flush_mutex);
+                flushed.notify_all();
+            }
+            continue;
+        }
+        if(stopping) break; // everything got written
+        if(dropped != reported_drops)
+        {
+            // we are idle, so this one will make it.
+            uint64_t drops = dropped;
+            if(auto global = spdlog::get("global")) global->warn("logging: dropped {} messages, the log queue was full", drops - reported_drops);
+            reported_drops = drops;
+            continue;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void AsyncSink::set_pattern(const std::string &pattern)
+{
+    spdlog::formatter_ptr f = make_shared<spdlog::pattern_formatter>(pattern);
+    std::atomic_store(&formatter, f);
+}
+
+void AsyncSink::write(spdlog::details::log_msg &msg)
+{
+    std::atomic_load(&formatter)->format(msg);
+    for(auto &sink : sinks) sink->log(msg);
+}
+
+Logging::Logging() : backend(8192)
 {
-    // Queue size for async mode must be power of 2
-    size_t q_size = 4096;
-    // Set async mode
-    spdlog::set_async_mode(q_size);
 }
 
 Logging::~Logging()
 {
+    backend.flush();
+    for(auto &sink : allsinks) sink->flush();
     spdlog::drop_all();
 }
 
@@ -36,8 +150,11 @@ void Logging::initDefaultLoggers()
 void Logging::createAndRegisterLogger(std::string logger_name)
 {
     std::vector<spdlog::sink_ptr> sinks = getSinksForLogger(logger_name);
-    auto logger = std::make_shared<spdlog::logger>(logger_name, begin(sinks), end(sinks));
-    logger->set_pattern("%H:%M:%S [%n] [%l] %v");
+    auto frontend = make_shared<AsyncSink>(backend, logger_name, sinks);
+    frontend->set_pattern("%H:%M:%S [%n] [%l] %v");
+    frontends[logger_name] = frontend;
+    auto logger = make_shared<spdlog::logger>(logger_name, frontend);
+    logger->set_formatter(make_shared<deferred_formatter>());
     spdlog::register_logger(logger);
 }
 
@@ -50,8 +167,10 @@ std::vector<spdlog::sink_ptr> &Logging::getSinksForLogger(std::string logger_nam
 // TODO: Here we should configure which sinks are used in which logger using a configuration file
 void Logging::createSinks()
 {
+    // single threaded sinks: only the backend thread writes to them.
+    console = make_shared<InexorConsoleSink>(true);
     allsinks.push_back(make_shared<spdlog::sinks::stdout_sink_st>());
-    allsinks.push_back(make_shared<InexorConsoleSink>());
+    allsinks.push_back(console);
     allsinks.push_back(make_shared<InexorCutAnsiCodesSink>(make_shared<spdlog::sinks::rotating_file_sink_st>("inexor", "log", 5242880, 3)));
 #if defined(_MSC_VER) && !defined(NDEBUG)
     allsinks.push_back(make_shared<spdlog::sinks::msvc_sink_st>());
@@ -74,12 +193,55 @@ void Logging::setLogFormat(std::string logger_name, std::string pattern)
 {
     try {
         if(pattern.empty() || logger_name.empty()) return;
-        auto logger = spdlog::get(logger_name);
-        logger->set_pattern(pattern);
+        auto frontend = frontends.find(logger_name);
+        if(frontend != frontends.end()) frontend->second->set_pattern(pattern);
     } catch (const spdlog::spdlog_ex& ex) {
     }
 }
 
+void Logging::flushConsole()
+{
+    if(console) console->flush_pending();
+}
+
+void Logging::benchmark(int lines, int ticks)
+{
+    auto run = [&](std::shared_ptr<spdlog::logger> logger, double &avg, double &max)
+    {
+        logger->set_level(spdlog::level::debug);
+        avg = max = 0;
+        for(int tick = 0; tick < ticks; tick++)
+        {
+            Stopwatch sw;
+            for(int i = 0; i < lines; i++) logger->debug("benchlog: tick {0}, line {1}, pos ({2}, {3}, {4})", tick, i, i*0.5f, tick*0.25f, 512.0f);
+            double ms = sw.elapsed_ms();
+            avg += ms / ticks;
+            max = std::max(max, ms);
+        }
+    };
+
+    // the old way: formatting in the calling thread. Both ways write to a null sink of their own, so the
+    // benchmark neither spams the real sinks nor leaves files behind.
+    auto synclogger = make_shared<spdlog::logger>("benchlog", make_shared<spdlog::sinks::null_sink_st>());
+    synclogger->set_pattern("%H:%M:%S [%n] [%l] %v");
+    double syncavg, syncmax;
+    run(synclogger, syncavg, syncmax);
+
+    auto frontend = make_shared<AsyncSink>(backend, "benchlog", std::vector<spdlog::sink_ptr>{ make_shared<spdlog::sinks::null_sink_st>() });
+    frontend->set_pattern("%H:%M:%S [%n] [%l] %v");
+    auto asynclogger = make_shared<spdlog::logger>("benchlog", frontend);
+    asynclogger->set_formatter(make_shared<deferred_formatter>());
+    const uint64_t dropped = backend.dropped;
+    double asyncavg, asyncmax;
+    run(asynclogger, asyncavg, asyncmax);
+    Stopwatch drain;
+    backend.flush(); // frontend must not go away before the backend is done with its messages
+    const double drainms = drain.elapsed_ms();
+
+    spdlog::get("global")->info("benchlog: {} lines/tick, {} ticks: synchronous {:.3f} ms/tick (max {:.3f}), async {:.3f} ms/tick (max {:.3f}, {} dropped, {:.1f} ms until written)",
+        lines, ticks, syncavg, syncmax, asyncavg, asyncmax, backend.dropped - dropped, drainms);
+}
+
 void InexorConsoleSink::log(const spdlog::details::log_msg & msg)
 {
     int type = 0;
@@ -102,7 +264,15 @@ void InexorConsoleSink::log(const spdlog::details::log_msg & msg)
     }
     std::string str = msg.formatted.str();
     str.erase(std::remove(str.begin(), str.end(), '\n'), str.end());
-    conline(type, str.c_str());
+    if(!pending) conline(type, str.c_str());
+    else pending->push(line{type, std::move(str)}); // if it's full the line still makes it to the other sinks
+}
+
+void InexorConsoleSink::flush_pending()
+{
+    if(!pending) return;
+    line l;
+    while(pending->pop(l)) conline(l.type, l.text.c_str());
 }
 
 std::string InexorCutAnsiCodesSink::cutANSICodes(std::string logline)
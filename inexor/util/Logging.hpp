@@ -11,6 +11,14 @@
 #include <map>
 #include <array>
 #include <string>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "inexor/util/SpscQueue.hpp"
 
 /// Function which displayes console text ingame.
 extern void conline(int type, const char *sf);
@@ -90,10 +98,142 @@ namespace util {
         {"off", spdlog::level::off}
     };
 
+    /// Lets through one call every interval_ms, for logging from code which runs every frame or for every packet.
+    /// See LOG_EVERY_MS.
+    struct log_rate_limit
+    {
+        std::atomic<int64_t> next{0};
+        std::atomic<int> suppressed{0};
+
+        /// @return -1 if this call should be suppressed, otherwise the number of calls suppressed since the last one let through.
+        int allow(int interval_ms)
+        {
+            int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            int64_t due = next.load(std::memory_order_relaxed);
+            if(now < due || !next.compare_exchange_strong(due, now + interval_ms))
+            {
+                suppressed++;
+                return -1;
+            }
+            return suppressed.exchange(0);
+        }
+    };
+
+    /// Log at most once every interval_ms from this call site:
+    ///   LOG_EVERY_MS("global", debug, 1000, "{0} emitters, {1} particles", emitted, addedparticles);
+    #define LOG_EVERY_MS(logger_name, level, interval_ms, ...) do { \
+            static inexor::util::log_rate_limit _log_rate_limit; \
+            int _log_suppressed = _log_rate_limit.allow(interval_ms); \
+            if(_log_suppressed < 0) break; \
+            auto _logger = spdlog::get(logger_name); \
+            _logger->level(__VA_ARGS__); \
+            if(_log_suppressed) _logger->level("(suppressed {} similar messages)", _log_suppressed); \
+        } while(0)
+
+    class AsyncSink;
+
+    /// One thread which formats the messages of all loggers and writes them to their sinks.
+    ///
+    /// Logging itself (from the game thread or any other) then only copies the message into a slot of a preallocated
+    /// lock-free ring buffer, without allocating. If that is full the message gets dropped (and counted) instead of blocking.
+    class AsyncLogBackend
+    {
+    public:
+        /// Longer messages get cut off.
+        static const size_t MAX_MESSAGE_LENGTH = 480;
+
+    private:
+        struct slot
+        {
+            /// Which round of the ring this slot is in: its index + n*size when free, one more when it holds a message.
+            std::atomic<size_t> sequence;
+            AsyncSink *target;
+            spdlog::level::level_enum level;
+            spdlog::log_clock::time_point time;
+            size_t thread_id;
+            size_t length;
+            char text[MAX_MESSAGE_LENGTH];
+        };
+        std::unique_ptr<slot[]> ring;
+        const size_t mask;
+        std::atomic<size_t> enqueue_pos{0};
+        size_t dequeue_pos = 0; ///< backend thread only
+
+        std::mutex flush_mutex;
+        std::condition_variable flushed;
+        std::atomic<int> flush_waiters{0};
+
+        std::atomic<bool> stopping{false};
+        std::thread worker;
+
+        void run();
+
+    public:
+        /// @param queue_size must be a power of 2.
+        AsyncLogBackend(size_t queue_size);
+        ~AsyncLogBackend();
+
+        /// Number of messages handed to us, written to the sinks and dropped because the queue was full.
+        std::atomic<uint64_t> queued{0}, written{0}, dropped{0};
+
+        void push(AsyncSink *target, const spdlog::details::log_msg &msg);
+
+        /// Wait until everything queued so far has been written.
+        void flush();
+    };
+
+    /// The (only) sink of a logger: queues its messages for the AsyncLogBackend, which then formats them with our pattern and
+    /// writes them to our sinks in its own thread.
+    class AsyncSink : public spdlog::sinks::sink
+    {
+        AsyncLogBackend &backend;
+        const std::string logger_name;
+        const std::vector<spdlog::sink_ptr> sinks;
+        spdlog::formatter_ptr formatter;
+
+    public:
+        AsyncSink(AsyncLogBackend &backend_, const std::string &logger_name_, const std::vector<spdlog::sink_ptr> &sinks_)
+            : backend(backend_), logger_name(logger_name_), sinks(sinks_) {}
+
+        void log(const spdlog::details::log_msg& msg) override { backend.push(this, msg); }
+        void flush() override { backend.flush(); }
+
+        void set_pattern(const std::string &pattern);
+
+        /// Backend thread only.
+        const std::string &name() const { return logger_name; }
+        void write(spdlog::details::log_msg &msg);
+    };
+
+    /// Ingame GUI console.
+    ///
+    /// conline() may only be called from the main thread, so when we get fed by the AsyncLogBackend the lines get queued
+    /// until the main thread calls flush_pending() (once a frame).
+    class InexorConsoleSink : public spdlog::sinks::sink
+    {
+        struct line
+        {
+            int type;
+            std::string text;
+        };
+        std::unique_ptr<SpscQueue<line>> pending;
+    public:
+        /// @param deferred Whether we get called from another thread than the main thread.
+        InexorConsoleSink(bool deferred = false) : pending(deferred ? new SpscQueue<line>(1024) : nullptr) {}
+        void log(const spdlog::details::log_msg& msg) override;
+        void flush() override {}
+
+        /// Main thread only: hand the queued lines to the console.
+        void flush_pending();
+    };
+
     /// The global inexor logging API
     class Logging
     {
+        AsyncLogBackend backend;
         std::vector<spdlog::sink_ptr> allsinks;
+        std::shared_ptr<InexorConsoleSink> console;
+        std::map<std::string, std::shared_ptr<AsyncSink>> frontends;
         public:
             Logging();
             ~Logging();
@@ -103,14 +243,13 @@ namespace util {
             std::vector<spdlog::sink_ptr> &getSinksForLogger(std::string logger_name);
             void setLogLevel(std::string logger_name, std::string log_level);
             void setLogFormat(std::string logger_name, std::string pattern);
-    };
 
-    /// Ingame GUI console.
-    class InexorConsoleSink : public spdlog::sinks::sink
-    {
-    public:
-        void log(const spdlog::details::log_msg& msg) override;
-        void flush() override {}
+            /// Show the log lines which arrived in the meantime in the ingame console, call this once a frame.
+            void flushConsole();
+
+            /// Log lines debug lines per tick for ticks ticks, once formatted in this thread and once through the backend
+            /// and log how long the ticks took. The lines themselves go to null sinks.
+            void benchmark(int lines, int ticks);
     };
 
     /// Sink wrapper for removing any color codes from the log.
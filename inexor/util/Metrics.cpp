@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "inexor/util/Metrics.hpp"
+
+namespace inexor {
+namespace util {
+
+uint64_t Histogram::quantile(double q) const {
+    uint64_t total = count();
+    if (!total) return 0;
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(q * total + 0.5)), seen = 0;
+    for (int i = 0; i < bucket_count; i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) return std::min(bucket_max(i), max());
+    }
+    return max();
+}
+
+namespace {
+
+struct family {
+    std::string help;
+    double scale = 1;
+    // ordered by labels, so the output is stable
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+};
+
+/// Everything registered; like Subsystem::Register this is created on
+/// first use, since metrics get registered during static initialization.
+struct registry {
+    std::mutex mtx;
+    std::map<std::string, family> families;
+    std::vector<Metrics::Collector> collectors;
+
+    static registry &get() {
+        static registry instance;
+        return instance;
+    }
+};
+
+std::string with_label(const std::string &labels, const char *extra) {
+    if (labels.empty()) return extra;
+    return labels + "," + extra;
+}
+
+}
+
+Counter &Metrics::counter(const std::string &name, const std::string &help, const std::string &labels) {
+    registry &r = registry::get();
+    std::unique_lock<std::mutex> lock(r.mtx);
+    family &f = r.families[name];
+    f.help = help;
+    std::unique_ptr<Counter> &c = f.counters[labels];
+    if (!c) c.reset(new Counter);
+    return *c;
+}
+
+Histogram &Metrics::histogram(const std::string &name, const std::string &help, double scale, const std::string &labels) {
+    registry &r = registry::get();
+    std::unique_lock<std::mutex> lock(r.mtx);
+    family &f = r.families[name];
+    f.help = help;
+    f.scale = scale;
+    std::unique_ptr<Histogram> &h = f.histograms[labels];
+    if (!h) h.reset(new Histogram);
+    return *h;
+}
+
+void Metrics::add_collector(Collector c) {
+    registry &r = registry::get();
+    std::unique_lock<std::mutex> lock(r.mtx);
+    r.collectors.push_back(std::move(c));
+}
+
+void Metrics::write_header(std::string &out, const char *name, const char *help, const char *type) {
+    out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+    out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+}
+
+void Metrics::write_sample(std::string &out, const std::string &name, const std::string &labels, double value) {
+    char num[32];
+    snprintf(num, sizeof(num), "%.17g", value);
+    out += name;
+    if (!labels.empty()) {
+        out += '{'; out += labels; out += '}';
+    }
+    out += ' '; out += num; out += '\n';
+}
+
+std::string Metrics::render() {
+    registry &r = registry::get();
+    std::unique_lock<std::mutex> lock(r.mtx);
+    std::string out;
+    for (auto &n : r.families) {
+        family &f = n.second;
+        const char *type = f.histograms.empty() ? "counter" : "summary";
+        write_header(out, n.first.c_str(), f.help.c_str(), type);
+        for (auto &c : f.counters) write_sample(out, n.first, c.first, double(c.second->value()));
+        for (auto &e : f.histograms) {
+            const Histogram &h = *e.second;
+            static const struct { double q; const char *label; } quantiles[] = {
+                { 0.5, "quantile=\"0.5\"" }, { 0.9, "quantile=\"0.9\"" }, { 0.99, "quantile=\"0.99\"" }
+            };
+            for (auto &q : quantiles)
+                write_sample(out, n.first, with_label(e.first, q.label), h.quantile(q.q) * f.scale);
+            write_sample(out, n.first, with_label(e.first, "quantile=\"1\""), h.max() * f.scale);
+            write_sample(out, n.first + "_sum", e.first, h.sum() * f.scale);
+            write_sample(out, n.first + "_count", e.first, double(h.count()));
+        }
+    }
+    for (auto &c : r.collectors) c(out);
+    return out;
+}
+
+}
+}
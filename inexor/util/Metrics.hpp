@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace inexor {
+namespace util {
+
+/// A monotonically increasing number (packets sent, bytes written, ..).
+class Counter {
+public:
+    void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+/// Distribution of integer samples (durations in microseconds, sizes
+/// in bytes, ..) with a bounded relative error, like an HDR histogram.
+///
+/// Values are counted in log-linear buckets: the first 32 values get a
+/// bucket each, above that every power of two is split into 32 buckets,
+/// so any quantile is off by at most ~3%. Recording is a handful of
+/// instructions and never allocates.
+class Histogram {
+public:
+    static const int sub_bits = 5;
+    static const int sub_count = 1 << sub_bits;
+    static const int bucket_count = (64 - sub_bits + 1) * sub_count;
+
+    void record(uint64_t value) {
+        buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t m = max_.load(std::memory_order_relaxed);
+        while (value > m && !max_.compare_exchange_weak(m, value, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    /// @param q Between 0 and 1.
+    /// @return The largest value that falls into the same bucket as the
+    ///   q-th quantile (never more than max()), 0 if nothing got recorded.
+    uint64_t quantile(double q) const;
+
+    static int bucket_of(uint64_t value) {
+        if (value < uint64_t(sub_count)) return int(value);
+        int msb = 63;
+        while (!(value >> msb)) msb--;
+        return (msb - sub_bits + 1) * sub_count + int((value >> (msb - sub_bits)) - sub_count);
+    }
+
+    /// Largest value that still falls into the bucket.
+    static uint64_t bucket_max(int bucket) {
+        if (bucket < sub_count) return uint64_t(bucket);
+        int shift = bucket / sub_count - 1;
+        uint64_t lowest = uint64_t(sub_count + bucket % sub_count) << shift;
+        return lowest + ((uint64_t(1) << shift) - 1);
+    }
+
+private:
+    std::atomic<uint64_t> buckets[bucket_count] = {};
+    std::atomic<uint64_t> count_{0}, sum_{0}, max_{0};
+};
+
+/// Process wide registry of counters and histograms, rendered in the
+/// Prometheus text format on request.
+///
+/// Register once (at startup, or in a static) and keep the reference,
+/// updating a metric never touches the registry again:
+///
+///   static Counter &sent = Metrics::counter("inexor_packets_sent_total",
+///       "Packets sent to clients", "channel=\"1\"");
+///   sent.add();
+///
+/// Values that are cheap to read but change all the time (per client
+/// ping, queue lengths) are better exported by a collector, which only
+/// runs when somebody actually asks for the metrics.
+class Metrics {
+public:
+    /// @param labels Prometheus labels without braces, e.g. chan="1".
+    /// Registering the same name and labels twice returns the same counter.
+    static Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+
+    /// @param scale Factor applied to the recorded values when rendering,
+    ///   e.g. 1e-6 to record microseconds and export seconds.
+    static Histogram &histogram(const std::string &name, const std::string &help,
+                                double scale = 1, const std::string &labels = "");
+
+    /// A collector appends complete metric families to the output
+    /// (use write_sample() for the lines). Called from render().
+    typedef std::function<void(std::string &out)> Collector;
+    static void add_collector(Collector c);
+
+    /// Append "# HELP" and "# TYPE" lines.
+    static void write_header(std::string &out, const char *name, const char *help, const char *type);
+    /// Append one "name{labels} value" line.
+    static void write_sample(std::string &out, const std::string &name, const std::string &labels, double value);
+
+    /// All metrics in the Prometheus text exposition format; histograms
+    /// are exported as summaries (p50, p90, p99, max, sum and count).
+    static std::string render();
+};
+
+}
+}
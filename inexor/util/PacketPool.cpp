@@ -0,0 +1,95 @@
+#include <cstring>
+
+#include "inexor/util/PacketPool.hpp"
+
+namespace inexor {
+namespace util {
+
+/// Header in front of the data of every block, free blocks are
+/// linked through it.
+struct PacketPool::Block {
+    Block *next;
+    PacketPool *pool;
+    ENetPacketFreeCallback callback;
+
+    enet_uint8 *data() { return reinterpret_cast<enet_uint8 *>(this + 1); }
+    static Block *of(const ENetPacket *packet) { return reinterpret_cast<Block *>(packet->data) - 1; }
+};
+
+PacketPool::PacketPool(size_t block_size, size_t max_free)
+    : block_size_(block_size), max_free_(max_free) {}
+
+PacketPool::~PacketPool() {
+    while (free_) {
+        Block *b = free_;
+        free_ = b->next;
+        delete[] reinterpret_cast<char *>(b);
+    }
+}
+
+ENetPacket *PacketPool::create(size_t size, enet_uint32 flags) {
+    if (size > block_size_) {
+        unpooled++;
+        return enet_packet_create(nullptr, size, flags & ~ENET_PACKET_FLAG_NO_ALLOCATE);
+    }
+    Block *b = free_;
+    if (b) {
+        free_ = b->next;
+        free_count_--;
+        reused++;
+    } else {
+        b = reinterpret_cast<Block *>(new char[sizeof(Block) + block_size_]);
+        allocated++;
+    }
+    b->pool = this;
+    b->callback = nullptr;
+    ENetPacket *packet = enet_packet_create(b->data(), size, flags | ENET_PACKET_FLAG_NO_ALLOCATE);
+    if (!packet) {
+        b->next = free_;
+        free_ = b;
+        free_count_++;
+        return nullptr;
+    }
+    packet->freeCallback = release;
+    in_use_++;
+    return packet;
+}
+
+ENetPacket *PacketPool::grow(ENetPacket *packet, size_t len, size_t size) {
+    if (!pooled(packet) || size <= Block::of(packet)->pool->block_size_) {
+        enet_packet_resize(packet, size);
+        return packet;
+    }
+    Block::of(packet)->pool->unpooled++;
+    ENetPacket *grown = enet_packet_create(nullptr, size, packet->flags & ~ENET_PACKET_FLAG_NO_ALLOCATE);
+    if (!grown) return packet;
+    memcpy(grown->data, packet->data, len);
+    enet_packet_destroy(packet);
+    return grown;
+}
+
+bool PacketPool::pooled(const ENetPacket *packet) {
+    return packet->freeCallback == release;
+}
+
+void PacketPool::set_free_callback(ENetPacket *packet, ENetPacketFreeCallback callback) {
+    if (pooled(packet)) Block::of(packet)->callback = callback;
+    else packet->freeCallback = callback;
+}
+
+void PacketPool::release(ENetPacket *packet) {
+    Block *b = Block::of(packet);
+    if (b->callback) b->callback(packet);
+    PacketPool &pool = *b->pool;
+    pool.in_use_--;
+    if (pool.free_count_ >= pool.max_free_) {
+        delete[] reinterpret_cast<char *>(b);
+        return;
+    }
+    b->next = pool.free_;
+    pool.free_ = b;
+    pool.free_count_++;
+}
+
+}
+}
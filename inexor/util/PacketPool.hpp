@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <enet/enet.h>
+
+namespace inexor {
+namespace util {
+
+/// Fixed size blocks of memory for ENet packets, so building a
+/// message doesn't cost a malloc and a free each.
+///
+/// create() makes a packet with ENET_PACKET_FLAG_NO_ALLOCATE in a
+/// free block. Its freeCallback hands the block back once ENet
+/// destroys the packet, i.e. after the last peer sent it.
+///
+/// Not thread safe: every thread building packets needs a pool of
+/// its own, and a packet has to be destroyed by the thread which
+/// created it. The pool has to outlive its packets.
+///
+///   PacketPool pool(5000, 256);
+///   ENetPacket *p = pool.create(100, ENET_PACKET_FLAG_RELIABLE);
+///   enet_packet_destroy(p); // the block is free for the next create()
+class PacketPool {
+public:
+    /// @param block_size Bytes of data per block.
+    /// @param max_free Number of free blocks kept for reuse, more
+    ///   get freed.
+    PacketPool(size_t block_size, size_t max_free);
+    ~PacketPool();
+
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+
+    /// A packet of size bytes, in a block unless it doesn't fit one.
+    ENetPacket *create(size_t size, enet_uint32 flags);
+
+    /// Make packet size bytes long, keeping its first len bytes.
+    ///
+    /// Pooled packets which outgrow their block get replaced by one
+    /// with memory of its own (ENet only sets the length of
+    /// NO_ALLOCATE packets), the old one gets destroyed then.
+    /// @return The packet to use from now on.
+    static ENetPacket *grow(ENetPacket *packet, size_t len, size_t size);
+
+    /// Whether the packet lives in a block of some pool.
+    static bool pooled(const ENetPacket *packet);
+
+    /// Pooled packets need their own freeCallback, set any other
+    /// callback with this; it gets called before the block is
+    /// handed back.
+    static void set_free_callback(ENetPacket *packet, ENetPacketFreeCallback callback);
+
+    size_t block_size() const { return block_size_; }
+    /// Blocks ready for reuse.
+    size_t free_count() const { return free_count_; }
+    /// Blocks of packets which have not been destroyed yet.
+    size_t in_use() const { return in_use_; }
+
+    /// Blocks which had to be allocated, packets built in a reused
+    /// block and packets which didn't fit a block.
+    uint64_t allocated = 0, reused = 0, unpooled = 0;
+
+private:
+    struct Block;
+
+    static void release(ENetPacket *packet);
+
+    const size_t block_size_, max_free_;
+    Block *free_ = nullptr;
+    size_t free_count_ = 0, in_use_ = 0;
+};
+
+}
+}
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "inexor/util/Profiler.hpp"
+
+namespace inexor {
+namespace util {
+
+std::atomic<bool> Profiler::active{false};
+
+namespace {
+
+struct zone {
+    const char *name;
+    uint64_t begin, end;
+};
+
+struct threadbuffer {
+    int tid;
+    std::vector<zone> zones;
+    /// Number of zones written since the last start(), the ring
+    /// holds the last zones.size() of them.
+    std::atomic<uint64_t> written{0};
+    /// Set around every write, so stop() can wait for it.
+    std::atomic<bool> writing{false};
+};
+
+std::mutex mtx; // guards everything below
+std::vector<std::unique_ptr<threadbuffer>> buffers;
+size_t capacity = 1 << 16;
+typedef std::chrono::steady_clock steadyclock;
+uint64_t starttick = 0;
+steadyclock::time_point starttime;
+
+thread_local threadbuffer *local = nullptr;
+
+void wait_for_writers() {
+    for (auto &b : buffers)
+        while (b->writing.load()) std::this_thread::yield();
+}
+
+struct snapshot {
+    struct threadzones {
+        int tid;
+        std::vector<zone> zones;
+    };
+    std::vector<threadzones> threads;
+    uint64_t starttick = 0;
+    double ticks_per_ms = 1;
+};
+
+/// Copy what got recorded so far, recording goes on afterwards.
+void take_snapshot(snapshot &s) {
+    bool wasactive = Profiler::recording();
+    Profiler::stop();
+    std::unique_lock<std::mutex> lock(mtx);
+    for (auto &b : buffers) {
+        uint64_t n = b->written.load(std::memory_order_acquire);
+        size_t count = size_t(std::min<uint64_t>(n, b->zones.size()));
+        if (!count) continue;
+        s.threads.emplace_back();
+        s.threads.back().tid = b->tid;
+        for (uint64_t i = n - count; i < n; i++)
+            s.threads.back().zones.push_back(b->zones[i % b->zones.size()]);
+    }
+    s.starttick = starttick;
+    double ms = std::chrono::duration<double, std::milli>(steadyclock::now() - starttime).count();
+    if (ms > 0) s.ticks_per_ms = std::max((Profiler::now() - starttick) / ms, 1e-9);
+    lock.unlock();
+    if (wasactive) Profiler::resume();
+}
+
+}
+
+void Profiler::start(size_t events) {
+    stop();
+    std::unique_lock<std::mutex> lock(mtx);
+    capacity = std::max<size_t>(events, 1);
+    for (auto &b : buffers) {
+        b->zones.assign(capacity, zone());
+        b->written = 0;
+    }
+    starttick = now();
+    starttime = steadyclock::now();
+    active = true;
+}
+
+void Profiler::resume() {
+    active = true;
+}
+
+void Profiler::stop() {
+    active = false;
+    std::unique_lock<std::mutex> lock(mtx);
+    wait_for_writers();
+}
+
+void Profiler::record(const char *name, uint64_t begin, uint64_t end) {
+    threadbuffer *b = local;
+    if (!b) {
+        std::unique_lock<std::mutex> lock(mtx);
+        buffers.emplace_back(new threadbuffer);
+        b = local = buffers.back().get();
+        b->tid = int(buffers.size()) - 1;
+        b->zones.resize(capacity);
+    }
+    // Pairs with stop(): either it sees us writing or we see it stopped.
+    b->writing.store(true);
+    if (active.load()) {
+        uint64_t n = b->written.load(std::memory_order_relaxed);
+        zone &z = b->zones[n % b->zones.size()];
+        z.name = name;
+        z.begin = begin;
+        z.end = end;
+        b->written.store(n + 1, std::memory_order_release);
+    }
+    b->writing.store(false, std::memory_order_release);
+}
+
+std::string Profiler::summary() {
+    snapshot s;
+    take_snapshot(s);
+
+    struct stats {
+        std::vector<double> ms;
+        double total = 0;
+    };
+    std::map<std::string, stats> byname;
+    for (auto &t : s.threads)
+        for (zone &z : t.zones) {
+            stats &st = byname[z.name];
+            double ms = (z.end - z.begin) / s.ticks_per_ms;
+            st.ms.push_back(ms);
+            st.total += ms;
+        }
+
+    std::vector<std::pair<std::string, stats *>> sorted;
+    for (auto &n : byname) sorted.emplace_back(n.first, &n.second);
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, stats *> &a, const std::pair<std::string, stats *> &b) {
+        return a.second->total > b.second->total;
+    });
+
+    std::string out;
+    char line[256];
+    for (auto &n : sorted) {
+        std::vector<double> &ms = n.second->ms;
+        std::sort(ms.begin(), ms.end());
+        auto pct = [&ms](double p) { return ms[std::min(ms.size() - 1, size_t(p * ms.size()))]; };
+        snprintf(line, sizeof(line), "%-24s %8zu calls  avg %8.3f  p50 %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f ms\n",
+                 n.first.c_str(), ms.size(), n.second->total / ms.size(), pct(0.5), pct(0.95), pct(0.99), ms.back());
+        out += line;
+    }
+    return out;
+}
+
+bool Profiler::export_trace(const char *filename) {
+    snapshot s;
+    take_snapshot(s);
+
+    std::ofstream f(filename);
+    if (!f) return false;
+    f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char event[512];
+    for (auto &t : s.threads) {
+        snprintf(event, sizeof(event), "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                 first ? "" : ",", t.tid, t.tid);
+        f << event;
+        first = false;
+        for (zone &z : t.zones) {
+            std::string name;
+            for (const char *c = z.name; *c; c++) {
+                if (*c == '"' || *c == '\\') name += '\\';
+                name += *c;
+            }
+            // timestamps in microseconds
+            snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                     name.c_str(), t.tid, int64_t(z.begin - s.starttick) / s.ticks_per_ms * 1000, (z.end - z.begin) / s.ticks_per_ms * 1000);
+            f << event;
+        }
+    }
+    f << "\n]}\n";
+    return bool(f);
+}
+
+}
+}
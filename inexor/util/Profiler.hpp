@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#elif defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace inexor {
+namespace util {
+
+/// Low overhead instrumentation of named zones, see PROFILE_SCOPE.
+///
+/// While recording, every thread writes the zones it leaves into a
+/// ring buffer of its own (timestamps are raw cpu ticks), so nothing
+/// is shared between threads on the hot path. Evaluating happens
+/// afterwards: summary() for per zone statistics and
+/// export_trace() for chrome://tracing.
+///
+///   void serverslice() {
+///       PROFILE_SCOPE("serverslice");
+///       ...
+///   }
+class Profiler {
+public:
+    /// Forget everything recorded so far and start recording.
+    /// @param events Size of each thread's ring buffer, older
+    ///   zones get overwritten.
+    static void start(size_t events = 1 << 16);
+
+    /// Stop recording, returns once no thread writes anymore.
+    static void stop();
+
+    /// Continue recording after stop(), keeping what got recorded.
+    static void resume();
+
+    static bool recording() {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    /// One line per zone: calls, average, median, 95th/99th
+    /// percentile and maximum in milliseconds, sorted by total time.
+    static std::string summary();
+
+    /// Write everything recorded in the Chrome trace event format.
+    /// @return false if the file couldn't be written.
+    static bool export_trace(const char *filename);
+
+    /// Current timestamp in ticks.
+    static uint64_t now() {
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    /// Add a zone to the calling thread's buffer.
+    /// @param name Must stay valid, usually a string literal.
+    static void record(const char *name, uint64_t begin, uint64_t end);
+
+private:
+    static std::atomic<bool> active;
+};
+
+/// Records the time from construction to destruction as a zone.
+class ProfileScope {
+    const char *name;
+    uint64_t begin;
+
+public:
+    explicit ProfileScope(const char *name_)
+        : name(name_), begin(Profiler::recording() ? Profiler::now() : 0) {}
+
+    ~ProfileScope() {
+        if (begin) Profiler::record(name, begin, Profiler::now());
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+}
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+/// Profile the rest of the enclosing scope as zone name.
+/// Build with INEXOR_NO_PROFILER defined to compile all of them out.
+#ifdef INEXOR_NO_PROFILER
+#define PROFILE_SCOPE(name) ((void)0)
+#else
+#define PROFILE_SCOPE(name) inexor::util::ProfileScope PROFILE_CONCAT(profilescope_, __LINE__)(name)
+#endif
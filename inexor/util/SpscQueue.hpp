@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// A bounded lock-free queue between exactly one producer
+/// and one consumer thread.
+///
+/// Neither push() nor pop() block or allocate, the producer
+/// has to deal with a full queue itself (keep the data,
+/// retry later, ..).
+///
+///   SpscQueue<Msg> q(1024);
+///   // producer thread:
+///   if(!q.push(std::move(msg))) keep(msg);
+///   // consumer thread:
+///   Msg m;
+///   while(q.pop(m)) handle(m);
+template<typename T>
+class SpscQueue {
+public:
+    /// @param capacity Maximum number of queued elements,
+    ///   rounded up to a power of two.
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    size_t capacity() const { return slots.size(); }
+
+    /// Producer only.
+    /// @return false if the queue is full, value is left untouched then.
+    bool push(T &&value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head_cache == slots.size()) {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t - head_cache == slots.size()) return false;
+        }
+        slots[t & mask] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool push(const T &value) {
+        T copy(value);
+        return push(std::move(copy));
+    }
+
+    /// Consumer only.
+    /// @return false if the queue is empty.
+    bool pop(T &value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail_cache) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h == tail_cache) return false;
+        }
+        value = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Number of queued elements; only a snapshot while the
+    /// other side is active.
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    std::vector<T> slots;
+    size_t mask;
+
+    // Each side mostly touches its own cache line: the index
+    // it advances plus its last view of the other index.
+    std::atomic<size_t> head{0}; ///< next element to pop
+    size_t tail_cache = 0;
+    char pad[64];
+    std::atomic<size_t> tail{0}; ///< next free slot
+    size_t head_cache = 0;
+};
+
+}
+}
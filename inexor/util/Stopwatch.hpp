@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+
+namespace inexor {
+namespace util {
+
+/// A simple high resolution stopwatch for benchmarks and profiling output.
+///
+/// The legacy engine only has millisecond clocks (getclockmillis(), totalmillis),
+/// which are too coarse to measure anything that runs faster than a frame.
+///
+///   Stopwatch sw;
+///   do_something();
+///   double ms = sw.elapsed_ms();
+class Stopwatch
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start_;
+
+public:
+    Stopwatch() : start_(clock::now()) {}
+
+    /// Restart measuring from now on.
+    void reset() { start_ = clock::now(); }
+
+    /// @return the time since construction or the last reset() in microseconds.
+    double elapsed_us() const
+    {
+        return std::chrono::duration<double, std::micro>(clock::now() - start_).count();
+    }
+
+    /// @return the time since construction or the last reset() in milliseconds.
+    double elapsed_ms() const
+    {
+        return std::chrono::duration<double, std::milli>(clock::now() - start_).count();
+    }
+};
+
+}
+}
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <exception>
+
+#include "inexor/util/ThreadPool.hpp"
+
+namespace inexor {
+namespace util {
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        size_t hw = std::thread::hardware_concurrency();
+        threads = hw > 1 ? hw - 1 : 1;
+    }
+    workers.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+        workers.emplace_back([this]() { work(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    jobcond.notify_all();
+    for (std::thread &t : workers) t.join();
+}
+
+void ThreadPool::submit(Job job) {
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        jobs.push_back(std::move(job));
+    }
+    jobcond.notify_one();
+}
+
+bool ThreadPool::run_one(std::unique_lock<std::mutex> &lock) {
+    if (jobs.empty()) return false;
+    Job job = std::move(jobs.front());
+    jobs.pop_front();
+    active++;
+    lock.unlock();
+    job();
+    lock.lock();
+    active--;
+    if (jobs.empty() && active == 0) idlecond.notify_all();
+    return true;
+}
+
+void ThreadPool::work() {
+    std::unique_lock<std::mutex> lock(mtx);
+    for (;;) {
+        if (run_one(lock)) continue;
+        if (stopping) return;
+        jobcond.wait(lock);
+    }
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (run_one(lock)) {}
+    idlecond.wait(lock, [this]() { return jobs.empty() && active == 0; });
+}
+
+void ThreadPool::parallel_for(size_t count, size_t grain, const RangeJob &fn) {
+    if (count == 0) return;
+    grain = std::max<size_t>(grain, 1);
+
+    // A few chunks per thread keep the load balanced when
+    // some elements are more expensive than others
+    size_t chunks = std::min((count + grain - 1) / grain, (workers.size() + 1) * 4);
+    if (chunks <= 1 || workers.empty()) {
+        fn(0, count);
+        return;
+    }
+
+    struct Batch {
+        std::mutex mtx;
+        std::condition_variable done;
+        size_t left;
+        std::exception_ptr error;
+    } batch;
+    batch.left = chunks - 1;
+
+    auto run = [&fn, &batch](size_t begin, size_t end) {
+        try {
+            fn(begin, end);
+        } catch (...) {
+            std::unique_lock<std::mutex> lock(batch.mtx);
+            if (!batch.error) batch.error = std::current_exception();
+        }
+    };
+
+    size_t step = count / chunks, extra = count % chunks;
+    size_t first = step + (extra > 0 ? 1 : 0), begin = first;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (size_t i = 1; i < chunks; i++) {
+            size_t end = begin + step + (i < extra ? 1 : 0);
+            jobs.push_back([&run, &batch, begin, end]() {
+                run(begin, end);
+                std::unique_lock<std::mutex> lock(batch.mtx);
+                if (--batch.left == 0) batch.done.notify_all();
+            });
+            begin = end;
+        }
+    }
+    jobcond.notify_all();
+
+    run(0, first);
+
+    // Help with whatever is queued (our own chunks or those
+    // of nested calls) instead of just sleeping
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (run_one(lock)) {}
+    }
+
+    std::unique_lock<std::mutex> lock(batch.mtx);
+    batch.done.wait(lock, [&batch]() { return batch.left == 0; });
+    if (batch.error) std::rethrow_exception(batch.error);
+}
+
+ThreadPool &shared_pool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+}
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace inexor {
+namespace util {
+
+/// A fixed set of worker threads processing a shared job queue.
+///
+/// Meant for short, CPU bound work which can be split into
+/// independent pieces (particle vertex generation, image
+/// decoding, ...). Jobs must not block on each other.
+///
+///   ThreadPool pool;
+///   pool.parallel_for(n, 256, [&](size_t begin, size_t end) {
+///       for(size_t i = begin; i < end; i++) work(i);
+///   });
+class ThreadPool {
+public:
+    typedef std::function<void()> Job;
+    typedef std::function<void(size_t, size_t)> RangeJob;
+
+    /// Start the workers.
+    ///
+    /// @param threads Number of worker threads; 0 picks one
+    ///   less than the number of hardware threads, since the
+    ///   calling thread helps out in wait() and parallel_for().
+    explicit ThreadPool(size_t threads = 0);
+
+    /// Runs all remaining jobs and joins the workers.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Number of worker threads (not counting the caller).
+    size_t size() const { return workers.size(); }
+
+    /// Queue a job to be run by any of the workers.
+    void submit(Job job);
+
+    /// Block until every job submitted so far has completed.
+    ///
+    /// The calling thread runs queued jobs meanwhile.
+    void wait();
+
+    /// Split [0, count) into chunks of at least grain elements
+    /// and run fn(begin, end) for each of them in parallel.
+    ///
+    /// The calling thread takes the first chunk and returns
+    /// once all chunks are done. Can be nested: a job may call
+    /// parallel_for() itself. If any chunk throws, the first
+    /// exception is rethrown here after all chunks finished.
+    void parallel_for(size_t count, size_t grain, const RangeJob &fn);
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<Job> jobs;
+    std::mutex mtx;
+    std::condition_variable jobcond, idlecond;
+    size_t active = 0;
+    bool stopping = false;
+
+    void work();
+
+    /// Pop and run one queued job; lock must be held and is
+    /// held again on return.
+    /// @return false if the queue was empty.
+    bool run_one(std::unique_lock<std::mutex> &lock);
+};
+
+/// The pool shared by the engine, created on first use.
+extern ThreadPool &shared_pool();
+
+}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+
+namespace inexor {
+namespace util {
+
+/// The last SIZE values of something, with the time in ms each
+/// one arrived at; adding more overwrites the oldest.
+///
+/// Times have to be added in ascending order.
+///
+///   TimedHistory<vec, 64> positions;
+///   positions.add(gamemillis, pos);
+///   positions.during(from, to, [&](const vec &o) { check(o); });
+template<typename T, size_t SIZE>
+class TimedHistory {
+public:
+    struct Sample {
+        int millis;
+        T value;
+    };
+
+    TimedHistory() { reset(); }
+
+    void reset() { count = next = 0; }
+
+    void add(int millis, const T &value) {
+        Sample &s = samples[next];
+        s.millis = millis;
+        s.value = value;
+        next = (next + 1) % SIZE;
+        if (count < SIZE) count++;
+    }
+
+    size_t size() const { return count; }
+
+    /// The i-th sample, oldest first.
+    const Sample &get(size_t i) const { return samples[(next + SIZE - count + i) % SIZE]; }
+
+    /// Calls f(value) for the values held between from and to
+    /// millis: the samples in between and the last one before,
+    /// since that one was current until the next arrived.
+    template<typename F>
+    void during(int from, int to, F f) const {
+        for (size_t i = 0; i < count; i++) {
+            const Sample &s = get(i);
+            if (s.millis > to) break;
+            if (s.millis >= from || i + 1 >= count || get(i + 1).millis > from) f(s.value);
+        }
+    }
+
+private:
+    Sample samples[SIZE];
+    size_t count, next;
+};
+
+}
+}